@@ -0,0 +1,172 @@
+#include "AsyncEngine.h"
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+// Edits applied per apply_updates call at most, so a long burst does not
+// hold back the commands queued behind it.
+const size_t kMaxBatch = 1024;
+} // namespace
+
+AsyncEngine::AsyncEngine(std::unique_ptr<ImageEngine> engine)
+    : engine(std::move(engine)), width(this->engine->get_width()),
+      height(this->engine->get_height()), queue(kQueueLength)
+{
+	worker = std::thread(&AsyncEngine::run, this);
+}
+
+AsyncEngine::~AsyncEngine()
+{
+	queue.close();
+	worker.join();
+}
+
+void AsyncEngine::check_rect(int r1, int c1, int r2, int c2) const
+{
+	if (r1 < 0 || c1 < 0 || r2 >= height || c2 >= width || r1 > r2 ||
+	    c1 > c2)
+		throw std::out_of_range("rectangle outside the " +
+		                        std::to_string(width) + "x" +
+		                        std::to_string(height) + " image");
+}
+
+void AsyncEngine::submit_edit(const SegmentTree::Update &update)
+{
+	check_rect(update.r1, update.c1, update.r2, update.c2);
+	Command command;
+	command.update = update;
+	queue.push(std::move(command));
+}
+
+void AsyncEngine::adjust_brightness(int r1, int c1, int r2, int c2,
+                                    int value)
+{
+	submit_edit(
+	    {SegmentTree::Update::Brightness, r1, c1, r2, c2, (double)value});
+}
+
+void AsyncEngine::adjust_contrast(int r1, int c1, int r2, int c2,
+                                  double multiplier)
+{
+	submit_edit({SegmentTree::Update::Contrast, r1, c1, r2, c2, multiplier});
+}
+
+void AsyncEngine::fill_region(int r1, int c1, int r2, int c2,
+                              const RGB_uc &color)
+{
+	submit_edit({SegmentTree::Update::Fill, r1, c1, r2, c2, 0, color});
+}
+
+std::future<RGB_d> AsyncEngine::query_average_color(int r1, int c1, int r2,
+                                                    int c2)
+{
+	check_rect(r1, c1, r2, c2);
+	Command command;
+	command.kind = Command::Query;
+	command.update = {SegmentTree::Update::Fill, r1, c1, r2, c2};
+	command.average = std::make_unique<std::promise<RGB_d>>();
+	std::future<RGB_d> result = command.average->get_future();
+	queue.push(std::move(command));
+	return result;
+}
+
+std::future<Image> AsyncEngine::get_image()
+{
+	Command command;
+	command.kind = Command::Export;
+	command.image = std::make_unique<std::promise<Image>>();
+	std::future<Image> result = command.image->get_future();
+	queue.push(std::move(command));
+	return result;
+}
+
+std::future<void> AsyncEngine::flush()
+{
+	return submit([](ImageEngine &e) { e.flush(); });
+}
+
+void AsyncEngine::run()
+{
+	std::vector<SegmentTree::Update> batch;
+	batch.reserve(kMaxBatch);
+	for (;;)
+	{
+		Command command;
+		if (!queue.try_pop(command))
+		{
+			// Nothing else waiting: apply what has been gathered, then sleep.
+			apply(batch);
+			if (!queue.pop(command))
+				break;
+		}
+		if (command.kind == Command::Edit)
+		{
+			batch.push_back(command.update);
+			if (batch.size() >= kMaxBatch)
+				apply(batch);
+			continue;
+		}
+		apply(batch);
+		execute(command);
+	}
+	apply(batch);
+}
+
+void AsyncEngine::apply(std::vector<SegmentTree::Update> &batch)
+{
+	if (batch.empty())
+		return;
+	try
+	{
+		engine->apply_updates(batch);
+	}
+	catch (...)
+	{
+		if (!edit_error)
+			edit_error = std::current_exception();
+	}
+	applied_edits += batch.size();
+	++applied_batches;
+	batch.clear();
+}
+
+void AsyncEngine::execute(Command &command)
+{
+	std::exception_ptr error = edit_error;
+	edit_error = nullptr;
+	switch (command.kind)
+	{
+	case Command::Query:
+		if (error)
+			return command.average->set_exception(error);
+		try
+		{
+			const SegmentTree::Update &u = command.update;
+			command.average->set_value(
+			    engine->query_average_color(u.r1, u.c1, u.r2, u.c2));
+		}
+		catch (...)
+		{
+			command.average->set_exception(std::current_exception());
+		}
+		break;
+	case Command::Export:
+		if (error)
+			return command.image->set_exception(error);
+		try
+		{
+			command.image->set_value(engine->get_image());
+		}
+		catch (...)
+		{
+			command.image->set_exception(std::current_exception());
+		}
+		break;
+	case Command::Task:
+		command.task(*engine, error);
+		break;
+	case Command::Edit:
+		break;
+	}
+}
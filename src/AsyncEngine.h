@@ -0,0 +1,123 @@
+#ifndef ASYNC_ENGINE_H
+#define ASYNC_ENGINE_H
+
+#include "BoundedQueue.h"
+#include "Engine.h"
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Runs an engine on a background thread. Edits return as soon as they are
+// queued; queries, exports and flush() return futures that resolve after
+// every edit submitted before them has been applied. Commands run in
+// submission order. Consecutive edits the worker finds waiting are
+// handed to the engine together through ImageEngine::apply_updates, so a
+// SegmentTree applies a burst of them in one traversal.
+//
+// Any number of threads may submit. The queue holds kQueueLength commands;
+// beyond that, submitting blocks until the worker catches up. Rectangles
+// are checked on submission (std::out_of_range). An exception thrown while
+// applying an edit is delivered by the next query, export or flush.
+class AsyncEngine
+{
+  public:
+	static const size_t kQueueLength = 4096;
+
+	explicit AsyncEngine(std::unique_ptr<ImageEngine> engine);
+	// Finishes every queued command, then stops the worker.
+	~AsyncEngine();
+
+	AsyncEngine(const AsyncEngine &) = delete;
+	AsyncEngine &operator=(const AsyncEngine &) = delete;
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+	// Edits applied so far and the apply_updates calls they took.
+	uint64_t get_applied_edits() const { return applied_edits; }
+	uint64_t get_applied_batches() const { return applied_batches; }
+
+	void adjust_brightness(int r1, int c1, int r2, int c2, int value);
+	void adjust_contrast(int r1, int c1, int r2, int c2, double multiplier);
+	void fill_region(int r1, int c1, int r2, int c2, const RGB_uc &color);
+
+	std::future<RGB_d> query_average_color(int r1, int c1, int r2, int c2);
+	std::future<Image> get_image();
+	// Resolves once everything submitted so far is applied and the engine
+	// has been flushed.
+	std::future<void> flush();
+
+	template <typename F>
+	using TaskResult =
+	    decltype(std::declval<F &>()(std::declval<ImageEngine &>()));
+
+	// Runs `fn(engine)` on the worker, in order with the other commands.
+	template <typename F> std::future<TaskResult<F>> submit(F fn)
+	{
+		using R = TaskResult<F>;
+		auto promise = std::make_shared<std::promise<R>>();
+		auto call = std::make_shared<F>(std::move(fn));
+		std::future<R> result = promise->get_future();
+		Command command;
+		command.kind = Command::Task;
+		command.task = [promise, call](ImageEngine &engine,
+		                               std::exception_ptr error) {
+			if (error)
+				return promise->set_exception(error);
+			try
+			{
+				if constexpr (std::is_void<R>::value)
+				{
+					(*call)(engine);
+					promise->set_value();
+				}
+				else
+					promise->set_value((*call)(engine));
+			}
+			catch (...)
+			{
+				promise->set_exception(std::current_exception());
+			}
+		};
+		queue.push(std::move(command));
+		return result;
+	}
+
+  private:
+	struct Command
+	{
+		enum Kind : uint8_t
+		{
+			Edit,
+			Query,
+			Export,
+			Task
+		} kind = Edit;
+		SegmentTree::Update update{SegmentTree::Update::Fill, 0, 0, 0, 0};
+		std::unique_ptr<std::promise<RGB_d>> average;
+		std::unique_ptr<std::promise<Image>> image;
+		// Given the pending edit error, if any, instead of running.
+		std::function<void(ImageEngine &, std::exception_ptr)> task;
+	};
+
+	std::unique_ptr<ImageEngine> engine;
+	int width, height;
+	BoundedQueue<Command> queue;
+	std::exception_ptr edit_error; // worker only
+	std::atomic<uint64_t> applied_edits{0}, applied_batches{0};
+	std::thread worker;
+
+	void check_rect(int r1, int c1, int r2, int c2) const;
+	void submit_edit(const SegmentTree::Update &update);
+	void run();
+	void apply(std::vector<SegmentTree::Update> &batch);
+	void execute(Command &command);
+};
+
+#endif // ASYNC_ENGINE_H
@@ -0,0 +1,298 @@
+#include "BenchHarness.h"
+#include "Json.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+double percentile(const std::vector<double> &sorted, double p)
+{
+	double rank = p * (sorted.size() - 1);
+	size_t lo = (size_t)std::floor(rank);
+	size_t hi = std::min(sorted.size() - 1, lo + 1);
+	return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+}
+
+std::vector<std::string> split_csv(const std::string &line)
+{
+	std::vector<std::string> fields;
+	std::stringstream ss(line);
+	std::string field;
+	while (std::getline(ss, field, ','))
+		fields.push_back(field);
+	if (!line.empty() && line.back() == ',')
+		fields.push_back("");
+	return fields;
+}
+
+double ns_per_op(const BenchResult &r)
+{
+	return r.ops > 0 ? r.stats.median * 1e6 / r.ops : 0.0;
+}
+
+const char *kCsvHeader =
+    "engine,phase,scenario,ops,pixels,count,median_ms,mean_ms,stddev_ms,"
+    "min_ms,max_ms,p95_ms,p99_ms,ci_low_ms,ci_high_ms,ns_per_op,peak_rss_kb,"
+    "bytes_per_px";
+
+// Counter columns follow the fixed ones: <event>_per_op and <event>_per_px
+// for every event, empty (CSV) or null (JSON) when it was not counted.
+void write_counters(std::ostream &out, const BenchResult &r, bool json)
+{
+	for (int i = 0; i < kPerfEventCount; ++i)
+	{
+		std::string name = perf_event_name((PerfEvent)i);
+		bool valid = r.counters.valid[i];
+		double v = r.counters.value[i];
+		if (json)
+		{
+			out << ", \"" << name << "_per_op\": ";
+			if (valid && r.ops > 0)
+				out << v / r.ops;
+			else
+				out << "null";
+			out << ", \"" << name << "_per_px\": ";
+			if (valid && r.pixels > 0)
+				out << v / r.pixels;
+			else
+				out << "null";
+		}
+		else
+		{
+			out << ",";
+			if (valid && r.ops > 0)
+				out << v / r.ops;
+			out << ",";
+			if (valid && r.pixels > 0)
+				out << v / r.pixels;
+		}
+	}
+}
+} // namespace
+
+SampleStats summarize(std::vector<double> samples)
+{
+	SampleStats s;
+	s.count = (int)samples.size();
+	if (samples.empty())
+		return s;
+	std::sort(samples.begin(), samples.end());
+
+	double sum = 0;
+	for (double v : samples)
+		sum += v;
+	s.mean = sum / s.count;
+	double sq = 0;
+	for (double v : samples)
+		sq += (v - s.mean) * (v - s.mean);
+	s.stddev = s.count > 1 ? std::sqrt(sq / (s.count - 1)) : 0.0;
+	s.min = samples.front();
+	s.max = samples.back();
+	s.median = percentile(samples, 0.5);
+	s.p95 = percentile(samples, 0.95);
+	s.p99 = percentile(samples, 0.99);
+
+	// 1-based ranks n/2 - 1.96 * sqrt(n) / 2 and 1 + n/2 + 1.96 * sqrt(n) / 2
+	// bound the median with ~95% coverage.
+	double half_width = 1.96 * std::sqrt((double)s.count) / 2;
+	int lo = (int)std::floor(s.count / 2.0 - half_width) - 1;
+	int hi = (int)std::ceil(s.count / 2.0 + half_width);
+	s.ci_low = samples[std::max(0, lo)];
+	s.ci_high = samples[std::min(s.count - 1, hi)];
+	return s;
+}
+
+void print_latency(std::ostream &out, const std::string &label,
+                   const std::vector<double> &us)
+{
+	if (us.empty())
+		return;
+	SampleStats s = summarize(us);
+	out << "  " << label << ": " << s.count << " ops, latency us p50 "
+	    << s.median << ", p95 " << s.p95 << ", p99 " << s.p99 << ", max "
+	    << s.max << ", mean " << s.mean << "\n";
+}
+
+std::vector<double> measure(const BenchConfig &config,
+                            const std::function<void()> &setup,
+                            const std::function<void()> &body,
+                            PerfReading *counters)
+{
+	PerfCounters &perf = PerfCounters::instance();
+	bool count = counters && perf.any_available();
+	PerfReading total;
+	std::vector<double> samples;
+	for (int i = 0; i < config.warmups + config.repetitions; ++i)
+	{
+		if (setup)
+			setup();
+		bool measured = i >= config.warmups;
+		if (count && measured)
+			perf.start();
+		auto start = std::chrono::steady_clock::now();
+		body();
+		auto end = std::chrono::steady_clock::now();
+		if (count && measured)
+			total += perf.stop();
+		if (measured)
+			samples.push_back(
+			    std::chrono::duration<double, std::milli>(end - start).count());
+	}
+	if (counters)
+	{
+		if (config.repetitions > 0)
+			total /= config.repetitions;
+		*counters = total;
+	}
+	return samples;
+}
+
+long peak_rss_kb()
+{
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+		if (line.compare(0, 6, "VmHWM:") == 0)
+			return std::stol(line.substr(6));
+	return -1;
+}
+
+bool reset_peak_rss()
+{
+	std::ofstream clear("/proc/self/clear_refs");
+	clear << "5";
+	clear.flush();
+	return (bool)clear;
+}
+
+void BenchReport::write_csv(std::ostream &out) const
+{
+	out << kCsvHeader;
+	for (int i = 0; i < kPerfEventCount; ++i)
+	{
+		std::string name = perf_event_name((PerfEvent)i);
+		out << "," << name << "_per_op," << name << "_per_px";
+	}
+	out << "\n";
+	for (const auto &r : results)
+	{
+		const SampleStats &s = r.stats;
+		out << r.engine << "," << r.phase << "," << r.scenario << "," << r.ops
+		    << "," << r.pixels << "," << s.count << "," << s.median << ","
+		    << s.mean << "," << s.stddev << "," << s.min << "," << s.max << ","
+		    << s.p95 << "," << s.p99 << "," << s.ci_low << "," << s.ci_high
+		    << "," << ns_per_op(r) << "," << r.peak_rss_kb << ","
+		    << r.bytes_per_px;
+		write_counters(out, r, false);
+		out << "\n";
+	}
+}
+
+void BenchReport::write_json(std::ostream &out) const
+{
+	out << "[\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult &r = results[i];
+		const SampleStats &s = r.stats;
+		out << "  {\"engine\": " << json_string(r.engine)
+		    << ", \"phase\": " << json_string(r.phase)
+		    << ", \"scenario\": " << json_string(r.scenario)
+		    << ", \"ops\": " << r.ops << ", \"pixels\": " << r.pixels
+		    << ", \"count\": " << s.count << ", \"median_ms\": " << s.median
+		    << ", \"mean_ms\": " << s.mean << ", \"stddev_ms\": " << s.stddev
+		    << ", \"min_ms\": " << s.min << ", \"max_ms\": " << s.max
+		    << ", \"p95_ms\": " << s.p95 << ", \"p99_ms\": " << s.p99
+		    << ", \"ci_low_ms\": " << s.ci_low
+		    << ", \"ci_high_ms\": " << s.ci_high
+		    << ", \"ns_per_op\": " << ns_per_op(r)
+		    << ", \"peak_rss_kb\": " << r.peak_rss_kb
+		    << ", \"bytes_per_px\": " << r.bytes_per_px;
+		write_counters(out, r, true);
+		out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "]\n";
+}
+
+BenchReport BenchReport::read_csv(std::istream &in)
+{
+	BenchReport report;
+	std::string line;
+	if (!std::getline(in, line))
+		return report;
+	// Columns are looked up by name so older baselines stay readable.
+	std::map<std::string, size_t> column;
+	std::vector<std::string> header = split_csv(line);
+	for (size_t i = 0; i < header.size(); ++i)
+		column[header[i]] = i;
+	for (const char *required : {"engine", "phase", "scenario", "median_ms"})
+		if (!column.count(required))
+			throw std::runtime_error("baseline CSV lacks column " +
+			                         std::string(required));
+
+	while (std::getline(in, line))
+	{
+		std::vector<std::string> f = split_csv(line);
+		if (f.size() != header.size())
+			continue;
+		auto number = [&](const char *name, double fallback) {
+			auto it = column.find(name);
+			return it == column.end() ? fallback : std::stod(f[it->second]);
+		};
+		BenchResult r;
+		r.engine = f[column["engine"]];
+		r.phase = f[column["phase"]];
+		r.scenario = f[column["scenario"]];
+		r.ops = (long long)number("ops", 1);
+		r.pixels = (long long)number("pixels", 0);
+		r.stats.count = (int)number("count", 0);
+		r.stats.median = number("median_ms", 0);
+		r.stats.mean = number("mean_ms", r.stats.median);
+		r.stats.stddev = number("stddev_ms", 0);
+		r.stats.min = number("min_ms", r.stats.median);
+		r.stats.max = number("max_ms", r.stats.median);
+		r.stats.p95 = number("p95_ms", r.stats.median);
+		r.stats.p99 = number("p99_ms", r.stats.median);
+		r.stats.ci_low = number("ci_low_ms", r.stats.median);
+		r.stats.ci_high = number("ci_high_ms", r.stats.median);
+		r.peak_rss_kb = (long)number("peak_rss_kb", -1);
+		r.bytes_per_px = number("bytes_per_px", -1);
+		report.add(r);
+	}
+	return report;
+}
+
+int BenchReport::compare(const BenchReport &baseline, double threshold,
+                         std::ostream &out) const
+{
+	std::map<std::string, const BenchResult *> base;
+	for (const auto &r : baseline.results)
+		base[r.key()] = &r;
+
+	int regressions = 0, compared = 0;
+	for (const auto &r : results)
+	{
+		auto it = base.find(r.key());
+		if (it == base.end() || it->second->stats.median <= 0)
+			continue;
+		++compared;
+		const SampleStats &old = it->second->stats;
+		double change = r.stats.median / old.median - 1.0;
+		// Slower beyond the threshold, and not explainable by noise.
+		if (change > threshold && r.stats.ci_low > old.ci_high)
+		{
+			++regressions;
+			out << "REGRESSION " << r.key() << ": " << old.median << " ms -> "
+			    << r.stats.median << " ms (+" << change * 100 << "%)\n";
+		}
+	}
+	out << "Compared " << compared << " results against the baseline: "
+	    << regressions << " regression(s).\n";
+	return regressions;
+}
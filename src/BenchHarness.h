@@ -0,0 +1,93 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include "PerfCounters.h"
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Measurement and reporting for the benchmark binary: repeated timed runs
+// after warmups, robust summary statistics, hardware counters, peak RSS,
+// CSV/JSON output and a regression check against a saved baseline.
+
+struct BenchConfig
+{
+	int warmups = 1;
+	// The fewest for which the median's confidence interval is narrower
+	// than [min, max]; with fewer, compare() rarely finds a difference.
+	int repetitions = 11;
+};
+
+struct SampleStats
+{
+	int count = 0;
+	double mean = 0, stddev = 0, min = 0, max = 0;
+	double median = 0, p95 = 0, p99 = 0;
+	// Distribution-free 95% confidence interval for the median, from order
+	// statistics (collapses to [min, max] below 11 samples).
+	double ci_low = 0, ci_high = 0;
+};
+
+SampleStats summarize(std::vector<double> samples);
+// Prints "  <label>: N ops, latency us p50 ..." for microsecond samples;
+// nothing when there are none.
+void print_latency(std::ostream &out, const std::string &label,
+                   const std::vector<double> &us);
+
+// Runs `setup` (untimed) then `body` (timed, in milliseconds) for
+// config.warmups discarded rounds and config.repetitions measured ones.
+// When `counters` is given it receives the mean perf counts of one measured
+// repetition.
+std::vector<double> measure(const BenchConfig &config,
+                            const std::function<void()> &setup,
+                            const std::function<void()> &body,
+                            PerfReading *counters = nullptr);
+
+// Resident-set high-water mark of this process in KiB (VmHWM), or -1 when
+// /proc is unavailable.
+long peak_rss_kb();
+// Resets the high-water mark to the current RSS so the next peak_rss_kb()
+// covers only what follows. Returns false when the kernel does not allow it,
+// in which case peaks are process-wide.
+bool reset_peak_rss();
+
+struct BenchResult
+{
+	std::string engine;   // e.g. "SegmentTree"
+	std::string phase;    // build, update, query, export
+	std::string scenario; // e.g. "fill 64x64"
+	long long ops = 1;    // operations per repetition
+	long long pixels = 0; // pixels touched per repetition
+	SampleStats stats;    // milliseconds per repetition
+	long peak_rss_kb = -1;
+	PerfReading counters; // per repetition; reported per op and per pixel
+	// The engine's memory_footprint() over its image's pixels.
+	double bytes_per_px = -1;
+
+	std::string key() const { return engine + "/" + phase + "/" + scenario; }
+};
+
+class BenchReport
+{
+  public:
+	void add(const BenchResult &result) { results.push_back(result); }
+	std::vector<BenchResult> &get_results() { return results; }
+	const std::vector<BenchResult> &get_results() const { return results; }
+
+	void write_csv(std::ostream &out) const;
+	void write_json(std::ostream &out) const;
+	// Reads a report previously written by write_csv().
+	static BenchReport read_csv(std::istream &in);
+
+	// Prints every result whose median got slower than the baseline's by
+	// more than `threshold` (0.1 = 10%) with non-overlapping confidence
+	// intervals. Returns the number of regressions.
+	int compare(const BenchReport &baseline, double threshold,
+	            std::ostream &out) const;
+
+  private:
+	std::vector<BenchResult> results;
+};
+
+#endif // BENCH_HARNESS_H
@@ -0,0 +1,183 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// Fixed-capacity multi-producer multi-consumer FIFO. try_push/try_pop are
+// lock-free (a ring of cells with per-cell sequence numbers, after Dmitry
+// Vyukov's bounded MPMC queue). push/pop block while the queue is full or
+// empty, which is how a slow consumer holds its producers back; they only
+// take a mutex to sleep, never on the fast path.
+template <typename T> class BoundedQueue
+{
+  public:
+	// `capacity` is rounded up to a power of two.
+	explicit BoundedQueue(size_t capacity)
+	{
+		size_t n = 2;
+		while (n < capacity)
+			n *= 2;
+		mask = n - 1;
+		cells.reset(new Cell[n]);
+		for (size_t i = 0; i < n; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	BoundedQueue(const BoundedQueue &) = delete;
+	BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+	size_t capacity() const { return mask + 1; }
+
+	// Moves from `value` only when it returns true.
+	bool try_push(T &value)
+	{
+		if (!enqueue(value))
+			return false;
+		wake(waiting_poppers, not_empty);
+		return true;
+	}
+
+	bool try_pop(T &value)
+	{
+		if (!dequeue(value))
+			return false;
+		wake(waiting_pushers, not_full);
+		return true;
+	}
+
+	// Blocks while the queue is full.
+	void push(T value)
+	{
+		if (try_push(value))
+			return;
+		{
+			std::unique_lock<std::mutex> lock(park_mutex);
+			waiting_pushers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!enqueue(value))
+				not_full.wait(lock);
+			waiting_pushers.fetch_sub(1);
+		}
+		wake(waiting_poppers, not_empty);
+	}
+
+	// Blocks while the queue is empty. Returns false once the queue is
+	// closed and drained.
+	bool pop(T &value)
+	{
+		if (try_pop(value))
+			return true;
+		bool got = false;
+		{
+			std::unique_lock<std::mutex> lock(park_mutex);
+			waiting_poppers.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			for (;;)
+			{
+				// Read the flag first: anything pushed before close() is
+				// then still found by the dequeue below.
+				bool was_closed = closed.load(std::memory_order_acquire);
+				if ((got = dequeue(value)) || was_closed)
+					break;
+				not_empty.wait(lock);
+			}
+			waiting_poppers.fetch_sub(1);
+		}
+		if (got)
+			wake(waiting_pushers, not_full);
+		return got;
+	}
+
+	// Called by the last producer; wakes consumers waiting on an empty queue.
+	void close()
+	{
+		closed.store(true, std::memory_order_release);
+		std::lock_guard<std::mutex> lock(park_mutex);
+		not_empty.notify_all();
+	}
+
+  private:
+	struct alignas(64) Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> enqueue_pos{0};
+	alignas(64) std::atomic<size_t> dequeue_pos{0};
+	std::atomic<bool> closed{false};
+
+	std::mutex park_mutex;
+	std::condition_variable not_full, not_empty;
+	std::atomic<int> waiting_pushers{0}, waiting_poppers{0};
+
+	bool enqueue(T &value)
+	{
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		Cell *cell;
+		for (;;)
+		{
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)(seq - pos);
+			if (diff == 0)
+			{
+				if (enqueue_pos.compare_exchange_weak(
+				        pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false; // full
+			else
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+		cell->value = std::move(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool dequeue(T &value)
+	{
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		Cell *cell;
+		for (;;)
+		{
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)(seq - (pos + 1));
+			if (diff == 0)
+			{
+				if (dequeue_pos.compare_exchange_weak(
+				        pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false; // empty
+			else
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+		value = std::move(cell->value);
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// A sleeper registers before its final try, and this check follows the
+	// sequence store, so one of the two always sees the other.
+	void wake(std::atomic<int> &waiting, std::condition_variable &cv)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed) == 0)
+			return;
+		std::lock_guard<std::mutex> lock(park_mutex);
+		cv.notify_all();
+	}
+};
+
+#endif // BOUNDED_QUEUE_H
@@ -0,0 +1,212 @@
+#include "BufferPool.h"
+#include <algorithm>
+#include <sys/mman.h>
+
+namespace
+{
+const size_t kPageBytes = 4096;
+const size_t kHugePageBytes = 2 << 20;
+
+size_t round_up(size_t bytes, size_t to) { return (bytes + to - 1) / to * to; }
+} // namespace
+
+BufferPool &BufferPool::instance()
+{
+	static BufferPool pool;
+	return pool;
+}
+
+BufferPool::BufferPool()
+{
+	MemoryBudget::instance().set_reclaimer([] { instance().trim(); });
+}
+
+BufferPool::~BufferPool() { trim(); }
+
+BufferPool::Block BufferPool::acquire(size_t bytes, bool zeroed)
+{
+	Block block;
+	HugePages mode;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// Smallest cached block that fits, unless it would waste more than
+		// half of itself.
+		auto best = cache.end();
+		for (auto it = cache.begin(); it != cache.end(); ++it)
+			if (it->block.capacity >= bytes &&
+			    it->block.capacity / 2 <= bytes &&
+			    (best == cache.end() ||
+			     it->block.capacity < best->block.capacity))
+				best = it;
+		if (best != cache.end())
+		{
+			block = best->block;
+			cache.erase(best); // the caller reserves it from here on
+			++counters.reused;
+			counters.cached_bytes -= block.capacity;
+		}
+		mode = huge_pages;
+	}
+	if (block.data)
+	{
+		// Cleared outside the lock: other threads' requests need not wait
+		// for gigabytes of memset.
+		if (zeroed)
+			std::memset(block.data, 0, bytes);
+		return block;
+	}
+	block = map(bytes, mode);
+	std::lock_guard<std::mutex> lock(mutex);
+	++counters.mapped;
+	counters.explicit_huge += block.explicit_huge;
+	return block;
+}
+
+void BufferPool::release(Block block)
+{
+	if (!block.data)
+		return;
+	// Reserved without reclaiming, which would only empty the cache to
+	// make room for this block.
+	MemoryBudget::Reservation charge =
+	    MemoryBudget::instance().try_reserve(block.capacity, false);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (charge && cache.size() < max_cached &&
+		    counters.cached_bytes + block.capacity <= max_cached_bytes)
+		{
+			cache.push_back({block, std::move(charge)});
+			counters.cached_bytes += block.capacity;
+			return;
+		}
+		++counters.unmapped;
+	}
+	unmap(block);
+}
+
+size_t BufferPool::block_size(size_t bytes) const
+{
+	HugePages mode = get_huge_pages();
+	bool huge = mode == HugePages::Explicit ||
+	            (mode == HugePages::Transparent && bytes >= kHugePageBytes);
+	return round_up(bytes, huge ? kHugePageBytes : kPageBytes);
+}
+
+BufferPool::Block BufferPool::map(size_t bytes, HugePages mode)
+{
+	Block block;
+	if (mode == HugePages::Explicit)
+	{
+		block.capacity = round_up(bytes, kHugePageBytes);
+		void *p = mmap(nullptr, block.capacity, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			block.data = p;
+			block.explicit_huge = true;
+			return block;
+		}
+		// No reserved huge pages; settle for transparent ones.
+		mode = HugePages::Transparent;
+	}
+	bool huge = mode == HugePages::Transparent && bytes >= kHugePageBytes;
+	block.capacity = round_up(bytes, huge ? kHugePageBytes : kPageBytes);
+	// Over-map so the block can start on a huge-page boundary, then hand
+	// the slack either side back.
+	size_t length = block.capacity + (huge ? kHugePageBytes : 0);
+	void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		throw std::bad_alloc();
+	char *start = static_cast<char *>(p);
+	if (huge)
+	{
+		char *aligned = reinterpret_cast<char *>(
+		    round_up(reinterpret_cast<uintptr_t>(start), kHugePageBytes));
+		if (aligned > start)
+			munmap(start, aligned - start);
+		size_t tail = (start + length) - (aligned + block.capacity);
+		if (tail)
+			munmap(aligned + block.capacity, tail);
+		start = aligned;
+		madvise(start, block.capacity, MADV_HUGEPAGE);
+	}
+	block.data = start;
+	return block;
+}
+
+void BufferPool::unmap(const Block &block)
+{
+	munmap(block.data, block.capacity);
+}
+
+void BufferPool::set_huge_pages(HugePages mode)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	huge_pages = mode;
+}
+
+HugePages BufferPool::get_huge_pages() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return huge_pages;
+}
+
+void BufferPool::set_max_cached(size_t blocks)
+{
+	std::vector<Cached> evicted;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		max_cached = blocks;
+		evicted = evict_over_limits();
+	}
+	for (const Cached &cached : evicted)
+		unmap(cached.block);
+}
+
+void BufferPool::set_max_cached_bytes(size_t bytes)
+{
+	std::vector<Cached> evicted;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		max_cached_bytes = bytes;
+		evicted = evict_over_limits();
+	}
+	for (const Cached &cached : evicted)
+		unmap(cached.block);
+}
+
+std::vector<BufferPool::Cached> BufferPool::evict_over_limits()
+{
+	std::vector<Cached> evicted;
+	while (cache.size() > max_cached ||
+	       counters.cached_bytes > max_cached_bytes)
+	{
+		counters.cached_bytes -= cache.back().block.capacity;
+		evicted.push_back(std::move(cache.back()));
+		cache.pop_back();
+	}
+	counters.unmapped += evicted.size();
+	return evicted;
+}
+
+void BufferPool::trim()
+{
+	std::vector<Cached> evicted;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		evicted.swap(cache);
+		counters.cached_bytes = 0;
+		counters.unmapped += evicted.size();
+	}
+	for (const Cached &cached : evicted)
+		unmap(cached.block);
+}
+
+BufferPool::Stats BufferPool::stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Stats s = counters;
+	s.cached_blocks = cache.size();
+	return s;
+}
@@ -0,0 +1,203 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "MemoryBudget.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Page-backed storage for the large arrays behind images and trees.
+//
+// Big blocks come from anonymous mmap and are kept in a small cache when
+// released, so rebuilding a tree or exporting an image of the same size
+// reuses memory whose pages are already faulted in instead of mapping,
+// zeroing and unmapping gigabytes each time. Fresh mappings read as zero
+// without being written; callers that overwrite every element can skip
+// initialisation entirely. Cached blocks are reserved from MemoryBudget,
+// which drops them when a reservation would otherwise not fit.
+//
+// With HugePages::Transparent (the default) blocks of 2 MiB and more are
+// 2 MiB-aligned and marked MADV_HUGEPAGE, so the kernel can back them with
+// huge pages and cut TLB misses. HugePages::Explicit first asks for
+// MAP_HUGETLB pages from the reserved pool (vm.nr_hugepages) and falls
+// back to transparent ones when none are available.
+enum class HugePages
+{
+	Off,
+	Transparent,
+	Explicit
+};
+
+class BufferPool
+{
+  public:
+	// Smaller requests are left to malloc.
+	static const size_t kMinPooledBytes = 1 << 20;
+
+	struct Block
+	{
+		void *data = nullptr;
+		size_t capacity = 0; // bytes usable
+		bool explicit_huge = false;
+	};
+
+	struct Stats
+	{
+		uint64_t mapped = 0;   // new mappings
+		uint64_t reused = 0;   // requests served from the cache
+		uint64_t unmapped = 0; // blocks returned to the kernel
+		uint64_t explicit_huge = 0; // mappings backed by MAP_HUGETLB
+		size_t cached_blocks = 0, cached_bytes = 0;
+	};
+
+	static BufferPool &instance();
+
+	// A block of at least `bytes` bytes. A recycled block keeps its old
+	// contents unless `zeroed` is set; a fresh one is always zero.
+	Block acquire(size_t bytes, bool zeroed);
+	void release(Block block);
+	// The capacity of a fresh block for `bytes`, after rounding to pages;
+	// acquire() may instead hand out a cached block up to twice that.
+	size_t block_size(size_t bytes) const;
+
+	void set_huge_pages(HugePages mode);
+	HugePages get_huge_pages() const;
+	// Blocks kept for reuse (default 4); extra releases are unmapped.
+	void set_max_cached(size_t blocks);
+	// Bytes kept for reuse (default 1 GiB).
+	void set_max_cached_bytes(size_t bytes);
+	// Unmaps every cached block.
+	void trim();
+	Stats stats() const;
+
+  private:
+	BufferPool();
+	~BufferPool();
+
+	struct Cached
+	{
+		Block block;
+		MemoryBudget::Reservation charge;
+	};
+
+	mutable std::mutex mutex;
+	std::vector<Cached> cache;
+	size_t max_cached = 4;
+	size_t max_cached_bytes = size_t(1) << 30;
+	HugePages huge_pages = HugePages::Transparent;
+	Stats counters;
+
+	Block map(size_t bytes, HugePages mode);
+	static void unmap(const Block &block);
+	// Takes cached blocks out, newest first, until the cache is within its
+	// limits. Called with the mutex held; the caller unmaps them after
+	// releasing it.
+	std::vector<Cached> evict_over_limits();
+};
+
+// A fixed-size array of trivially copyable T. Arrays of at least
+// BufferPool::kMinPooledBytes live in BufferPool blocks, smaller ones on
+// the heap. Unlike std::vector, allocation can skip value-initialisation.
+template <typename T> class PooledArray
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+	              "PooledArray copies elements as bytes");
+
+  public:
+	PooledArray() = default;
+	explicit PooledArray(size_t n, bool zeroed = true) { reset(n, zeroed); }
+	PooledArray(const PooledArray &other)
+	{
+		reset(other.count, false);
+		if (count)
+			std::memcpy(block.data, other.block.data, count * sizeof(T));
+	}
+	PooledArray(PooledArray &&other) noexcept
+	    : block(other.block), pooled(other.pooled), count(other.count)
+	{
+		other.block = BufferPool::Block();
+		other.count = 0;
+	}
+	PooledArray &operator=(PooledArray other) noexcept
+	{
+		std::swap(block, other.block);
+		std::swap(pooled, other.pooled);
+		std::swap(count, other.count);
+		return *this;
+	}
+	~PooledArray() { clear(); }
+
+	// Resizes to `n` elements, keeping the current block when it is large
+	// enough. Contents are unspecified afterwards unless `zeroed`.
+	void reset(size_t n, bool zeroed)
+	{
+		size_t bytes = n * sizeof(T);
+		if (bytes > block.capacity)
+		{
+			clear();
+			if (bytes >= BufferPool::kMinPooledBytes)
+			{
+				block = BufferPool::instance().acquire(bytes, zeroed);
+				pooled = true;
+				zeroed = false; // already done
+			}
+			else if (bytes > 0)
+			{
+				block.data = zeroed ? std::calloc(n, sizeof(T))
+				                    : std::malloc(bytes);
+				if (!block.data)
+					throw std::bad_alloc();
+				block.capacity = bytes;
+				pooled = false;
+				zeroed = false;
+			}
+		}
+		count = n;
+		if (zeroed && bytes)
+			std::memset(block.data, 0, bytes);
+	}
+	// Returns the storage.
+	void clear()
+	{
+		if (pooled)
+			BufferPool::instance().release(block);
+		else
+			std::free(block.data);
+		block = BufferPool::Block();
+		pooled = false;
+		count = 0;
+	}
+
+	size_t size() const { return count; }
+	// Bytes held, which may exceed size() elements when a block is reused.
+	size_t capacity_bytes() const { return block.capacity; }
+	// The bytes a fresh array of `n` elements holds.
+	static size_t bytes_for(size_t n)
+	{
+		size_t bytes = n * sizeof(T);
+		return bytes < BufferPool::kMinPooledBytes
+		           ? bytes
+		           : BufferPool::instance().block_size(bytes);
+	}
+	T *data() { return static_cast<T *>(block.data); }
+	const T *data() const { return static_cast<const T *>(block.data); }
+	T &operator[](size_t i) { return data()[i]; }
+	const T &operator[](size_t i) const { return data()[i]; }
+	T *begin() { return data(); }
+	T *end() { return data() + count; }
+	const T *begin() const { return data(); }
+	const T *end() const { return data() + count; }
+
+  private:
+	BufferPool::Block block;
+	bool pooled = false;
+	size_t count = 0;
+};
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,611 @@
+#include "Convolution.h"
+#include "CpuFeatures.h"
+#include "SegmentTree.h"
+#include "ThreadPool.h"
+#include "VectorImage.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONV_HAVE_X86 1
+#endif
+
+// --- Kernel ---
+Kernel::Kernel(int width, int height, std::vector<float> weights, float scale)
+    : width(width), height(height), scale(scale), weights(std::move(weights))
+{
+	if (width <= 0 || height <= 0 ||
+	    this->weights.size() != (size_t)width * height)
+		throw std::invalid_argument("Kernel: weights do not match size");
+	classify();
+}
+
+Kernel Kernel::separable(std::vector<float> horizontal,
+                         std::vector<float> vertical, float scale)
+{
+	std::vector<float> weights(horizontal.size() * vertical.size());
+	for (size_t y = 0; y < vertical.size(); ++y)
+		for (size_t x = 0; x < horizontal.size(); ++x)
+			weights[y * horizontal.size() + x] = vertical[y] * horizontal[x];
+	return Kernel((int)horizontal.size(), (int)vertical.size(),
+	              std::move(weights), scale);
+}
+
+Kernel Kernel::box(int radius)
+{
+	int n = 2 * radius + 1;
+	return Kernel(n, n, std::vector<float>(n * n, 1.0f), 1.0f / (n * n));
+}
+
+Kernel Kernel::gaussian(double sigma)
+{
+	int radius = std::max(1, (int)std::ceil(3.0 * sigma));
+	std::vector<float> g(2 * radius + 1);
+	double sum = 0.0;
+	for (int i = -radius; i <= radius; ++i)
+	{
+		double v = std::exp(-(i * i) / (2.0 * sigma * sigma));
+		g[i + radius] = (float)v;
+		sum += v;
+	}
+	for (auto &v : g)
+		v = (float)(v / sum);
+	return separable(g, g);
+}
+
+Kernel Kernel::sharpen()
+{
+	return Kernel(3, 3, {0, -1, 0, -1, 5, -1, 0, -1, 0});
+}
+
+Kernel Kernel::edge_detect()
+{
+	return Kernel(3, 3, {-1, -1, -1, -1, 8, -1, -1, -1, -1});
+}
+
+Kernel Kernel::sobel_x()
+{
+	return Kernel(3, 3, {-1, 0, 1, -2, 0, 2, -1, 0, 1});
+}
+
+Kernel Kernel::sobel_y()
+{
+	return Kernel(3, 3, {-1, -2, -1, 0, 0, 0, 1, 2, 1});
+}
+
+double Kernel::total_weight() const
+{
+	double sum = 0.0;
+	for (float w : weights)
+		sum += w;
+	return sum * scale;
+}
+
+void Kernel::classify()
+{
+	double abs_sum = 0.0;
+	integer_kernel = true;
+	for (float w : weights)
+	{
+		if (w != std::nearbyint(w))
+			integer_kernel = false;
+		abs_sum += std::fabs(w);
+	}
+	// 255 * sum|w| must fit in int16 for the integer path.
+	if (abs_sum > 128.0)
+		integer_kernel = false;
+
+	// Rank-1 test: factor around the largest weight and check the product.
+	int py = 0, px = 0;
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+			if (std::fabs(weight(y, x)) > std::fabs(weight(py, px)))
+			{
+				py = y;
+				px = x;
+			}
+	float pivot = weight(py, px);
+	separable_kernel = false;
+	if (pivot == 0.0f || (width == 1 && height == 1))
+		return;
+
+	std::vector<float> h(width), v(height);
+	for (int x = 0; x < width; ++x)
+		h[x] = weight(py, x);
+	for (int y = 0; y < height; ++y)
+		v[y] = weight(y, px) / pivot;
+	float tolerance = std::fabs(pivot) * 1e-6f;
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+			if (std::fabs(v[y] * h[x] - weight(y, x)) > tolerance)
+				return;
+	separable_kernel = true;
+	h_weights = std::move(h);
+	v_weights = std::move(v);
+}
+
+// --- Row kernels ---
+namespace
+{
+struct ConvKernels
+{
+	// out[i] (+)= sum_k w[k] * in[i + k]
+	void (*row_f)(const float *in, const float *w, int taps, float *out,
+	              int n, bool accumulate);
+	// out[i] = sum_k w[k] * rows[k][i]
+	void (*column_f)(const float *const *rows, const float *w, int taps,
+	                 float *out, int n);
+	void (*row_i16)(const int16_t *in, const int16_t *w, int taps,
+	                int16_t *out, int n, bool accumulate);
+};
+
+void row_f_scalar(const float *in, const float *w, int taps, float *out, int n,
+                  bool accumulate)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		float acc = accumulate ? out[i] : 0.0f;
+		for (int k = 0; k < taps; ++k)
+			acc += w[k] * in[i + k];
+		out[i] = acc;
+	}
+}
+
+void column_f_scalar(const float *const *rows, const float *w, int taps,
+                     float *out, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		float acc = 0.0f;
+		for (int k = 0; k < taps; ++k)
+			acc += w[k] * rows[k][i];
+		out[i] = acc;
+	}
+}
+
+void row_i16_scalar(const int16_t *in, const int16_t *w, int taps,
+                    int16_t *out, int n, bool accumulate)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		int acc = accumulate ? out[i] : 0;
+		for (int k = 0; k < taps; ++k)
+			acc += w[k] * in[i + k];
+		out[i] = (int16_t)acc;
+	}
+}
+
+#ifdef CONV_HAVE_X86
+// Multiply and add are kept separate (no FMA) so the AVX2 path rounds
+// exactly like the scalar one.
+__attribute__((target("avx2"))) void
+row_f_avx2(const float *in, const float *w, int taps, float *out, int n,
+           bool accumulate)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 acc = accumulate ? _mm256_loadu_ps(out + i) : _mm256_setzero_ps();
+		for (int k = 0; k < taps; ++k)
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[k]),
+			                                       _mm256_loadu_ps(in + i + k)));
+		_mm256_storeu_ps(out + i, acc);
+	}
+	row_f_scalar(in + i, w, taps, out + i, n - i, accumulate);
+}
+
+__attribute__((target("avx2"))) void
+column_f_avx2(const float *const *rows, const float *w, int taps, float *out,
+              int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 acc = _mm256_setzero_ps();
+		for (int k = 0; k < taps; ++k)
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[k]),
+			                                       _mm256_loadu_ps(rows[k] + i)));
+		_mm256_storeu_ps(out + i, acc);
+	}
+	for (; i < n; ++i)
+	{
+		float acc = 0.0f;
+		for (int k = 0; k < taps; ++k)
+			acc += w[k] * rows[k][i];
+		out[i] = acc;
+	}
+}
+
+__attribute__((target("avx2"))) void
+row_i16_avx2(const int16_t *in, const int16_t *w, int taps, int16_t *out,
+             int n, bool accumulate)
+{
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256i acc =
+		    accumulate ? _mm256_loadu_si256((const __m256i *)(out + i))
+		               : _mm256_setzero_si256();
+		for (int k = 0; k < taps; ++k)
+		{
+			if (w[k] == 0)
+				continue;
+			__m256i px = _mm256_loadu_si256((const __m256i *)(in + i + k));
+			acc = _mm256_add_epi16(
+			    acc, _mm256_mullo_epi16(px, _mm256_set1_epi16(w[k])));
+		}
+		_mm256_storeu_si256((__m256i *)(out + i), acc);
+	}
+	row_i16_scalar(in + i, w, taps, out + i, n - i, accumulate);
+}
+#endif
+
+const ConvKernels &select_kernels()
+{
+	static const ConvKernels scalar = {row_f_scalar, column_f_scalar,
+	                                   row_i16_scalar};
+#ifdef CONV_HAVE_X86
+	static const ConvKernels avx2 = {row_f_avx2, column_f_avx2, row_i16_avx2};
+	if (active_simd_level() >= SimdLevel::AVX2)
+		return avx2;
+#endif
+	return scalar;
+}
+
+// --- Tiled engine ---
+enum class Path
+{
+	Integer,
+	Separable,
+	Direct
+};
+
+int map_coord(int x, int n, BorderMode mode)
+{
+	if (x >= 0 && x < n)
+		return x;
+	switch (mode)
+	{
+	case BorderMode::Clamp:
+		return x < 0 ? 0 : n - 1;
+	case BorderMode::Reflect:
+		if (n == 1)
+			return 0;
+		while (x < 0 || x >= n)
+			x = x < 0 ? -x - 1 : 2 * n - x - 1;
+		return x;
+	case BorderMode::Wrap:
+		return ((x % n) + n) % n;
+	default:
+		return -1; // Constant / Normalize: caller supplies the value
+	}
+}
+
+struct Scratch
+{
+	std::vector<float> in[3], tmp, out[3];
+	std::vector<int16_t> in16[3], out16;
+	std::vector<const float *> row_ptrs;
+	std::vector<int> row_map, col_map;
+};
+
+class Convolver
+{
+  public:
+	Convolver(const Image &src, const Kernel &kernel, int r1, int c1, int r2,
+	          int c2, const ConvolutionOptions &options, Image &dst)
+	    : src(src), kernel(kernel), options(options), dst(dst), r1(r1),
+	      c1(c1), r2(r2), c2(c2), kernels(select_kernels())
+	{
+		kh = kernel.get_height();
+		kw = kernel.get_width();
+		ay = kh / 2;
+		ax = kw / 2;
+		if (kernel.is_integer())
+			path = Path::Integer;
+		else if (kernel.is_separable())
+			path = Path::Separable;
+		else
+			path = Path::Direct;
+
+		for (int y = 0; y < kh; ++y)
+			for (int x = 0; x < kw; ++x)
+			{
+				weights_f.push_back(kernel.weight(y, x) * kernel.get_scale());
+				weights_i16.push_back((int16_t)kernel.weight(y, x));
+			}
+		if (path == Path::Separable)
+		{
+			h_f = kernel.horizontal();
+			v_f = kernel.vertical();
+			for (auto &v : v_f)
+				v *= kernel.get_scale();
+		}
+		total = kernel.total_weight();
+	}
+
+	void run()
+	{
+		int tile_rows = std::max(1, options.tile_rows);
+		int tile_cols = std::max(1, options.tile_cols);
+		for (int tr = r1; tr <= r2; tr += tile_rows)
+			for (int tc = c1; tc <= c2; tc += tile_cols)
+				tiles.push_back({tr, tc, std::min(r2, tr + tile_rows - 1),
+				                 std::min(c2, tc + tile_cols - 1)});
+
+		auto run_range = [&](int begin, int end) {
+			Scratch scratch;
+			for (int i = begin; i < end; ++i)
+				process_tile(tiles[i], scratch);
+		};
+		if (options.threads == 1)
+			run_range(0, (int)tiles.size());
+		else
+			ThreadPool::instance().parallel_for(0, (int)tiles.size(),
+			                                    run_range);
+	}
+
+  private:
+	struct Tile
+	{
+		int r1, c1, r2, c2;
+	};
+
+	const Image &src;
+	const Kernel &kernel;
+	const ConvolutionOptions &options;
+	Image &dst;
+	int r1, c1, r2, c2;
+	const ConvKernels &kernels;
+	int kh, kw, ay, ax;
+	Path path;
+	double total;
+	std::vector<float> weights_f, h_f, v_f;
+	std::vector<int16_t> weights_i16;
+	std::vector<Tile> tiles;
+
+	void process_tile(const Tile &t, Scratch &s)
+	{
+		int th = t.r2 - t.r1 + 1, tw = t.c2 - t.c1 + 1;
+		int ih = th + kh - 1, iw = tw + kw - 1;
+		gather(t, ih, iw, s);
+
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			s.out[ch].resize((size_t)th * tw);
+			float *out = s.out[ch].data();
+			if (path == Path::Integer)
+			{
+				s.out16.resize((size_t)th * tw);
+				const int16_t *in = s.in16[ch].data();
+				for (int y = 0; y < th; ++y)
+					for (int ky = 0; ky < kh; ++ky)
+						kernels.row_i16(in + (size_t)(y + ky) * iw,
+						                &weights_i16[ky * kw], kw,
+						                s.out16.data() + (size_t)y * tw, tw,
+						                ky > 0);
+				float scale = kernel.get_scale();
+				for (size_t i = 0; i < s.out16.size(); ++i)
+					out[i] = s.out16[i] * scale;
+			}
+			else if (path == Path::Separable)
+			{
+				const float *in = s.in[ch].data();
+				s.tmp.resize((size_t)ih * tw);
+				for (int y = 0; y < ih; ++y)
+					kernels.row_f(in + (size_t)y * iw, h_f.data(), kw,
+					              s.tmp.data() + (size_t)y * tw, tw, false);
+				s.row_ptrs.resize(kh);
+				for (int y = 0; y < th; ++y)
+				{
+					for (int ky = 0; ky < kh; ++ky)
+						s.row_ptrs[ky] = s.tmp.data() + (size_t)(y + ky) * tw;
+					kernels.column_f(s.row_ptrs.data(), v_f.data(), kh,
+					                 out + (size_t)y * tw, tw);
+				}
+			}
+			else
+			{
+				const float *in = s.in[ch].data();
+				for (int y = 0; y < th; ++y)
+					for (int ky = 0; ky < kh; ++ky)
+						kernels.row_f(in + (size_t)(y + ky) * iw,
+						              &weights_f[ky * kw], kw,
+						              out + (size_t)y * tw, tw, ky > 0);
+			}
+		}
+
+		if (options.border == BorderMode::Normalize)
+			normalize_edges(t, th, tw, s);
+		store(t, th, tw, s);
+	}
+
+	// Copies the tile plus halo into per-channel planes, resolving borders.
+	void gather(const Tile &t, int ih, int iw, Scratch &s)
+	{
+		int H = src.get_height(), W = src.get_width();
+		s.row_map.resize(ih);
+		s.col_map.resize(iw);
+		for (int y = 0; y < ih; ++y)
+			s.row_map[y] = map_coord(t.r1 - ay + y, H, options.border);
+		for (int x = 0; x < iw; ++x)
+			s.col_map[x] = map_coord(t.c1 - ax + x, W, options.border);
+
+		RGB_uc fill = options.border == BorderMode::Constant
+		                  ? options.border_color
+		                  : RGB_uc{0, 0, 0};
+		bool integer = path == Path::Integer;
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			if (integer)
+				s.in16[ch].resize((size_t)ih * iw);
+			else
+				s.in[ch].resize((size_t)ih * iw);
+		}
+
+		bool planar = src.get_layout() == PixelLayout::Planar;
+		for (int y = 0; y < ih; ++y)
+		{
+			int sr = s.row_map[y];
+			size_t base = (size_t)y * iw;
+			for (int ch = 0; ch < 3; ++ch)
+			{
+				const unsigned char *row = nullptr;
+				int step = 1;
+				if (sr >= 0 && planar)
+					row = src.plane_row(ch, sr);
+				else if (sr >= 0)
+				{
+					row = &src.row(sr)->r + ch;
+					step = 3;
+				}
+				unsigned char outside = (&fill.r)[ch];
+				for (int x = 0; x < iw; ++x)
+				{
+					int sc = s.col_map[x];
+					unsigned char v = (row && sc >= 0) ? row[sc * step] : outside;
+					if (integer)
+						s.in16[ch][base + x] = v;
+					else
+						s.in[ch][base + x] = v;
+				}
+			}
+		}
+	}
+
+	// Rescales pixels whose footprint crosses the image edge so the taps
+	// that remain inside carry the kernel's full weight.
+	void normalize_edges(const Tile &t, int th, int tw, Scratch &s)
+	{
+		int H = src.get_height(), W = src.get_width();
+		bool near_edge = t.r1 - ay < 0 || t.c1 - ax < 0 ||
+		                 t.r2 + (kh - 1 - ay) >= H || t.c2 + (kw - 1 - ax) >= W;
+		if (!near_edge || total == 0.0)
+			return;
+
+		for (int y = 0; y < th; ++y)
+		{
+			int r = t.r1 + y;
+			for (int x = 0; x < tw; ++x)
+			{
+				int c = t.c1 + x;
+				if (r - ay >= 0 && c - ax >= 0 && r + (kh - 1 - ay) < H &&
+				    c + (kw - 1 - ax) < W)
+					continue;
+				double inside = 0.0;
+				for (int ky = 0; ky < kh; ++ky)
+				{
+					int sr = r - ay + ky;
+					if (sr < 0 || sr >= H)
+						continue;
+					for (int kx = 0; kx < kw; ++kx)
+					{
+						int sc = c - ax + kx;
+						if (sc >= 0 && sc < W)
+							inside += kernel.weight(ky, kx);
+					}
+				}
+				inside *= kernel.get_scale();
+				if (inside == 0.0)
+					continue;
+				float factor = (float)(total / inside);
+				for (int ch = 0; ch < 3; ++ch)
+					s.out[ch][(size_t)y * tw + x] *= factor;
+			}
+		}
+	}
+
+	void store(const Tile &t, int th, int tw, Scratch &s)
+	{
+		float bias = options.bias + 0.5f; // round to nearest
+		for (int y = 0; y < th; ++y)
+		{
+			int dr = t.r1 - r1 + y, dc = t.c1 - c1;
+			const float *pr = s.out[0].data() + (size_t)y * tw;
+			const float *pg = s.out[1].data() + (size_t)y * tw;
+			const float *pb = s.out[2].data() + (size_t)y * tw;
+			if (dst.get_layout() == PixelLayout::Planar)
+			{
+				const float *planes[3] = {pr, pg, pb};
+				for (int ch = 0; ch < 3; ++ch)
+				{
+					unsigned char *row = dst.plane_row(ch, dr) + dc;
+					for (int x = 0; x < tw; ++x)
+						row[x] = saturate_cast_uchar(planes[ch][x] + bias);
+				}
+				continue;
+			}
+			RGB_uc *row = dst.row(dr) + dc;
+			for (int x = 0; x < tw; ++x)
+				row[x] = {saturate_cast_uchar(pr[x] + bias),
+				          saturate_cast_uchar(pg[x] + bias),
+				          saturate_cast_uchar(pb[x] + bias)};
+		}
+	}
+};
+
+// Bounds of the source pixels a filtered rectangle depends on.
+void halo_window(const Kernel &kernel, BorderMode border, int height,
+                 int width, int r1, int c1, int r2, int c2, int &wr1, int &wc1,
+                 int &wr2, int &wc2)
+{
+	if (border == BorderMode::Wrap)
+	{
+		wr1 = 0;
+		wc1 = 0;
+		wr2 = height - 1;
+		wc2 = width - 1;
+		return;
+	}
+	int ay = kernel.get_height() / 2, ax = kernel.get_width() / 2;
+	wr1 = std::max(0, r1 - ay);
+	wc1 = std::max(0, c1 - ax);
+	wr2 = std::min(height - 1, r2 + (kernel.get_height() - 1 - ay));
+	wc2 = std::min(width - 1, c2 + (kernel.get_width() - 1 - ax));
+}
+} // namespace
+
+// --- Public API ---
+Image convolve(const Image &src, const Kernel &kernel, int r1, int c1, int r2,
+               int c2, const ConvolutionOptions &options)
+{
+	Image dst(c2 - c1 + 1, r2 - r1 + 1, src.get_layout());
+	if (r1 > r2 || c1 > c2)
+		return dst;
+	Convolver(src, kernel, r1, c1, r2, c2, options, dst).run();
+	return dst;
+}
+
+Image convolve(const Image &src, const Kernel &kernel,
+               const ConvolutionOptions &options)
+{
+	return convolve(src, kernel, 0, 0, src.get_height() - 1,
+	                src.get_width() - 1, options);
+}
+
+void convolve_region(SegmentTree &tree, const Kernel &kernel, int r1, int c1,
+                     int r2, int c2, const ConvolutionOptions &options)
+{
+	int wr1, wc1, wr2, wc2;
+	halo_window(kernel, options.border, tree.get_height(), tree.get_width(),
+	            r1, c1, r2, c2, wr1, wc1, wr2, wc2);
+	Image window = tree.get_region(wr1, wc1, wr2, wc2);
+	Image patch = convolve(window, kernel, r1 - wr1, c1 - wc1, r2 - wr1,
+	                       c2 - wc1, options);
+	tree.assign_region(r1, c1, patch);
+}
+
+void convolve_region(VectorImage &image, const Kernel &kernel, int r1, int c1,
+                     int r2, int c2, const ConvolutionOptions &options)
+{
+	int wr1, wc1, wr2, wc2;
+	halo_window(kernel, options.border, image.get_height(), image.get_width(),
+	            r1, c1, r2, c2, wr1, wc1, wr2, wc2);
+	Image window = image.get_region(wr1, wc1, wr2, wc2);
+	Image patch = convolve(window, kernel, r1 - wr1, c1 - wc1, r2 - wr1,
+	                       c2 - wc1, options);
+	image.assign_region(r1, c1, patch);
+}
@@ -0,0 +1,92 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include "Image.h"
+#include "types.h"
+#include <vector>
+
+class SegmentTree;
+class VectorImage;
+
+// How taps that fall outside the image are resolved.
+enum class BorderMode
+{
+	Clamp,     // repeat the edge pixel
+	Reflect,   // mirror around the edge (abc|cba)
+	Wrap,      // tile the image
+	Constant,  // use ConvolutionOptions::border_color
+	Normalize  // drop outside taps and rescale the remaining weights
+};
+
+// A correlation kernel (not flipped). Weights are row-major with the anchor
+// at (height / 2, width / 2); every weight is multiplied by `scale`.
+class Kernel
+{
+  public:
+	Kernel(int width, int height, std::vector<float> weights,
+	       float scale = 1.0f);
+
+	// Outer product of a vertical and a horizontal 1D kernel.
+	static Kernel separable(std::vector<float> horizontal,
+	                        std::vector<float> vertical, float scale = 1.0f);
+
+	static Kernel box(int radius);
+	static Kernel gaussian(double sigma);
+	static Kernel sharpen();
+	static Kernel edge_detect();
+	static Kernel sobel_x();
+	static Kernel sobel_y();
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+	float get_scale() const { return scale; }
+	float weight(int ky, int kx) const { return weights[ky * width + kx]; }
+	bool is_separable() const { return separable_kernel; }
+	const std::vector<float> &horizontal() const { return h_weights; }
+	const std::vector<float> &vertical() const { return v_weights; }
+
+	// Sum of all weights, including scale.
+	double total_weight() const;
+	// True when every weight is an integer small enough for the 16-bit path.
+	bool is_integer() const { return integer_kernel; }
+
+  private:
+	int width, height;
+	float scale;
+	std::vector<float> weights;
+	bool separable_kernel = false;
+	std::vector<float> h_weights, v_weights;
+	bool integer_kernel = false;
+
+	void classify();
+};
+
+struct ConvolutionOptions
+{
+	BorderMode border = BorderMode::Clamp;
+	RGB_uc border_color = {0, 0, 0};
+	float bias = 0.0f;
+	// Output tile size; each tile's working set (plus halo) stays in cache.
+	int tile_rows = 64;
+	int tile_cols = 256;
+	// 1 = calling thread only; otherwise tiles run on the shared ThreadPool.
+	int threads = 0;
+};
+
+// Filters the rectangle (r1, c1)-(r2, c2) of `src` and returns it as a new
+// image of the rectangle's size, in `src`'s layout. Pixels outside the
+// rectangle are read as neighbours; the options' border mode applies only
+// beyond the image edges.
+Image convolve(const Image &src, const Kernel &kernel, int r1, int c1, int r2,
+               int c2, const ConvolutionOptions &options = {});
+Image convolve(const Image &src, const Kernel &kernel,
+               const ConvolutionOptions &options = {});
+
+// Filters a region of an engine in place: reads the region plus the kernel's
+// halo, convolves it and writes the result back with assign_region().
+void convolve_region(SegmentTree &tree, const Kernel &kernel, int r1, int c1,
+                     int r2, int c2, const ConvolutionOptions &options = {});
+void convolve_region(VectorImage &image, const Kernel &kernel, int r1, int c1,
+                     int r2, int c2, const ConvolutionOptions &options = {});
+
+#endif // CONVOLUTION_H
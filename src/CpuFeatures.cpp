@@ -0,0 +1,62 @@
+#include "CpuFeatures.h"
+#include <atomic>
+
+namespace
+{
+SimdLevel detect()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SimdLevel::AVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return SimdLevel::SSSE3;
+	if (__builtin_cpu_supports("sse2"))
+		return SimdLevel::SSE2;
+#endif
+	return SimdLevel::Scalar;
+}
+
+std::atomic<int> &override_level()
+{
+	static std::atomic<int> level{-1};
+	return level;
+}
+} // namespace
+
+SimdLevel detected_simd_level()
+{
+	static const SimdLevel level = detect();
+	return level;
+}
+
+SimdLevel active_simd_level()
+{
+	int forced = override_level().load(std::memory_order_relaxed);
+	if (forced < 0)
+		return detected_simd_level();
+	return static_cast<SimdLevel>(forced);
+}
+
+void set_simd_level(SimdLevel level)
+{
+	// Never allow a level the CPU cannot execute.
+	if (level > detected_simd_level())
+		level = detected_simd_level();
+	override_level().store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+const char *simd_level_name(SimdLevel level)
+{
+	switch (level)
+	{
+	case SimdLevel::AVX2:
+		return "AVX2";
+	case SimdLevel::SSSE3:
+		return "SSSE3";
+	case SimdLevel::SSE2:
+		return "SSE2";
+	default:
+		return "Scalar";
+	}
+}
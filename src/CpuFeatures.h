@@ -0,0 +1,25 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// Runtime SIMD dispatch. Kernels are compiled with per-function target
+// attributes, so the binary itself stays at the baseline ISA and picks the
+// widest path the running CPU supports.
+enum class SimdLevel
+{
+	Scalar = 0,
+	SSE2 = 1,
+	SSSE3 = 2,
+	AVX2 = 3
+};
+
+// Widest level supported by the CPU.
+SimdLevel detected_simd_level();
+
+// Level kernels should use: the detected level unless lowered with
+// set_simd_level() (e.g. to benchmark the scalar path).
+SimdLevel active_simd_level();
+void set_simd_level(SimdLevel level);
+
+const char *simd_level_name(SimdLevel level);
+
+#endif // CPU_FEATURES_H
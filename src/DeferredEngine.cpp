@@ -0,0 +1,118 @@
+#include "DeferredEngine.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+using Update = SegmentTree::Update;
+
+bool same_rect(const Update &a, const Update &b)
+{
+	return a.r1 == b.r1 && a.c1 == b.c1 && a.r2 == b.r2 && a.c2 == b.c2;
+}
+
+bool overlaps(const Update &u, int r1, int c1, int r2, int c2)
+{
+	return u.r1 <= r2 && r1 <= u.r2 && u.c1 <= c2 && c1 <= u.c2;
+}
+
+// True when `inner`'s rectangle lies inside `outer`'s.
+bool contains(const Update &outer, const Update &inner)
+{
+	return outer.r1 <= inner.r1 && inner.r2 <= outer.r2 &&
+	       outer.c1 <= inner.c1 && inner.c2 <= outer.c2;
+}
+} // namespace
+
+void DeferredEngine::adjust_brightness(int r1, int c1, int r2, int c2,
+                                       int value)
+{
+	add_affine(r1, c1, r2, c2, 1.0, value);
+}
+
+void DeferredEngine::adjust_contrast(int r1, int c1, int r2, int c2,
+                                     double multiplier)
+{
+	// Same map as SegmentTree::adjust_contrast: (p - 128) * m + 128.
+	add_affine(r1, c1, r2, c2, multiplier, (1.0 - multiplier) * 128.0);
+}
+
+void DeferredEngine::fill_region(int r1, int c1, int r2, int c2,
+                                 const RGB_uc &color)
+{
+	++compaction.submitted;
+	Update fill{Update::Fill, r1, c1, r2, c2};
+	fill.color = color;
+	size_t before = pending.size();
+	pending.erase(std::remove_if(pending.begin(), pending.end(),
+	                             [&](const Update &u) {
+		                             return contains(fill, u);
+	                             }),
+	              pending.end());
+	compaction.dropped += before - pending.size();
+	push(fill);
+}
+
+void DeferredEngine::add_affine(int r1, int c1, int r2, int c2, double mul,
+                                double add)
+{
+	++compaction.submitted;
+	Update edit{Update::Affine, r1, c1, r2, c2, mul};
+	edit.offset = add;
+	// Walk back over queued edits this one commutes with (disjoint ones)
+	// looking for an affine edit on the same rectangle to fold it into.
+	for (size_t i = pending.size(); i-- > 0;)
+	{
+		Update &u = pending[i];
+		if (!overlaps(u, r1, c1, r2, c2))
+			continue;
+		if (!same_rect(u, edit) || u.kind != Update::Affine)
+			break;
+		// edit(u(p)) = (p * u.value + u.offset) * mul + add
+		u.offset = u.offset * mul + add;
+		u.value *= mul;
+		++compaction.fused;
+		if (std::abs(u.value - 1.0) < 1e-12 && std::abs(u.offset) < 1e-9)
+		{
+			pending.erase(pending.begin() + i);
+			compaction.dropped += 1;
+		}
+		return;
+	}
+	push(edit);
+}
+
+void DeferredEngine::push(const Update &update)
+{
+	pending.push_back(update);
+	if (pending.size() >= kMaxPending)
+		flush();
+}
+
+void DeferredEngine::flush()
+{
+	if (pending.empty())
+		return;
+	tree.apply_batch(pending);
+	compaction.applied += pending.size();
+	++compaction.flushes;
+	pending.clear();
+}
+
+RGB_d DeferredEngine::query_average_color(int r1, int c1, int r2, int c2)
+{
+	// Edits elsewhere in the image can keep waiting.
+	for (const Update &u : pending)
+		if (overlaps(u, r1, c1, r2, c2))
+		{
+			flush();
+			break;
+		}
+	return tree.query_average_color(r1, c1, r2, c2);
+}
+
+Image DeferredEngine::get_image()
+{
+	flush();
+	return tree.get_image();
+}
@@ -0,0 +1,79 @@
+#ifndef DEFERRED_ENGINE_H
+#define DEFERRED_ENGINE_H
+
+#include "Engine.h"
+#include "SegmentTree.h"
+#include <cstdint>
+#include <vector>
+
+// A SegmentTree engine that queues region edits and compacts the queue
+// before applying it:
+//
+//   - brightness and contrast are affine maps, so an edit on the same
+//     rectangle as an earlier queued affine edit (with only disjoint edits
+//     in between) is composed into it, and the pair is dropped when the
+//     composition is the identity;
+//   - a fill drops every queued edit whose rectangle it contains, since it
+//     overwrites all of their pixels.
+//
+// All edits are pointwise, so both rules give the same pixels as applying
+// the edits one by one (up to floating-point rounding of the composed
+// tags). The queue is applied in one SegmentTree::apply_batch traversal
+// when a query overlaps a queued edit, on get_image() and flush(), and when
+// it reaches kMaxPending edits.
+class DeferredEngine : public ImageEngine
+{
+  public:
+	static const size_t kMaxPending = 1024;
+
+	explicit DeferredEngine(const Image &image) : tree(image) {}
+	explicit DeferredEngine(SegmentTree tree) : tree(std::move(tree)) {}
+
+	const char *name() const override { return "SegmentTree (deferred)"; }
+	int get_width() const override { return tree.get_width(); }
+	int get_height() const override { return tree.get_height(); }
+
+	void adjust_brightness(int r1, int c1, int r2, int c2,
+	                       int value) override;
+	void adjust_contrast(int r1, int c1, int r2, int c2,
+	                     double multiplier) override;
+	void fill_region(int r1, int c1, int r2, int c2,
+	                 const RGB_uc &color) override;
+	RGB_d query_average_color(int r1, int c1, int r2, int c2) override;
+	Image get_image() override;
+	void flush() override;
+
+	struct Stats
+	{
+		uint64_t submitted = 0; // edits received
+		uint64_t fused = 0;     // merged into an earlier affine edit
+		uint64_t dropped = 0;   // overwritten by a fill or cancelled out
+		uint64_t applied = 0;   // edits that reached the tree
+		uint64_t flushes = 0;
+	};
+	const Stats &stats() const { return compaction; }
+
+	// The tree plus the queue's storage, which grows to kMaxPending edits.
+	size_t memory_footprint() const override
+	{
+		return sizeof(DeferredEngine) - sizeof(SegmentTree) +
+		       tree.memory_footprint() +
+		       pending.capacity() * sizeof(SegmentTree::Update);
+	}
+	static size_t footprint_for(int width, int height)
+	{
+		return sizeof(DeferredEngine) - sizeof(SegmentTree) +
+		       SegmentTree::footprint_for(width, height) +
+		       kMaxPending * sizeof(SegmentTree::Update);
+	}
+
+  private:
+	SegmentTree tree;
+	std::vector<SegmentTree::Update> pending;
+	Stats compaction;
+
+	void add_affine(int r1, int c1, int r2, int c2, double mul, double add);
+	void push(const SegmentTree::Update &update);
+};
+
+#endif // DEFERRED_ENGINE_H
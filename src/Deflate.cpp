@@ -0,0 +1,710 @@
+#include "Deflate.h"
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+
+namespace
+{
+const uint16_t length_base[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                  15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                  1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                  4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t dist_base[30] = {1,    2,    3,    4,    5,    7,     9,
+                                13,   17,   25,   33,   49,   65,    97,
+                                129,  193,  257,  385,  513,  769,   1025,
+                                1537, 2049, 3073, 4097, 6145, 8193,  12289,
+                                16385, 24577};
+const uint8_t dist_extra[30] = {0, 0, 0,  0,  1,  1,  2,  2,  3,  3,
+                                4, 4, 5,  5,  6,  6,  7,  7,  8,  8,
+                                9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order in which code-length code lengths are transmitted.
+const uint8_t clen_order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+const int kWindow = 32768;
+const int kMinMatch = 3;
+const int kMaxMatch = 258;
+const int kHashBits = 15;
+const int kMaxChain = 64;
+const size_t kBlockSymbols = 1 << 15;
+
+uint32_t reverse_bits(uint32_t code, int len)
+{
+	uint32_t r = 0;
+	for (int i = 0; i < len; ++i)
+	{
+		r = (r << 1) | (code & 1);
+		code >>= 1;
+	}
+	return r;
+}
+
+// Canonical Huffman codes (RFC 1951 3.2.2), bit-reversed for LSB-first
+// output.
+std::vector<uint32_t> canonical_codes(const std::vector<unsigned char> &lengths)
+{
+	int bl_count[16] = {0};
+	for (unsigned char l : lengths)
+		bl_count[l]++;
+	bl_count[0] = 0;
+	uint32_t next_code[16] = {0};
+	uint32_t code = 0;
+	for (int bits = 1; bits < 16; ++bits)
+	{
+		code = (code + bl_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+	std::vector<uint32_t> codes(lengths.size(), 0);
+	for (size_t i = 0; i < lengths.size(); ++i)
+		if (lengths[i])
+			codes[i] = reverse_bits(next_code[lengths[i]]++, lengths[i]);
+	return codes;
+}
+
+// Huffman code lengths limited to `max_bits`. Frequencies are flattened and
+// the tree rebuilt until it fits, which is rarely needed and converges
+// quickly. At least two symbols always get a code so the code is complete.
+std::vector<unsigned char> build_lengths(std::vector<uint32_t> freq,
+                                         int max_bits)
+{
+	int used = 0;
+	for (uint32_t f : freq)
+		used += f > 0;
+	if (used < 2)
+	{
+		for (size_t i = 0; i < freq.size() && used < 2; ++i)
+			if (freq[i] == 0)
+			{
+				freq[i] = 1;
+				++used;
+			}
+	}
+
+	const size_t n = freq.size();
+	std::vector<unsigned char> lengths(n, 0);
+	for (;;)
+	{
+		using Item = std::pair<uint64_t, int>; // weight, node
+		std::priority_queue<Item, std::vector<Item>, std::greater<Item>> heap;
+		std::vector<int> parent(2 * n, -1);
+		for (size_t i = 0; i < n; ++i)
+			if (freq[i])
+				heap.push({freq[i], (int)i});
+		int next = (int)n;
+		while (heap.size() > 1)
+		{
+			Item a = heap.top();
+			heap.pop();
+			Item b = heap.top();
+			heap.pop();
+			parent[a.second] = next;
+			parent[b.second] = next;
+			heap.push({a.first + b.first, next++});
+		}
+
+		int longest = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (!freq[i])
+			{
+				lengths[i] = 0;
+				continue;
+			}
+			int depth = 0;
+			for (int p = parent[i]; p != -1; p = parent[p])
+				++depth;
+			lengths[i] = (unsigned char)depth;
+			longest = std::max(longest, depth);
+		}
+		if (longest <= max_bits)
+			return lengths;
+		for (auto &f : freq)
+			if (f)
+				f = (f >> 1) | 1;
+	}
+}
+
+int length_code(int length)
+{
+	int code = 28;
+	while (length_base[code] > length)
+		--code;
+	return code;
+}
+
+int dist_code(int dist)
+{
+	int code = 29;
+	while (dist_base[code] > dist)
+		--code;
+	return code;
+}
+} // namespace
+
+// --- Checksums ---
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t n)
+{
+	static const std::vector<uint32_t> table = []() {
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < n; ++i)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+uint32_t adler32_update(uint32_t adler, const unsigned char *data, size_t n)
+{
+	uint32_t a = adler & 0xFFFF, b = adler >> 16;
+	while (n > 0)
+	{
+		// 5552 is the largest run that cannot overflow 32 bits.
+		size_t run = std::min<size_t>(n, 5552);
+		for (size_t i = 0; i < run; ++i)
+		{
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += run;
+		n -= run;
+	}
+	return (b << 16) | a;
+}
+
+// --- Inflater ---
+Inflater::Inflater(Source source) : source(std::move(source)), input(1 << 16)
+{
+}
+
+void Inflater::fill_bits(int n)
+{
+	while (bit_count < n)
+	{
+		if (input_pos == input_len)
+		{
+			input_len = input_eof ? 0 : source(input.data(), input.size());
+			input_pos = 0;
+			if (input_len == 0)
+			{
+				// Feed zeros so table lookups can peek past the end; reading
+				// them as real data is caught in finish_stream().
+				input_eof = true;
+				if (++overrun > 8)
+					throw std::runtime_error("inflate: unexpected end of data");
+				bit_count += 8;
+				continue;
+			}
+		}
+		bit_buffer |= (uint64_t)input[input_pos++] << bit_count;
+		bit_count += 8;
+	}
+}
+
+uint32_t Inflater::get_bits(int n)
+{
+	if (n == 0)
+		return 0;
+	fill_bits(n);
+	uint32_t v = (uint32_t)(bit_buffer & ((1ull << n) - 1));
+	bit_buffer >>= n;
+	bit_count -= n;
+	return v;
+}
+
+int Inflater::decode(const Table &table)
+{
+	fill_bits(table.bits);
+	uint16_t e = table.entries[bit_buffer & ((1u << table.bits) - 1)];
+	int len = e & 15;
+	if (len == 0)
+		throw std::runtime_error("inflate: invalid Huffman code");
+	bit_buffer >>= len;
+	bit_count -= len;
+	return e >> 4;
+}
+
+void Inflater::build_table(Table &table, const unsigned char *lengths,
+                           int count)
+{
+	int bl_count[16] = {0};
+	int longest = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		bl_count[lengths[i]]++;
+		longest = std::max<int>(longest, lengths[i]);
+	}
+	bl_count[0] = 0;
+	int left = 1;
+	for (int len = 1; len < 16; ++len)
+	{
+		left = (left << 1) - bl_count[len];
+		if (left < 0)
+			throw std::runtime_error("inflate: over-subscribed code");
+	}
+
+	table.bits = std::max(1, longest);
+	table.entries.assign((size_t)1 << table.bits, 0);
+	uint32_t next_code[16] = {0};
+	uint32_t code = 0;
+	for (int bits = 1; bits < 16; ++bits)
+	{
+		code = (code + bl_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+	for (int sym = 0; sym < count; ++sym)
+	{
+		int len = lengths[sym];
+		if (!len)
+			continue;
+		uint32_t rev = reverse_bits(next_code[len]++, len);
+		for (uint32_t k = rev; k < table.entries.size(); k += 1u << len)
+			table.entries[k] = (uint16_t)((sym << 4) | len);
+	}
+}
+
+void Inflater::read_header()
+{
+	uint32_t cmf = get_bits(8), flg = get_bits(8);
+	if ((cmf & 15) != 8 || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 != 0)
+		throw std::runtime_error("inflate: bad zlib header");
+	if (flg & 0x20)
+		throw std::runtime_error("inflate: preset dictionary not supported");
+	header_done = true;
+}
+
+void Inflater::start_block()
+{
+	last_block = get_bits(1);
+	block_type = (int)get_bits(2);
+	if (block_type == 0)
+	{
+		get_bits(bit_count % 8); // align to a byte boundary
+		uint32_t len = get_bits(16), nlen = get_bits(16);
+		if ((len ^ 0xFFFF) != nlen)
+			throw std::runtime_error("inflate: corrupt stored block");
+		stored_remaining = len;
+	}
+	else if (block_type == 1)
+	{
+		unsigned char lengths[288 + 30];
+		std::fill(lengths, lengths + 144, 8);
+		std::fill(lengths + 144, lengths + 256, 9);
+		std::fill(lengths + 256, lengths + 280, 7);
+		std::fill(lengths + 280, lengths + 288, 8);
+		std::fill(lengths + 288, lengths + 318, 5);
+		build_table(litlen, lengths, 288);
+		build_table(distance, lengths + 288, 30);
+	}
+	else if (block_type == 2)
+		read_dynamic_tables();
+	else
+		throw std::runtime_error("inflate: invalid block type");
+	in_block = true;
+}
+
+void Inflater::read_dynamic_tables()
+{
+	int hlit = (int)get_bits(5) + 257;
+	int hdist = (int)get_bits(5) + 1;
+	int hclen = (int)get_bits(4) + 4;
+	if (hlit > 286 || hdist > 30)
+		throw std::runtime_error("inflate: bad table sizes");
+
+	unsigned char clen[19] = {0};
+	for (int i = 0; i < hclen; ++i)
+		clen[clen_order[i]] = (unsigned char)get_bits(3);
+	Table clen_table;
+	build_table(clen_table, clen, 19);
+
+	unsigned char lengths[286 + 30] = {0};
+	int n = 0;
+	while (n < hlit + hdist)
+	{
+		int sym = decode(clen_table);
+		if (sym < 16)
+		{
+			lengths[n++] = (unsigned char)sym;
+			continue;
+		}
+		int repeat = 0;
+		unsigned char value = 0;
+		if (sym == 16)
+		{
+			if (n == 0)
+				throw std::runtime_error("inflate: repeat with no length");
+			value = lengths[n - 1];
+			repeat = 3 + (int)get_bits(2);
+		}
+		else if (sym == 17)
+			repeat = 3 + (int)get_bits(3);
+		else
+			repeat = 11 + (int)get_bits(7);
+		if (n + repeat > hlit + hdist)
+			throw std::runtime_error("inflate: code lengths overflow");
+		while (repeat--)
+			lengths[n++] = value;
+	}
+	if (lengths[256] == 0)
+		throw std::runtime_error("inflate: missing end-of-block code");
+	build_table(litlen, lengths, hlit);
+	build_table(distance, lengths + hlit, hdist);
+}
+
+void Inflater::decode_some(size_t want)
+{
+	while (output.size() - read_pos < want && !stream_done)
+	{
+		if (!header_done)
+		{
+			read_header();
+			continue;
+		}
+		if (!in_block)
+		{
+			if (last_block)
+			{
+				finish_stream();
+				break;
+			}
+			start_block();
+			continue;
+		}
+
+		if (block_type == 0)
+		{
+			if (stored_remaining == 0)
+			{
+				in_block = false;
+				continue;
+			}
+			output.push_back((unsigned char)get_bits(8));
+			--stored_remaining;
+			continue;
+		}
+
+		int sym = decode(litlen);
+		if (sym < 256)
+		{
+			output.push_back((unsigned char)sym);
+			continue;
+		}
+		if (sym == 256)
+		{
+			in_block = false;
+			continue;
+		}
+		sym -= 257;
+		if (sym >= 29)
+			throw std::runtime_error("inflate: bad length code");
+		int len = length_base[sym] + (int)get_bits(length_extra[sym]);
+		int dsym = decode(distance);
+		if (dsym >= 30)
+			throw std::runtime_error("inflate: bad distance code");
+		size_t dist = dist_base[dsym] + get_bits(dist_extra[dsym]);
+		if (dist > output.size())
+			throw std::runtime_error("inflate: distance too far back");
+		size_t from = output.size() - dist;
+		for (int i = 0; i < len; ++i)
+			output.push_back(output[from + i]);
+	}
+}
+
+void Inflater::finish_stream()
+{
+	get_bits(bit_count % 8);
+	uint32_t expected = 0;
+	for (int i = 0; i < 4; ++i)
+		expected = (expected << 8) | get_bits(8);
+	if (bit_count < overrun * 8)
+		throw std::runtime_error("inflate: truncated stream");
+	adler = adler32_update(adler, output.data() + adler_pos,
+	                       output.size() - adler_pos);
+	adler_pos = output.size();
+	if (adler != expected)
+		throw std::runtime_error("inflate: Adler-32 mismatch");
+	stream_done = true;
+}
+
+void Inflater::compact()
+{
+	adler = adler32_update(adler, output.data() + adler_pos,
+	                       output.size() - adler_pos);
+	adler_pos = output.size();
+	// Keep the 32 KiB history that back-references may still reach.
+	size_t keep_from = output.size() > (size_t)kWindow
+	                       ? std::min(read_pos, output.size() - kWindow)
+	                       : 0;
+	if (keep_from < (size_t)4 * kWindow)
+		return;
+	output.erase(output.begin(), output.begin() + keep_from);
+	read_pos -= keep_from;
+	adler_pos -= keep_from;
+}
+
+size_t Inflater::read(unsigned char *out, size_t n)
+{
+	size_t produced = 0;
+	while (produced < n)
+	{
+		if (read_pos == output.size())
+		{
+			if (stream_done)
+				break;
+			compact();
+			decode_some(std::max<size_t>(n - produced, 1 << 15));
+			continue;
+		}
+		size_t take = std::min(n - produced, output.size() - read_pos);
+		std::copy(output.begin() + read_pos, output.begin() + read_pos + take,
+		          out + produced);
+		read_pos += take;
+		produced += take;
+	}
+	return produced;
+}
+
+// --- Deflater ---
+Deflater::Deflater(Sink sink)
+    : sink(std::move(sink)), head((size_t)1 << kHashBits, -1), prev(kWindow, -1)
+{
+}
+
+void Deflater::write(const unsigned char *data, size_t n)
+{
+	adler = adler32_update(adler, data, n);
+	window.insert(window.end(), data, data + n);
+	compress(false);
+}
+
+void Deflater::finish()
+{
+	compress(true);
+	emit_block(true);
+	if (bit_count > 0)
+		put_bits(0, 8 - bit_count);
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back((unsigned char)(adler >> shift));
+	flush_out(true);
+}
+
+void Deflater::compress(bool final_pass)
+{
+	auto hash = [&](size_t p) {
+		return ((window[p] << 10) ^ (window[p + 1] << 5) ^ window[p + 2]) &
+		       ((1 << kHashBits) - 1);
+	};
+	auto insert = [&](size_t p) {
+		int h = hash(p);
+		prev[p & (kWindow - 1)] = head[h];
+		head[h] = (int)p;
+	};
+
+	for (;;)
+	{
+		size_t avail = window.size() - pos;
+		// Keep a full match of lookahead until the input is complete.
+		if (avail == 0 || (!final_pass && avail < (size_t)kMaxMatch))
+			break;
+
+		int best_len = 0, best_dist = 0;
+		if (avail >= (size_t)kMinMatch)
+		{
+			int max_len = (int)std::min<size_t>(avail, kMaxMatch);
+			int cand = head[hash(pos)];
+			int chain = kMaxChain;
+			while (cand >= 0 && (int)pos - cand <= kWindow && chain-- > 0)
+			{
+				const unsigned char *a = &window[cand], *b = &window[pos];
+				if (a[best_len] == b[best_len])
+				{
+					int len = 0;
+					while (len < max_len && a[len] == b[len])
+						++len;
+					if (len > best_len)
+					{
+						best_len = len;
+						best_dist = (int)pos - cand;
+						if (len == max_len)
+							break;
+					}
+				}
+				int next = prev[cand & (kWindow - 1)];
+				if (next >= cand) // slot reused by a newer position
+					break;
+				cand = next;
+			}
+			insert(pos);
+		}
+
+		if (best_len >= kMinMatch)
+		{
+			int lc = length_code(best_len), dc = dist_code(best_dist);
+			symbols.push_back({(uint16_t)(257 + lc),
+			                   (uint16_t)(best_len - length_base[lc]),
+			                   (uint16_t)dc,
+			                   (uint16_t)(best_dist - dist_base[dc])});
+			for (int i = 1; i < best_len; ++i)
+				if (pos + i + 2 < window.size())
+					insert(pos + i);
+			pos += best_len;
+		}
+		else
+		{
+			symbols.push_back({window[pos], 0, 0, 0});
+			++pos;
+		}
+
+		if (symbols.size() >= kBlockSymbols)
+			emit_block(false);
+		if (pos >= (size_t)3 * kWindow)
+			slide();
+	}
+}
+
+void Deflater::slide()
+{
+	// Shift by a multiple of the window so `prev` slots keep their index.
+	size_t shift = (pos - kWindow) / kWindow * kWindow;
+	window.erase(window.begin(), window.begin() + shift);
+	pos -= shift;
+	for (auto &h : head)
+		h = h >= (int)shift ? h - (int)shift : -1;
+	for (auto &p : prev)
+		p = p >= (int)shift ? p - (int)shift : -1;
+}
+
+void Deflater::put_bits(uint32_t value, int n)
+{
+	bit_buffer |= (uint64_t)value << bit_count;
+	bit_count += n;
+	while (bit_count >= 8)
+	{
+		out.push_back((unsigned char)bit_buffer);
+		bit_buffer >>= 8;
+		bit_count -= 8;
+	}
+}
+
+void Deflater::flush_out(bool all)
+{
+	if (!all && out.size() < (1 << 16))
+		return;
+	if (!out.empty())
+		sink(out.data(), out.size());
+	out.clear();
+}
+
+void Deflater::emit_block(bool final_block)
+{
+	if (!header_written)
+	{
+		out.push_back(0x78); // deflate, 32 KiB window
+		out.push_back(0x9C); // default compression level
+		header_written = true;
+	}
+	if (symbols.empty() && !final_block)
+		return;
+
+	std::vector<uint32_t> lit_freq(286, 0), dist_freq(30, 0);
+	for (const auto &s : symbols)
+	{
+		lit_freq[s.litlen]++;
+		if (s.litlen > 256)
+			dist_freq[s.dist]++;
+	}
+	lit_freq[256]++;
+	std::vector<unsigned char> lit_len = build_lengths(lit_freq, 15);
+	std::vector<unsigned char> dist_len = build_lengths(dist_freq, 15);
+
+	int hlit = 286, hdist = 30;
+	while (hlit > 257 && lit_len[hlit - 1] == 0)
+		--hlit;
+	while (hdist > 1 && dist_len[hdist - 1] == 0)
+		--hdist;
+
+	// Run-length encode the concatenated code lengths with symbols 16-18.
+	std::vector<unsigned char> all(lit_len.begin(), lit_len.begin() + hlit);
+	all.insert(all.end(), dist_len.begin(), dist_len.begin() + hdist);
+	std::vector<std::pair<int, int>> rle; // symbol, extra value
+	for (size_t i = 0; i < all.size();)
+	{
+		size_t run = 1;
+		while (i + run < all.size() && all[i + run] == all[i])
+			++run;
+		if (all[i] == 0 && run >= 3)
+		{
+			size_t take = std::min<size_t>(run, 138);
+			if (take >= 11)
+				rle.push_back({18, (int)take - 11});
+			else
+				rle.push_back({17, (int)take - 3});
+			i += take;
+			continue;
+		}
+		rle.push_back({all[i], 0});
+		size_t repeats = run - 1;
+		i += 1;
+		while (all[i - 1] != 0 && repeats >= 3)
+		{
+			size_t take = std::min<size_t>(repeats, 6);
+			rle.push_back({16, (int)take - 3});
+			repeats -= take;
+			i += take;
+		}
+	}
+
+	std::vector<uint32_t> clen_freq(19, 0);
+	for (const auto &r : rle)
+		clen_freq[r.first]++;
+	std::vector<unsigned char> clen_len = build_lengths(clen_freq, 7);
+	int hclen = 19;
+	while (hclen > 4 && clen_len[clen_order[hclen - 1]] == 0)
+		--hclen;
+
+	std::vector<uint32_t> lit_code = canonical_codes(lit_len);
+	std::vector<uint32_t> dist_code_bits = canonical_codes(dist_len);
+	std::vector<uint32_t> clen_code = canonical_codes(clen_len);
+
+	put_bits(final_block ? 1 : 0, 1);
+	put_bits(2, 2);
+	put_bits(hlit - 257, 5);
+	put_bits(hdist - 1, 5);
+	put_bits(hclen - 4, 4);
+	for (int i = 0; i < hclen; ++i)
+		put_bits(clen_len[clen_order[i]], 3);
+	for (const auto &r : rle)
+	{
+		put_bits(clen_code[r.first], clen_len[r.first]);
+		if (r.first == 16)
+			put_bits(r.second, 2);
+		else if (r.first == 17)
+			put_bits(r.second, 3);
+		else if (r.first == 18)
+			put_bits(r.second, 7);
+	}
+
+	for (const auto &s : symbols)
+	{
+		put_bits(lit_code[s.litlen], lit_len[s.litlen]);
+		if (s.litlen <= 256)
+			continue;
+		put_bits(s.extra, length_extra[s.litlen - 257]);
+		put_bits(dist_code_bits[s.dist], dist_len[s.dist]);
+		put_bits(s.dist_extra, dist_extra[s.dist]);
+	}
+	put_bits(lit_code[256], lit_len[256]);
+	symbols.clear();
+	flush_out(false);
+}
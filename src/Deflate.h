@@ -0,0 +1,110 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Self-contained zlib (RFC 1950) / DEFLATE (RFC 1951) streams, used by the
+// PNG codec. Both directions stream: neither holds more than the 32 KiB
+// history window plus one block of data.
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t n);
+uint32_t adler32_update(uint32_t adler, const unsigned char *data, size_t n);
+
+// Pulls compressed bytes from `source` on demand and yields the
+// decompressed stream. Throws std::runtime_error on malformed input.
+class Inflater
+{
+  public:
+	// Fills up to `n` bytes and returns how many were written; 0 means the
+	// compressed input is exhausted.
+	using Source = std::function<size_t(unsigned char *buffer, size_t n)>;
+
+	explicit Inflater(Source source);
+
+	// Reads exactly `n` bytes unless the stream ends first; returns the
+	// number of bytes produced.
+	size_t read(unsigned char *out, size_t n);
+	bool finished() const { return stream_done && read_pos == output.size(); }
+
+  private:
+	struct Table
+	{
+		std::vector<uint16_t> entries; // (symbol << 4) | length
+		int bits = 0;
+	};
+
+	Source source;
+	std::vector<unsigned char> input;
+	size_t input_pos = 0, input_len = 0;
+	bool input_eof = false;
+	uint64_t bit_buffer = 0;
+	int bit_count = 0;
+	int overrun = 0; // zero bytes fed past the end of input
+
+	std::vector<unsigned char> output; // history window + unread bytes
+	size_t read_pos = 0;
+
+	bool header_done = false, in_block = false, last_block = false;
+	bool stream_done = false;
+	int block_type = 0;
+	size_t stored_remaining = 0;
+	Table litlen, distance;
+	uint32_t adler = 1;
+	size_t adler_pos = 0; // output[adler_pos..] not yet checksummed
+
+	void fill_bits(int n);
+	uint32_t get_bits(int n);
+	int decode(const Table &table);
+	void build_table(Table &table, const unsigned char *lengths, int count);
+	void read_header();
+	void start_block();
+	void read_dynamic_tables();
+	void decode_some(size_t want);
+	void finish_stream();
+	void compact();
+};
+
+// Accepts uncompressed bytes with write() and emits a zlib stream through
+// `sink`, using LZ77 hash chains and dynamic Huffman blocks.
+class Deflater
+{
+  public:
+	using Sink = std::function<void(const unsigned char *data, size_t n)>;
+
+	explicit Deflater(Sink sink);
+
+	void write(const unsigned char *data, size_t n);
+	// Flushes the final block and the Adler-32 trailer.
+	void finish();
+
+  private:
+	struct Symbol
+	{
+		uint16_t litlen; // 0-255 literal, 257-285 length code
+		uint16_t extra;  // length extra bits value
+		uint16_t dist;   // distance code
+		uint16_t dist_extra;
+	};
+
+	Sink sink;
+	std::vector<unsigned char> window; // history + pending input
+	size_t pos = 0;                    // next byte to encode
+	std::vector<int> head, prev;
+	std::vector<Symbol> symbols;
+	std::vector<unsigned char> out;
+	uint64_t bit_buffer = 0;
+	int bit_count = 0;
+	uint32_t adler = 1;
+	bool header_written = false;
+
+	void compress(bool final_pass);
+	void emit_block(bool final_block);
+	void put_bits(uint32_t value, int n);
+	void flush_out(bool all);
+	void slide();
+};
+
+#endif // DEFLATE_H
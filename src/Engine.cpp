@@ -0,0 +1,96 @@
+#include "Engine.h"
+#include "DeferredEngine.h"
+#include "HistogramTree.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+void ImageEngine::apply_updates(
+    const std::vector<SegmentTree::Update> &updates)
+{
+	apply_updates_in_turn(*this, updates);
+}
+
+Histogram ImageEngine::query_histogram(int r1, int c1, int r2, int c2)
+{
+	return scan_histogram(get_image(), r1, c1, r2, c2);
+}
+
+Image engine_image(OutOfCoreImage &engine)
+{
+	Image image = Image::uninitialized(engine.get_width(), engine.get_height());
+	engine.export_rows([&](int r, const RGB_uc *pixels) {
+		std::copy(pixels, pixels + image.get_width(), image.row(r));
+	});
+	return image;
+}
+
+std::vector<std::string> engine_names()
+{
+	return {"vector", "tree", "tiled", "deferred", "histogram"};
+}
+
+size_t engine_footprint(const std::string &name, int width, int height)
+{
+	if (name == "vector")
+		return VectorImage::footprint_for(width, height);
+	if (name == "tree")
+		return SegmentTree::footprint_for(width, height);
+	if (name == "tiled")
+		return TiledImage::footprint_for(width, height);
+	if (name == "deferred")
+		return DeferredEngine::footprint_for(width, height);
+	if (name == "histogram")
+		return HistogramTree::footprint_for(width, height);
+	throw std::invalid_argument("unknown engine \"" + name + "\"");
+}
+
+namespace
+{
+std::unique_ptr<ImageEngine> build_engine(const std::string &name,
+                                          const Image &image)
+{
+	if (name == "vector")
+		return std::make_unique<EngineAdapter<VectorImage>>("VectorImage",
+		                                                    image);
+	if (name == "tree")
+		return std::make_unique<EngineAdapter<SegmentTree>>("SegmentTree",
+		                                                    image);
+	if (name == "tiled")
+		return std::make_unique<EngineAdapter<TiledImage>>("TiledImage",
+		                                                   image);
+	if (name == "deferred")
+		return std::make_unique<DeferredEngine>(image);
+	return std::make_unique<HistogramTree>(image);
+}
+} // namespace
+
+std::unique_ptr<ImageEngine> make_engine(const std::string &name,
+                                         const Image &image)
+{
+	int w = image.get_width(), h = image.get_height();
+	size_t wanted = engine_footprint(name, w, h);
+	MemoryBudget &budget = MemoryBudget::instance();
+	std::string chosen = name;
+	MemoryBudget::Reservation held = budget.try_reserve(wanted);
+	if (!held && budget.get_policy() == MemoryBudget::Policy::Fallback)
+		for (const char *cheaper : {"tiled", "vector"})
+		{
+			size_t bytes = engine_footprint(cheaper, w, h);
+			if (bytes >= wanted || !(held = budget.try_reserve(bytes)))
+				continue;
+			chosen = cheaper;
+			break;
+		}
+	if (!held) // throws, with the numbers
+		held = budget.reserve(wanted, "engine \"" + name + "\" for a " +
+		                                  std::to_string(w) + "x" +
+		                                  std::to_string(h) + " image");
+
+	std::unique_ptr<ImageEngine> engine = build_engine(chosen, image);
+	// A reused pool block can be larger than estimated. A larger estimate
+	// is kept: it allows for growth, such as DeferredEngine's queue.
+	held.resize(std::max(held.bytes(), engine->memory_footprint()));
+	engine->hold(std::move(held));
+	return engine;
+}
@@ -0,0 +1,175 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "Histogram.h"
+#include "Image.h"
+#include "MemoryBudget.h"
+#include "OutOfCoreImage.h"
+#include "SegmentTree.h"
+#include "TiledImage.h"
+#include "VectorImage.h"
+#include "types.h"
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// The region operations every image engine supports, behind one virtual
+// interface so that tools (trace recording and replay, batch mode) can drive
+// any engine. Hot loops that know their engine should keep calling it
+// directly; this layer costs one indirect call per operation.
+class ImageEngine
+{
+  public:
+	virtual ~ImageEngine() = default;
+
+	virtual const char *name() const = 0;
+	virtual int get_width() const = 0;
+	virtual int get_height() const = 0;
+
+	virtual void adjust_brightness(int r1, int c1, int r2, int c2,
+	                               int value) = 0;
+	virtual void adjust_contrast(int r1, int c1, int r2, int c2,
+	                             double multiplier) = 0;
+	virtual void fill_region(int r1, int c1, int r2, int c2,
+	                         const RGB_uc &color) = 0;
+	virtual RGB_d query_average_color(int r1, int c1, int r2, int c2) = 0;
+	// Per-channel value counts over the rectangle. The default exports the
+	// image and scans the rectangle; HistogramTree keeps an index instead.
+	virtual Histogram query_histogram(int r1, int c1, int r2, int c2);
+	virtual Image get_image() = 0;
+	// Completes queued updates, for engines that defer them.
+	virtual void flush() {}
+	// Applies brightness, contrast and fill updates in order. The default
+	// makes one call per update; a SegmentTree applies them in one batch.
+	virtual void apply_updates(const std::vector<SegmentTree::Update> &updates);
+	// Bytes the engine holds: pixels, nodes, tiles and queues.
+	virtual size_t memory_footprint() const = 0;
+
+	// Keeps the engine's share of the MemoryBudget until it is destroyed;
+	// make_engine() sets it.
+	void hold(MemoryBudget::Reservation reservation)
+	{
+		budget = std::move(reservation);
+	}
+	// Gives up the engine's share, e.g. to lend it to a replacement.
+	MemoryBudget::Reservation release_budget() { return std::move(budget); }
+
+  private:
+	MemoryBudget::Reservation budget;
+};
+
+// Applies `updates` one at a time through the engine's region calls.
+// Affine updates need a SegmentTree and throw std::invalid_argument.
+template <typename E>
+void apply_updates_in_turn(E &engine,
+                           const std::vector<SegmentTree::Update> &updates)
+{
+	for (const SegmentTree::Update &u : updates)
+		switch (u.kind)
+		{
+		case SegmentTree::Update::Brightness:
+			engine.adjust_brightness(u.r1, u.c1, u.r2, u.c2, (int)u.value);
+			break;
+		case SegmentTree::Update::Contrast:
+			engine.adjust_contrast(u.r1, u.c1, u.r2, u.c2, u.value);
+			break;
+		case SegmentTree::Update::Fill:
+			engine.fill_region(u.r1, u.c1, u.r2, u.c2, u.color);
+			break;
+		case SegmentTree::Update::Affine:
+			throw std::invalid_argument("affine updates need a SegmentTree");
+		}
+}
+
+// How the adapter exports and flushes each engine.
+template <typename T> Image engine_image(T &engine)
+{
+	return engine.get_image();
+}
+Image engine_image(OutOfCoreImage &engine);
+template <typename T> void engine_flush(T &) {}
+inline void engine_flush(TiledImage &engine) { engine.flush(); }
+inline void engine_flush(OutOfCoreImage &engine) { engine.flush(); }
+template <typename T>
+void engine_apply(T &engine, const std::vector<SegmentTree::Update> &updates)
+{
+	apply_updates_in_turn(engine, updates);
+}
+inline void engine_apply(SegmentTree &engine,
+                         const std::vector<SegmentTree::Update> &updates)
+{
+	engine.apply_batch(updates);
+}
+
+// Wraps an engine by value, or by reference when T is a reference type
+// (e.g. EngineAdapter<SegmentTree &> over a tree owned elsewhere).
+template <typename T> class EngineAdapter : public ImageEngine
+{
+  public:
+	template <typename... Args>
+	explicit EngineAdapter(const char *name, Args &&...args)
+	    : engine_name(name), engine(std::forward<Args>(args)...)
+	{
+	}
+
+	std::remove_reference_t<T> &get() { return engine; }
+
+	const char *name() const override { return engine_name; }
+	int get_width() const override { return engine.get_width(); }
+	int get_height() const override { return engine.get_height(); }
+
+	void adjust_brightness(int r1, int c1, int r2, int c2,
+	                       int value) override
+	{
+		engine.adjust_brightness(r1, c1, r2, c2, value);
+	}
+	void adjust_contrast(int r1, int c1, int r2, int c2,
+	                     double multiplier) override
+	{
+		engine.adjust_contrast(r1, c1, r2, c2, multiplier);
+	}
+	void fill_region(int r1, int c1, int r2, int c2,
+	                 const RGB_uc &color) override
+	{
+		engine.fill_region(r1, c1, r2, c2, color);
+	}
+	RGB_d query_average_color(int r1, int c1, int r2, int c2) override
+	{
+		return engine.query_average_color(r1, c1, r2, c2);
+	}
+	Image get_image() override { return engine_image(engine); }
+	void flush() override { engine_flush(engine); }
+	void apply_updates(const std::vector<SegmentTree::Update> &updates) override
+	{
+		engine_apply(engine, updates);
+	}
+	size_t memory_footprint() const override
+	{
+		return engine.memory_footprint();
+	}
+
+  private:
+	const char *engine_name;
+	T engine;
+};
+
+// Names accepted by make_engine(): "vector", "tree", "tiled", "deferred"
+// (DeferredEngine.h) and "histogram" (HistogramTree.h).
+std::vector<std::string> engine_names();
+// The footprint the named engine will have for a width x height image,
+// known before building it. Throws std::invalid_argument for an unknown
+// name.
+size_t engine_footprint(const std::string &name, int width, int height);
+// Builds the named in-memory engine from `image` and reserves its footprint
+// in MemoryBudget::instance(). When it does not fit, the budget's policy
+// either throws std::runtime_error or falls back to the first cheaper
+// engine that fits: "tiled" (smaller trees for sides just past a power of
+// two), then "vector" (3 bytes per pixel); check name() for what was built.
+// Throws std::invalid_argument for an unknown name.
+std::unique_ptr<ImageEngine> make_engine(const std::string &name,
+                                         const Image &image);
+
+#endif // ENGINE_H
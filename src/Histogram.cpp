@@ -0,0 +1,151 @@
+#include "Histogram.h"
+#include "PixelKernels.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+unsigned char Histogram::kth(int channel, uint64_t k) const
+{
+	if (k >= pixels)
+		throw std::out_of_range("rank " + std::to_string(k) + " of " +
+		                        std::to_string(pixels) + " pixels");
+	const std::array<uint64_t, 256> &bins = counts[channel];
+	for (int v = 0; v < 256; ++v)
+	{
+		if (k < bins[v])
+			return (unsigned char)v;
+		k -= bins[v];
+	}
+	return 255;
+}
+
+unsigned char Histogram::percentile(int channel, double fraction) const
+{
+	fraction = std::min(1.0, std::max(0.0, fraction));
+	uint64_t rank = (uint64_t)std::ceil(fraction * (double)pixels);
+	return kth(channel, std::max<uint64_t>(rank, 1) - 1);
+}
+
+RGB_uc Histogram::percentile(double fraction) const
+{
+	return {percentile(0, fraction), percentile(1, fraction),
+	        percentile(2, fraction)};
+}
+
+RGB_d Histogram::mean() const
+{
+	if (pixels == 0)
+		return {0, 0, 0};
+	double sum[3] = {0, 0, 0};
+	for (int ch = 0; ch < 3; ++ch)
+		for (int v = 0; v < 256; ++v)
+			sum[ch] += (double)v * counts[ch][v];
+	return {sum[0] / pixels, sum[1] / pixels, sum[2] / pixels};
+}
+
+ChannelLut identity_lut()
+{
+	ChannelLut lut;
+	for (auto &table : lut)
+		for (int v = 0; v < 256; ++v)
+			table[v] = (unsigned char)v;
+	return lut;
+}
+
+ChannelLut brightness_lut(int value)
+{
+	ChannelLut lut = identity_lut();
+	for (auto &table : lut)
+		add_saturate_bytes(table.data(), table.size(), value);
+	return lut;
+}
+
+ChannelLut contrast_lut(double multiplier)
+{
+	ChannelLut lut = identity_lut();
+	for (auto &table : lut)
+		scale_saturate_bytes(table.data(), table.size(), multiplier);
+	return lut;
+}
+
+ChannelLut fill_lut(const RGB_uc &color)
+{
+	ChannelLut lut;
+	lut[0].fill(color.r);
+	lut[1].fill(color.g);
+	lut[2].fill(color.b);
+	return lut;
+}
+
+ChannelLut compose_lut(const ChannelLut &first, const ChannelLut &second)
+{
+	ChannelLut lut;
+	for (int ch = 0; ch < 3; ++ch)
+		for (int v = 0; v < 256; ++v)
+			lut[ch][v] = second[ch][first[ch][v]];
+	return lut;
+}
+
+ChannelLut levels_lut(const Histogram &histogram, double low, double high)
+{
+	ChannelLut lut = identity_lut();
+	if (histogram.pixels == 0)
+		return lut;
+	for (int ch = 0; ch < 3; ++ch)
+	{
+		int lo = histogram.percentile(ch, low);
+		int hi = histogram.percentile(ch, high);
+		if (hi <= lo)
+			continue;
+		for (int v = 0; v < 256; ++v)
+		{
+			double t = (double)(v - lo) / (hi - lo);
+			lut[ch][v] =
+			    (unsigned char)std::lround(std::min(1.0, std::max(0.0, t)) *
+			                               255.0);
+		}
+	}
+	return lut;
+}
+
+ChannelLut equalize_lut(const Histogram &histogram)
+{
+	ChannelLut lut = identity_lut();
+	for (int ch = 0; ch < 3; ++ch)
+	{
+		const std::array<uint64_t, 256> &bins = histogram.counts[ch];
+		// Counts below the lowest value present map to 0.
+		uint64_t lowest = 0;
+		for (int v = 0; v < 256 && lowest == 0; ++v)
+			lowest = bins[v];
+		if (histogram.pixels == lowest) // one value, or empty
+			continue;
+		uint64_t cumulative = 0;
+		for (int v = 0; v < 256; ++v)
+		{
+			cumulative += bins[v];
+			double t = cumulative <= lowest
+			               ? 0.0
+			               : (double)(cumulative - lowest) /
+			                     (histogram.pixels - lowest);
+			lut[ch][v] = (unsigned char)std::lround(t * 255.0);
+		}
+	}
+	return lut;
+}
+
+Histogram scan_histogram(const Image &image, int r1, int c1, int r2, int c2)
+{
+	Histogram histogram;
+	for (int r = r1; r <= r2; ++r)
+		for (int c = c1; c <= c2; ++c)
+		{
+			RGB_uc p = image.get_pixel(r, c);
+			++histogram.counts[0][p.r];
+			++histogram.counts[1][p.g];
+			++histogram.counts[2][p.b];
+		}
+	histogram.pixels = (uint64_t)(r2 - r1 + 1) * (c2 - c1 + 1);
+	return histogram;
+}
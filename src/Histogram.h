@@ -0,0 +1,47 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "Image.h"
+#include "types.h"
+#include <array>
+#include <cstdint>
+
+// Pixel counts per channel (0 = R, 1 = G, 2 = B) and 8-bit value.
+struct Histogram
+{
+	std::array<std::array<uint64_t, 256>, 3> counts{};
+	uint64_t pixels = 0;
+
+	// The k-th smallest value of `channel`, counting from 0 (k < pixels).
+	unsigned char kth(int channel, uint64_t k) const;
+	// Nearest-rank percentile: the smallest value with at least
+	// `fraction` of the pixels at or below it; 0 is the minimum and 1 the
+	// maximum.
+	unsigned char percentile(int channel, double fraction) const;
+	RGB_uc percentile(double fraction) const;
+	RGB_d mean() const;
+};
+
+// Per-channel pixel value mapping: value v of channel c becomes lut[c][v].
+using ChannelLut = std::array<std::array<unsigned char, 256>, 3>;
+
+ChannelLut identity_lut();
+// The same tables VectorImage's brightness and contrast kernels apply
+// (saturating add; Q16 multiply), and a fill's constant tables.
+ChannelLut brightness_lut(int value);
+ChannelLut contrast_lut(double multiplier);
+ChannelLut fill_lut(const RGB_uc &color);
+// `second` applied after `first`.
+ChannelLut compose_lut(const ChannelLut &first, const ChannelLut &second);
+// Auto-levels: stretches each channel linearly so its `low` percentile
+// maps to 0 and its `high` percentile to 255.
+ChannelLut levels_lut(const Histogram &histogram, double low = 0.01,
+                      double high = 0.99);
+// Histogram equalisation: maps each value to its cumulative share of the
+// pixels, per channel.
+ChannelLut equalize_lut(const Histogram &histogram);
+
+// Counts the rectangle by scanning every pixel.
+Histogram scan_histogram(const Image &image, int r1, int c1, int r2, int c2);
+
+#endif // HISTOGRAM_H
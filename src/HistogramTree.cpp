@@ -0,0 +1,336 @@
+#include "HistogramTree.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+HistogramTree::HistogramTree(const Image &image, int tile)
+    : width(image.get_width()), height(image.get_height()), tile(tile),
+      pixels(image.get_layout() == PixelLayout::Interleaved
+                 ? image
+                 : image.to_layout(PixelLayout::Interleaved))
+{
+	if (width <= 0 || height <= 0)
+		throw std::invalid_argument("image size must be positive");
+	if (tile <= 0)
+		throw std::invalid_argument("tile size must be positive");
+	root_span = {0, 0, (height - 1) / tile, (width - 1) / tile};
+	// A quadtree over n tiles has fewer than 2n nodes, even where one
+	// axis has run out of splits; reserving keeps references stable.
+	size_t tiles = (size_t)(root_span.tr2 + 1) * (root_span.tc2 + 1);
+	nodes.reserve(2 * tiles);
+	build(root_span);
+}
+
+void HistogramTree::check_rect(int r1, int c1, int r2, int c2) const
+{
+	if (r1 < 0 || c1 < 0 || r2 >= height || c2 >= width || r1 > r2 ||
+	    c1 > c2)
+		throw std::out_of_range("rectangle outside the " +
+		                        std::to_string(width) + "x" +
+		                        std::to_string(height) + " image");
+}
+
+HistogramTree::Rect HistogramTree::bounds(const Span &span) const
+{
+	return {span.tr1 * tile, span.tc1 * tile,
+	        std::min(height, (span.tr2 + 1) * tile) - 1,
+	        std::min(width, (span.tc2 + 1) * tile) - 1};
+}
+
+bool HistogramTree::is_tile(const Span &span)
+{
+	return span.tr1 == span.tr2 && span.tc1 == span.tc2;
+}
+
+void HistogramTree::split(const Span &span, Span children[4])
+{
+	// Same split as SegmentTree: [start, mid] is the first half.
+	int mid_r = span.tr1 + (span.tr2 - span.tr1) / 2;
+	int mid_c = span.tc1 + (span.tc2 - span.tc1) / 2;
+	children[0] = {span.tr1, span.tc1, mid_r, mid_c};
+	children[1] = {span.tr1, mid_c + 1, mid_r, span.tc2};
+	children[2] = {mid_r + 1, span.tc1, span.tr2, mid_c};
+	children[3] = {mid_r + 1, mid_c + 1, span.tr2, span.tc2};
+}
+
+int HistogramTree::build(const Span &span)
+{
+	if (span.tr1 > span.tr2 || span.tc1 > span.tc2)
+		return -1;
+	int idx = (int)nodes.size();
+	nodes.emplace_back();
+	if (is_tile(span))
+	{
+		Node &node = nodes[idx];
+		for (auto &bins : node.counts)
+			bins.fill(0);
+		Rect b = bounds(span);
+		for (int r = b.r1; r <= b.r2; ++r)
+		{
+			const RGB_uc *row = pixels.row(r);
+			for (int c = b.c1; c <= b.c2; ++c)
+			{
+				++node.counts[0][row[c].r];
+				++node.counts[1][row[c].g];
+				++node.counts[2][row[c].b];
+			}
+		}
+		return idx;
+	}
+	Span children[4];
+	split(span, children);
+	for (int i = 0; i < 4; ++i)
+	{
+		int child = build(children[i]);
+		nodes[idx].child[i] = child;
+	}
+	pull(nodes[idx]);
+	return idx;
+}
+
+void HistogramTree::apply_tag(Node &node, const ChannelLut &lut)
+{
+	for (int ch = 0; ch < 3; ++ch)
+	{
+		std::array<uint32_t, 256> rebinned{};
+		for (int v = 0; v < 256; ++v)
+			rebinned[lut[ch][v]] += node.counts[ch][v];
+		node.counts[ch] = rebinned;
+	}
+	node.lut = node.has_lut ? compose_lut(node.lut, lut) : lut;
+	node.has_lut = true;
+}
+
+void HistogramTree::push(Node &node)
+{
+	if (!node.has_lut)
+		return;
+	for (int child : node.child)
+		if (child >= 0)
+			apply_tag(nodes[child], node.lut);
+	node.has_lut = false;
+}
+
+void HistogramTree::pull(Node &node)
+{
+	for (auto &bins : node.counts)
+		bins.fill(0);
+	for (int child : node.child)
+	{
+		if (child < 0)
+			continue;
+		const Node &c = nodes[child];
+		for (int ch = 0; ch < 3; ++ch)
+			for (int v = 0; v < 256; ++v)
+				node.counts[ch][v] += c.counts[ch][v];
+	}
+}
+
+void HistogramTree::settle_tile(Node &node, const Span &span)
+{
+	if (!node.has_lut)
+		return;
+	Rect b = bounds(span);
+	for (int r = b.r1; r <= b.r2; ++r)
+	{
+		RGB_uc *row = pixels.row(r);
+		for (int c = b.c1; c <= b.c2; ++c)
+			row[c] = {node.lut[0][row[c].r], node.lut[1][row[c].g],
+			          node.lut[2][row[c].b]};
+	}
+	node.has_lut = false;
+}
+
+void HistogramTree::settle_all(int idx, const Span &span)
+{
+	Node &node = nodes[idx];
+	if (is_tile(span))
+		return settle_tile(node, span);
+	push(node);
+	Span children[4];
+	split(span, children);
+	for (int i = 0; i < 4; ++i)
+		if (node.child[i] >= 0)
+			settle_all(node.child[i], children[i]);
+}
+
+void HistogramTree::update(int idx, const Span &span, const Rect &rect,
+                           const ChannelLut &lut)
+{
+	Rect b = bounds(span);
+	if (b.r1 > rect.r2 || rect.r1 > b.r2 || b.c1 > rect.c2 || rect.c1 > b.c2)
+		return;
+	Node &node = nodes[idx];
+	if (rect.r1 <= b.r1 && b.r2 <= rect.r2 && rect.c1 <= b.c1 &&
+	    b.c2 <= rect.c2)
+		return apply_tag(node, lut);
+
+	if (is_tile(span))
+	{
+		// Cut by the rectangle's edge: edit the covered pixels in place.
+		settle_tile(node, span);
+		int r1 = std::max(b.r1, rect.r1), r2 = std::min(b.r2, rect.r2);
+		int c1 = std::max(b.c1, rect.c1), c2 = std::min(b.c2, rect.c2);
+		for (int r = r1; r <= r2; ++r)
+		{
+			RGB_uc *row = pixels.row(r);
+			for (int c = c1; c <= c2; ++c)
+			{
+				RGB_uc p = row[c];
+				RGB_uc q = {lut[0][p.r], lut[1][p.g], lut[2][p.b]};
+				--node.counts[0][p.r];
+				--node.counts[1][p.g];
+				--node.counts[2][p.b];
+				++node.counts[0][q.r];
+				++node.counts[1][q.g];
+				++node.counts[2][q.b];
+				row[c] = q;
+			}
+		}
+		return;
+	}
+
+	push(node);
+	Span children[4];
+	split(span, children);
+	for (int i = 0; i < 4; ++i)
+		if (node.child[i] >= 0)
+			update(node.child[i], children[i], rect, lut);
+	pull(node);
+}
+
+void HistogramTree::collect(int idx, const Span &span, const Rect &rect,
+                            const ChannelLut *after, Histogram &out) const
+{
+	// `after` is the composition of the ancestors' pending tables, still
+	// to be applied to everything below them.
+	Rect b = bounds(span);
+	if (b.r1 > rect.r2 || rect.r1 > b.r2 || b.c1 > rect.c2 || rect.c1 > b.c2)
+		return;
+	const Node &node = nodes[idx];
+	if (rect.r1 <= b.r1 && b.r2 <= rect.r2 && rect.c1 <= b.c1 &&
+	    b.c2 <= rect.c2)
+	{
+		for (int ch = 0; ch < 3; ++ch)
+			for (int v = 0; v < 256; ++v)
+				out.counts[ch][after ? (*after)[ch][v] : v] +=
+				    node.counts[ch][v];
+		return;
+	}
+
+	ChannelLut below;
+	if (node.has_lut)
+	{
+		below = after ? compose_lut(node.lut, *after) : node.lut;
+		after = &below;
+	}
+	if (is_tile(span))
+	{
+		int r1 = std::max(b.r1, rect.r1), r2 = std::min(b.r2, rect.r2);
+		int c1 = std::max(b.c1, rect.c1), c2 = std::min(b.c2, rect.c2);
+		for (int r = r1; r <= r2; ++r)
+		{
+			const RGB_uc *row = pixels.row(r);
+			for (int c = c1; c <= c2; ++c)
+			{
+				RGB_uc p = row[c];
+				if (after)
+					p = {(*after)[0][p.r], (*after)[1][p.g],
+					     (*after)[2][p.b]};
+				++out.counts[0][p.r];
+				++out.counts[1][p.g];
+				++out.counts[2][p.b];
+			}
+		}
+		return;
+	}
+
+	Span children[4];
+	split(span, children);
+	for (int i = 0; i < 4; ++i)
+		if (node.child[i] >= 0)
+			collect(node.child[i], children[i], rect, after, out);
+}
+
+void HistogramTree::adjust_brightness(int r1, int c1, int r2, int c2,
+                                      int value)
+{
+	apply_lut(r1, c1, r2, c2, brightness_lut(value));
+}
+
+void HistogramTree::adjust_contrast(int r1, int c1, int r2, int c2,
+                                    double multiplier)
+{
+	apply_lut(r1, c1, r2, c2, contrast_lut(multiplier));
+}
+
+void HistogramTree::fill_region(int r1, int c1, int r2, int c2,
+                                const RGB_uc &color)
+{
+	apply_lut(r1, c1, r2, c2, fill_lut(color));
+}
+
+void HistogramTree::apply_lut(int r1, int c1, int r2, int c2,
+                              const ChannelLut &lut)
+{
+	check_rect(r1, c1, r2, c2);
+	update(0, root_span, {r1, c1, r2, c2}, lut);
+}
+
+void HistogramTree::auto_levels(int r1, int c1, int r2, int c2, double low,
+                                double high)
+{
+	apply_lut(r1, c1, r2, c2,
+	          levels_lut(query_histogram(r1, c1, r2, c2), low, high));
+}
+
+void HistogramTree::equalize(int r1, int c1, int r2, int c2)
+{
+	apply_lut(r1, c1, r2, c2, equalize_lut(query_histogram(r1, c1, r2, c2)));
+}
+
+Histogram HistogramTree::query_histogram(int r1, int c1, int r2, int c2)
+{
+	check_rect(r1, c1, r2, c2);
+	Histogram histogram;
+	collect(0, root_span, {r1, c1, r2, c2}, nullptr, histogram);
+	histogram.pixels = (uint64_t)(r2 - r1 + 1) * (c2 - c1 + 1);
+	return histogram;
+}
+
+RGB_d HistogramTree::query_average_color(int r1, int c1, int r2, int c2)
+{
+	return query_histogram(r1, c1, r2, c2).mean();
+}
+
+RGB_uc HistogramTree::query_percentile(int r1, int c1, int r2, int c2,
+                                       double fraction)
+{
+	return query_histogram(r1, c1, r2, c2).percentile(fraction);
+}
+
+RGB_uc HistogramTree::query_kth(int r1, int c1, int r2, int c2, uint64_t k)
+{
+	Histogram histogram = query_histogram(r1, c1, r2, c2);
+	return {histogram.kth(0, k), histogram.kth(1, k), histogram.kth(2, k)};
+}
+
+size_t HistogramTree::memory_footprint() const
+{
+	return sizeof(HistogramTree) - sizeof(Image) + pixels.memory_footprint() +
+	       nodes.capacity() * sizeof(Node);
+}
+
+size_t HistogramTree::footprint_for(int width, int height, int tile)
+{
+	size_t tiles = (size_t)((height + tile - 1) / tile) *
+	               ((width + tile - 1) / tile);
+	return sizeof(HistogramTree) - sizeof(Image) +
+	       Image::footprint_for(width, height) + 2 * tiles * sizeof(Node);
+}
+
+Image HistogramTree::get_image()
+{
+	settle_all(0, root_span);
+	return pixels;
+}
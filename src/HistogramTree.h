@@ -0,0 +1,107 @@
+#ifndef HISTOGRAM_TREE_H
+#define HISTOGRAM_TREE_H
+
+#include "Engine.h"
+#include "Histogram.h"
+#include <cstdint>
+#include <vector>
+
+// An engine that answers histogram and percentile queries over any
+// rectangle without visiting every pixel in it.
+//
+// The image is cut into tile x tile squares. Each tile keeps per-channel
+// 256-bin counts, and a quadtree over the tiles keeps the sum of its
+// children's counts. Every edit is a per-channel lookup table
+// (brightness, contrast and fill included) and is applied lazily. A node
+// the rectangle covers re-bins its counts through the table and stores
+// the table as a pending tag, composed with any tag already there, for
+// its children. Only tiles cut by the rectangle's edge touch pixels.
+// A query therefore costs O(256) per quadtree node along the rectangle's
+// boundary, plus the pixels of the boundary tiles, however large the
+// rectangle is.
+//
+// Pixels follow VectorImage's 8-bit semantics: every edit saturates, and
+// brightness and contrast use the same kernels, so both engines export
+// identical images. Rectangles outside the image throw std::out_of_range.
+class HistogramTree : public ImageEngine
+{
+  public:
+	static const int kDefaultTile = 32;
+
+	explicit HistogramTree(const Image &image, int tile = kDefaultTile);
+
+	const char *name() const override { return "HistogramTree"; }
+	int get_width() const override { return width; }
+	int get_height() const override { return height; }
+
+	void adjust_brightness(int r1, int c1, int r2, int c2,
+	                       int value) override;
+	void adjust_contrast(int r1, int c1, int r2, int c2,
+	                     double multiplier) override;
+	void fill_region(int r1, int c1, int r2, int c2,
+	                 const RGB_uc &color) override;
+	// Maps every pixel of the rectangle through `lut`.
+	void apply_lut(int r1, int c1, int r2, int c2, const ChannelLut &lut);
+	// Stretches each channel of the rectangle so its `low` and `high`
+	// percentiles become 0 and 255 (see levels_lut).
+	void auto_levels(int r1, int c1, int r2, int c2, double low = 0.01,
+	                 double high = 0.99);
+	void equalize(int r1, int c1, int r2, int c2);
+
+	RGB_d query_average_color(int r1, int c1, int r2, int c2) override;
+	Histogram query_histogram(int r1, int c1, int r2, int c2) override;
+	RGB_uc query_percentile(int r1, int c1, int r2, int c2,
+	                        double fraction);
+	// Per channel, the k-th smallest value in the rectangle (from 0).
+	RGB_uc query_kth(int r1, int c1, int r2, int c2, uint64_t k);
+	Image get_image() override;
+
+	// The pixels plus fewer than two quadtree nodes per tile, each with
+	// three 256-bin histograms and a pending table (about 3.8 KiB).
+	size_t memory_footprint() const override;
+	static size_t footprint_for(int width, int height,
+	                            int tile = kDefaultTile);
+
+  private:
+	struct Node
+	{
+		std::array<std::array<uint32_t, 256>, 3> counts;
+		// Pending for the children; for a tile, not yet applied to its
+		// pixels.
+		ChannelLut lut;
+		bool has_lut = false;
+		int child[4] = {-1, -1, -1, -1};
+	};
+	// A node's tiles, inclusive, in tile coordinates.
+	struct Span
+	{
+		int tr1, tc1, tr2, tc2;
+	};
+	struct Rect
+	{
+		int r1, c1, r2, c2;
+	};
+
+	int width, height, tile;
+	Image pixels;            // tiles' pixels, before their pending tables
+	std::vector<Node> nodes; // nodes[0] is the root
+	Span root_span;
+
+	void check_rect(int r1, int c1, int r2, int c2) const;
+	Rect bounds(const Span &span) const;
+	static bool is_tile(const Span &span);
+	static void split(const Span &span, Span children[4]);
+
+	int build(const Span &span);
+	static void apply_tag(Node &node, const ChannelLut &lut);
+	void push(Node &node);
+	void pull(Node &node);
+	void settle_tile(Node &node, const Span &span);
+	void settle_all(int idx, const Span &span);
+	void update(int idx, const Span &span, const Rect &rect,
+	            const ChannelLut &lut);
+	void collect(int idx, const Span &span, const Rect &rect,
+	             const ChannelLut *after, Histogram &out) const;
+};
+
+#endif // HISTOGRAM_TREE_H
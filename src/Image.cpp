@@ -1,29 +1,98 @@
 #include "Image.h"
+#include "PixelKernels.h"
+#include "ThreadPool.h"
+#include <algorithm>
 #include <iostream>
 #include <random>
+#include <vector>
 
-Image::Image(int width, int height) : width(width), height(height)
+Image::Image(int width, int height, PixelLayout layout)
+    : width(width), height(height), layout(layout)
 {
-	data.resize(width * height);
+	data.reset((size_t)width * height, true);
 }
 
-RGB_uc Image::get_pixel(int r, int c) const { return data[r * width + c]; }
+Image::Image(int width, int height, PixelLayout layout, NoInit)
+    : width(width), height(height), layout(layout)
+{
+	data.reset((size_t)width * height, false);
+}
+
+Image Image::uninitialized(int width, int height, PixelLayout layout)
+{
+	return Image(width, height, layout, NoInit());
+}
+
+RGB_uc Image::get_pixel(int r, int c) const
+{
+	size_t idx = (size_t)r * width + c;
+	if (layout == PixelLayout::Interleaved)
+		return data[idx];
+	size_t plane = (size_t)width * height;
+	const unsigned char *b = bytes();
+	return {b[idx], b[plane + idx], b[2 * plane + idx]};
+}
 
 void Image::set_pixel(int r, int c, const RGB_uc &color)
 {
-	data[r * width + c] = color;
+	size_t idx = (size_t)r * width + c;
+	if (layout == PixelLayout::Interleaved)
+	{
+		data[idx] = color;
+		return;
+	}
+	size_t plane = (size_t)width * height;
+	unsigned char *b = bytes();
+	b[idx] = color.r;
+	b[plane + idx] = color.g;
+	b[2 * plane + idx] = color.b;
+}
+
+Image Image::to_layout(PixelLayout target) const
+{
+	if (target == layout)
+		return *this;
+
+	Image converted = uninitialized(width, height, target);
+	size_t n = (size_t)width * height;
+	if (n == 0)
+		return converted;
+	if (target == PixelLayout::Planar)
+		deinterleave_rgb(data.data(), converted.bytes(),
+		                 converted.bytes() + n, converted.bytes() + 2 * n, n);
+	else
+		interleave_rgb(bytes(), bytes() + n, bytes() + 2 * n,
+		               converted.data.data(), n);
+	return converted;
 }
 
 void Image::generate_random()
 {
 	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(0, 255);
+	generate_random(rd());
+}
 
-	for (auto &pixel : data)
-	{
-		pixel.r = dis(gen);
-		pixel.g = dis(gen);
-		pixel.b = dis(gen);
-	}
+void Image::generate_random(unsigned seed)
+{
+	// Row r is Philox stream r keyed by the seed, so the pixels do not
+	// depend on the layout, the thread count or the SIMD path.
+	const size_t row_bytes = (size_t)width * 3;
+	auto fill_rows = [&](int begin, int end) {
+		std::vector<RGB_uc> pixels(layout == PixelLayout::Planar ? width : 0);
+		for (int r = begin; r < end; ++r)
+		{
+			if (layout == PixelLayout::Interleaved)
+			{
+				random_bytes(reinterpret_cast<unsigned char *>(row(r)),
+				             row_bytes, seed, r);
+				continue;
+			}
+			random_bytes(reinterpret_cast<unsigned char *>(pixels.data()),
+			             row_bytes, seed, r);
+			deinterleave_rgb(pixels.data(), plane_row(0, r), plane_row(1, r),
+			                 plane_row(2, r), width);
+		}
+	};
+	int rows_per_chunk = std::max(1, (1 << 16) / std::max(width, 1));
+	ThreadPool::instance().parallel_for(0, height, fill_rows, rows_per_chunk);
 }
@@ -1,26 +1,91 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include "BufferPool.h"
 #include "types.h"
+#include <cstddef>
+#include <functional>
 #include <vector>
 
+// Row-at-a-time pixel streams, top to bottom. A RowSource fills `pixels`
+// (one image width) with row r; a RowSink consumes row r.
+using RowSource = std::function<void(int r, RGB_uc *pixels)>;
+using RowSink = std::function<void(int r, const RGB_uc *pixels)>;
+
 class Image
 {
   public:
-	Image(int width, int height);
+	Image(int width, int height,
+	      PixelLayout layout = PixelLayout::Interleaved);
+	// An image whose pixels are left unset, for callers that are about to
+	// write every one of them; saves clearing a buffer that may be
+	// recycled from an earlier image.
+	static Image uninitialized(int width, int height,
+	                           PixelLayout layout = PixelLayout::Interleaved);
 
 	int get_width() const { return width; }
 	int get_height() const { return height; }
+	PixelLayout get_layout() const { return layout; }
 
 	RGB_uc get_pixel(int r, int c) const;
 	void set_pixel(int r, int c, const RGB_uc &color);
 
+	// Direct access to a row of `width` contiguous pixels (interleaved only).
+	const RGB_uc *row(int r) const { return &data[(size_t)r * width]; }
+	RGB_uc *row(int r) { return &data[(size_t)r * width]; }
+
+	// Direct access to a row of one channel, 0 = R, 1 = G, 2 = B (planar
+	// only).
+	const unsigned char *plane_row(int channel, int r) const
+	{
+		return bytes() + (size_t)channel * width * height + (size_t)r * width;
+	}
+	unsigned char *plane_row(int channel, int r)
+	{
+		return bytes() + (size_t)channel * width * height + (size_t)r * width;
+	}
+
+	// Copy of this image in the given layout.
+	Image to_layout(PixelLayout target) const;
+
 	void generate_random();
+	// Reproducible variant: the same seed always yields the same pixels,
+	// whatever the layout. Counter-based (Philox), so rows are filled in
+	// parallel on ThreadPool::instance().
+	void generate_random(unsigned seed);
 
+	// Bytes held by this image: the object and its pixel buffer.
+	size_t memory_footprint() const
+	{
+		return sizeof(Image) + data.capacity_bytes();
+	}
+	// The footprint of a freshly allocated width x height image.
+	static size_t footprint_for(int width, int height)
+	{
+		return sizeof(Image) +
+		       PooledArray<RGB_uc>::bytes_for((size_t)width * height);
+	}
 
   private:
 	int width, height;
-	std::vector<RGB_uc> data;
+	PixelLayout layout;
+	// Always width * height * 3 bytes; planar images view it as raw bytes.
+	// Large images draw it from BufferPool.
+	PooledArray<RGB_uc> data;
+
+	struct NoInit
+	{
+	};
+	Image(int width, int height, PixelLayout layout, NoInit);
+
+	const unsigned char *bytes() const
+	{
+		return reinterpret_cast<const unsigned char *>(data.data());
+	}
+	unsigned char *bytes()
+	{
+		return reinterpret_cast<unsigned char *>(data.data());
+	}
 };
 
 #endif // IMAGE_H
@@ -0,0 +1,125 @@
+#include "ImageClient.h"
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+using protocol::Decoder;
+using protocol::Encoder;
+using protocol::Opcode;
+
+ImageClient::ImageClient(const std::string &socket_path)
+    : fd(protocol::connect_unix(socket_path))
+{
+}
+
+ImageClient::~ImageClient() { ::close(fd); }
+
+Encoder ImageClient::request(Opcode op, const std::string &name)
+{
+	Encoder e;
+	e.u8((uint8_t)op).name(name);
+	return e;
+}
+
+Decoder ImageClient::call(Encoder &request)
+{
+	protocol::write_frame(fd, request.payload());
+	if (!protocol::read_frame(fd, response))
+		throw std::runtime_error("server closed the connection");
+	Decoder in(response.data(), response.size());
+	if ((protocol::Status)in.u8() != protocol::Status::Ok)
+		throw std::runtime_error("server: " + in.str());
+	return in;
+}
+
+void ImageClient::create(const std::string &name, int width, int height,
+                         unsigned seed)
+{
+	Encoder e = request(Opcode::Create, name);
+	e.u32((uint32_t)width).u32((uint32_t)height).u32(seed);
+	call(e);
+}
+
+void ImageClient::load(const std::string &name, const std::string &path)
+{
+	Encoder e = request(Opcode::Load, name);
+	e.str(path);
+	call(e);
+}
+
+void ImageClient::save(const std::string &name, const std::string &path)
+{
+	Encoder e = request(Opcode::Save, name);
+	e.str(path);
+	call(e);
+}
+
+void ImageClient::drop(const std::string &name)
+{
+	Encoder e = request(Opcode::Drop, name);
+	call(e);
+}
+
+void ImageClient::fill_region(const std::string &name, int r1, int c1, int r2,
+                              int c2, const RGB_uc &color)
+{
+	Encoder e = request(Opcode::Fill, name);
+	e.i32(r1).i32(c1).i32(r2).i32(c2).u8(color.r).u8(color.g).u8(color.b);
+	call(e);
+}
+
+void ImageClient::adjust_brightness(const std::string &name, int r1, int c1,
+                                    int r2, int c2, int value)
+{
+	Encoder e = request(Opcode::Brightness, name);
+	e.i32(r1).i32(c1).i32(r2).i32(c2).i32(value);
+	call(e);
+}
+
+void ImageClient::adjust_contrast(const std::string &name, int r1, int c1,
+                                  int r2, int c2, double multiplier)
+{
+	Encoder e = request(Opcode::Contrast, name);
+	e.i32(r1).i32(c1).i32(r2).i32(c2).f64(multiplier);
+	call(e);
+}
+
+RGB_d ImageClient::query_average_color(const std::string &name, int r1,
+                                       int c1, int r2, int c2)
+{
+	Encoder e = request(Opcode::Query, name);
+	e.i32(r1).i32(c1).i32(r2).i32(c2);
+	Decoder in = call(e);
+	RGB_d avg;
+	avg.r = in.f64();
+	avg.g = in.f64();
+	avg.b = in.f64();
+	return avg;
+}
+
+Image ImageClient::export_region(const std::string &name, int r1, int c1,
+                                 int r2, int c2)
+{
+	Encoder e = request(Opcode::Export, name);
+	e.i32(r1).i32(c1).i32(r2).i32(c2);
+	Decoder in = call(e);
+	int width = (int)in.u32(), height = (int)in.u32();
+	Image image(width, height);
+	for (int r = 0; r < height; ++r)
+		std::memcpy(image.row(r), in.bytes((size_t)width * 3),
+		            (size_t)width * 3);
+	return image;
+}
+
+ImageClient::Stats ImageClient::stats(const std::string &name)
+{
+	Encoder e = request(Opcode::Stats, name);
+	Decoder in = call(e);
+	Stats s;
+	s.width = (int)in.u32();
+	s.height = (int)in.u32();
+	s.updates = in.u64();
+	s.batches = in.u64();
+	s.queries = in.u64();
+	return s;
+}
@@ -0,0 +1,55 @@
+#ifndef IMAGE_CLIENT_H
+#define IMAGE_CLIENT_H
+
+#include "Image.h"
+#include "Protocol.h"
+#include "types.h"
+#include <cstdint>
+#include <string>
+
+// Blocking connection to an image_server. Each call sends one request and
+// waits for its response. Server-side errors throw std::runtime_error with
+// the server's message. Not thread-safe: use one client per thread.
+class ImageClient
+{
+  public:
+	explicit ImageClient(const std::string &socket_path);
+	~ImageClient();
+
+	ImageClient(const ImageClient &) = delete;
+	ImageClient &operator=(const ImageClient &) = delete;
+
+	void create(const std::string &name, int width, int height,
+	            unsigned seed);
+	// `path` is opened by the server process.
+	void load(const std::string &name, const std::string &path);
+	void save(const std::string &name, const std::string &path);
+	void drop(const std::string &name);
+
+	void fill_region(const std::string &name, int r1, int c1, int r2, int c2,
+	                 const RGB_uc &color);
+	void adjust_brightness(const std::string &name, int r1, int c1, int r2,
+	                       int c2, int value);
+	void adjust_contrast(const std::string &name, int r1, int c1, int r2,
+	                     int c2, double multiplier);
+	RGB_d query_average_color(const std::string &name, int r1, int c1,
+	                          int r2, int c2);
+	Image export_region(const std::string &name, int r1, int c1, int r2,
+	                    int c2);
+
+	struct Stats
+	{
+		int width, height;
+		uint64_t updates, batches, queries;
+	};
+	Stats stats(const std::string &name);
+
+  private:
+	int fd;
+	std::vector<unsigned char> response;
+
+	protocol::Encoder request(protocol::Opcode op, const std::string &name);
+	protocol::Decoder call(protocol::Encoder &request);
+};
+
+#endif // IMAGE_CLIENT_H
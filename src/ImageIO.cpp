@@ -0,0 +1,698 @@
+#include "ImageIO.h"
+#include "Deflate.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+const unsigned char png_signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+uint32_t load_u32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | p[3];
+}
+
+void store_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+std::ifstream open_input(const std::string &path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error("cannot open " + path);
+	return in;
+}
+
+// Refuses a header whose image would be too large to decode.
+void check_image_size(const std::string &path, uint64_t width,
+                      uint64_t height)
+{
+	if (width * height > (uint64_t)kMaxImagePixels)
+		throw std::runtime_error(
+		    path + ": " + std::to_string(width) + "x" +
+		    std::to_string(height) + " image is over the limit of " +
+		    std::to_string(kMaxImagePixels) + " pixels");
+}
+
+int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// --- PNG ---
+class PngReader : public ImageReader
+{
+  public:
+	explicit PngReader(const std::string &path);
+	void read_row(RGB_uc *pixels) override;
+
+  private:
+	std::ifstream in;
+	int bit_depth = 0, color_type = 0, channels = 0;
+	size_t stride = 0, bpp = 0;
+	std::vector<unsigned char> palette;
+	std::vector<unsigned char> prev, cur;
+	int rows_read = 0;
+
+	// State of the chunk being read.
+	uint32_t chunk_remaining = 0, chunk_crc = 0;
+	bool idat_done = false;
+	std::unique_ptr<Inflater> inflater;
+
+	void read_exact(unsigned char *buffer, size_t n);
+	// Reads a chunk's length and type and starts its CRC.
+	uint32_t read_chunk_header(char type[5]);
+	void read_chunk_data(unsigned char *buffer, size_t n);
+	void finish_chunk();
+	size_t read_idat(unsigned char *buffer, size_t n);
+	int sample(size_t index) const;
+};
+
+PngReader::PngReader(const std::string &path) : in(open_input(path))
+{
+	unsigned char signature[8];
+	read_exact(signature, 8);
+	if (std::memcmp(signature, png_signature, 8) != 0)
+		throw std::runtime_error(path + ": not a PNG file");
+
+	char type[5];
+	uint32_t length = read_chunk_header(type);
+	if (std::strcmp(type, "IHDR") != 0 || length != 13)
+		throw std::runtime_error(path + ": missing IHDR");
+	unsigned char ihdr[13];
+	read_chunk_data(ihdr, 13);
+	finish_chunk();
+
+	uint32_t w = load_u32(ihdr), h = load_u32(ihdr + 4);
+	bit_depth = ihdr[8];
+	color_type = ihdr[9];
+	if (w == 0 || h == 0 || w > (1u << 24) || h > (1u << 24))
+		throw std::runtime_error(path + ": bad image size");
+	check_image_size(path, w, h);
+	if (ihdr[10] != 0 || ihdr[11] != 0)
+		throw std::runtime_error(path + ": unknown compression or filter");
+	if (ihdr[12] != 0)
+		throw std::runtime_error(path + ": interlaced PNG not supported");
+	width = (int)w;
+	height = (int)h;
+
+	bool depth_ok = false;
+	switch (color_type)
+	{
+	case 0:
+		channels = 1;
+		depth_ok = bit_depth == 1 || bit_depth == 2 || bit_depth == 4 ||
+		           bit_depth == 8 || bit_depth == 16;
+		break;
+	case 2:
+		channels = 3;
+		depth_ok = bit_depth == 8 || bit_depth == 16;
+		break;
+	case 3:
+		channels = 1;
+		depth_ok = bit_depth == 1 || bit_depth == 2 || bit_depth == 4 ||
+		           bit_depth == 8;
+		break;
+	case 4:
+		channels = 2;
+		depth_ok = bit_depth == 8 || bit_depth == 16;
+		break;
+	case 6:
+		channels = 4;
+		depth_ok = bit_depth == 8 || bit_depth == 16;
+		break;
+	}
+	if (!depth_ok)
+		throw std::runtime_error(path + ": unsupported colour type/depth");
+	stride = ((size_t)width * channels * bit_depth + 7) / 8;
+	bpp = std::max<size_t>(1, (size_t)channels * bit_depth / 8);
+	prev.assign(stride, 0);
+	cur.assign(stride + 1, 0);
+
+	// Ancillary chunks before the image data are skipped (CRC-checked).
+	for (;;)
+	{
+		length = read_chunk_header(type);
+		if (std::strcmp(type, "IDAT") == 0)
+		{
+			chunk_remaining = length;
+			break;
+		}
+		if (std::strcmp(type, "IEND") == 0)
+			throw std::runtime_error(path + ": no image data");
+		std::vector<unsigned char> data(length);
+		read_chunk_data(data.data(), length);
+		finish_chunk();
+		if (std::strcmp(type, "PLTE") == 0)
+			palette = std::move(data);
+	}
+	if (color_type == 3 && palette.empty())
+		throw std::runtime_error(path + ": palette image without PLTE");
+
+	inflater = std::make_unique<Inflater>(
+	    [this](unsigned char *buffer, size_t n) { return read_idat(buffer, n); });
+}
+
+void PngReader::read_exact(unsigned char *buffer, size_t n)
+{
+	in.read(reinterpret_cast<char *>(buffer), (std::streamsize)n);
+	if ((size_t)in.gcount() != n)
+		throw std::runtime_error("PNG: unexpected end of file");
+}
+
+uint32_t PngReader::read_chunk_header(char type[5])
+{
+	unsigned char header[8];
+	read_exact(header, 8);
+	std::memcpy(type, header + 4, 4);
+	type[4] = '\0';
+	chunk_crc = crc32_update(0, header + 4, 4);
+	uint32_t length = load_u32(header);
+	if (length > 0x7FFFFFFFu)
+		throw std::runtime_error("PNG: bad chunk length");
+	return length;
+}
+
+void PngReader::read_chunk_data(unsigned char *buffer, size_t n)
+{
+	read_exact(buffer, n);
+	chunk_crc = crc32_update(chunk_crc, buffer, n);
+}
+
+void PngReader::finish_chunk()
+{
+	unsigned char stored[4];
+	read_exact(stored, 4);
+	if (load_u32(stored) != chunk_crc)
+		throw std::runtime_error("PNG: chunk CRC mismatch");
+}
+
+size_t PngReader::read_idat(unsigned char *buffer, size_t n)
+{
+	// The zlib stream continues across consecutive IDAT chunks.
+	while (chunk_remaining == 0)
+	{
+		if (idat_done)
+			return 0;
+		finish_chunk();
+		char type[5];
+		uint32_t length = read_chunk_header(type);
+		if (std::strcmp(type, "IDAT") != 0)
+		{
+			idat_done = true;
+			return 0;
+		}
+		chunk_remaining = length;
+	}
+	size_t take = std::min<size_t>(n, chunk_remaining);
+	read_chunk_data(buffer, take);
+	chunk_remaining -= (uint32_t)take;
+	return take;
+}
+
+int PngReader::sample(size_t index) const
+{
+	const unsigned char *row = cur.data() + 1;
+	if (bit_depth == 8)
+		return row[index];
+	if (bit_depth == 16)
+		return row[index * 2]; // keep the high byte
+	size_t bit = index * bit_depth;
+	int mask = (1 << bit_depth) - 1;
+	return (row[bit / 8] >> (8 - bit_depth - (int)(bit % 8))) & mask;
+}
+
+void PngReader::read_row(RGB_uc *pixels)
+{
+	if (rows_read >= height)
+		throw std::runtime_error("PNG: read past the last row");
+	if (inflater->read(cur.data(), cur.size()) != cur.size())
+		throw std::runtime_error("PNG: image data ends early");
+	++rows_read;
+
+	unsigned char *row = cur.data() + 1;
+	switch (cur[0])
+	{
+	case 0:
+		break;
+	case 1:
+		for (size_t i = bpp; i < stride; ++i)
+			row[i] = (unsigned char)(row[i] + row[i - bpp]);
+		break;
+	case 2:
+		for (size_t i = 0; i < stride; ++i)
+			row[i] = (unsigned char)(row[i] + prev[i]);
+		break;
+	case 3:
+		for (size_t i = 0; i < stride; ++i)
+		{
+			int left = i >= bpp ? row[i - bpp] : 0;
+			row[i] = (unsigned char)(row[i] + ((left + prev[i]) >> 1));
+		}
+		break;
+	case 4:
+		for (size_t i = 0; i < stride; ++i)
+		{
+			int left = i >= bpp ? row[i - bpp] : 0;
+			int up_left = i >= bpp ? prev[i - bpp] : 0;
+			row[i] = (unsigned char)(row[i] + paeth(left, prev[i], up_left));
+		}
+		break;
+	default:
+		throw std::runtime_error("PNG: bad filter type");
+	}
+
+	// Sub-byte greyscale is scaled up to the full 0-255 range.
+	int scale = bit_depth < 8 ? 255 / ((1 << bit_depth) - 1) : 1;
+	for (int c = 0; c < width; ++c)
+	{
+		size_t s = (size_t)c * channels;
+		switch (color_type)
+		{
+		case 0:
+		case 4:
+		{
+			unsigned char g = (unsigned char)(sample(s) * scale);
+			pixels[c] = {g, g, g};
+			break;
+		}
+		case 3:
+		{
+			size_t index = (size_t)sample(s) * 3;
+			if (index + 2 >= palette.size())
+				throw std::runtime_error("PNG: palette index out of range");
+			pixels[c] = {palette[index], palette[index + 1],
+			             palette[index + 2]};
+			break;
+		}
+		default:
+			pixels[c] = {(unsigned char)sample(s), (unsigned char)sample(s + 1),
+			             (unsigned char)sample(s + 2)};
+		}
+	}
+	std::copy(row, row + stride, prev.begin());
+}
+
+class PngWriter : public ImageWriter
+{
+  public:
+	PngWriter(const std::string &path, int width, int height);
+	void write_row(const RGB_uc *pixels) override;
+	void finish() override;
+
+  private:
+	std::ofstream out;
+	std::string path;
+	int width, height, rows_written = 0;
+	std::vector<unsigned char> prev, raw, best, trial;
+	Deflater deflater;
+
+	void write_chunk(const char *type, const unsigned char *data, size_t n);
+};
+
+PngWriter::PngWriter(const std::string &path, int width, int height)
+    : out(path, std::ios::binary), path(path), width(width), height(height),
+      prev((size_t)width * 3, 0), raw((size_t)width * 3),
+      best((size_t)width * 3 + 1), trial((size_t)width * 3 + 1),
+      deflater([this](const unsigned char *data, size_t n) {
+	      write_chunk("IDAT", data, n);
+      })
+{
+	if (!out)
+		throw std::runtime_error("cannot create " + path);
+	out.write(reinterpret_cast<const char *>(png_signature), 8);
+	unsigned char ihdr[13] = {0};
+	store_u32(ihdr, (uint32_t)width);
+	store_u32(ihdr + 4, (uint32_t)height);
+	ihdr[8] = 8; // bits per sample
+	ihdr[9] = 2; // RGB
+	write_chunk("IHDR", ihdr, 13);
+}
+
+void PngWriter::write_chunk(const char *type, const unsigned char *data,
+                            size_t n)
+{
+	unsigned char header[8];
+	store_u32(header, (uint32_t)n);
+	std::memcpy(header + 4, type, 4);
+	uint32_t crc = crc32_update(0, header + 4, 4);
+	crc = crc32_update(crc, data, n);
+	unsigned char trailer[4];
+	store_u32(trailer, crc);
+	out.write(reinterpret_cast<const char *>(header), 8);
+	out.write(reinterpret_cast<const char *>(data), (std::streamsize)n);
+	out.write(reinterpret_cast<const char *>(trailer), 4);
+}
+
+void PngWriter::write_row(const RGB_uc *pixels)
+{
+	if (rows_written >= height)
+		throw std::runtime_error("PNG: too many rows written");
+	++rows_written;
+	const size_t n = raw.size();
+	for (int c = 0; c < width; ++c)
+	{
+		raw[c * 3 + 0] = pixels[c].r;
+		raw[c * 3 + 1] = pixels[c].g;
+		raw[c * 3 + 2] = pixels[c].b;
+	}
+
+	// Pick the filter with the smallest sum of signed residuals, the usual
+	// heuristic for what will deflate best.
+	long long best_cost = -1;
+	for (int filter = 0; filter < 5; ++filter)
+	{
+		trial[0] = (unsigned char)filter;
+		long long cost = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			int left = i >= 3 ? raw[i - 3] : 0;
+			int up_left = i >= 3 ? prev[i - 3] : 0;
+			int predictor = 0;
+			switch (filter)
+			{
+			case 1: predictor = left; break;
+			case 2: predictor = prev[i]; break;
+			case 3: predictor = (left + prev[i]) >> 1; break;
+			case 4: predictor = paeth(left, prev[i], up_left); break;
+			}
+			unsigned char v = (unsigned char)(raw[i] - predictor);
+			trial[i + 1] = v;
+			cost += std::abs((int)(signed char)v);
+		}
+		if (best_cost < 0 || cost < best_cost)
+		{
+			best_cost = cost;
+			best.swap(trial);
+		}
+	}
+	deflater.write(best.data(), best.size());
+	prev.swap(raw);
+}
+
+void PngWriter::finish()
+{
+	if (rows_written != height)
+		throw std::runtime_error("PNG: wrote " + std::to_string(rows_written) +
+		                         " of " + std::to_string(height) + " rows");
+	deflater.finish();
+	write_chunk("IEND", nullptr, 0);
+	out.flush();
+	if (!out)
+		throw std::runtime_error("error writing " + path);
+}
+
+// --- PPM ---
+class PpmReader : public ImageReader
+{
+  public:
+	explicit PpmReader(const std::string &path);
+	void read_row(RGB_uc *pixels) override;
+
+  private:
+	std::ifstream in;
+	bool ascii = false;
+	int max_value = 255;
+	std::vector<unsigned char> raw;
+	int rows_read = 0;
+
+	int read_header_value();
+	unsigned char scale(int value) const
+	{
+		return (unsigned char)((value * 255 + max_value / 2) / max_value);
+	}
+};
+
+PpmReader::PpmReader(const std::string &path) : in(open_input(path))
+{
+	char magic[2] = {0, 0};
+	in.read(magic, 2);
+	if (magic[0] != 'P' || (magic[1] != '6' && magic[1] != '3'))
+		throw std::runtime_error(path + ": not a P3/P6 PPM file");
+	ascii = magic[1] == '3';
+	width = read_header_value();
+	height = read_header_value();
+	max_value = read_header_value();
+	if (width <= 0 || height <= 0 || max_value <= 0 || max_value > 65535)
+		throw std::runtime_error(path + ": bad PPM header");
+	check_image_size(path, (uint64_t)width, (uint64_t)height);
+	if (!ascii)
+	{
+		in.get(); // the single whitespace byte before the raster
+		raw.resize((size_t)width * 3 * (max_value > 255 ? 2 : 1));
+	}
+}
+
+int PpmReader::read_header_value()
+{
+	int ch = in.get();
+	while (ch != EOF && (std::isspace(ch) || ch == '#'))
+	{
+		if (ch == '#')
+			while (ch != EOF && ch != '\n')
+				ch = in.get();
+		ch = in.get();
+	}
+	if (ch == EOF || !std::isdigit(ch))
+		throw std::runtime_error("PPM: malformed header");
+	long value = 0;
+	while (ch != EOF && std::isdigit(ch))
+	{
+		value = value * 10 + (ch - '0');
+		if (value > (1 << 24))
+			throw std::runtime_error("PPM: header value too large");
+		ch = in.get();
+	}
+	if (ch != EOF)
+		in.unget();
+	return (int)value;
+}
+
+void PpmReader::read_row(RGB_uc *pixels)
+{
+	if (rows_read >= height)
+		throw std::runtime_error("PPM: read past the last row");
+	++rows_read;
+	int v[3];
+	for (int c = 0; c < width; ++c)
+	{
+		if (ascii)
+		{
+			in >> v[0] >> v[1] >> v[2];
+			if (!in)
+				throw std::runtime_error("PPM: image data ends early");
+		}
+		else if (c == 0)
+		{
+			in.read(reinterpret_cast<char *>(raw.data()),
+			        (std::streamsize)raw.size());
+			if ((size_t)in.gcount() != raw.size())
+				throw std::runtime_error("PPM: image data ends early");
+		}
+		if (!ascii)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				size_t i = (size_t)c * 3 + k;
+				v[k] = max_value > 255 ? (raw[i * 2] << 8) | raw[i * 2 + 1]
+				                       : raw[i];
+			}
+		}
+		pixels[c] = {scale(std::min(v[0], max_value)),
+		             scale(std::min(v[1], max_value)),
+		             scale(std::min(v[2], max_value))};
+	}
+}
+
+class PpmWriter : public ImageWriter
+{
+  public:
+	PpmWriter(const std::string &path, int width, int height);
+	void write_row(const RGB_uc *pixels) override;
+	void finish() override;
+
+  private:
+	std::ofstream out;
+	std::string path;
+	int width, height, rows_written = 0;
+};
+
+PpmWriter::PpmWriter(const std::string &path, int width, int height)
+    : out(path, std::ios::binary), path(path), width(width), height(height)
+{
+	if (!out)
+		throw std::runtime_error("cannot create " + path);
+	out << "P6\n" << width << " " << height << "\n255\n";
+}
+
+void PpmWriter::write_row(const RGB_uc *pixels)
+{
+	if (rows_written >= height)
+		throw std::runtime_error("PPM: too many rows written");
+	++rows_written;
+	static_assert(sizeof(RGB_uc) == 3, "RGB_uc must be packed");
+	out.write(reinterpret_cast<const char *>(pixels),
+	          (std::streamsize)width * 3);
+}
+
+void PpmWriter::finish()
+{
+	if (rows_written != height)
+		throw std::runtime_error("PPM: wrote " + std::to_string(rows_written) +
+		                         " of " + std::to_string(height) + " rows");
+	out.flush();
+	if (!out)
+		throw std::runtime_error("error writing " + path);
+}
+
+bool has_png_extension(const std::string &path)
+{
+	if (path.size() < 4)
+		return false;
+	std::string ext = path.substr(path.size() - 4);
+	std::transform(ext.begin(), ext.end(), ext.begin(),
+	               [](unsigned char ch) { return (char)std::tolower(ch); });
+	return ext == ".png";
+}
+} // namespace
+
+std::unique_ptr<ImageReader> open_image(const std::string &path)
+{
+	unsigned char magic[8] = {0};
+	{
+		std::ifstream in = open_input(path);
+		in.read(reinterpret_cast<char *>(magic), 8);
+	}
+	if (std::memcmp(magic, png_signature, 8) == 0)
+		return std::make_unique<PngReader>(path);
+	if (magic[0] == 'P' && (magic[1] == '3' || magic[1] == '6'))
+		return std::make_unique<PpmReader>(path);
+	throw std::runtime_error(path + ": unrecognised image format");
+}
+
+std::unique_ptr<ImageWriter> create_image(const std::string &path, int width,
+                                          int height)
+{
+	if (width <= 0 || height <= 0)
+		throw std::runtime_error("cannot save an empty image");
+	if (has_png_extension(path))
+		return std::make_unique<PngWriter>(path, width, height);
+	return std::make_unique<PpmWriter>(path, width, height);
+}
+
+Image load_image(const std::string &path, PixelLayout layout)
+{
+	auto reader = open_image(path);
+	Image image =
+	    Image::uninitialized(reader->get_width(), reader->get_height());
+	for (int r = 0; r < image.get_height(); ++r)
+		reader->read_row(image.row(r));
+	return layout == PixelLayout::Interleaved ? image : image.to_layout(layout);
+}
+
+void save_image(const Image &image, const std::string &path)
+{
+	auto writer = create_image(path, image.get_width(), image.get_height());
+	if (image.get_layout() == PixelLayout::Interleaved)
+	{
+		for (int r = 0; r < image.get_height(); ++r)
+			writer->write_row(image.row(r));
+	}
+	else
+	{
+		std::vector<RGB_uc> pixels(image.get_width());
+		for (int r = 0; r < image.get_height(); ++r)
+		{
+			for (int c = 0; c < image.get_width(); ++c)
+				pixels[c] = image.get_pixel(r, c);
+			writer->write_row(pixels.data());
+		}
+	}
+	writer->finish();
+}
+
+SegmentTree load_segment_tree(const std::string &path)
+{
+	auto reader = open_image(path);
+	return load_segment_tree(*reader);
+}
+
+SegmentTree load_segment_tree(ImageReader &reader)
+{
+	return SegmentTree(reader.get_width(), reader.get_height(),
+	                   [&](int, RGB_uc *pixels) { reader.read_row(pixels); });
+}
+
+void save_segment_tree(SegmentTree &tree, const std::string &path)
+{
+	auto writer = create_image(path, tree.get_width(), tree.get_height());
+	tree.export_rows(
+	    [&](int, const RGB_uc *pixels) { writer->write_row(pixels); });
+	writer->finish();
+}
+
+SegmentTree open_segment_tree(const std::string &image_path,
+                              const std::string &snapshot_path)
+{
+	namespace fs = std::filesystem;
+	std::error_code snapshot_ec, image_ec;
+	auto snapshot_time = fs::last_write_time(snapshot_path, snapshot_ec);
+	auto image_time = fs::last_write_time(image_path, image_ec);
+	if (!snapshot_ec && !image_ec && snapshot_time >= image_time)
+	{
+		try
+		{
+			// Not checksummed: that would read the whole file and undo
+			// the lazy mapping. The header, version and size checks still
+			// send a stale or truncated file back to the decoder.
+			return SegmentTree::load_snapshot(snapshot_path);
+		}
+		catch (const std::runtime_error &)
+		{
+			// Old format version or damaged file: fall through and rebuild.
+		}
+	}
+
+	SegmentTree tree = load_segment_tree(image_path);
+	try
+	{
+		tree.save_snapshot(snapshot_path);
+	}
+	catch (const std::runtime_error &)
+	{
+		// The snapshot is only a cache; the tree itself is fine.
+	}
+	return tree;
+}
+
+VectorImage load_vector_image(const std::string &path, PixelLayout layout)
+{
+	auto reader = open_image(path);
+	return VectorImage(
+	    reader->get_width(), reader->get_height(),
+	    [&](int, RGB_uc *pixels) { reader->read_row(pixels); }, layout);
+}
+
+void save_vector_image(const VectorImage &image, const std::string &path)
+{
+	auto writer = create_image(path, image.get_width(), image.get_height());
+	image.export_rows(
+	    [&](int, const RGB_uc *pixels) { writer->write_row(pixels); });
+	writer->finish();
+}
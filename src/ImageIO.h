@@ -0,0 +1,75 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include "Image.h"
+#include "SegmentTree.h"
+#include "VectorImage.h"
+#include "types.h"
+#include <memory>
+#include <string>
+
+// Streaming PNG and PPM (P3/P6) codecs. Readers decode one scanline at a
+// time and writers encode one at a time, so images can move between files
+// and the image structures without a full-size intermediate copy.
+//
+// PNG: all standard colour types at 1-16 bits per sample, non-interlaced.
+// Alpha is dropped and 16-bit samples keep their high byte. Files are
+// written as 8-bit RGB. Errors throw std::runtime_error.
+
+// The most pixels a reader accepts (16384 x 16384), checked against the
+// header before anything is allocated. A segment tree of that size takes
+// about 29 GB, and its node count still fits an int whatever the shape.
+const long long kMaxImagePixels = 1LL << 28;
+
+class ImageReader
+{
+  public:
+	virtual ~ImageReader() = default;
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+
+	// Decodes the next row, top to bottom, into `pixels` (width entries).
+	virtual void read_row(RGB_uc *pixels) = 0;
+
+  protected:
+	int width = 0, height = 0;
+};
+
+class ImageWriter
+{
+  public:
+	virtual ~ImageWriter() = default;
+
+	// Encodes the next row, top to bottom.
+	virtual void write_row(const RGB_uc *pixels) = 0;
+	// Completes the file after the last row.
+	virtual void finish() = 0;
+};
+
+// Opens a PNG or PPM file, detected from its signature.
+std::unique_ptr<ImageReader> open_image(const std::string &path);
+// Creates a PNG when `path` ends in ".png", otherwise a binary PPM.
+std::unique_ptr<ImageWriter> create_image(const std::string &path, int width,
+                                          int height);
+
+Image load_image(const std::string &path,
+                 PixelLayout layout = PixelLayout::Interleaved);
+void save_image(const Image &image, const std::string &path);
+
+SegmentTree load_segment_tree(const std::string &path);
+// Decodes the rest of an open image into a tree, row by row; for callers
+// that check the size first, e.g. against a MemoryBudget.
+SegmentTree load_segment_tree(ImageReader &reader);
+void save_segment_tree(SegmentTree &tree, const std::string &path);
+// Maps `snapshot_path` when it holds a current-format snapshot at least as
+// new as `image_path`, without checksumming it. Otherwise decodes the
+// image and rewrites the snapshot so the next open is instant.
+SegmentTree open_segment_tree(const std::string &image_path,
+                              const std::string &snapshot_path);
+
+VectorImage load_vector_image(const std::string &path,
+                              PixelLayout layout = PixelLayout::Interleaved);
+void save_vector_image(const VectorImage &image, const std::string &path);
+
+#endif // IMAGE_IO_H
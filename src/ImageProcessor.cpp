@@ -7,6 +7,11 @@ ImageProcessor::ImageProcessor(int width, int height) : image(width, height)
 
 void ImageProcessor::generate_random() { image.generate_random(); }
 
+void ImageProcessor::generate_random(unsigned seed)
+{
+	image.generate_random(seed);
+}
+
 Image ImageProcessor::get_image() const { return image; }
 
 void ImageProcessor::set_image(const Image &img) { image = img; }
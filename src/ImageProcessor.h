@@ -9,6 +9,7 @@ class ImageProcessor
 	ImageProcessor(int width, int height);
 
 	void generate_random();
+	void generate_random(unsigned seed);
 	Image get_image() const;
 	void set_image(const Image &img);
 
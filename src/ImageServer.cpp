@@ -0,0 +1,358 @@
+#include "ImageServer.h"
+#include "Image.h"
+#include "ImageIO.h"
+#include "MemoryBudget.h"
+#include "SegmentTree.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using protocol::Decoder;
+using protocol::Encoder;
+using protocol::Opcode;
+using protocol::Status;
+
+struct ImageServer::StoredImage
+{
+	explicit StoredImage(SegmentTree tree) : tree(std::move(tree)) {}
+
+	// Guards the tree: shared for peeks, exclusive for batches and exports.
+	std::shared_mutex tree_mutex;
+	SegmentTree tree;
+
+	// Writes waiting for the next batch. Each writer holds on to the batch
+	// it joined to learn when, and whether, it was applied.
+	struct Batch
+	{
+		std::vector<SegmentTree::Update> updates;
+		bool done = false;
+		std::exception_ptr error; // set when applying the batch threw
+	};
+	std::mutex queue_mutex;
+	std::condition_variable applied;
+	std::shared_ptr<Batch> pending = std::make_shared<Batch>();
+	bool combining = false;
+
+	std::atomic<uint64_t> updates{0}, batches{0}, queries{0};
+	MemoryBudget::Reservation budget; // the tree's footprint
+
+	// Returns once `update` has been applied, possibly by another thread.
+	void submit(const SegmentTree::Update &update);
+};
+
+void ImageServer::StoredImage::submit(const SegmentTree::Update &update)
+{
+	std::unique_lock<std::mutex> queue(queue_mutex);
+	std::shared_ptr<Batch> joined = pending;
+	joined->updates.push_back(update);
+	while (!joined->done)
+	{
+		if (combining)
+		{
+			applied.wait(queue);
+			continue;
+		}
+		// Become the combiner: apply everything queued so far. Earlier
+		// batches are done, so this is the one `update` joined.
+		combining = true;
+		std::shared_ptr<Batch> batch = std::move(pending);
+		pending = std::make_shared<Batch>();
+		queue.unlock();
+		try
+		{
+			std::unique_lock<std::shared_mutex> write(tree_mutex);
+			tree.apply_batch(batch->updates);
+			updates += batch->updates.size();
+			++batches;
+		}
+		catch (...)
+		{
+			// Every writer in the batch fails, and the next can still run.
+			batch->error = std::current_exception();
+		}
+		queue.lock();
+		batch->done = true;
+		combining = false;
+		applied.notify_all();
+	}
+	if (joined->error)
+		std::rethrow_exception(joined->error);
+}
+
+namespace
+{
+struct Rect
+{
+	int r1, c1, r2, c2;
+};
+
+Rect read_rect(Decoder &in, const SegmentTree &tree)
+{
+	Rect r;
+	r.r1 = in.i32();
+	r.c1 = in.i32();
+	r.r2 = in.i32();
+	r.c2 = in.i32();
+	if (r.r1 < 0 || r.c1 < 0 || r.r2 >= tree.get_height() ||
+	    r.c2 >= tree.get_width() || r.r1 > r.r2 || r.c1 > r.c2)
+		throw std::out_of_range("rectangle outside the " +
+		                        std::to_string(tree.get_width()) + "x" +
+		                        std::to_string(tree.get_height()) + " image");
+	return r;
+}
+
+// Called once a request's fields are read and before it takes effect, so a
+// malformed request is refused without having changed anything.
+void end_of_request(const Decoder &in)
+{
+	if (!in.done())
+		throw std::runtime_error("trailing bytes in request");
+}
+} // namespace
+
+ImageServer::ImageServer(const std::string &socket_path)
+    : socket_path(socket_path), listen_fd(protocol::listen_unix(socket_path))
+{
+}
+
+ImageServer::~ImageServer()
+{
+	::close(listen_fd);
+	::unlink(socket_path.c_str());
+}
+
+void ImageServer::run()
+{
+	std::string error;
+	while (!stopping)
+	{
+		int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (stopping)
+				break; // stop() shut the listening socket down
+			if (errno == EMFILE || errno == ENFILE)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			else if (errno != EINTR && errno != ECONNABORTED)
+			{
+				// Shut down as stop() would; the connection threads use
+				// this object, so they are drained before reporting.
+				error = std::string("accept: ") + std::strerror(errno);
+				stop();
+				break;
+			}
+			continue;
+		}
+		std::lock_guard<std::mutex> lock(connections_mutex);
+		if (stopping)
+		{
+			::close(fd);
+			break;
+		}
+		connections.insert(fd);
+		std::thread(&ImageServer::serve, this, fd).detach();
+	}
+
+	std::unique_lock<std::mutex> lock(connections_mutex);
+	connections_done.wait(lock, [this] { return connections.empty(); });
+	if (!error.empty())
+		throw std::runtime_error(error);
+}
+
+void ImageServer::stop()
+{
+	stopping = true;
+	::shutdown(listen_fd, SHUT_RDWR);
+	std::lock_guard<std::mutex> lock(connections_mutex);
+	for (int fd : connections)
+		::shutdown(fd, SHUT_RDWR);
+}
+
+void ImageServer::serve(int fd)
+{
+	std::vector<unsigned char> request;
+	try
+	{
+		while (protocol::read_frame(fd, request))
+		{
+			Encoder reply;
+			try
+			{
+				Decoder in(request.data(), request.size());
+				Opcode op = (Opcode)in.u8();
+				std::string name = in.name();
+				reply.u8((uint8_t)Status::Ok);
+				handle(op, name, in, reply);
+			}
+			catch (const std::exception &e)
+			{
+				reply = Encoder();
+				reply.u8((uint8_t)Status::Error).str(e.what());
+			}
+			protocol::write_frame(fd, reply.payload());
+		}
+	}
+	catch (const std::exception &)
+	{
+		// The client went away or broke framing; drop the connection.
+	}
+
+	std::lock_guard<std::mutex> lock(connections_mutex);
+	::close(fd);
+	connections.erase(fd);
+	if (connections.empty())
+		connections_done.notify_all();
+}
+
+std::shared_ptr<ImageServer::StoredImage>
+ImageServer::find(const std::string &name)
+{
+	std::shared_lock<std::shared_mutex> lock(images_mutex);
+	auto it = images.find(name);
+	if (it == images.end())
+		throw std::runtime_error("no image named \"" + name + "\"");
+	return it->second;
+}
+
+void ImageServer::handle(Opcode op, const std::string &name, Decoder &in,
+                         Encoder &out)
+{
+	switch (op)
+	{
+	case Opcode::Create:
+	case Opcode::Load: {
+		// The tree's footprint is reserved before it is built.
+		auto reserve = [&](int width, int height) {
+			return MemoryBudget::instance().reserve(
+			    SegmentTree::footprint_for(width, height),
+			    "image \"" + name + "\" (" + std::to_string(width) + "x" +
+			        std::to_string(height) + ")");
+		};
+		std::shared_ptr<StoredImage> image;
+		MemoryBudget::Reservation held;
+		if (op == Opcode::Create)
+		{
+			int width = (int)in.u32(), height = (int)in.u32();
+			unsigned seed = in.u32();
+			end_of_request(in);
+			if (width <= 0 || height <= 0)
+				throw std::invalid_argument("size must be positive");
+			held = reserve(width, height);
+			Image pixels(width, height);
+			pixels.generate_random(seed);
+			image = std::make_shared<StoredImage>(SegmentTree(pixels));
+		}
+		else
+		{
+			std::string path = in.str();
+			end_of_request(in);
+			std::unique_ptr<ImageReader> reader = open_image(path);
+			int width = reader->get_width(), height = reader->get_height();
+			held = reserve(width, height);
+			image = std::make_shared<StoredImage>(load_segment_tree(*reader));
+		}
+		held.resize(image->tree.memory_footprint());
+		image->budget = std::move(held);
+		std::unique_lock<std::shared_mutex> lock(images_mutex);
+		images[name] = image;
+		return;
+	}
+	case Opcode::Drop: {
+		end_of_request(in);
+		std::unique_lock<std::shared_mutex> lock(images_mutex);
+		if (images.erase(name) == 0)
+			throw std::runtime_error("no image named \"" + name + "\"");
+		return;
+	}
+	default:
+		break;
+	}
+
+	std::shared_ptr<StoredImage> image = find(name);
+	switch (op)
+	{
+	case Opcode::Fill:
+	case Opcode::Brightness:
+	case Opcode::Contrast: {
+		Rect r = read_rect(in, image->tree);
+		SegmentTree::Update update{SegmentTree::Update::Fill, r.r1, r.c1,
+		                           r.r2, r.c2};
+		if (op == Opcode::Fill)
+		{
+			update.color.r = in.u8();
+			update.color.g = in.u8();
+			update.color.b = in.u8();
+		}
+		else if (op == Opcode::Brightness)
+		{
+			update.kind = SegmentTree::Update::Brightness;
+			update.value = in.i32();
+		}
+		else
+		{
+			update.kind = SegmentTree::Update::Contrast;
+			update.value = in.f64();
+		}
+		end_of_request(in);
+		image->submit(update);
+		return;
+	}
+	case Opcode::Query: {
+		Rect r = read_rect(in, image->tree);
+		end_of_request(in);
+		RGB_d avg;
+		{
+			std::shared_lock<std::shared_mutex> lock(image->tree_mutex);
+			avg = image->tree.peek_average_color(r.r1, r.c1, r.r2, r.c2);
+		}
+		++image->queries;
+		out.f64(avg.r).f64(avg.g).f64(avg.b);
+		return;
+	}
+	case Opcode::Export: {
+		Rect r = read_rect(in, image->tree);
+		end_of_request(in);
+		// The reply (status, size, pixels) has to fit in one frame.
+		uint64_t reply_bytes =
+		    9 + (uint64_t)(r.r2 - r.r1 + 1) * (r.c2 - r.c1 + 1) * 3;
+		if (reply_bytes > protocol::kMaxFrame)
+			throw std::invalid_argument(
+			    "region of " + std::to_string(r.c2 - r.c1 + 1) + "x" +
+			    std::to_string(r.r2 - r.r1 + 1) +
+			    " pixels is too large for one reply; export it in pieces");
+		std::unique_lock<std::shared_mutex> lock(image->tree_mutex);
+		Image region = image->tree.get_region(r.r1, r.c1, r.r2, r.c2);
+		lock.unlock();
+		out.u32((uint32_t)region.get_width())
+		    .u32((uint32_t)region.get_height());
+		for (int row = 0; row < region.get_height(); ++row)
+			out.bytes(region.row(row), (size_t)region.get_width() * 3);
+		return;
+	}
+	case Opcode::Save: {
+		std::string path = in.str();
+		end_of_request(in);
+		std::unique_lock<std::shared_mutex> lock(image->tree_mutex);
+		save_segment_tree(image->tree, path);
+		return;
+	}
+	case Opcode::Stats:
+		end_of_request(in);
+		out.u32((uint32_t)image->tree.get_width())
+		    .u32((uint32_t)image->tree.get_height())
+		    .u64(image->updates)
+		    .u64(image->batches)
+		    .u64(image->queries);
+		return;
+	default:
+		throw std::invalid_argument("unknown opcode " +
+		                            std::to_string((int)op));
+	}
+}
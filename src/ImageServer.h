@@ -0,0 +1,63 @@
+#ifndef IMAGE_SERVER_H
+#define IMAGE_SERVER_H
+
+#include "Protocol.h"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+
+// Serves named SegmentTree images to local processes over a Unix domain
+// socket (protocol in Protocol.h), one thread per connection.
+//
+// Concurrent writes to an image are coalesced: they queue up, and whichever
+// writer finds no batch in progress applies the whole queue in a single
+// SegmentTree::apply_batch traversal while the others wait for it. Each
+// write is acknowledged once applied. Queries use the const
+// peek_average_color under a shared lock, so they run alongside each other
+// and wait only while a batch is being applied.
+//
+// Create and Load reserve each tree's footprint in MemoryBudget::instance()
+// before building it and fail with an error reply when it would not fit;
+// Drop gives the memory back once no request still uses the image.
+class ImageServer
+{
+  public:
+	explicit ImageServer(const std::string &socket_path);
+	~ImageServer();
+
+	ImageServer(const ImageServer &) = delete;
+	ImageServer &operator=(const ImageServer &) = delete;
+
+	// Accepts connections until stop(), then waits for them to close. An
+	// accept error stops the server the same way, and once the connections
+	// are closed throws std::runtime_error.
+	void run();
+	// Safe to call from any thread.
+	void stop();
+
+  private:
+	struct StoredImage;
+
+	std::string socket_path;
+	int listen_fd;
+	std::atomic<bool> stopping{false};
+
+	std::shared_mutex images_mutex;
+	std::map<std::string, std::shared_ptr<StoredImage>> images;
+
+	std::mutex connections_mutex;
+	std::condition_variable connections_done;
+	std::set<int> connections;
+
+	void serve(int fd);
+	void handle(protocol::Opcode op, const std::string &name,
+	            protocol::Decoder &in, protocol::Encoder &out);
+	std::shared_ptr<StoredImage> find(const std::string &name);
+};
+
+#endif // IMAGE_SERVER_H
@@ -0,0 +1,24 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <string>
+
+// `s` as a JSON string literal, for the reports and result lines the tools
+// print. Quotes and backslashes are escaped; control characters, which
+// only stray input produces, become spaces.
+inline std::string json_string(const std::string &s)
+{
+	std::string out = "\"";
+	for (char ch : s)
+	{
+		if (ch == '"' || ch == '\\')
+			out += '\\';
+		if ((unsigned char)ch < 0x20)
+			out += ' ';
+		else
+			out += ch;
+	}
+	return out + "\"";
+}
+
+#endif // JSON_H
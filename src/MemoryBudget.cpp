@@ -0,0 +1,146 @@
+#include "MemoryBudget.h"
+#include <cctype>
+#include <cstdio>
+#include <stdexcept>
+#include <utility>
+
+MemoryBudget::Reservation::Reservation(Reservation &&other) noexcept
+    : owner(other.owner), held(other.held)
+{
+	other.owner = nullptr;
+	other.held = 0;
+}
+
+MemoryBudget::Reservation &
+MemoryBudget::Reservation::operator=(Reservation other) noexcept
+{
+	std::swap(owner, other.owner);
+	std::swap(held, other.held);
+	return *this;
+}
+
+void MemoryBudget::Reservation::resize(size_t bytes)
+{
+	if (!owner)
+		return;
+	if (bytes > held)
+		owner->used += bytes - held;
+	else
+		owner->used -= held - bytes;
+	held = bytes;
+}
+
+void MemoryBudget::Reservation::release()
+{
+	if (owner)
+		owner->used -= held;
+	owner = nullptr;
+	held = 0;
+}
+
+MemoryBudget &MemoryBudget::instance()
+{
+	static MemoryBudget budget;
+	return budget;
+}
+
+void MemoryBudget::set_limit(size_t bytes) { limit = bytes; }
+
+void MemoryBudget::set_policy(Policy p) { policy = p; }
+
+void MemoryBudget::set_reclaimer(void (*reclaim)()) { reclaimer = reclaim; }
+
+bool MemoryBudget::take(size_t bytes)
+{
+	size_t current = used;
+	do
+	{
+		size_t cap = limit;
+		if (bytes > cap || current > cap - bytes)
+			return false;
+	} while (!used.compare_exchange_weak(current, current + bytes));
+	return true;
+}
+
+MemoryBudget::Reservation MemoryBudget::try_reserve(size_t bytes,
+                                                    bool reclaim)
+{
+	if (!take(bytes))
+	{
+		void (*reclaim_cache)() = reclaimer;
+		if (!reclaim || !reclaim_cache)
+			return Reservation();
+		reclaim_cache();
+		if (!take(bytes))
+			return Reservation();
+	}
+	Reservation reservation;
+	reservation.owner = this;
+	reservation.held = bytes;
+	return reservation;
+}
+
+MemoryBudget::Reservation MemoryBudget::reserve(size_t bytes,
+                                                const std::string &what)
+{
+	Reservation reservation = try_reserve(bytes);
+	if (!reservation)
+		throw std::runtime_error(what + " needs " + format_bytes(bytes) +
+		                         ", over the memory budget (" +
+		                         format_bytes(used) + " of " +
+		                         format_bytes(limit) + " in use)");
+	return reservation;
+}
+
+size_t parse_byte_size(const std::string &text)
+{
+	size_t end = 0;
+	unsigned long long value = 0;
+	try
+	{
+		if (!text.empty() && std::isdigit((unsigned char)text[0]))
+			value = std::stoull(text, &end);
+	}
+	catch (const std::out_of_range &)
+	{
+		end = 0;
+	}
+	int shift = -1;
+	if (end > 0 && end == text.size())
+		shift = 0;
+	else if (end > 0 && end + 1 == text.size())
+		switch (std::toupper((unsigned char)text[end]))
+		{
+		case 'K':
+			shift = 10;
+			break;
+		case 'M':
+			shift = 20;
+			break;
+		case 'G':
+			shift = 30;
+			break;
+		}
+	if (shift < 0 || value > (SIZE_MAX >> shift))
+		throw std::invalid_argument("expected a size such as 512M, not \"" +
+		                            text + "\"");
+	return (size_t)value << shift;
+}
+
+std::string format_bytes(size_t bytes)
+{
+	if (bytes == MemoryBudget::kUnlimited)
+		return "unlimited";
+	const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+	double value = (double)bytes;
+	int unit = 0;
+	while (value >= 1024 && unit < 4)
+	{
+		value /= 1024;
+		++unit;
+	}
+	char text[32];
+	std::snprintf(text, sizeof(text), unit ? "%.1f %s" : "%.0f %s", value,
+	              units[unit]);
+	return text;
+}
@@ -0,0 +1,91 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A process-wide cap on the memory held by images, so a host can be sized
+// by how many of them fit. Engines reserve their footprint when they are
+// built (see make_engine) and give it back when destroyed; a reservation
+// that would take the total over the limit is refused. Only what reserves
+// is counted: BufferPool's cached blocks are, temporary images and
+// allocator overhead are not.
+//
+// The default limit is unlimited, which still keeps count.
+class MemoryBudget
+{
+  public:
+	static const size_t kUnlimited = SIZE_MAX;
+
+	// What make_engine() does when the engine asked for would not fit:
+	// throw, or build a cheaper one that does.
+	enum class Policy
+	{
+		Reject,
+		Fallback
+	};
+
+	// Bytes counted against the budget until released or destroyed.
+	class Reservation
+	{
+	  public:
+		Reservation() = default;
+		Reservation(Reservation &&other) noexcept;
+		Reservation &operator=(Reservation other) noexcept;
+		~Reservation() { release(); }
+
+		// False for a refused (or released) reservation.
+		explicit operator bool() const { return owner != nullptr; }
+		size_t bytes() const { return held; }
+		// Changes the amount held, even past the limit: for settling an
+		// estimate to the footprint measured once the engine exists.
+		void resize(size_t bytes);
+		void release();
+
+	  private:
+		friend class MemoryBudget;
+		MemoryBudget *owner = nullptr;
+		size_t held = 0;
+	};
+
+	static MemoryBudget &instance();
+
+	void set_limit(size_t bytes);
+	size_t get_limit() const { return limit; }
+	void set_policy(Policy policy);
+	Policy get_policy() const { return policy; }
+	// Bytes currently reserved.
+	size_t get_used() const { return used; }
+
+	// Reserves `bytes` when they fit under the limit; otherwise returns an
+	// empty reservation. Unless `reclaim` is false, a reservation that
+	// would not fit first has the reclaimer drop cached memory.
+	Reservation try_reserve(size_t bytes, bool reclaim = true);
+	// Like try_reserve(), but throws std::runtime_error saying what `what`
+	// needed and how much of the budget is in use.
+	Reservation reserve(size_t bytes, const std::string &what);
+
+	// Called when a reservation would not fit, to release memory that is
+	// reserved only as a cache (BufferPool's); the reservation is then
+	// tried once more.
+	void set_reclaimer(void (*reclaim)());
+
+  private:
+	MemoryBudget() = default;
+
+	bool take(size_t bytes);
+
+	std::atomic<size_t> limit{kUnlimited}, used{0};
+	std::atomic<Policy> policy{Policy::Fallback};
+	std::atomic<void (*)()> reclaimer{nullptr};
+};
+
+// Parses "1048576", "512K", "64M" or "2G" (powers of 1024). Throws
+// std::invalid_argument.
+size_t parse_byte_size(const std::string &text);
+// e.g. "1.5 GiB", for messages.
+std::string format_bytes(size_t bytes);
+
+#endif // MEMORY_BUDGET_H
@@ -0,0 +1,374 @@
+#include "OutOfCoreImage.h"
+#include "PixelKernels.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+// File layout: this header, then every tile in row-major tile order as
+// tile_size * tile_size interleaved pixels. Edge tiles are padded to full
+// size so any tile's offset is a multiplication.
+const char kTiledMagic[8] = {'P', 'N', 'G', 'T', 'I', 'L', 'E', 'S'};
+const uint32_t kTiledVersion = 1;
+
+struct TiledHeader
+{
+	char magic[8];
+	uint32_t version;
+	int32_t width, height, tile_size;
+	uint32_t reserved[10];
+};
+static_assert(sizeof(TiledHeader) == 64, "tiled header layout");
+
+// How many tiles ahead of a detected stride to request from the kernel.
+const int kPrefetchDepth = 2;
+
+void pwrite_all(int fd, const void *data, size_t n, long long offset,
+                const std::string &path)
+{
+	const char *p = static_cast<const char *>(data);
+	while (n > 0)
+	{
+		ssize_t done = ::pwrite(fd, p, n, offset);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			throw std::runtime_error("error writing " + path + ": " +
+			                         std::strerror(errno));
+		p += done;
+		n -= (size_t)done;
+		offset += done;
+	}
+}
+
+void pread_all(int fd, void *data, size_t n, long long offset,
+               const std::string &path)
+{
+	char *p = static_cast<char *>(data);
+	while (n > 0)
+	{
+		ssize_t done = ::pread(fd, p, n, offset);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			throw std::runtime_error("error reading " + path + ": " +
+			                         (done == 0 ? std::string("file truncated")
+			                                    : std::strerror(errno)));
+		p += done;
+		n -= (size_t)done;
+		offset += done;
+	}
+}
+} // namespace
+
+void OutOfCoreImage::create(const std::string &path, int width, int height,
+                            const RowSource &source, int tile_size)
+{
+	if (width <= 0 || height <= 0 || tile_size <= 0)
+		throw std::invalid_argument("OutOfCoreImage: bad dimensions");
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("cannot create " + path + ": " +
+		                         std::strerror(errno));
+
+	try
+	{
+		TiledHeader header = {};
+		std::memcpy(header.magic, kTiledMagic, sizeof(header.magic));
+		header.version = kTiledVersion;
+		header.width = width;
+		header.height = height;
+		header.tile_size = tile_size;
+		long long offset = 0;
+		pwrite_all(fd, &header, sizeof(header), offset, path);
+		offset += sizeof(header);
+
+		// One band of tile_size rows at a time, cut into tiles and written
+		// sequentially.
+		std::vector<RGB_uc> band((size_t)tile_size * width);
+		Image tile_pixels(tile_size, tile_size);
+		for (int r0 = 0; r0 < height; r0 += tile_size)
+		{
+			int band_rows = std::min(tile_size, height - r0);
+			for (int r = 0; r < band_rows; ++r)
+				source(r0 + r, &band[(size_t)r * width]);
+			for (int c0 = 0; c0 < width; c0 += tile_size)
+			{
+				int cols = std::min(tile_size, width - c0);
+				for (int r = 0; r < tile_size; ++r)
+				{
+					RGB_uc *dst = tile_pixels.row(r);
+					if (r < band_rows)
+						std::copy(&band[(size_t)r * width + c0],
+						          &band[(size_t)r * width + c0] + cols, dst);
+					std::fill(dst + (r < band_rows ? cols : 0),
+					          dst + tile_size, RGB_uc{0, 0, 0});
+				}
+				size_t bytes = (size_t)tile_size * tile_size * 3;
+				pwrite_all(fd, tile_pixels.row(0), bytes, offset, path);
+				offset += (long long)bytes;
+			}
+		}
+	}
+	catch (...)
+	{
+		::close(fd);
+		throw;
+	}
+	if (::close(fd) != 0)
+		throw std::runtime_error("error writing " + path + ": " +
+		                         std::strerror(errno));
+}
+
+OutOfCoreImage::OutOfCoreImage(const std::string &path, size_t cache_bytes)
+    : path(path)
+{
+	fd = ::open(path.c_str(), O_RDWR);
+	if (fd < 0)
+		throw std::runtime_error("cannot open " + path + ": " +
+		                         std::strerror(errno));
+	TiledHeader header;
+	try
+	{
+		pread_all(fd, &header, sizeof(header), 0, path);
+	}
+	catch (...)
+	{
+		::close(fd);
+		throw;
+	}
+	if (std::memcmp(header.magic, kTiledMagic, sizeof(header.magic)) != 0 ||
+	    header.version != kTiledVersion || header.width <= 0 ||
+	    header.height <= 0 || header.tile_size <= 0)
+	{
+		::close(fd);
+		throw std::runtime_error(path + ": not a tiled image file");
+	}
+
+	width = header.width;
+	height = header.height;
+	tile_size = header.tile_size;
+	tile_rows = (height + tile_size - 1) / tile_size;
+	tile_cols = (width + tile_size - 1) / tile_size;
+	capacity = std::max<size_t>(2, cache_bytes / tile_bytes());
+	// Tile order rarely matches file order, so turn off the kernel's
+	// sequential readahead and rely on note_access() instead.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+}
+
+OutOfCoreImage::~OutOfCoreImage()
+{
+	try
+	{
+		flush();
+	}
+	catch (const std::exception &)
+	{
+		// Destructors must not throw; call flush() to see write errors.
+	}
+	::close(fd);
+}
+
+long long OutOfCoreImage::tile_offset(int index) const
+{
+	return (long long)sizeof(TiledHeader) + (long long)index * tile_bytes();
+}
+
+OutOfCoreImage::CachedTile &OutOfCoreImage::tile(int index, bool overwrite)
+{
+	note_access(index);
+	auto it = cache.find(index);
+	if (it != cache.end())
+	{
+		++stats.hits;
+		lru.splice(lru.begin(), lru, it->second.lru_position);
+		return it->second;
+	}
+
+	++stats.misses;
+	while (cache.size() >= capacity)
+		evict_one();
+	Image pixels(tile_size, tile_size);
+	if (!overwrite)
+		pread_all(fd, pixels.row(0), tile_bytes(), tile_offset(index), path);
+	lru.push_front(index);
+	auto inserted =
+	    cache.emplace(index, CachedTile{std::move(pixels), false, lru.begin()});
+	return inserted.first->second;
+}
+
+void OutOfCoreImage::evict_one()
+{
+	int index = lru.back();
+	auto it = cache.find(index);
+	if (it->second.dirty)
+		write_back(index, it->second);
+	lru.pop_back();
+	cache.erase(it);
+	++stats.evictions;
+}
+
+void OutOfCoreImage::write_back(int index, CachedTile &entry)
+{
+	pwrite_all(fd, entry.pixels.row(0), tile_bytes(), tile_offset(index),
+	           path);
+	entry.dirty = false;
+	++stats.writebacks;
+}
+
+void OutOfCoreImage::note_access(int index)
+{
+	if (index == last_tile)
+		return;
+	int stride = index - last_tile;
+	if (last_tile >= 0 && stride == last_stride)
+	{
+		// Two equal steps in a row: ask the kernel to start reading the
+		// next tiles along the same stride.
+		for (int k = 1; k <= kPrefetchDepth; ++k)
+		{
+			int next = index + k * stride;
+			if (next < 0 || next >= tile_rows * tile_cols || cache.count(next))
+				continue;
+			posix_fadvise(fd, tile_offset(next), (off_t)tile_bytes(),
+			              POSIX_FADV_WILLNEED);
+			++stats.prefetches;
+		}
+	}
+	last_stride = stride;
+	last_tile = index;
+}
+
+template <typename TileOp>
+void OutOfCoreImage::for_each_tile(int r1, int c1, int r2, int c2,
+                                   bool writes, bool overwrite_covered,
+                                   TileOp fn)
+{
+	r1 = std::max(0, r1);
+	c1 = std::max(0, c1);
+	r2 = std::min(height - 1, r2);
+	c2 = std::min(width - 1, c2);
+	if (r1 > r2 || c1 > c2)
+		return;
+
+	for (int tr = r1 / tile_size; tr <= r2 / tile_size; ++tr)
+		for (int tc = c1 / tile_size; tc <= c2 / tile_size; ++tc)
+		{
+			int r0 = tr * tile_size, c0 = tc * tile_size;
+			int lr1 = std::max(r1, r0) - r0;
+			int lc1 = std::max(c1, c0) - c0;
+			int lr2 = std::min(r2, r0 + tile_size - 1) - r0;
+			int lc2 = std::min(c2, c0 + tile_size - 1) - c0;
+			// Padding outside the image does not need to survive.
+			bool covered = overwrite_covered && lr1 == 0 && lc1 == 0 &&
+			               lr2 == std::min(tile_size, height - r0) - 1 &&
+			               lc2 == std::min(tile_size, width - c0) - 1;
+			CachedTile &entry = tile(tr * tile_cols + tc, covered);
+			if (writes)
+				entry.dirty = true;
+			fn(entry.pixels, lr1, lc1, lr2, lc2);
+		}
+}
+
+void OutOfCoreImage::adjust_brightness(int r1, int c1, int r2, int c2,
+                                       int value)
+{
+	for_each_tile(r1, c1, r2, c2, true, false,
+	              [value](Image &t, int lr1, int lc1, int lr2, int lc2) {
+		              for (int r = lr1; r <= lr2; ++r)
+			              add_saturate_bytes(
+			                  reinterpret_cast<unsigned char *>(t.row(r) + lc1),
+			                  (size_t)(lc2 - lc1 + 1) * 3, value);
+	              });
+}
+
+void OutOfCoreImage::adjust_contrast(int r1, int c1, int r2, int c2,
+                                     double multiplier)
+{
+	for_each_tile(r1, c1, r2, c2, true, false,
+	              [multiplier](Image &t, int lr1, int lc1, int lr2, int lc2) {
+		              for (int r = lr1; r <= lr2; ++r)
+			              scale_saturate_bytes(
+			                  reinterpret_cast<unsigned char *>(t.row(r) + lc1),
+			                  (size_t)(lc2 - lc1 + 1) * 3, multiplier);
+	              });
+}
+
+void OutOfCoreImage::fill_region(int r1, int c1, int r2, int c2,
+                                 const RGB_uc &color)
+{
+	for_each_tile(r1, c1, r2, c2, true, true,
+	              [&color](Image &t, int lr1, int lc1, int lr2, int lc2) {
+		              for (int r = lr1; r <= lr2; ++r)
+			              fill_rgb(t.row(r) + lc1, (size_t)(lc2 - lc1 + 1),
+			                       color);
+	              });
+}
+
+RGB_d OutOfCoreImage::query_average_color(int r1, int c1, int r2, int c2)
+{
+	long long num_pixels = (long long)(r2 - r1 + 1) * (c2 - c1 + 1);
+	if (num_pixels <= 0)
+		return {0, 0, 0};
+
+	long long sum[3] = {0, 0, 0};
+	for_each_tile(r1, c1, r2, c2, false, false,
+	              [&sum](Image &t, int lr1, int lc1, int lr2, int lc2) {
+		              for (int r = lr1; r <= lr2; ++r)
+		              {
+			              const RGB_uc *p = t.row(r);
+			              for (int c = lc1; c <= lc2; ++c)
+			              {
+				              sum[0] += p[c].r;
+				              sum[1] += p[c].g;
+				              sum[2] += p[c].b;
+			              }
+		              }
+	              });
+	return {(double)sum[0] / num_pixels, (double)sum[1] / num_pixels,
+	        (double)sum[2] / num_pixels};
+}
+
+void OutOfCoreImage::export_rows(const RowSink &sink)
+{
+	// Assemble one band of tiles at a time so each tile is fetched once,
+	// however small the cache.
+	std::vector<RGB_uc> band((size_t)tile_size * width);
+	for (int tr = 0; tr < tile_rows; ++tr)
+	{
+		int r0 = tr * tile_size;
+		int band_rows = std::min(tile_size, height - r0);
+		for (int tc = 0; tc < tile_cols; ++tc)
+		{
+			int c0 = tc * tile_size;
+			int cols = std::min(tile_size, width - c0);
+			const Image &t = tile(tr * tile_cols + tc, false).pixels;
+			for (int r = 0; r < band_rows; ++r)
+				std::copy(t.row(r), t.row(r) + cols,
+				          &band[(size_t)r * width + c0]);
+		}
+		for (int r = 0; r < band_rows; ++r)
+			sink(r0 + r, &band[(size_t)r * width]);
+	}
+}
+
+void OutOfCoreImage::flush()
+{
+	for (auto &[index, entry] : cache)
+		if (entry.dirty)
+			write_back(index, entry);
+}
+
+size_t OutOfCoreImage::memory_footprint() const
+{
+	size_t bytes = sizeof(OutOfCoreImage);
+	for (const auto &entry : cache)
+		bytes += sizeof(entry) - sizeof(Image) +
+		         entry.second.pixels.memory_footprint();
+	return bytes;
+}
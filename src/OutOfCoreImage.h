@@ -0,0 +1,99 @@
+#ifndef OUT_OF_CORE_IMAGE_H
+#define OUT_OF_CORE_IMAGE_H
+
+#include "Image.h"
+#include "types.h"
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+// An image kept in a tiled file on disk, for images larger than RAM. Tiles
+// of tile_size x tile_size pixels are read on demand into a bounded LRU
+// cache. Dirty tiles are written back on eviction or flush(). A detected
+// stride in the tile access sequence triggers readahead of the next tiles.
+//
+// Region operations match VectorImage, including contrast as p * m. They
+// visit the tiles a rectangle touches. A fill that covers a whole tile
+// never reads it from disk. Not thread-safe.
+class OutOfCoreImage
+{
+  public:
+	struct CacheStats
+	{
+		long long hits = 0, misses = 0, evictions = 0, writebacks = 0,
+		          prefetches = 0;
+	};
+
+	// Writes a new tiled file from rows pulled in order from `source`,
+	// holding one band of tile_size rows in memory at a time.
+	static void create(const std::string &path, int width, int height,
+	                   const RowSource &source, int tile_size = 256);
+
+	// Opens a tiled file; at most `cache_bytes` of tiles stay resident
+	// (never fewer than two tiles).
+	explicit OutOfCoreImage(const std::string &path,
+	                        size_t cache_bytes = (size_t)256 << 20);
+	// Writes back dirty tiles; errors are only reported by flush().
+	~OutOfCoreImage();
+
+	OutOfCoreImage(const OutOfCoreImage &) = delete;
+	OutOfCoreImage &operator=(const OutOfCoreImage &) = delete;
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+	int get_tile_size() const { return tile_size; }
+	const CacheStats &cache_stats() const { return stats; }
+
+	void adjust_brightness(int r1, int c1, int r2, int c2, int value);
+	void adjust_contrast(int r1, int c1, int r2, int c2, double multiplier);
+	void fill_region(int r1, int c1, int r2, int c2, const RGB_uc &color);
+	RGB_d query_average_color(int r1, int c1, int r2, int c2);
+
+	// Streams the whole image to `sink` one row at a time.
+	void export_rows(const RowSink &sink);
+	// Writes every dirty tile back to the file.
+	void flush();
+
+	// Bytes held in memory: the cached tiles and their entries. The file
+	// itself is not counted.
+	size_t memory_footprint() const;
+
+  private:
+	struct CachedTile
+	{
+		Image pixels;
+		bool dirty;
+		std::list<int>::iterator lru_position;
+	};
+
+	int fd = -1;
+	std::string path;
+	int width = 0, height = 0, tile_size = 0;
+	int tile_rows = 0, tile_cols = 0;
+	size_t capacity = 0; // tiles
+
+	std::unordered_map<int, CachedTile> cache;
+	std::list<int> lru; // most recently used first
+	CacheStats stats;
+
+	// Access-pattern tracking for prefetch.
+	int last_tile = -1, last_stride = 0;
+
+	size_t tile_bytes() const { return (size_t)tile_size * tile_size * 3; }
+	long long tile_offset(int index) const;
+	// The cached tile, loading it unless `overwrite` says every pixel is
+	// about to be replaced.
+	CachedTile &tile(int index, bool overwrite);
+	void evict_one();
+	void write_back(int index, CachedTile &entry);
+	void note_access(int index);
+
+	// Calls fn(tile_pixels, lr1, lc1, lr2, lc2) for each tile the rectangle
+	// touches, with the rectangle clipped to that tile in tile coordinates.
+	template <typename TileOp>
+	void for_each_tile(int r1, int c1, int r2, int c2, bool writes,
+	                   bool overwrite_covered, TileOp fn);
+};
+
+#endif // OUT_OF_CORE_IMAGE_H
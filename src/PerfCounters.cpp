@@ -0,0 +1,139 @@
+#include "PerfCounters.h"
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+struct EventSpec
+{
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+constexpr uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result)
+{
+	return cache | (op << 8) | (result << 16);
+}
+
+const EventSpec kEvents[kPerfEventCount] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"l1d_misses", PERF_TYPE_HW_CACHE,
+     cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"dtlb_misses", PERF_TYPE_HW_CACHE,
+     cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+struct ReadFormat
+{
+	uint64_t value, time_enabled, time_running;
+};
+} // namespace
+
+const char *perf_event_name(PerfEvent event)
+{
+	return kEvents[(int)event].name;
+}
+
+PerfReading &PerfReading::operator+=(const PerfReading &other)
+{
+	for (int i = 0; i < kPerfEventCount; ++i)
+	{
+		valid[i] = valid[i] || other.valid[i];
+		value[i] += other.value[i];
+	}
+	return *this;
+}
+
+PerfReading &PerfReading::operator/=(double divisor)
+{
+	for (double &v : value)
+		v /= divisor;
+	return *this;
+}
+
+PerfCounters::PerfCounters()
+{
+	for (int i = 0; i < kPerfEventCount; ++i)
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = kEvents[i].type;
+		attr.config = kEvents[i].config;
+		attr.disabled = 1;
+		// User space only: allowed at perf_event_paranoid <= 2.
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		attr.read_format =
+		    PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fds[i] < 0)
+		{
+			if (!reason.empty())
+				reason += "; ";
+			reason += std::string(kEvents[i].name) + ": " + std::strerror(errno);
+		}
+	}
+}
+
+PerfCounters::~PerfCounters()
+{
+	for (int fd : fds)
+		if (fd >= 0)
+			close(fd);
+}
+
+PerfCounters &PerfCounters::instance()
+{
+	static PerfCounters counters;
+	return counters;
+}
+
+bool PerfCounters::any_available() const
+{
+	for (int fd : fds)
+		if (fd >= 0)
+			return true;
+	return false;
+}
+
+void PerfCounters::start()
+{
+	for (int fd : fds)
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+}
+
+PerfReading PerfCounters::stop()
+{
+	PerfReading reading;
+	for (int i = 0; i < kPerfEventCount; ++i)
+	{
+		if (fds[i] < 0)
+			continue;
+		ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		ReadFormat data;
+		if (read(fds[i], &data, sizeof(data)) != (ssize_t)sizeof(data) ||
+		    data.time_running == 0)
+			continue;
+		reading.valid[i] = true;
+		reading.value[i] = (double)data.value * ((double)data.time_enabled /
+		                                         (double)data.time_running);
+	}
+	return reading;
+}
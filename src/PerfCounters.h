@@ -0,0 +1,66 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <string>
+
+// Linux perf_event_open counters for this process, user space only. Events
+// are inherited by threads created after the counters open, so open them
+// before ThreadPool::instance() to include the workers. Each event opens on
+// its own so that missing ones do not take down the rest: virtual machines
+// often lack a PMU, containers often block the syscall, and
+// perf_event_paranoid can forbid it. Every reading says which events were
+// counted.
+enum class PerfEvent
+{
+	Cycles,
+	Instructions,
+	L1DMisses,
+	LLCMisses,
+	BranchMisses,
+	DTLBMisses,
+	PageFaults,
+	Count
+};
+
+constexpr int kPerfEventCount = (int)PerfEvent::Count;
+
+const char *perf_event_name(PerfEvent event);
+
+struct PerfReading
+{
+	bool valid[kPerfEventCount] = {};
+	// Scaled for multiplexing when the kernel time-shared the PMU.
+	double value[kPerfEventCount] = {};
+
+	PerfReading &operator+=(const PerfReading &other);
+	PerfReading &operator/=(double divisor);
+};
+
+class PerfCounters
+{
+  public:
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters &) = delete;
+	PerfCounters &operator=(const PerfCounters &) = delete;
+
+	// Process-wide instance used by measure().
+	static PerfCounters &instance();
+
+	bool any_available() const;
+	// Why events are missing (e.g. "cycles: No such file or directory"), or
+	// empty when all opened.
+	const std::string &unavailable_reason() const { return reason; }
+
+	void start();
+	// Counts since start().
+	PerfReading stop();
+
+  private:
+	int fds[kPerfEventCount];
+	std::string reason;
+};
+
+#endif // PERF_COUNTERS_H
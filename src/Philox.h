@@ -0,0 +1,46 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <array>
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2,
+// 3", SC 2011): a counter-based generator. Each 128-bit counter maps to
+// 128 random bits under a 64-bit key with no state carried between calls,
+// so any block of a stream can be computed independently. That lets
+// threads and SIMD lanes fill disjoint parts of an image and still give
+// the same bytes as a sequential fill.
+namespace philox
+{
+using Counter = std::array<uint32_t, 4>;
+
+const uint32_t kMul0 = 0xD2511F53, kMul1 = 0xCD9E8D57;
+const uint32_t kWeyl0 = 0x9E3779B9, kWeyl1 = 0xBB67AE85;
+const int kRounds = 10;
+
+inline Counter block(Counter x, uint64_t key)
+{
+	uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+	for (int round = 0; round < kRounds; ++round)
+	{
+		uint64_t p0 = (uint64_t)kMul0 * x[0];
+		uint64_t p1 = (uint64_t)kMul1 * x[2];
+		x = {(uint32_t)(p1 >> 32) ^ x[1] ^ k0, (uint32_t)p1,
+		     (uint32_t)(p0 >> 32) ^ x[3] ^ k1, (uint32_t)p0};
+		k0 += kWeyl0;
+		k1 += kWeyl1;
+	}
+	return x;
+}
+
+// Counter for block `index` of stream `stream`.
+inline Counter counter(uint64_t stream, uint32_t index)
+{
+	return {index, (uint32_t)stream, (uint32_t)(stream >> 32), 0};
+}
+
+// A uniform value in [0, 1) from 32 random bits.
+inline double unit(uint32_t bits) { return bits * (1.0 / 4294967296.0); }
+} // namespace philox
+
+#endif // PHILOX_H
@@ -0,0 +1,458 @@
+#include "Pipeline.h"
+#include "BoundedQueue.h"
+#include "ImageIO.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+double seconds(Clock::duration d)
+{
+	return std::chrono::duration<double>(d).count();
+}
+
+enum Stage
+{
+	Decode,
+	Build,
+	Ops,
+	Export,
+	Encode,
+	kStageCount
+};
+
+const char *const kStageNames[kStageCount] = {"decode", "build", "ops",
+                                              "export", "encode"};
+
+struct PixelBuffer
+{
+	int width = 0, height = 0;
+	std::vector<RGB_uc> pixels;
+
+	RGB_uc *row(int r) { return &pixels[(size_t)r * width]; }
+};
+
+// Free list of reusable objects. acquire() returns null when nothing is
+// free; release() drops the object if the list is already full.
+template <typename T> class RecyclePool
+{
+  public:
+	explicit RecyclePool(size_t capacity) : free_list(capacity) {}
+
+	std::unique_ptr<T> acquire()
+	{
+		std::unique_ptr<T> object;
+		free_list.try_pop(object);
+		return object;
+	}
+	void release(std::unique_ptr<T> &object)
+	{
+		if (object)
+			free_list.try_push(object);
+		object.reset();
+	}
+
+  private:
+	BoundedQueue<std::unique_ptr<T>> free_list;
+};
+
+struct Job
+{
+	const PipelineTask *task = nullptr;
+	std::unique_ptr<PixelBuffer> buffer;
+	std::unique_ptr<SegmentTree> tree;
+	std::string error;
+};
+
+class Runner
+{
+  public:
+	Runner(const std::vector<PipelineTask> &tasks,
+	       const std::vector<SegmentTree::Update> &edits,
+	       const PipelineConfig &config);
+
+	PipelineReport run();
+
+  private:
+	const std::vector<SegmentTree::Update> &edits;
+	int workers[kStageCount];
+	std::vector<Job> jobs;
+	std::atomic<size_t> next_job{0};
+	// queues[s] carries job indices from stage s to stage s + 1.
+	std::vector<std::unique_ptr<BoundedQueue<size_t>>> queues;
+	std::atomic<int> live_workers[kStageCount];
+	std::unique_ptr<RecyclePool<PixelBuffer>> buffer_pool;
+	std::unique_ptr<RecyclePool<SegmentTree>> tree_pool;
+	std::atomic<size_t> buffers_allocated{0}, trees_allocated{0};
+
+	void worker(int stage, StageStats &stats);
+	void process(int stage, Job &job);
+	void check_edits(int width, int height) const;
+};
+
+Runner::Runner(const std::vector<PipelineTask> &tasks,
+               const std::vector<SegmentTree::Update> &edits,
+               const PipelineConfig &config)
+    : edits(edits), jobs(tasks.size())
+{
+	const int counts[kStageCount] = {config.decoders, config.builders,
+	                                 config.editors, config.exporters,
+	                                 config.encoders};
+	for (int s = 0; s < kStageCount; ++s)
+	{
+		if (counts[s] < 1)
+			throw std::invalid_argument(std::string(kStageNames[s]) +
+			                            " needs at least one worker");
+		workers[s] = counts[s];
+		live_workers[s] = counts[s];
+	}
+	if (config.queue_depth < 1)
+		throw std::invalid_argument("queue depth must be at least 1");
+
+	size_t in_flight = 0;
+	for (int s = 0; s + 1 < kStageCount; ++s)
+	{
+		queues.push_back(
+		    std::make_unique<BoundedQueue<size_t>>(config.queue_depth));
+		in_flight += queues.back()->capacity();
+	}
+	for (int s = 0; s < kStageCount; ++s)
+		in_flight += workers[s];
+	buffer_pool = std::make_unique<RecyclePool<PixelBuffer>>(in_flight);
+	tree_pool = std::make_unique<RecyclePool<SegmentTree>>(in_flight);
+
+	for (size_t i = 0; i < tasks.size(); ++i)
+		jobs[i].task = &tasks[i];
+}
+
+PipelineReport Runner::run()
+{
+	PipelineReport report;
+	report.images = jobs.size();
+	// One StageStats per worker, merged at the end, so workers never share
+	// a counter.
+	std::vector<std::vector<StageStats>> per_worker(kStageCount);
+	for (int s = 0; s < kStageCount; ++s)
+		per_worker[s].resize(workers[s]);
+
+	Clock::time_point begin = Clock::now();
+	std::vector<std::thread> threads;
+	for (int s = 0; s < kStageCount; ++s)
+		for (int w = 0; w < workers[s]; ++w)
+			threads.emplace_back(&Runner::worker, this, s,
+			                     std::ref(per_worker[s][w]));
+	for (std::thread &t : threads)
+		t.join();
+	report.wall_s = seconds(Clock::now() - begin);
+
+	for (int s = 0; s < kStageCount; ++s)
+	{
+		StageStats total;
+		total.name = kStageNames[s];
+		total.workers = workers[s];
+		for (const StageStats &w : per_worker[s])
+		{
+			total.items += w.items;
+			total.busy_s += w.busy_s;
+			total.input_wait_s += w.input_wait_s;
+			total.output_wait_s += w.output_wait_s;
+		}
+		report.stages.push_back(total);
+	}
+	for (const Job &job : jobs)
+		if (!job.error.empty())
+			report.errors.push_back(job.task->input + ": " + job.error);
+	report.pixel_buffers = buffers_allocated;
+	report.trees = trees_allocated;
+	return report;
+}
+
+void Runner::worker(int stage, StageStats &stats)
+{
+	BoundedQueue<size_t> *in = stage > 0 ? queues[stage - 1].get() : nullptr;
+	BoundedQueue<size_t> *out =
+	    stage + 1 < kStageCount ? queues[stage].get() : nullptr;
+	for (;;)
+	{
+		Clock::time_point t0 = Clock::now();
+		size_t index;
+		bool have = in ? in->pop(index) : (index = next_job++) < jobs.size();
+		Clock::time_point t1 = Clock::now();
+		stats.input_wait_s += seconds(t1 - t0);
+		if (!have)
+			break;
+
+		Job &job = jobs[index];
+		if (job.error.empty())
+		{
+			try
+			{
+				process(stage, job);
+			}
+			catch (const std::exception &e)
+			{
+				job.error = e.what();
+			}
+		}
+		if (!out)
+		{
+			// Last stage: hand the buffers back even if the job failed early.
+			buffer_pool->release(job.buffer);
+			tree_pool->release(job.tree);
+		}
+		Clock::time_point t2 = Clock::now();
+		stats.busy_s += seconds(t2 - t1);
+		++stats.items;
+
+		if (out)
+		{
+			out->push(index);
+			stats.output_wait_s += seconds(Clock::now() - t2);
+		}
+	}
+	if (out && --live_workers[stage] == 0)
+		out->close();
+}
+
+void Runner::check_edits(int width, int height) const
+{
+	for (size_t i = 0; i < edits.size(); ++i)
+	{
+		const SegmentTree::Update &u = edits[i];
+		if (u.r1 < 0 || u.c1 < 0 || u.r2 >= height || u.c2 >= width ||
+		    u.r1 > u.r2 || u.c1 > u.c2)
+			throw std::out_of_range(
+			    "edit " + std::to_string(i + 1) + ": rectangle outside the " +
+			    std::to_string(width) + "x" + std::to_string(height) +
+			    " image");
+	}
+}
+
+void Runner::process(int stage, Job &job)
+{
+	switch (stage)
+	{
+	case Decode: {
+		std::unique_ptr<ImageReader> reader = open_image(job.task->input);
+		job.buffer = buffer_pool->acquire();
+		if (!job.buffer)
+		{
+			job.buffer = std::make_unique<PixelBuffer>();
+			++buffers_allocated;
+		}
+		PixelBuffer &buffer = *job.buffer;
+		buffer.width = reader->get_width();
+		buffer.height = reader->get_height();
+		// Keeps the capacity of a recycled buffer; grows it at most once.
+		buffer.pixels.resize((size_t)buffer.width * buffer.height);
+		for (int r = 0; r < buffer.height; ++r)
+			reader->read_row(buffer.row(r));
+		break;
+	}
+	case Build: {
+		PixelBuffer &buffer = *job.buffer;
+		RowSource source = [&buffer](int r, RGB_uc *pixels) {
+			const RGB_uc *row = buffer.row(r);
+			std::copy(row, row + buffer.width, pixels);
+		};
+		job.tree = tree_pool->acquire();
+		if (job.tree)
+			job.tree->rebuild(buffer.width, buffer.height, source);
+		else
+		{
+			job.tree = std::make_unique<SegmentTree>(buffer.width,
+			                                         buffer.height, source);
+			++trees_allocated;
+		}
+		break;
+	}
+	case Ops:
+		check_edits(job.tree->get_width(), job.tree->get_height());
+		job.tree->apply_batch(edits);
+		break;
+	case Export: {
+		PixelBuffer &buffer = *job.buffer;
+		job.tree->export_rows([&buffer](int r, const RGB_uc *pixels) {
+			std::copy(pixels, pixels + buffer.width, buffer.row(r));
+		});
+		tree_pool->release(job.tree);
+		break;
+	}
+	case Encode: {
+		PixelBuffer &buffer = *job.buffer;
+		std::unique_ptr<ImageWriter> writer =
+		    create_image(job.task->output, buffer.width, buffer.height);
+		for (int r = 0; r < buffer.height; ++r)
+			writer->write_row(buffer.row(r));
+		writer->finish();
+		break;
+	}
+	}
+}
+
+template <typename T> T read_arg(std::istringstream &args, const char *what)
+{
+	T value;
+	if (!(args >> value))
+		throw std::invalid_argument(std::string("expected ") + what);
+	return value;
+}
+} // namespace
+
+std::vector<SegmentTree::Update> read_edit_list(std::istream &in)
+{
+	std::vector<SegmentTree::Update> edits;
+	std::string line;
+	int line_number = 0;
+	while (std::getline(in, line))
+	{
+		++line_number;
+		std::istringstream args(line);
+		std::string command;
+		if (!(args >> command) || command[0] == '#')
+			continue;
+		try
+		{
+			SegmentTree::Update u{SegmentTree::Update::Fill, 0, 0, 0, 0};
+			if (command == "brightness")
+				u.kind = SegmentTree::Update::Brightness;
+			else if (command == "contrast")
+				u.kind = SegmentTree::Update::Contrast;
+			else if (command != "fill")
+				throw std::invalid_argument("unknown edit \"" + command +
+				                            "\"");
+			u.r1 = read_arg<int>(args, "r1");
+			u.c1 = read_arg<int>(args, "c1");
+			u.r2 = read_arg<int>(args, "r2");
+			u.c2 = read_arg<int>(args, "c2");
+			if (u.kind == SegmentTree::Update::Brightness)
+				u.value = read_arg<int>(args, "value");
+			else if (u.kind == SegmentTree::Update::Contrast)
+				u.value = read_arg<double>(args, "multiplier");
+			else
+			{
+				int r = read_arg<int>(args, "R"), g = read_arg<int>(args, "G"),
+				    b = read_arg<int>(args, "B");
+				u.color = {(unsigned char)r, (unsigned char)g,
+				           (unsigned char)b};
+			}
+			edits.push_back(u);
+		}
+		catch (const std::invalid_argument &e)
+		{
+			throw std::invalid_argument("line " + std::to_string(line_number) +
+			                            ": " + e.what());
+		}
+	}
+	return edits;
+}
+
+PipelineReport run_pipeline(const std::vector<PipelineTask> &tasks,
+                            const std::vector<SegmentTree::Update> &edits,
+                            const PipelineConfig &config)
+{
+	Runner runner(tasks, edits, config);
+	return runner.run();
+}
+
+void PipelineReport::print(std::ostream &out) const
+{
+	out << "Processed " << images << " images in " << wall_s << " s ("
+	    << (wall_s > 0 ? images / wall_s : 0.0) << " images/s), "
+	    << errors.size() << " failed\n";
+
+	auto percent = [&](double part, int workers) {
+		double total = wall_s * workers;
+		return total > 0 ? 100.0 * part / total : 0.0;
+	};
+	out << std::left << std::setw(8) << "stage" << std::right
+	    << std::setw(8) << "workers" << std::setw(8) << "items"
+	    << std::setw(8) << "busy%" << std::setw(10) << "in-wait%"
+	    << std::setw(11) << "out-wait%" << "\n";
+	const StageStats *bottleneck = nullptr;
+	std::ios::fmtflags flags = out.flags();
+	out << std::fixed << std::setprecision(1);
+	for (const StageStats &s : stages)
+	{
+		out << std::left << std::setw(8) << s.name << std::right
+		    << std::setw(8) << s.workers << std::setw(8) << s.items
+		    << std::setw(8) << percent(s.busy_s, s.workers) << std::setw(10)
+		    << percent(s.input_wait_s, s.workers) << std::setw(11)
+		    << percent(s.output_wait_s, s.workers) << "\n";
+		if (!bottleneck || s.busy_s / s.workers >
+		                       bottleneck->busy_s / bottleneck->workers)
+			bottleneck = &s;
+	}
+	if (bottleneck)
+		out << "Bottleneck: " << bottleneck->name << " (busy "
+		    << percent(bottleneck->busy_s, bottleneck->workers)
+		    << "% per worker)\n";
+	out.flags(flags);
+	out << "Allocated " << pixel_buffers << " pixel buffers and " << trees
+	    << " trees for " << images << " images\n";
+}
+
+Image reference_edits(const Image &image,
+                      const std::vector<SegmentTree::Update> &edits)
+{
+	int w = image.get_width(), h = image.get_height();
+	std::vector<RGB_d> pixels((size_t)w * h);
+	for (int r = 0; r < h; ++r)
+		for (int c = 0; c < w; ++c)
+		{
+			RGB_uc p = image.get_pixel(r, c);
+			pixels[(size_t)r * w + c] = {(double)p.r, (double)p.g,
+			                             (double)p.b};
+		}
+
+	for (const SegmentTree::Update &u : edits)
+	{
+		if (u.r1 < 0 || u.c1 < 0 || u.r2 >= h || u.c2 >= w || u.r1 > u.r2 ||
+		    u.c1 > u.c2)
+			throw std::out_of_range("edit rectangle outside the image");
+		double mul = 1, add = 0;
+		if (u.kind == SegmentTree::Update::Brightness)
+			add = u.value;
+		else if (u.kind == SegmentTree::Update::Contrast)
+		{
+			mul = u.value;
+			add = (1.0 - u.value) * 128.0;
+		}
+		else if (u.kind == SegmentTree::Update::Affine)
+		{
+			mul = u.value;
+			add = u.offset;
+		}
+		RGB_d fill = {(double)u.color.r, (double)u.color.g,
+		              (double)u.color.b};
+		for (int r = u.r1; r <= u.r2; ++r)
+			for (int c = u.c1; c <= u.c2; ++c)
+			{
+				RGB_d &p = pixels[(size_t)r * w + c];
+				if (u.kind == SegmentTree::Update::Fill)
+					p = fill;
+				else
+					p = {p.r * mul + add, p.g * mul + add, p.b * mul + add};
+			}
+	}
+
+	Image out = Image::uninitialized(w, h);
+	for (int r = 0; r < h; ++r)
+		for (int c = 0; c < w; ++c)
+		{
+			const RGB_d &p = pixels[(size_t)r * w + c];
+			out.set_pixel(r, c,
+			              {saturate_cast_uchar(p.r), saturate_cast_uchar(p.g),
+			               saturate_cast_uchar(p.b)});
+		}
+	return out;
+}
@@ -0,0 +1,81 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "Image.h"
+#include "SegmentTree.h"
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Runs one edit list over many images with five concurrent stages:
+//
+//   decode   read the file into a pixel buffer
+//   build    build a SegmentTree from the buffer
+//   ops      apply the edit list in one apply_batch traversal
+//   export   write the tree's pixels back into the buffer
+//   encode   write the buffer to the output file
+//
+// Stages hand images on through bounded queues, so a slow stage stalls the
+// ones before it instead of letting work pile up, and at most
+// queue_depth * 4 + (total workers) images are in flight. Pixel buffers and
+// trees are recycled, so once the pool holds one of each per image in
+// flight, further images allocate nothing large.
+
+struct PipelineConfig
+{
+	// Worker threads per stage, in stage order.
+	int decoders = 1, builders = 1, editors = 1, exporters = 1, encoders = 1;
+	int queue_depth = 4; // images between two stages
+};
+
+struct PipelineTask
+{
+	std::string input, output;
+};
+
+struct StageStats
+{
+	std::string name;
+	int workers = 0;
+	uint64_t items = 0;
+	// Summed over the stage's workers.
+	double busy_s = 0;
+	double input_wait_s = 0;  // blocked on an empty input queue
+	double output_wait_s = 0; // blocked on a full output queue
+};
+
+struct PipelineReport
+{
+	double wall_s = 0;
+	size_t images = 0;
+	std::vector<std::string> errors; // "path: message", in task order
+	std::vector<StageStats> stages;
+	// Large buffers actually allocated; the rest were reused.
+	size_t pixel_buffers = 0, trees = 0;
+
+	// Busy, input-wait and output-wait shares of each stage's worker time,
+	// and the bottleneck (the busiest stage per worker).
+	void print(std::ostream &out) const;
+};
+
+// Reads brightness/contrast/fill lines in the --script syntax (see
+// ScriptRunner.h). Blank lines and '#' comments are skipped; anything else
+// throws std::invalid_argument naming the line.
+std::vector<SegmentTree::Update> read_edit_list(std::istream &in);
+
+// The pixels `edits` should leave in `image`, worked out one pixel at a
+// time with SegmentTree's arithmetic: unclamped until export, contrast
+// about 128, truncated to 8 bits at the end. Independent of the tree, for
+// checking the pipeline's output. Throws std::out_of_range for a
+// rectangle outside the image.
+Image reference_edits(const Image &image,
+                      const std::vector<SegmentTree::Update> &edits);
+
+// Processes every task. A failing image (unreadable file, a rectangle
+// outside it) is recorded in the report and does not stop the others.
+PipelineReport run_pipeline(const std::vector<PipelineTask> &tasks,
+                            const std::vector<SegmentTree::Update> &edits,
+                            const PipelineConfig &config = PipelineConfig());
+
+#endif // PIPELINE_H
@@ -0,0 +1,455 @@
+#include "PixelKernels.h"
+#include "CpuFeatures.h"
+#include "Philox.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_HAVE_X86 1
+#endif
+
+static_assert(sizeof(RGB_uc) == 3, "RGB_uc must be tightly packed");
+
+namespace
+{
+// Multiplier split as integer part + Q16 fraction so every product fits in
+// 16-bit lanes: p * whole <= 255 * 256 and (p * frac) >> 16 < 256.
+struct FixedMultiplier
+{
+	uint16_t whole;
+	uint16_t frac;
+};
+
+FixedMultiplier to_fixed(double multiplier)
+{
+	if (!(multiplier > 0.0))
+		return {0, 0};
+	if (multiplier >= 256.0)
+		return {256, 0};
+	double whole = std::floor(multiplier);
+	long frac = std::lround((multiplier - whole) * 65536.0);
+	if (frac >= 65536)
+	{
+		whole += 1.0;
+		frac = 0;
+	}
+	return {(uint16_t)whole, (uint16_t)frac};
+}
+
+// --- Scalar ---
+void add_scalar(unsigned char *p, size_t n, int value)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		int v = p[i] + value;
+		p[i] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+	}
+}
+
+void scale_scalar(unsigned char *p, size_t n, FixedMultiplier m)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		unsigned v = p[i] * m.whole + ((p[i] * (unsigned)m.frac) >> 16);
+		p[i] = (unsigned char)std::min(v, 255u);
+	}
+}
+
+void fill_scalar(RGB_uc *p, size_t n, const RGB_uc &color)
+{
+	for (size_t i = 0; i < n; ++i)
+		p[i] = color;
+}
+
+void deinterleave_scalar(const RGB_uc *src, unsigned char *r,
+                        unsigned char *g, unsigned char *b, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		r[i] = src[i].r;
+		g[i] = src[i].g;
+		b[i] = src[i].b;
+	}
+}
+
+void interleave_scalar(const unsigned char *r, const unsigned char *g,
+                       const unsigned char *b, RGB_uc *dst, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = {r[i], g[i], b[i]};
+}
+
+// Blocks `index` onwards of the stream, words stored little-endian.
+void random_scalar(unsigned char *p, size_t n, uint64_t key, uint64_t stream,
+                   uint32_t index)
+{
+	for (size_t i = 0; i < n; i += 16, ++index)
+	{
+		philox::Counter x =
+		    philox::block(philox::counter(stream, index), key);
+		unsigned char bytes[16];
+		for (int w = 0; w < 4; ++w)
+			for (int b = 0; b < 4; ++b)
+				bytes[4 * w + b] = (unsigned char)(x[w] >> (8 * b));
+		std::memcpy(p + i, bytes, std::min<size_t>(16, n - i));
+	}
+}
+
+#ifdef PIXEL_HAVE_X86
+// pshufb masks for 16 pixels (48 bytes, three vectors). For deinterleave,
+// split[c][v] gathers channel c's bytes from input vector v into their
+// output slots; for interleave, merge[v][c] places plane c's bytes into
+// output vector v. Unused slots are 0x80 (zero).
+struct ShuffleMasks
+{
+	alignas(16) unsigned char split[3][3][16];
+	alignas(16) unsigned char merge[3][3][16];
+
+	ShuffleMasks()
+	{
+		for (int c = 0; c < 3; ++c)
+			for (int v = 0; v < 3; ++v)
+				for (int i = 0; i < 16; ++i)
+				{
+					int src = 3 * i + c; // byte of pixel i, channel c
+					split[c][v][i] =
+					    src / 16 == v ? (unsigned char)(src % 16) : 0x80;
+					int dst = 16 * v + i; // output byte
+					merge[v][c][i] =
+					    dst % 3 == c ? (unsigned char)(dst / 3) : 0x80;
+				}
+	}
+};
+
+const ShuffleMasks &shuffle_masks()
+{
+	static const ShuffleMasks masks;
+	return masks;
+}
+
+// --- SSSE3 ---
+__attribute__((target("ssse3"))) void
+deinterleave_ssse3(const RGB_uc *src, unsigned char *r, unsigned char *g,
+                   unsigned char *b, size_t n)
+{
+	const ShuffleMasks &m = shuffle_masks();
+	unsigned char *planes[3] = {r, g, b};
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(src);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i in[3];
+		for (int v = 0; v < 3; ++v)
+			in[v] =
+			    _mm_loadu_si128((const __m128i *)(bytes + 3 * i + 16 * v));
+		for (int c = 0; c < 3; ++c)
+		{
+			__m128i out = _mm_setzero_si128();
+			for (int v = 0; v < 3; ++v)
+			{
+				__m128i mask = _mm_load_si128((const __m128i *)m.split[c][v]);
+				out = _mm_or_si128(out, _mm_shuffle_epi8(in[v], mask));
+			}
+			_mm_storeu_si128((__m128i *)(planes[c] + i), out);
+		}
+	}
+	deinterleave_scalar(src + i, r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("ssse3"))) void
+interleave_ssse3(const unsigned char *r, const unsigned char *g,
+                 const unsigned char *b, RGB_uc *dst, size_t n)
+{
+	const ShuffleMasks &m = shuffle_masks();
+	const unsigned char *planes[3] = {r, g, b};
+	unsigned char *bytes = reinterpret_cast<unsigned char *>(dst);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i in[3];
+		for (int c = 0; c < 3; ++c)
+			in[c] = _mm_loadu_si128((const __m128i *)(planes[c] + i));
+		for (int v = 0; v < 3; ++v)
+		{
+			__m128i out = _mm_setzero_si128();
+			for (int c = 0; c < 3; ++c)
+			{
+				__m128i mask = _mm_load_si128((const __m128i *)m.merge[v][c]);
+				out = _mm_or_si128(out, _mm_shuffle_epi8(in[c], mask));
+			}
+			_mm_storeu_si128((__m128i *)(bytes + 3 * i + 16 * v), out);
+		}
+	}
+	interleave_scalar(r + i, g + i, b + i, dst + i, n - i);
+}
+
+// --- SSE2 ---
+__attribute__((target("sse2"))) void add_sse2(unsigned char *p, size_t n,
+                                              int value)
+{
+	__m128i amount = _mm_set1_epi8((char)std::min(std::abs(value), 255));
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		v = value >= 0 ? _mm_adds_epu8(v, amount) : _mm_subs_epu8(v, amount);
+		_mm_storeu_si128((__m128i *)(p + i), v);
+	}
+	add_scalar(p + i, n - i, value);
+}
+
+__attribute__((target("sse2"))) __m128i scale_half_sse2(__m128i px,
+                                                        __m128i whole,
+                                                        __m128i frac)
+{
+	__m128i v = _mm_adds_epu16(_mm_mullo_epi16(px, whole),
+	                           _mm_mulhi_epu16(px, frac));
+	// min(v, 255) without SSE4.1's _mm_min_epu16.
+	return _mm_sub_epi16(v, _mm_subs_epu16(v, _mm_set1_epi16(255)));
+}
+
+__attribute__((target("sse2"))) void scale_sse2(unsigned char *p, size_t n,
+                                                FixedMultiplier m)
+{
+	__m128i whole = _mm_set1_epi16((short)m.whole);
+	__m128i frac = _mm_set1_epi16((short)m.frac);
+	__m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i lo = scale_half_sse2(_mm_unpacklo_epi8(v, zero), whole, frac);
+		__m128i hi = scale_half_sse2(_mm_unpackhi_epi8(v, zero), whole, frac);
+		_mm_storeu_si128((__m128i *)(p + i), _mm_packus_epi16(lo, hi));
+	}
+	scale_scalar(p + i, n - i, m);
+}
+
+__attribute__((target("sse2"))) void fill_sse2(RGB_uc *p, size_t n,
+                                               const RGB_uc &color)
+{
+	// 16 pixels = 48 bytes = three vectors of the repeating pattern.
+	alignas(16) unsigned char pattern[48];
+	for (int i = 0; i < 16; ++i)
+		std::memcpy(pattern + 3 * i, &color, 3);
+	__m128i v0 = _mm_load_si128((const __m128i *)pattern);
+	__m128i v1 = _mm_load_si128((const __m128i *)(pattern + 16));
+	__m128i v2 = _mm_load_si128((const __m128i *)(pattern + 32));
+
+	unsigned char *bytes = reinterpret_cast<unsigned char *>(p);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		_mm_storeu_si128((__m128i *)(bytes + 3 * i), v0);
+		_mm_storeu_si128((__m128i *)(bytes + 3 * i + 16), v1);
+		_mm_storeu_si128((__m128i *)(bytes + 3 * i + 32), v2);
+	}
+	fill_scalar(p + i, n - i, color);
+}
+
+// --- AVX2 ---
+__attribute__((target("avx2"))) void add_avx2(unsigned char *p, size_t n,
+                                              int value)
+{
+	__m256i amount = _mm256_set1_epi8((char)std::min(std::abs(value), 255));
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		v = value >= 0 ? _mm256_adds_epu8(v, amount)
+		               : _mm256_subs_epu8(v, amount);
+		_mm256_storeu_si256((__m256i *)(p + i), v);
+	}
+	add_sse2(p + i, n - i, value);
+}
+
+__attribute__((target("avx2"))) void scale_avx2(unsigned char *p, size_t n,
+                                                FixedMultiplier m)
+{
+	__m256i whole = _mm256_set1_epi16((short)m.whole);
+	__m256i frac = _mm256_set1_epi16((short)m.frac);
+	__m256i limit = _mm256_set1_epi16(255);
+	__m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		// unpack and packus both work per 128-bit lane, so order is kept.
+		__m256i lo = _mm256_unpacklo_epi8(v, zero);
+		__m256i hi = _mm256_unpackhi_epi8(v, zero);
+		lo = _mm256_min_epu16(
+		    _mm256_adds_epu16(_mm256_mullo_epi16(lo, whole),
+		                      _mm256_mulhi_epu16(lo, frac)),
+		    limit);
+		hi = _mm256_min_epu16(
+		    _mm256_adds_epu16(_mm256_mullo_epi16(hi, whole),
+		                      _mm256_mulhi_epu16(hi, frac)),
+		    limit);
+		_mm256_storeu_si256((__m256i *)(p + i), _mm256_packus_epi16(lo, hi));
+	}
+	scale_sse2(p + i, n - i, m);
+}
+
+__attribute__((target("avx2"))) void fill_avx2(RGB_uc *p, size_t n,
+                                               const RGB_uc &color)
+{
+	// Build the 3-byte period with byte shuffles of the broadcast colour:
+	// each 16-byte lane starts at phase 0, 1 or 2 of RGB.
+	__m128i rgb = _mm_setr_epi8(color.r, color.g, color.b, 0, 0, 0, 0, 0, 0,
+	                            0, 0, 0, 0, 0, 0, 0);
+	__m128i s0 = _mm_shuffle_epi8(
+	    rgb, _mm_setr_epi8(0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0));
+	__m128i s1 = _mm_shuffle_epi8(
+	    rgb, _mm_setr_epi8(1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1));
+	__m128i s2 = _mm_shuffle_epi8(
+	    rgb, _mm_setr_epi8(2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2));
+	// 32 pixels = 96 bytes = lanes in phase order 0,1,2,0,1,2.
+	__m256i v0 = _mm256_setr_m128i(s0, s1);
+	__m256i v1 = _mm256_setr_m128i(s2, s0);
+	__m256i v2 = _mm256_setr_m128i(s1, s2);
+
+	unsigned char *bytes = reinterpret_cast<unsigned char *>(p);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		_mm256_storeu_si256((__m256i *)(bytes + 3 * i), v0);
+		_mm256_storeu_si256((__m256i *)(bytes + 3 * i + 32), v1);
+		_mm256_storeu_si256((__m256i *)(bytes + 3 * i + 64), v2);
+	}
+	fill_sse2(p + i, n - i, color);
+}
+
+// High halves of the eight 32x32-bit products a * m.
+__attribute__((target("avx2"))) __m256i mulhi_epu32_avx2(__m256i a,
+                                                         __m256i m)
+{
+	__m256i even = _mm256_srli_epi64(_mm256_mul_epu32(a, m), 32);
+	__m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+	return _mm256_blend_epi32(even, odd, 0xAA);
+}
+
+__attribute__((target("avx2"))) void random_avx2(unsigned char *p, size_t n,
+                                                 uint64_t key,
+                                                 uint64_t stream)
+{
+	// Eight Philox blocks at once, one per 32-bit lane: lane j of x0..x3
+	// holds the four words of block index + j.
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i mul0 = _mm256_set1_epi32((int)philox::kMul0);
+	const __m256i mul1 = _mm256_set1_epi32((int)philox::kMul1);
+	uint32_t index = 0;
+	size_t i = 0;
+	for (; i + 128 <= n; i += 128, index += 8)
+	{
+		__m256i x0 = _mm256_add_epi32(_mm256_set1_epi32((int)index), lanes);
+		__m256i x1 = _mm256_set1_epi32((int)(uint32_t)stream);
+		__m256i x2 = _mm256_set1_epi32((int)(uint32_t)(stream >> 32));
+		__m256i x3 = _mm256_setzero_si256();
+		uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+		for (int round = 0; round < philox::kRounds; ++round)
+		{
+			__m256i lo0 = _mm256_mullo_epi32(x0, mul0);
+			__m256i hi0 = mulhi_epu32_avx2(x0, mul0);
+			__m256i lo1 = _mm256_mullo_epi32(x2, mul1);
+			__m256i hi1 = mulhi_epu32_avx2(x2, mul1);
+			x0 = _mm256_xor_si256(_mm256_xor_si256(hi1, x1),
+			                      _mm256_set1_epi32((int)k0));
+			x1 = lo1;
+			x2 = _mm256_xor_si256(_mm256_xor_si256(hi0, x3),
+			                      _mm256_set1_epi32((int)k1));
+			x3 = lo0;
+			k0 += philox::kWeyl0;
+			k1 += philox::kWeyl1;
+		}
+		// Transpose to block order: u0 holds blocks 0 and 4, u1 1 and 5,
+		// u2 2 and 6, u3 3 and 7.
+		__m256i t0 = _mm256_unpacklo_epi32(x0, x1);
+		__m256i t1 = _mm256_unpackhi_epi32(x0, x1);
+		__m256i t2 = _mm256_unpacklo_epi32(x2, x3);
+		__m256i t3 = _mm256_unpackhi_epi32(x2, x3);
+		__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+		__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+		__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+		__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+		__m256i *out = (__m256i *)(p + i);
+		_mm256_storeu_si256(out, _mm256_permute2x128_si256(u0, u1, 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(u2, u3, 0x20));
+		_mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(u0, u1, 0x31));
+		_mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(u2, u3, 0x31));
+	}
+	random_scalar(p + i, n - i, key, stream, index);
+}
+#endif
+} // namespace
+
+void add_saturate_bytes(unsigned char *p, size_t n, int value)
+{
+	value = std::max(-255, std::min(255, value));
+	if (value == 0)
+		return;
+#ifdef PIXEL_HAVE_X86
+	SimdLevel level = active_simd_level();
+	if (level >= SimdLevel::AVX2)
+		return add_avx2(p, n, value);
+	if (level >= SimdLevel::SSE2)
+		return add_sse2(p, n, value);
+#endif
+	add_scalar(p, n, value);
+}
+
+void scale_saturate_bytes(unsigned char *p, size_t n, double multiplier)
+{
+	FixedMultiplier m = to_fixed(multiplier);
+#ifdef PIXEL_HAVE_X86
+	SimdLevel level = active_simd_level();
+	if (level >= SimdLevel::AVX2)
+		return scale_avx2(p, n, m);
+	if (level >= SimdLevel::SSE2)
+		return scale_sse2(p, n, m);
+#endif
+	scale_scalar(p, n, m);
+}
+
+void fill_rgb(RGB_uc *p, size_t n, const RGB_uc &color)
+{
+#ifdef PIXEL_HAVE_X86
+	SimdLevel level = active_simd_level();
+	if (level >= SimdLevel::AVX2)
+		return fill_avx2(p, n, color);
+	if (level >= SimdLevel::SSE2)
+		return fill_sse2(p, n, color);
+#endif
+	fill_scalar(p, n, color);
+}
+
+void deinterleave_rgb(const RGB_uc *src, unsigned char *r, unsigned char *g,
+                      unsigned char *b, size_t n)
+{
+#ifdef PIXEL_HAVE_X86
+	if (active_simd_level() >= SimdLevel::SSSE3)
+		return deinterleave_ssse3(src, r, g, b, n);
+#endif
+	deinterleave_scalar(src, r, g, b, n);
+}
+
+void interleave_rgb(const unsigned char *r, const unsigned char *g,
+                    const unsigned char *b, RGB_uc *dst, size_t n)
+{
+#ifdef PIXEL_HAVE_X86
+	if (active_simd_level() >= SimdLevel::SSSE3)
+		return interleave_ssse3(r, g, b, dst, n);
+#endif
+	interleave_scalar(r, g, b, dst, n);
+}
+
+void random_bytes(unsigned char *p, size_t n, uint64_t key, uint64_t stream)
+{
+#ifdef PIXEL_HAVE_X86
+	if (active_simd_level() >= SimdLevel::AVX2)
+		return random_avx2(p, n, key, stream);
+#endif
+	random_scalar(p, n, key, stream, 0);
+}
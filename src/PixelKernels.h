@@ -0,0 +1,33 @@
+#ifndef PIXEL_KERNELS_H
+#define PIXEL_KERNELS_H
+
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+
+// Span kernels behind VectorImage's region operations. Each dispatches to
+// AVX2, SSE2 or scalar code according to active_simd_level(); all paths
+// produce identical results.
+
+// p[i] = saturate(p[i] + value) for `n` channel bytes.
+void add_saturate_bytes(unsigned char *p, size_t n, int value);
+
+// p[i] = saturate(p[i] * multiplier) for `n` channel bytes, computed in
+// Q16 fixed point (within 1 of the exact product, truncated).
+void scale_saturate_bytes(unsigned char *p, size_t n, double multiplier);
+
+// Sets `n` interleaved pixels to `color`.
+void fill_rgb(RGB_uc *p, size_t n, const RGB_uc &color);
+
+// Splits `n` interleaved pixels into three channel planes, and back.
+void deinterleave_rgb(const RGB_uc *src, unsigned char *r, unsigned char *g,
+                      unsigned char *b, size_t n);
+void interleave_rgb(const unsigned char *r, const unsigned char *g,
+                    const unsigned char *b, RGB_uc *dst, size_t n);
+
+// Fills `n` bytes with Philox4x32-10 stream `stream` under `key`: bytes
+// [16i, 16i + 16) are block i (see Philox.h), words little-endian. Only
+// AVX2 and scalar paths; the generator needs 32-bit multiplies.
+void random_bytes(unsigned char *p, size_t n, uint64_t key, uint64_t stream);
+
+#endif // PIXEL_KERNELS_H
@@ -0,0 +1,262 @@
+#include "Protocol.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace protocol
+{
+namespace
+{
+std::runtime_error socket_error(const std::string &what)
+{
+	return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Returns false if the peer closed the connection before any byte.
+bool read_all(int fd, unsigned char *p, size_t n)
+{
+	size_t got = 0;
+	while (got < n)
+	{
+		ssize_t r = ::read(fd, p + got, n - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			throw socket_error("socket read");
+		if (r == 0)
+		{
+			if (got == 0)
+				return false;
+			throw std::runtime_error("connection closed mid-frame");
+		}
+		got += (size_t)r;
+	}
+	return true;
+}
+
+void send_all(int fd, const unsigned char *p, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0)
+			throw socket_error("socket write");
+		p += w;
+		n -= (size_t)w;
+	}
+}
+
+sockaddr_un unix_address(const std::string &path)
+{
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("socket path too long: " + path);
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return addr;
+}
+} // namespace
+
+Encoder &Encoder::u8(uint8_t v)
+{
+	buf.push_back(v);
+	return *this;
+}
+
+Encoder &Encoder::u16(uint16_t v)
+{
+	buf.push_back((unsigned char)v);
+	buf.push_back((unsigned char)(v >> 8));
+	return *this;
+}
+
+Encoder &Encoder::u32(uint32_t v)
+{
+	for (int i = 0; i < 4; ++i)
+		buf.push_back((unsigned char)(v >> (8 * i)));
+	return *this;
+}
+
+Encoder &Encoder::u64(uint64_t v)
+{
+	for (int i = 0; i < 8; ++i)
+		buf.push_back((unsigned char)(v >> (8 * i)));
+	return *this;
+}
+
+Encoder &Encoder::f64(double v)
+{
+	uint64_t bits;
+	std::memcpy(&bits, &v, sizeof(bits));
+	return u64(bits);
+}
+
+Encoder &Encoder::name(const std::string &s)
+{
+	if (s.size() > 255)
+		throw std::invalid_argument("image name longer than 255 bytes");
+	u8((uint8_t)s.size());
+	return bytes(s.data(), s.size());
+}
+
+Encoder &Encoder::str(const std::string &s)
+{
+	if (s.size() > 65535)
+		throw std::invalid_argument("string longer than 65535 bytes");
+	u16((uint16_t)s.size());
+	return bytes(s.data(), s.size());
+}
+
+Encoder &Encoder::bytes(const void *data, size_t n)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+	buf.insert(buf.end(), p, p + n);
+	return *this;
+}
+
+void Decoder::need(size_t n)
+{
+	if ((size_t)(end - p) < n)
+		throw std::runtime_error("truncated message");
+}
+
+uint8_t Decoder::u8()
+{
+	need(1);
+	return *p++;
+}
+
+uint16_t Decoder::u16()
+{
+	need(2);
+	uint16_t v = (uint16_t)(p[0] | (p[1] << 8));
+	p += 2;
+	return v;
+}
+
+uint32_t Decoder::u32()
+{
+	need(4);
+	uint32_t v = 0;
+	for (int i = 0; i < 4; ++i)
+		v |= (uint32_t)p[i] << (8 * i);
+	p += 4;
+	return v;
+}
+
+uint64_t Decoder::u64()
+{
+	need(8);
+	uint64_t v = 0;
+	for (int i = 0; i < 8; ++i)
+		v |= (uint64_t)p[i] << (8 * i);
+	p += 8;
+	return v;
+}
+
+double Decoder::f64()
+{
+	uint64_t bits = u64();
+	double v;
+	std::memcpy(&v, &bits, sizeof(v));
+	return v;
+}
+
+std::string Decoder::name()
+{
+	size_t n = u8();
+	const unsigned char *s = bytes(n);
+	return std::string(reinterpret_cast<const char *>(s), n);
+}
+
+std::string Decoder::str()
+{
+	size_t n = u16();
+	const unsigned char *s = bytes(n);
+	return std::string(reinterpret_cast<const char *>(s), n);
+}
+
+const unsigned char *Decoder::bytes(size_t n)
+{
+	need(n);
+	const unsigned char *start = p;
+	p += n;
+	return start;
+}
+
+bool read_frame(int fd, std::vector<unsigned char> &payload)
+{
+	unsigned char header[4];
+	if (!read_all(fd, header, 4))
+		return false;
+	uint32_t n = Decoder(header, 4).u32();
+	if (n > kMaxFrame)
+		throw std::runtime_error("frame of " + std::to_string(n) +
+		                         " bytes exceeds the limit");
+	payload.resize(n);
+	if (n > 0 && !read_all(fd, payload.data(), n))
+		throw std::runtime_error("connection closed mid-frame");
+	return true;
+}
+
+void write_frame(int fd, const std::vector<unsigned char> &payload)
+{
+	unsigned char frame[4 + 4096];
+	for (int i = 0; i < 4; ++i)
+		frame[i] = (unsigned char)(payload.size() >> (8 * i));
+	// Small frames go out in one send, so a request or response costs a
+	// single syscall each way.
+	if (payload.size() <= sizeof(frame) - 4)
+	{
+		if (!payload.empty())
+			std::memcpy(frame + 4, payload.data(), payload.size());
+		send_all(fd, frame, 4 + payload.size());
+		return;
+	}
+	send_all(fd, frame, 4);
+	send_all(fd, payload.data(), payload.size());
+}
+
+int listen_unix(const std::string &path)
+{
+	sockaddr_un addr = unix_address(path);
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw socket_error("socket");
+	// A stale socket from an earlier run is replaced; any other file at
+	// the path is left alone and bind() reports it.
+	struct stat info;
+	if (::lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+		::unlink(path.c_str());
+	if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+	    ::listen(fd, 64) < 0)
+	{
+		std::runtime_error error = socket_error("cannot listen on " + path);
+		::close(fd);
+		throw error;
+	}
+	return fd;
+}
+
+int connect_unix(const std::string &path)
+{
+	sockaddr_un addr = unix_address(path);
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw socket_error("socket");
+	if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+	{
+		std::runtime_error error = socket_error("cannot connect to " + path);
+		::close(fd);
+		throw error;
+	}
+	return fd;
+}
+} // namespace protocol
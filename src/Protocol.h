@@ -0,0 +1,104 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Wire format shared by image_server and its clients. Every message is a
+// frame: a little-endian u32 payload length, then the payload. A request
+// payload is an Opcode byte, the image name (u8 length + bytes) and the
+// opcode's arguments; a response payload is a Status byte followed by the
+// result, or by an error message. Responses come back in request order, so
+// clients may pipeline.
+//
+//   Create      u32 width, u32 height, u32 seed  (replaces an existing image)
+//   Load        str path
+//   Save        str path
+//   Drop        -
+//   Fill        rect, u8 r, u8 g, u8 b
+//   Brightness  rect, i32 value
+//   Contrast    rect, f64 multiplier
+//   Query       rect                  -> f64 r, f64 g, f64 b (average)
+//   Export      rect                  -> u32 width, u32 height, RGB bytes
+//   Stats       -                     -> u32 width, u32 height, u64
+//                                        updates, batches, queries
+//
+// A rect is four i32: r1, c1, r2, c2 (inclusive). Strings are u16 length +
+// bytes, except the u8-length image name.
+namespace protocol
+{
+enum class Opcode : uint8_t
+{
+	Create = 1,
+	Load,
+	Save,
+	Drop,
+	Fill,
+	Brightness,
+	Contrast,
+	Query,
+	Export,
+	Stats
+};
+
+enum class Status : uint8_t
+{
+	Ok = 0,
+	Error = 1
+};
+
+const uint32_t kMaxFrame = 256u << 20;
+
+// Appends little-endian fields to a payload.
+class Encoder
+{
+  public:
+	Encoder &u8(uint8_t v);
+	Encoder &u16(uint16_t v);
+	Encoder &u32(uint32_t v);
+	Encoder &u64(uint64_t v);
+	Encoder &i32(int32_t v) { return u32((uint32_t)v); }
+	Encoder &f64(double v);
+	Encoder &name(const std::string &s); // u8 length
+	Encoder &str(const std::string &s);  // u16 length
+	Encoder &bytes(const void *data, size_t n);
+
+	std::vector<unsigned char> &payload() { return buf; }
+
+  private:
+	std::vector<unsigned char> buf;
+};
+
+// Reads fields back; throws std::runtime_error when the payload is short.
+class Decoder
+{
+  public:
+	Decoder(const unsigned char *data, size_t n) : p(data), end(data + n) {}
+
+	uint8_t u8();
+	uint16_t u16();
+	uint32_t u32();
+	uint64_t u64();
+	int32_t i32() { return (int32_t)u32(); }
+	double f64();
+	std::string name();
+	std::string str();
+	const unsigned char *bytes(size_t n);
+	bool done() const { return p == end; }
+
+  private:
+	const unsigned char *p, *end;
+	void need(size_t n);
+};
+
+// Blocking frame I/O on a stream socket. read_frame returns false on a
+// clean end of stream; both throw std::runtime_error on errors.
+bool read_frame(int fd, std::vector<unsigned char> &payload);
+void write_frame(int fd, const std::vector<unsigned char> &payload);
+
+int listen_unix(const std::string &path);
+int connect_unix(const std::string &path);
+} // namespace protocol
+
+#endif // PROTOCOL_H
@@ -0,0 +1,317 @@
+#include "ScriptRunner.h"
+#include "Engine.h"
+#include "HistogramTree.h"
+#include "ImageIO.h"
+#include "Json.h"
+#include "SyntheticImage.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+void check_engine_name(const std::string &name)
+{
+	std::vector<std::string> names = engine_names();
+	if (std::find(names.begin(), names.end(), name) == names.end())
+		throw std::invalid_argument("unknown engine \"" + name + "\"");
+}
+
+class Script
+{
+  public:
+	explicit Script(const std::string &engine_name) : engine_name(engine_name)
+	{
+		check_engine_name(engine_name);
+	}
+
+	// Runs one command; query results go to `result` as JSON members.
+	void execute(std::istringstream &args, const std::string &command,
+	             std::ostream &result);
+
+  private:
+	std::string engine_name;
+	std::unique_ptr<ImageEngine> engine;
+
+	ImageEngine &current();
+	void replace_engine(
+	    const std::function<std::unique_ptr<ImageEngine>()> &build);
+	HistogramTree &histogram_engine(const std::string &command);
+	void read_rect(std::istringstream &args, int &r1, int &c1, int &r2,
+	               int &c2);
+};
+
+template <typename T> T read_arg(std::istringstream &args, const char *what)
+{
+	T value;
+	if (!(args >> value))
+		throw std::invalid_argument(std::string("expected ") + what);
+	return value;
+}
+
+ImageEngine &Script::current()
+{
+	if (!engine)
+		throw std::runtime_error("no image; use new or load first");
+	return *engine;
+}
+
+// The old image's share leaves the memory budget while its replacement is
+// built, and comes back if building throws, leaving the old image in place.
+void Script::replace_engine(
+    const std::function<std::unique_ptr<ImageEngine>()> &build)
+{
+	MemoryBudget::Reservation share;
+	if (engine)
+		share = engine->release_budget();
+	size_t bytes = share.bytes();
+	share.resize(0);
+	try
+	{
+		engine = build();
+	}
+	catch (...)
+	{
+		if (engine)
+		{
+			share.resize(bytes);
+			engine->hold(std::move(share));
+		}
+		throw;
+	}
+}
+
+HistogramTree &Script::histogram_engine(const std::string &command)
+{
+	auto *tree = dynamic_cast<HistogramTree *>(&current());
+	if (!tree)
+		throw std::invalid_argument(command + " needs --engine histogram");
+	return *tree;
+}
+
+void Script::read_rect(std::istringstream &args, int &r1, int &c1, int &r2,
+                       int &c2)
+{
+	r1 = read_arg<int>(args, "r1");
+	c1 = read_arg<int>(args, "c1");
+	r2 = read_arg<int>(args, "r2");
+	c2 = read_arg<int>(args, "c2");
+	ImageEngine &e = current();
+	if (r1 < 0 || c1 < 0 || r2 >= e.get_height() || c2 >= e.get_width() ||
+	    r1 > r2 || c1 > c2)
+		throw std::out_of_range("rectangle outside the " +
+		                        std::to_string(e.get_width()) + "x" +
+		                        std::to_string(e.get_height()) + " image");
+}
+
+void Script::execute(std::istringstream &args, const std::string &command,
+                     std::ostream &result)
+{
+	int r1, c1, r2, c2;
+	if (command == "new")
+	{
+		int w = read_arg<int>(args, "width"), h = read_arg<int>(args, "height");
+		if (w <= 0 || h <= 0)
+			throw std::invalid_argument("size must be positive");
+		Image image(w, h);
+		std::string content;
+		if ((args >> std::ws).eof())
+			image.generate_random();
+		else
+		{
+			unsigned seed = read_arg<unsigned>(args, "seed");
+			if (args >> content)
+				generate_content(image, parse_content(content), seed);
+			else
+				image.generate_random(seed);
+		}
+		replace_engine([&] { return make_engine(engine_name, image); });
+	}
+	else if (command == "load")
+	{
+		std::string path = read_arg<std::string>(args, "path");
+		replace_engine([&]() -> std::unique_ptr<ImageEngine> {
+			// The tree decodes straight from the file, without a full
+			// image, when it fits the budget; otherwise make_engine()
+			// decides.
+			std::unique_ptr<ImageReader> reader;
+			MemoryBudget::Reservation held;
+			if (engine_name == "tree")
+			{
+				reader = open_image(path);
+				held = MemoryBudget::instance().try_reserve(
+				    SegmentTree::footprint_for(reader->get_width(),
+				                               reader->get_height()));
+			}
+			if (!held)
+				return make_engine(engine_name, load_image(path));
+			auto tree = std::make_unique<EngineAdapter<SegmentTree>>(
+			    "SegmentTree", load_segment_tree(*reader));
+			held.resize(tree->memory_footprint());
+			tree->hold(std::move(held));
+			return tree;
+		});
+	}
+	else if (command == "save")
+	{
+		std::string path = read_arg<std::string>(args, "path");
+		save_image(current().get_image(), path);
+	}
+	else if (command == "engine")
+	{
+		std::string name = read_arg<std::string>(args, "engine name");
+		check_engine_name(name);
+		if (engine)
+			replace_engine(
+			    [&] { return make_engine(name, engine->get_image()); });
+		engine_name = name;
+	}
+	else if (command == "brightness")
+	{
+		read_rect(args, r1, c1, r2, c2);
+		engine->adjust_brightness(r1, c1, r2, c2,
+		                          read_arg<int>(args, "value"));
+	}
+	else if (command == "contrast")
+	{
+		read_rect(args, r1, c1, r2, c2);
+		engine->adjust_contrast(r1, c1, r2, c2,
+		                        read_arg<double>(args, "multiplier"));
+	}
+	else if (command == "fill")
+	{
+		read_rect(args, r1, c1, r2, c2);
+		int r = read_arg<int>(args, "R"), g = read_arg<int>(args, "G"),
+		    b = read_arg<int>(args, "B");
+		engine->fill_region(
+		    r1, c1, r2, c2,
+		    {(unsigned char)r, (unsigned char)g, (unsigned char)b});
+	}
+	else if (command == "query")
+	{
+		read_rect(args, r1, c1, r2, c2);
+		RGB_d avg = engine->query_average_color(r1, c1, r2, c2);
+		result << ", \"avg\": [" << avg.r << ", " << avg.g << ", " << avg.b
+		       << "]";
+	}
+	else if (command == "histogram")
+	{
+		read_rect(args, r1, c1, r2, c2);
+		Histogram h = engine->query_histogram(r1, c1, r2, c2);
+		result << ", \"pixels\": " << h.pixels << ", \"hist\": [";
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			result << (ch ? ", [" : "[");
+			for (int v = 0; v < 256; ++v)
+				result << (v ? ", " : "") << h.counts[ch][v];
+			result << "]";
+		}
+		result << "]";
+	}
+	else if (command == "percentile")
+	{
+		read_rect(args, r1, c1, r2, c2);
+		double fraction = read_arg<double>(args, "fraction");
+		if (!(fraction >= 0 && fraction <= 1))
+			throw std::invalid_argument("fraction must be in [0, 1]");
+		RGB_uc p = engine->query_histogram(r1, c1, r2, c2).percentile(fraction);
+		result << ", \"value\": [" << (int)p.r << ", " << (int)p.g << ", "
+		       << (int)p.b << "]";
+	}
+	else if (command == "levels")
+	{
+		HistogramTree &tree = histogram_engine(command);
+		read_rect(args, r1, c1, r2, c2);
+		double low = 0.01, high = 0.99;
+		if (args >> low)
+			high = read_arg<double>(args, "high");
+		if (!(0 <= low && low < high && high <= 1))
+			throw std::invalid_argument("need 0 <= low < high <= 1");
+		tree.auto_levels(r1, c1, r2, c2, low, high);
+	}
+	else if (command == "equalize")
+	{
+		HistogramTree &tree = histogram_engine(command);
+		read_rect(args, r1, c1, r2, c2);
+		tree.equalize(r1, c1, r2, c2);
+	}
+	else if (command == "memory")
+	{
+		ImageEngine &e = current();
+		size_t bytes = e.memory_footprint();
+		const MemoryBudget &budget = MemoryBudget::instance();
+		result << ", \"engine\": " << json_string(e.name())
+		       << ", \"bytes\": " << bytes << ", \"bytes_per_pixel\": "
+		       << (double)bytes / ((double)e.get_width() * e.get_height())
+		       << ", \"budget_used\": " << budget.get_used();
+		if (budget.get_limit() != MemoryBudget::kUnlimited)
+			result << ", \"budget_limit\": " << budget.get_limit();
+	}
+	else
+		throw std::invalid_argument("unknown command \"" + command + "\"");
+
+	std::string extra;
+	if (args >> extra)
+		throw std::invalid_argument("unexpected argument \"" + extra + "\"");
+}
+} // namespace
+
+int run_script(std::istream &in, std::ostream &out, const std::string &engine)
+{
+	Script script(engine);
+	std::string line;
+	int line_no = 0, commands = 0, errors = 0;
+	auto run_start = std::chrono::steady_clock::now();
+	while (std::getline(in, line))
+	{
+		++line_no;
+		std::istringstream args(line);
+		std::string command;
+		if (!(args >> command) || command[0] == '#')
+			continue;
+		++commands;
+
+		std::ostringstream result;
+		std::string error;
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			script.execute(args, command, result);
+		}
+		catch (const std::exception &e)
+		{
+			error = e.what();
+		}
+		auto end = std::chrono::steady_clock::now();
+		double us = std::chrono::duration<double, std::micro>(end - start)
+		                .count();
+
+		out << "{\"line\": " << line_no << ", \"op\": " << json_string(command)
+		    << ", \"ok\": " << (error.empty() ? "true" : "false")
+		    << ", \"us\": " << us;
+		if (error.empty())
+			out << result.str();
+		else
+		{
+			++errors;
+			out << ", \"error\": " << json_string(error);
+		}
+		// Flushed per command, so a reader piping the output sees each
+		// result as it happens.
+		out << "}\n" << std::flush;
+	}
+
+	double total_ms = std::chrono::duration<double, std::milli>(
+	                      std::chrono::steady_clock::now() - run_start)
+	                      .count();
+	out << "{\"summary\": true, \"commands\": " << commands
+	    << ", \"errors\": " << errors << ", \"total_ms\": " << total_ms
+	    << ", \"commands_per_s\": "
+	    << (total_ms > 0 ? commands / (total_ms / 1e3) : 0.0) << "}\n";
+	out.flush();
+	return errors;
+}
@@ -0,0 +1,45 @@
+#ifndef SCRIPT_RUNNER_H
+#define SCRIPT_RUNNER_H
+
+#include <iosfwd>
+#include <string>
+
+// Headless batch mode for image_app. Reads one command per line:
+//
+//   new W H [SEED [CONTENT]]   random image (seeded when SEED is given);
+//                              CONTENT is noise (default), gradient, flat
+//                              or photo, see SyntheticImage.h
+//   load PATH                  PNG or PPM
+//   save PATH                  PNG for .png paths, otherwise binary PPM
+//   engine NAME                rebuilds the current image in that engine
+//                              (vector, tree, tiled, deferred or
+//                              histogram)
+//   brightness R1 C1 R2 C2 VALUE
+//   contrast R1 C1 R2 C2 MULTIPLIER
+//   fill R1 C1 R2 C2 R G B
+//   query R1 C1 R2 C2
+//   histogram R1 C1 R2 C2      256 counts per channel
+//   percentile R1 C1 R2 C2 FRACTION
+//                              per channel, e.g. 0.5 for the median
+//   levels R1 C1 R2 C2 [LOW HIGH]
+//                              auto-levels between two percentiles
+//                              (default 0.01 and 0.99); histogram engine
+//   equalize R1 C1 R2 C2       histogram equalisation; histogram engine
+//   memory                     the engine's footprint in bytes and per
+//                              pixel, and the MemoryBudget in use
+//
+// new, load and engine build through make_engine(), so a MemoryBudget
+// limit can refuse them or substitute a cheaper engine. The image they
+// replace stays in place when they fail.
+//
+// Blank lines and lines starting with '#' are skipped. Every command writes
+// one JSON object line to `out` with its input line number, status and
+// time in microseconds ("avg", "hist" or "value" for queries, "error" on
+// failure). A final
+// line summarises the run. A failed command does not stop the script.
+// Returns the number of failed commands; throws std::invalid_argument for
+// an unknown engine.
+int run_script(std::istream &in, std::ostream &out,
+               const std::string &engine = "tree");
+
+#endif // SCRIPT_RUNNER_H
@@ -1,71 +1,342 @@
 #include "SegmentTree.h"
+#include "Convolution.h"
 #include "types.h"
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
 #include <stack>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <type_traits>
+#include <unistd.h>
+
+// Instrumentation hook for the update and query paths; expands to nothing
+// unless PNGTREE_STATS is defined.
+#ifdef PNGTREE_STATS
+#define TREE_STAT(statement) statement
+#else
+#define TREE_STAT(statement) \
+	do                        \
+	{                         \
+	} while (0)
+#endif
+
+namespace
+{
+// On-disk snapshot: this header, then the node array exactly as laid out
+// in memory. Bump the version whenever Node or the tree shape changes.
+const char kSnapshotMagic[8] = {'P', 'N', 'G', 'T', 'R', 'E', 'E', 'S'};
+const uint32_t kSnapshotVersion = 2;
+const uint32_t kByteOrderMark = 0x01020304;
+
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t node_size;
+	int32_t rows, cols;
+	uint32_t reserved;
+	uint64_t node_count;
+	uint64_t checksum;
+	uint64_t padding[2]; // keeps the nodes 64-byte aligned in the mapping
+};
+static_assert(sizeof(SnapshotHeader) == 64, "snapshot header layout");
+
+uint64_t checksum_bytes(const unsigned char *data, size_t n)
+{
+	// Word-at-a-time FNV-style mix: cheap enough to run over gigabytes.
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, data + i, 8);
+		h = (h ^ word) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	for (; i < n; ++i)
+		h = (h ^ data[i]) * 0x100000001b3ull;
+	return h;
+}
+
+void write_all(int fd, const void *data, size_t n, const std::string &path)
+{
+	const char *p = static_cast<const char *>(data);
+	while (n > 0)
+	{
+		ssize_t written = ::write(fd, p, n);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			throw std::runtime_error("error writing " + path + ": " +
+			                         std::strerror(errno));
+		p += written;
+		n -= (size_t)written;
+	}
+}
+} // namespace
 
 SegmentTree::SegmentTree(const Image &image)
 {
 	rows = image.get_height();
 	cols = image.get_width();
-	tree.resize(4 * rows * cols);
-	build(1, 0, 0, rows - 1, cols - 1, image);
+	std::vector<int> starts = level_starts(rows, cols);
+	tree.resize(starts.back());
+	build(0, 0, 0, rows - 1, cols - 1, image, 0, 0, starts.data() + 1);
+}
+
+SegmentTree::SegmentTree(int width, int height, const RowSource &source)
+{
+	rebuild(width, height, source);
+}
+
+void SegmentTree::rebuild(int width, int height, const RowSource &source)
+{
+	rows = height;
+	cols = width;
+	std::vector<int> starts = level_starts(rows, cols);
+	tree.resize(starts.back());
+	link(0, 0, 0, rows - 1, cols - 1, starts.data() + 1);
+
+	std::vector<RGB_uc> pixels(cols);
+	for (int r = 0; r < rows; ++r)
+	{
+		source(r, pixels.data());
+		for (int c = 0; c < cols; ++c)
+		{
+			const RGB_uc &p = pixels[c];
+			int leaf = leaf_index(r, c);
+			clear_node(leaf);
+			tree[leaf].sum = {(double)p.r, (double)p.g, (double)p.b};
+		}
+	}
+	sum_children(0, 0, 0, rows - 1, cols - 1);
+}
+
+std::vector<int> SegmentTree::level_starts(int rows, int cols)
+{
+	// Midpoint splits leave only a few distinct rectangle shapes on each
+	// level, so the levels are counted shape by shape.
+	std::vector<int> starts = {0};
+	std::map<std::pair<int, int>, size_t> level;
+	if (rows > 0 && cols > 0)
+		level[{rows, cols}] = 1;
+	size_t total = 0;
+	while (!level.empty())
+	{
+		std::map<std::pair<int, int>, size_t> below;
+		for (const auto &shape : level)
+		{
+			total += shape.second;
+			int h = shape.first.first, w = shape.first.second;
+			if (h == 1 && w == 1)
+				continue;
+			for (int child_h : {(h + 1) / 2, h / 2})
+				for (int child_w : {(w + 1) / 2, w / 2})
+					if (child_h > 0 && child_w > 0)
+						below[{child_h, child_w}] += shape.second;
+		}
+		if (total > INT_MAX)
+			throw std::invalid_argument(
+			    "image of " + std::to_string(cols) + "x" +
+			    std::to_string(rows) + " is too large for a SegmentTree");
+		starts.push_back((int)total);
+		level.swap(below);
+	}
+	return starts;
+}
+
+size_t SegmentTree::tree_size(int rows, int cols)
+{
+	return level_starts(rows, cols).back();
+}
+
+void SegmentTree::link(int node_idx, int start_r, int start_c, int end_r,
+                       int end_c, int *next)
+{
+	if (start_r > end_r || start_c > end_c)
+		return;
+	if (start_r == end_r && start_c == end_c)
+	{
+		tree[node_idx].first_child = 0;
+		return;
+	}
+
+	bool right = start_c < end_c, bottom = start_r < end_r;
+	tree[node_idx].first_child = *next;
+	*next += 1 + right + bottom + (right && bottom);
+
+	int mid_r = start_r + (end_r - start_r) / 2;
+	int mid_c = start_c + (end_c - start_c) / 2;
+
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	link(child[0], start_r, start_c, mid_r, mid_c, next + 1);
+	link(child[1], start_r, mid_c + 1, mid_r, end_c, next + 1);
+	link(child[2], mid_r + 1, start_c, end_r, mid_c, next + 1);
+	link(child[3], mid_r + 1, mid_c + 1, end_r, end_c, next + 1);
+}
+
+void SegmentTree::clear_node(int node_idx)
+{
+	Node &node = tree[node_idx];
+	int32_t first_child = node.first_child;
+	node = Node();
+	node.first_child = first_child;
+}
+
+void SegmentTree::children(int node_idx, int start_r, int start_c, int end_r,
+                           int end_c, int child[4]) const
+{
+	int first = tree[node_idx].first_child;
+	bool right = start_c < end_c, bottom = start_r < end_r;
+	child[0] = first;
+	child[1] = right ? first + 1 : -1;
+	child[2] = bottom ? first + 1 + right : -1;
+	child[3] = right && bottom ? first + 3 : -1;
+}
+
+void SegmentTree::pull(int node_idx, const int child[4])
+{
+	Node &node = tree[node_idx];
+	node.sum = {0, 0, 0};
+	for (int k = 0; k < 4; ++k)
+		if (child[k] >= 0)
+			node.sum += tree[child[k]].sum;
+}
+
+int SegmentTree::leaf_index(int r, int c) const
+{
+	int node_idx = 0;
+	int start_r = 0, start_c = 0, end_r = rows - 1, end_c = cols - 1;
+	while (start_r < end_r || start_c < end_c)
+	{
+		int child[4];
+		children(node_idx, start_r, start_c, end_r, end_c, child);
+		int mid_r = start_r + (end_r - start_r) / 2;
+		int mid_c = start_c + (end_c - start_c) / 2;
+		int k = 0;
+		if (r > mid_r)
+		{
+			k += 2;
+			start_r = mid_r + 1;
+		}
+		else
+			end_r = mid_r;
+		if (c > mid_c)
+		{
+			k += 1;
+			start_c = mid_c + 1;
+		}
+		else
+			end_c = mid_c;
+		node_idx = child[k];
+	}
+	return node_idx;
+}
+
+void SegmentTree::sum_children(int node_idx, int start_r, int start_c,
+                               int end_r, int end_c)
+{
+	if (start_r > end_r || start_c > end_c)
+		return;
+	if (start_r == end_r && start_c == end_c)
+		return;
+
+	int mid_r = start_r + (end_r - start_r) / 2;
+	int mid_c = start_c + (end_c - start_c) / 2;
+
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	sum_children(child[0], start_r, start_c, mid_r, mid_c);
+	sum_children(child[1], start_r, mid_c + 1, mid_r, end_c);
+	sum_children(child[2], mid_r + 1, start_c, end_r, mid_c);
+	sum_children(child[3], mid_r + 1, mid_c + 1, end_r, end_c);
+
+	clear_node(node_idx);
+	pull(node_idx, child);
+}
+
+size_t SegmentTree::memory_footprint() const
+{
+	return sizeof(SegmentTree) + tree.bytes_held();
+}
+
+size_t SegmentTree::footprint_for(int width, int height)
+{
+	return sizeof(SegmentTree) +
+	       PooledArray<Node>::bytes_for(tree_size(height, width));
 }
 
 void SegmentTree::build(int node_idx, int start_r, int start_c, int end_r,
-                        int end_c, const Image &image)
+                        int end_c, const Image &image, int origin_r,
+                        int origin_c, int *next)
 {
 	if (start_r > end_r || start_c > end_c)
 		return;
 
+	clear_node(node_idx);
 	if (start_r == end_r && start_c == end_c)
 	{
-		RGB_uc p = image.get_pixel(start_r, start_c);
+		RGB_uc p = image.get_pixel(start_r - origin_r, start_c - origin_c);
 		tree[node_idx].sum = {(double)p.r, (double)p.g, (double)p.b};
+		if (next)
+			tree[node_idx].first_child = 0;
 		return;
 	}
 
+	if (next)
+	{
+		bool right = start_c < end_c, bottom = start_r < end_r;
+		tree[node_idx].first_child = *next;
+		*next += 1 + right + bottom + (right && bottom);
+		++next;
+	}
+
 	int mid_r = start_r + (end_r - start_r) / 2;
 	int mid_c = start_c + (end_c - start_c) / 2;
 
-	int child_base = node_idx * 4;
-	build(child_base - 2, start_r, start_c, mid_r, mid_c, image);
-	build(child_base - 1, start_r, mid_c + 1, mid_r, end_c, image);
-	build(child_base + 0, mid_r + 1, start_c, end_r, mid_c, image);
-	build(child_base + 1, mid_r + 1, mid_c + 1, end_r, end_c, image);
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	build(child[0], start_r, start_c, mid_r, mid_c, image, origin_r,
+	      origin_c, next);
+	build(child[1], start_r, mid_c + 1, mid_r, end_c, image, origin_r,
+	      origin_c, next);
+	build(child[2], mid_r + 1, start_c, end_r, mid_c, image, origin_r,
+	      origin_c, next);
+	build(child[3], mid_r + 1, mid_c + 1, end_r, end_c, image, origin_r,
+	      origin_c, next);
 
-	tree[node_idx].sum = {0, 0, 0};
-	tree[node_idx].sum += tree[child_base - 2].sum;
-	tree[node_idx].sum += tree[child_base - 1].sum;
-	tree[node_idx].sum += tree[child_base + 0].sum;
-	tree[node_idx].sum += tree[child_base + 1].sum;
+	pull(node_idx, child);
 }
 
 void SegmentTree::push(int node_idx, int start_r, int start_c, int end_r,
-                       int end_c)
+                       int end_c, const int child_idx[4])
 {
 	Node &node = tree[node_idx];
 	if (start_r == end_r && start_c == end_c)
-	{ // Leaf node
-		if (node.is_lazy_set)
-		{
-			node.sum = {(double)node.lazy_set.r, (double)node.lazy_set.g,
-			            (double)node.lazy_set.b};
-		}
-		node.sum.r = node.sum.r * node.lazy_mul.r + node.lazy_add.r;
-		node.sum.g = node.sum.g * node.lazy_mul.g + node.lazy_add.g;
-		node.sum.b = node.sum.b * node.lazy_mul.b + node.lazy_add.b;
+	{
+		// Leaf node: its sum already includes its own tags, and there are
+		// no children to pass them to.
 		node.lazy_mul = {1, 1, 1};
 		node.lazy_add = {0, 0, 0};
 		node.is_lazy_set = false;
 		return;
 	}
 
+	TREE_STAT(record_push(node, (start_r < end_r ? 2 : 1) *
+	                                (start_c < end_c ? 2 : 1)));
+
 	int mid_r = start_r + (end_r - start_r) / 2;
 	int mid_c = start_c + (end_c - start_c) / 2;
 
-	int child_base = node_idx * 4;
-	int children[] = {child_base - 2, child_base - 1, child_base + 0,
-	                  child_base + 1};
 	int r_ranges[] = {start_r,   mid_r, start_r,   mid_r,
 	                  mid_r + 1, end_r, mid_r + 1, end_r};
 	int c_ranges[] = {start_c, mid_c, mid_c + 1, end_c,
@@ -73,13 +344,12 @@ void SegmentTree::push(int node_idx, int start_r, int start_c, int end_r,
 
 	for (int i = 0; i < 4; ++i)
 	{
-		int child_idx = children[i];
+		if (child_idx[i] < 0)
+			continue;
 		int r1 = r_ranges[i * 2], r2 = r_ranges[i * 2 + 1];
 		int c1 = c_ranges[i * 2], c2 = c_ranges[i * 2 + 1];
-		if (r1 > r2 || c1 > c2)
-			continue;
 
-		Node &child = tree[child_idx];
+		Node &child = tree[child_idx[i]];
 		long long num_pixels = (long long)(r2 - r1 + 1) * (c2 - c1 + 1);
 
 		if (node.is_lazy_set)
@@ -114,11 +384,47 @@ void SegmentTree::push(int node_idx, int start_r, int start_c, int end_r,
 	node.lazy_mul = {1, 1, 1};
 }
 
+void SegmentTree::apply_tag(Node &node, long long num_pixels,
+                            const RGB_d &mul_val, const RGB_d &add_val,
+                            const RGB_uc *set_val)
+{
+	TREE_STAT(++traversal_stats.full_cover_hits);
+	TREE_STAT(++(set_val ? traversal_stats.set_tags
+	                     : traversal_stats.affine_tags));
+
+	if (set_val)
+	{
+		node.is_lazy_set = true;
+		node.lazy_set = *set_val;
+		node.sum = {(double)set_val->r * num_pixels,
+		            (double)set_val->g * num_pixels,
+		            (double)set_val->b * num_pixels};
+		node.lazy_add = {0, 0, 0};
+		node.lazy_mul = {1, 1, 1};
+	}
+
+	node.sum.r = node.sum.r * mul_val.r;
+	node.sum.g = node.sum.g * mul_val.g;
+	node.sum.b = node.sum.b * mul_val.b;
+	node.lazy_mul.r *= mul_val.r;
+	node.lazy_mul.g *= mul_val.g;
+	node.lazy_mul.b *= mul_val.b;
+	node.lazy_add.r *= mul_val.r;
+	node.lazy_add.g *= mul_val.g;
+	node.lazy_add.b *= mul_val.b;
+
+	node.sum.r += num_pixels * add_val.r;
+	node.sum.g += num_pixels * add_val.g;
+	node.sum.b += num_pixels * add_val.b;
+	node.lazy_add += add_val;
+}
+
 void SegmentTree::update(int node_idx, int start_r, int start_c, int end_r,
                          int end_c, int r1, int c1, int r2, int c2,
                          const RGB_d &mul_val, const RGB_d &add_val,
                          const RGB_uc *set_val)
 {
+	TREE_STAT(record_visit(start_r, start_c, end_r, end_c));
 	if (start_r > r2 || end_r < r1 || start_c > c2 || end_c < c1 ||
 	    start_r > end_r || start_c > end_c)
 	{
@@ -128,63 +434,36 @@ void SegmentTree::update(int node_idx, int start_r, int start_c, int end_r,
 	Node &node = tree[node_idx];
 	if (r1 <= start_r && end_r <= r2 && c1 <= start_c && end_c <= c2)
 	{
-		long long num_pixels =
-		    (long long)(end_r - start_r + 1) * (end_c - start_c + 1);
-
-		if (set_val)
-		{
-			node.is_lazy_set = true;
-			node.lazy_set = *set_val;
-			node.sum = {(double)set_val->r * num_pixels,
-			            (double)set_val->g * num_pixels,
-			            (double)set_val->b * num_pixels};
-			node.lazy_add = {0, 0, 0};
-			node.lazy_mul = {1, 1, 1};
-		}
-
-		node.sum.r = node.sum.r * mul_val.r;
-		node.sum.g = node.sum.g * mul_val.g;
-		node.sum.b = node.sum.b * mul_val.b;
-		node.lazy_mul.r *= mul_val.r;
-		node.lazy_mul.g *= mul_val.g;
-		node.lazy_mul.b *= mul_val.b;
-		node.lazy_add.r *= mul_val.r;
-		node.lazy_add.g *= mul_val.g;
-		node.lazy_add.b *= mul_val.b;
-
-		node.sum.r += num_pixels * add_val.r;
-		node.sum.g += num_pixels * add_val.g;
-		node.sum.b += num_pixels * add_val.b;
-		node.lazy_add += add_val;
+		apply_tag(node,
+		          (long long)(end_r - start_r + 1) * (end_c - start_c + 1),
+		          mul_val, add_val, set_val);
 		return;
 	}
 
-	push(node_idx, start_r, start_c, end_r, end_c);
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	push(node_idx, start_r, start_c, end_r, end_c, child);
 
 	int mid_r = start_r + (end_r - start_r) / 2;
 	int mid_c = start_c + (end_c - start_c) / 2;
 
-	int child_base = node_idx * 4;
-	update(child_base - 2, start_r, start_c, mid_r, mid_c, r1, c1, r2, c2,
+	update(child[0], start_r, start_c, mid_r, mid_c, r1, c1, r2, c2,
 	       mul_val, add_val, set_val);
-	update(child_base - 1, start_r, mid_c + 1, mid_r, end_c, r1, c1, r2, c2,
+	update(child[1], start_r, mid_c + 1, mid_r, end_c, r1, c1, r2, c2,
 	       mul_val, add_val, set_val);
-	update(child_base + 0, mid_r + 1, start_c, end_r, mid_c, r1, c1, r2, c2,
+	update(child[2], mid_r + 1, start_c, end_r, mid_c, r1, c1, r2, c2,
 	       mul_val, add_val, set_val);
-	update(child_base + 1, mid_r + 1, mid_c + 1, end_r, end_c, r1, c1, r2, c2,
+	update(child[3], mid_r + 1, mid_c + 1, end_r, end_c, r1, c1, r2, c2,
 	       mul_val, add_val, set_val);
 
-	node.sum = {0, 0, 0};
-	node.sum += tree[child_base - 2].sum;
-	node.sum += tree[child_base - 1].sum;
-	node.sum += tree[child_base + 0].sum;
-	node.sum += tree[child_base + 1].sum;
+	pull(node_idx, child);
 }
 
 void SegmentTree::adjust_brightness(int r1, int c1, int r2, int c2, int value)
 {
-	update(1, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2, {1, 1, 1},
+	update(0, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2, {1, 1, 1},
 	       {(double)value, (double)value, (double)value}, nullptr);
+	TREE_STAT(record_op(false));
 }
 
 void SegmentTree::adjust_contrast(int r1, int c1, int r2, int c2,
@@ -192,65 +471,170 @@ void SegmentTree::adjust_contrast(int r1, int c1, int r2, int c2,
 {
 	RGB_d add_val = {(1.0 - multiplier) * 128.0, (1.0 - multiplier) * 128.0,
 	                 (1.0 - multiplier) * 128.0};
-	update(1, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2,
+	update(0, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2,
 	       {multiplier, multiplier, multiplier}, add_val, nullptr);
+	TREE_STAT(record_op(false));
 }
 
 void SegmentTree::fill_region(int r1, int c1, int r2, int c2,
                               const RGB_uc &color)
 {
-	update(1, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2, {1, 1, 1}, {0, 0, 0},
+	update(0, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2, {1, 1, 1}, {0, 0, 0},
 	       &color);
+	TREE_STAT(record_op(false));
 }
 
-Image SegmentTree::get_image()
+Image SegmentTree::get_image(PixelLayout layout)
 {
-	Image final_image(cols, rows);
-	reconstruct_image_iterative(final_image);
+	Image final_image = Image::uninitialized(cols, rows, layout);
+	reconstruct_image_iterative(final_image, 0, 0, rows - 1, cols - 1);
 	return final_image;
 }
 
-void SegmentTree::reconstruct_image_iterative(Image &image)
+void SegmentTree::export_rows(const RowSink &sink)
+{
+	// Settle every pending tag once; after that each leaf holds its pixel.
+	push_all(0, 0, 0, rows - 1, cols - 1);
+
+	std::vector<RGB_uc> pixels(cols);
+	for (int r = 0; r < rows; ++r)
+	{
+		for (int c = 0; c < cols; ++c)
+		{
+			const RGB_d &sum = tree[leaf_index(r, c)].sum;
+			pixels[c] = {saturate_cast_uchar(sum.r), saturate_cast_uchar(sum.g),
+			             saturate_cast_uchar(sum.b)};
+		}
+		sink(r, pixels.data());
+	}
+}
+
+void SegmentTree::push_all(int node_idx, int start_r, int start_c, int end_r,
+                           int end_c)
+{
+	if (start_r > end_r || start_c > end_c)
+		return;
+
+	if (start_r == end_r && start_c == end_c)
+	{
+		push(node_idx, start_r, start_c, end_r, end_c, nullptr);
+		return;
+	}
+
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	push(node_idx, start_r, start_c, end_r, end_c, child);
+
+	int mid_r = start_r + (end_r - start_r) / 2;
+	int mid_c = start_c + (end_c - start_c) / 2;
+
+	push_all(child[0], start_r, start_c, mid_r, mid_c);
+	push_all(child[1], start_r, mid_c + 1, mid_r, end_c);
+	push_all(child[2], mid_r + 1, start_c, end_r, mid_c);
+	push_all(child[3], mid_r + 1, mid_c + 1, end_r, end_c);
+}
+
+Image SegmentTree::get_region(int r1, int c1, int r2, int c2,
+                              PixelLayout layout)
+{
+	Image region = Image::uninitialized(c2 - c1 + 1, r2 - r1 + 1, layout);
+	reconstruct_image_iterative(region, r1, c1, r2, c2);
+	return region;
+}
+
+void SegmentTree::assign_region(int r1, int c1, const Image &patch)
+{
+	int r2 = r1 + patch.get_height() - 1;
+	int c2 = c1 + patch.get_width() - 1;
+	assign(0, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2, patch);
+}
+
+void SegmentTree::assign(int node_idx, int start_r, int start_c, int end_r,
+                         int end_c, int r1, int c1, int r2, int c2,
+                         const Image &patch)
+{
+	if (start_r > r2 || end_r < r1 || start_c > c2 || end_c < c1 ||
+	    start_r > end_r || start_c > end_c)
+	{
+		return;
+	}
+
+	if (r1 <= start_r && end_r <= r2 && c1 <= start_c && end_c <= c2)
+	{
+		build(node_idx, start_r, start_c, end_r, end_c, patch, r1, c1);
+		return;
+	}
+
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	push(node_idx, start_r, start_c, end_r, end_c, child);
+
+	int mid_r = start_r + (end_r - start_r) / 2;
+	int mid_c = start_c + (end_c - start_c) / 2;
+
+	assign(child[0], start_r, start_c, mid_r, mid_c, r1, c1, r2, c2,
+	       patch);
+	assign(child[1], start_r, mid_c + 1, mid_r, end_c, r1, c1, r2, c2,
+	       patch);
+	assign(child[2], mid_r + 1, start_c, end_r, mid_c, r1, c1, r2, c2,
+	       patch);
+	assign(child[3], mid_r + 1, mid_c + 1, end_r, end_c, r1, c1, r2, c2,
+	       patch);
+
+	pull(node_idx, child);
+}
+
+void SegmentTree::reconstruct_image_iterative(Image &image, int r1, int c1,
+                                              int r2, int c2)
 {
 	std::stack<std::tuple<int, int, int, int, int>> s;
-	s.push({1, 0, 0, rows - 1, cols - 1});
+	s.push({0, 0, 0, rows - 1, cols - 1});
 
 	while (!s.empty())
 	{
 		auto [node_idx, start_r, start_c, end_r, end_c] = s.top();
 		s.pop();
 
-		if (start_r > end_r || start_c > end_c)
+		if (start_r > end_r || start_c > end_c || start_r > r2 ||
+		    end_r < r1 || start_c > c2 || end_c < c1)
 			continue;
 
 		Node &node = tree[node_idx];
 		if (start_r == end_r && start_c == end_c)
 		{
-			push(node_idx, start_r, start_c, end_r, end_c);
+			push(node_idx, start_r, start_c, end_r, end_c, nullptr);
 			RGB_d final_color = node.sum;
-			image.set_pixel(start_r, start_c,
+			image.set_pixel(start_r - r1, start_c - c1,
 			                {saturate_cast_uchar(final_color.r),
 			                 saturate_cast_uchar(final_color.g),
 			                 saturate_cast_uchar(final_color.b)});
 			continue;
 		}
 
-		push(node_idx, start_r, start_c, end_r, end_c);
+		int child[4];
+		children(node_idx, start_r, start_c, end_r, end_c, child);
+		push(node_idx, start_r, start_c, end_r, end_c, child);
 
 		int mid_r = start_r + (end_r - start_r) / 2;
 		int mid_c = start_c + (end_c - start_c) / 2;
 
-		int child_base = node_idx * 4;
-		s.push({child_base + 1, mid_r + 1, mid_c + 1, end_r, end_c});
-		s.push({child_base + 0, mid_r + 1, start_c, end_r, mid_c});
-		s.push({child_base - 1, start_r, mid_c + 1, mid_r, end_c});
-		s.push({child_base - 2, start_r, start_c, mid_r, mid_c});
+		s.push({child[3], mid_r + 1, mid_c + 1, end_r, end_c});
+		s.push({child[2], mid_r + 1, start_c, end_r, mid_c});
+		s.push({child[1], start_r, mid_c + 1, mid_r, end_c});
+		s.push({child[0], start_r, start_c, mid_r, mid_c});
 	}
 }
 
+RGB_d SegmentTree::query_sum(int r1, int c1, int r2, int c2)
+{
+	RGB_d sum = query_tree(0, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2);
+	TREE_STAT(record_op(true));
+	return sum;
+}
+
 RGB_d SegmentTree::query_average_color(int r1, int c1, int r2, int c2)
 {
-	RGB_d total_sum = query_tree(1, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2);
+	RGB_d total_sum = query_sum(r1, c1, r2, c2);
 	long long num_pixels = (long long)(r2 - r1 + 1) * (c2 - c1 + 1);
 	if (num_pixels == 0)
 		return {0, 0, 0};
@@ -260,37 +644,20 @@ RGB_d SegmentTree::query_average_color(int r1, int c1, int r2, int c2)
 
 Image SegmentTree::blur(int r1, int c1, int r2, int c2)
 {
-	Image blurred_image(cols, rows);
-	Image current_image =
-	    get_image(); // To get non-blurred pixels at the border
-	for (int r = 0; r < rows; ++r)
-	{
-		for (int c = 0; c < cols; ++c)
-		{
-			if (r >= r1 && r <= r2 && c >= c1 && c <= c2)
-			{
-				int nr1 = std::max(0, r - 1);
-				int nc1 = std::max(0, c - 1);
-				int nr2 = std::min(rows - 1, r + 1);
-				int nc2 = std::min(cols - 1, c + 1);
-				RGB_d avg_color = query_average_color(nr1, nc1, nr2, nc2);
-				blurred_image.set_pixel(r, c,
-				                        {(unsigned char)avg_color.r,
-				                         (unsigned char)avg_color.g,
-				                         (unsigned char)avg_color.b});
-			}
-			else
-			{
-				blurred_image.set_pixel(r, c, current_image.get_pixel(r, c));
-			}
-		}
-	}
-	return blurred_image;
+	ConvolutionOptions options;
+	options.border = BorderMode::Normalize; // average over in-image neighbours
+	Image image = get_image();
+	Image patch = convolve(image, Kernel::box(1), r1, c1, r2, c2, options);
+	for (int r = 0; r < patch.get_height(); ++r)
+		std::copy(patch.row(r), patch.row(r) + patch.get_width(),
+		          image.row(r1 + r) + c1);
+	return image;
 }
 
 RGB_d SegmentTree::query_tree(int node_idx, int start_r, int start_c, int end_r,
                               int end_c, int r1, int c1, int r2, int c2)
 {
+	TREE_STAT(record_visit(start_r, start_c, end_r, end_c));
 	if (start_r > r2 || end_r < r1 || start_c > c2 || end_c < c1 ||
 	    start_r > end_r || start_c > end_c)
 	{
@@ -299,34 +666,276 @@ RGB_d SegmentTree::query_tree(int node_idx, int start_r, int start_c, int end_r,
 
 	if (r1 <= start_r && end_r <= r2 && c1 <= start_c && end_c <= c2)
 	{
+		TREE_STAT(++traversal_stats.full_cover_hits);
 		return tree[node_idx].sum;
 	}
 
-	push(node_idx, start_r, start_c, end_r, end_c);
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	push(node_idx, start_r, start_c, end_r, end_c, child);
 
 	int mid_r = start_r + (end_r - start_r) / 2;
 	int mid_c = start_c + (end_c - start_c) / 2;
 
 	RGB_d result = {0, 0, 0};
-	int child_base = node_idx * 4;
-	result += query_tree(child_base - 2, start_r, start_c, mid_r, mid_c, r1, c1,
+	result += query_tree(child[0], start_r, start_c, mid_r, mid_c, r1, c1,
 	                     r2, c2);
-	result += query_tree(child_base - 1, start_r, mid_c + 1, mid_r, end_c, r1,
+	result += query_tree(child[1], start_r, mid_c + 1, mid_r, end_c, r1,
 	                     c1, r2, c2);
-	result += query_tree(child_base + 0, mid_r + 1, start_c, end_r, mid_c, r1,
+	result += query_tree(child[2], mid_r + 1, start_c, end_r, mid_c, r1,
 	                     c1, r2, c2);
-	result += query_tree(child_base + 1, mid_r + 1, mid_c + 1, end_r, end_c, r1,
+	result += query_tree(child[3], mid_r + 1, mid_c + 1, end_r, end_c, r1,
 	                     c1, r2, c2);
 
 	return result;
 }
 
+void SegmentTree::record_visit(int start_r, int start_c, int end_r,
+                               int end_c)
+{
+	++op_nodes;
+	// Indices no longer encode depth, so walk down to the rectangle.
+	int depth = 0;
+	int r1 = 0, c1 = 0, r2 = rows - 1, c2 = cols - 1;
+	while ((r1 != start_r || c1 != start_c || r2 != end_r || c2 != end_c) &&
+	       r1 <= r2 && c1 <= c2 && (r1 < r2 || c1 < c2))
+	{
+		int mid_r = r1 + (r2 - r1) / 2, mid_c = c1 + (c2 - c1) / 2;
+		if (start_r > mid_r)
+			r1 = mid_r + 1;
+		else
+			r2 = mid_r;
+		if (start_c > mid_c)
+			c1 = mid_c + 1;
+		else
+			c2 = mid_c;
+		++depth;
+	}
+	traversal_stats.max_depth = std::max(traversal_stats.max_depth, depth);
+}
+
+void SegmentTree::record_push(const Node &node, int children)
+{
+	++traversal_stats.pushes;
+	if (node.is_lazy_set)
+		traversal_stats.set_tags += children;
+	if (node.lazy_mul.r != 1 || node.lazy_mul.g != 1 || node.lazy_mul.b != 1 ||
+	    node.lazy_add.r != 0 || node.lazy_add.g != 0 || node.lazy_add.b != 0)
+		traversal_stats.affine_tags += children;
+}
+
+void SegmentTree::record_op(bool is_query)
+{
+	++(is_query ? traversal_stats.queries : traversal_stats.updates);
+	traversal_stats.nodes_visited += op_nodes;
+	int bucket = 0;
+	while (bucket + 1 < (int)traversal_stats.nodes_per_op.size() &&
+	       op_nodes >> (bucket + 1))
+		++bucket;
+	++traversal_stats.nodes_per_op[bucket];
+	op_nodes = 0;
+}
+
+// An Update as tag values, with its rectangle.
+struct SegmentTree::BatchOp
+{
+	int r1, c1, r2, c2;
+	RGB_d mul, add;
+	RGB_uc set;
+	bool is_set;
+};
+
+void SegmentTree::apply_batch(const std::vector<Update> &updates)
+{
+	if (updates.empty())
+		return;
+	std::vector<BatchOp> ops;
+	ops.reserve(updates.size());
+	for (const Update &u : updates)
+	{
+		BatchOp op{u.r1, u.c1, u.r2, u.c2, {1, 1, 1}, {0, 0, 0}, u.color,
+		           u.kind == Update::Fill};
+		if (u.kind == Update::Brightness)
+			op.add = {u.value, u.value, u.value};
+		else if (u.kind == Update::Contrast)
+		{
+			double add = (1.0 - u.value) * 128.0;
+			op.mul = {u.value, u.value, u.value};
+			op.add = {add, add, add};
+		}
+		else if (u.kind == Update::Affine)
+		{
+			op.mul = {u.value, u.value, u.value};
+			op.add = {u.offset, u.offset, u.offset};
+		}
+		ops.push_back(op);
+	}
+
+	// Each level of the descent keeps its child's index list in scratch
+	// after its own, so the scratch needs one list per level.
+	int depth = 1;
+	while ((1LL << (depth - 1)) < std::max(rows, cols))
+		++depth;
+	int n = (int)ops.size();
+	std::vector<int> scratch((size_t)n * (depth + 2));
+	for (int i = 0; i < n; ++i)
+		scratch[i] = i;
+	update_batch(0, 0, 0, rows - 1, cols - 1, ops.data(), scratch.data(), n,
+	             scratch.data() + n);
+	TREE_STAT(record_op(false));
+}
+
+// `idx` lists, in order, the ops that intersect this node. Ops covering the
+// node become tags here; each run of partially covering ops is pushed
+// through the children together.
+void SegmentTree::update_batch(int node_idx, int start_r, int start_c,
+                               int end_r, int end_c, const BatchOp *ops,
+                               const int *idx, int n, int *scratch)
+{
+	TREE_STAT(record_visit(start_r, start_c, end_r, end_c));
+	auto covers = [&](const BatchOp &op) {
+		return op.r1 <= start_r && end_r <= op.r2 && op.c1 <= start_c &&
+		       end_c <= op.c2;
+	};
+	Node &node = tree[node_idx];
+	long long num_pixels =
+	    (long long)(end_r - start_r + 1) * (end_c - start_c + 1);
+	int mid_r = start_r + (end_r - start_r) / 2;
+	int mid_c = start_c + (end_c - start_c) / 2;
+	const int bounds[4][4] = {{start_r, start_c, mid_r, mid_c},
+	                          {start_r, mid_c + 1, mid_r, end_c},
+	                          {mid_r + 1, start_c, end_r, mid_c},
+	                          {mid_r + 1, mid_c + 1, end_r, end_c}};
+
+	int i = 0;
+	while (i < n)
+	{
+		const BatchOp &op = ops[idx[i]];
+		if (covers(op))
+		{
+			apply_tag(node, num_pixels, op.mul, op.add,
+			          op.is_set ? &op.set : nullptr);
+			++i;
+			continue;
+		}
+
+		int run_end = i;
+		while (run_end < n && !covers(ops[idx[run_end]]))
+			++run_end;
+		int child[4];
+		children(node_idx, start_r, start_c, end_r, end_c, child);
+		push(node_idx, start_r, start_c, end_r, end_c, child);
+		for (int k = 0; k < 4; ++k)
+		{
+			const int *b = bounds[k];
+			if (child[k] < 0)
+				continue;
+			int count = 0;
+			for (int j = i; j < run_end; ++j)
+			{
+				const BatchOp &o = ops[idx[j]];
+				if (o.r1 <= b[2] && b[0] <= o.r2 && o.c1 <= b[3] &&
+				    b[1] <= o.c2)
+					scratch[count++] = idx[j];
+			}
+			if (count > 0)
+				update_batch(child[k], b[0], b[1], b[2], b[3], ops,
+				             scratch, count, scratch + count);
+		}
+		pull(node_idx, child);
+		i = run_end;
+	}
+}
+
+// The combined effect of the tags above a node: a value v becomes
+// (is_set ? set : v) * mul + add, per channel.
+struct SegmentTree::PendingTransform
+{
+	bool is_set = false;
+	RGB_d set = {0, 0, 0};
+	RGB_d mul = {1, 1, 1};
+	RGB_d add = {0, 0, 0};
+};
+
+RGB_d SegmentTree::peek_sum(int r1, int c1, int r2, int c2) const
+{
+	return peek_tree(0, 0, 0, rows - 1, cols - 1, r1, c1, r2, c2,
+	                 PendingTransform());
+}
+
+RGB_d SegmentTree::peek_average_color(int r1, int c1, int r2, int c2) const
+{
+	RGB_d total_sum = peek_sum(r1, c1, r2, c2);
+	long long num_pixels = (long long)(r2 - r1 + 1) * (c2 - c1 + 1);
+	if (num_pixels == 0)
+		return {0, 0, 0};
+	return {total_sum.r / num_pixels, total_sum.g / num_pixels,
+	        total_sum.b / num_pixels};
+}
+
+RGB_d SegmentTree::peek_tree(int node_idx, int start_r, int start_c,
+                             int end_r, int end_c, int r1, int c1, int r2,
+                             int c2, const PendingTransform &pending) const
+{
+	if (start_r > r2 || end_r < r1 || start_c > c2 || end_c < c1 ||
+	    start_r > end_r || start_c > end_c)
+	{
+		return {0, 0, 0};
+	}
+
+	const Node &node = tree[node_idx];
+	if (r1 <= start_r && end_r <= r2 && c1 <= start_c && end_c <= c2)
+	{
+		// node.sum already includes the node's own tag.
+		double n = (double)(end_r - start_r + 1) * (end_c - start_c + 1);
+		RGB_d sum = pending.is_set ? pending.set * n : node.sum;
+		return {sum.r * pending.mul.r + n * pending.add.r,
+		        sum.g * pending.mul.g + n * pending.add.g,
+		        sum.b * pending.mul.b + n * pending.add.b};
+	}
+
+	// Tags deeper in the tree are older, so the node's tag applies before
+	// the ones already pending from above.
+	PendingTransform next = pending;
+	if (!pending.is_set)
+	{
+		if (node.is_lazy_set)
+		{
+			next.is_set = true;
+			next.set = {(double)node.lazy_set.r, (double)node.lazy_set.g,
+			            (double)node.lazy_set.b};
+		}
+		next.mul = {node.lazy_mul.r * pending.mul.r,
+		            node.lazy_mul.g * pending.mul.g,
+		            node.lazy_mul.b * pending.mul.b};
+		next.add = {node.lazy_add.r * pending.mul.r + pending.add.r,
+		            node.lazy_add.g * pending.mul.g + pending.add.g,
+		            node.lazy_add.b * pending.mul.b + pending.add.b};
+	}
+
+	int mid_r = start_r + (end_r - start_r) / 2;
+	int mid_c = start_c + (end_c - start_c) / 2;
+
+	RGB_d result = {0, 0, 0};
+	int child[4];
+	children(node_idx, start_r, start_c, end_r, end_c, child);
+	result += peek_tree(child[0], start_r, start_c, mid_r, mid_c, r1,
+	                    c1, r2, c2, next);
+	result += peek_tree(child[1], start_r, mid_c + 1, mid_r, end_c, r1,
+	                    c1, r2, c2, next);
+	result += peek_tree(child[2], mid_r + 1, start_c, end_r, mid_c, r1,
+	                    c1, r2, c2, next);
+	result += peek_tree(child[3], mid_r + 1, mid_c + 1, end_r, end_c,
+	                    r1, c1, r2, c2, next);
+	return result;
+}
+
 SegmentTree SegmentTree::delete_row(int row_num)
 {
 	Image current_image = get_image();
 	int old_width = current_image.get_width();
 	int old_height = current_image.get_height();
-	Image new_image(old_width, old_height - 1);
+	Image new_image = Image::uninitialized(old_width, old_height - 1);
 	for (int r = 0, new_r = 0; r < old_height; ++r)
 	{
 		if (r == row_num)
@@ -345,7 +954,7 @@ SegmentTree SegmentTree::delete_col(int col_num)
 	Image current_image = get_image();
 	int old_width = current_image.get_width();
 	int old_height = current_image.get_height();
-	Image new_image(old_width - 1, old_height);
+	Image new_image = Image::uninitialized(old_width - 1, old_height);
 
 	for (int r = 0; r < old_height; ++r)
 	{
@@ -359,3 +968,186 @@ SegmentTree SegmentTree::delete_col(int col_num)
 	}
 	return SegmentTree(new_image);
 }
+
+// --- Node storage ---
+SegmentTree::NodeStorage::NodeStorage(const NodeStorage &other)
+    : owned(other.count, false), nodes(owned.data()), count(other.count)
+{
+	std::copy(other.nodes, other.nodes + other.count, nodes);
+}
+
+SegmentTree::NodeStorage::NodeStorage(NodeStorage &&other) noexcept
+    : owned(std::move(other.owned)), nodes(other.nodes), count(other.count),
+      mapping(other.mapping), mapping_length(other.mapping_length)
+{
+	other.nodes = nullptr;
+	other.count = 0;
+	other.mapping = nullptr;
+	other.mapping_length = 0;
+}
+
+SegmentTree::NodeStorage &
+SegmentTree::NodeStorage::operator=(NodeStorage other) noexcept
+{
+	std::swap(owned, other.owned);
+	std::swap(nodes, other.nodes);
+	std::swap(count, other.count);
+	std::swap(mapping, other.mapping);
+	std::swap(mapping_length, other.mapping_length);
+	return *this;
+}
+
+SegmentTree::NodeStorage::~NodeStorage()
+{
+	release();
+}
+
+void SegmentTree::NodeStorage::release()
+{
+	unmap();
+	owned.clear();
+	nodes = nullptr;
+	count = 0;
+}
+
+void SegmentTree::NodeStorage::unmap()
+{
+	if (mapping)
+		munmap(mapping, mapping_length);
+	mapping = nullptr;
+	mapping_length = 0;
+}
+
+void SegmentTree::NodeStorage::resize(size_t n)
+{
+	// Keeps the owned block when it is big enough, as when a tree is
+	// rebuilt at the same size.
+	unmap();
+	owned.reset(n, false);
+	nodes = owned.data();
+	count = n;
+}
+
+void SegmentTree::NodeStorage::adopt_mapping(void *base, size_t length,
+                                             Node *first, size_t n)
+{
+	release();
+	mapping = base;
+	mapping_length = length;
+	nodes = first;
+	count = n;
+}
+
+// --- Snapshots ---
+void SegmentTree::save_snapshot(const std::string &path) const
+{
+	static_assert(std::is_trivially_copyable<Node>::value,
+	              "snapshots store nodes as raw bytes");
+	// Every byte of a node is a field the tree writes, and every slot is a
+	// node, so equal trees give byte-identical snapshots.
+	static_assert(sizeof(Node) == 9 * sizeof(double) + 4 + sizeof(int32_t),
+	              "Node has padding");
+	const unsigned char *bytes =
+	    reinterpret_cast<const unsigned char *>(tree.data());
+	size_t node_bytes = tree.size() * sizeof(Node);
+
+	SnapshotHeader header = {};
+	std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+	header.version = kSnapshotVersion;
+	header.byte_order = kByteOrderMark;
+	header.node_size = sizeof(Node);
+	header.rows = rows;
+	header.cols = cols;
+	header.node_count = tree.size();
+	header.checksum = checksum_bytes(bytes, node_bytes);
+
+	// Written beside the target and renamed over it, so a crash never
+	// leaves a half-written snapshot under the real name.
+	std::string temp = path + ".tmp";
+	int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("cannot create " + temp + ": " +
+		                         std::strerror(errno));
+	try
+	{
+		write_all(fd, &header, sizeof(header), temp);
+		write_all(fd, bytes, node_bytes, temp);
+	}
+	catch (...)
+	{
+		::close(fd);
+		::unlink(temp.c_str());
+		throw;
+	}
+	if (::close(fd) != 0 || std::rename(temp.c_str(), path.c_str()) != 0)
+	{
+		::unlink(temp.c_str());
+		throw std::runtime_error("cannot write " + path + ": " +
+		                         std::strerror(errno));
+	}
+}
+
+SegmentTree SegmentTree::load_snapshot(const std::string &path, bool verify)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("cannot open " + path + ": " +
+		                         std::strerror(errno));
+	struct stat info;
+	if (::fstat(fd, &info) != 0 ||
+	    (size_t)info.st_size < sizeof(SnapshotHeader))
+	{
+		::close(fd);
+		throw std::runtime_error(path + ": not a snapshot");
+	}
+	size_t length = (size_t)info.st_size;
+	// MAP_PRIVATE: writable in memory, copy-on-write, never written back.
+	void *base =
+	    mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED)
+		throw std::runtime_error("cannot map " + path + ": " +
+		                         std::strerror(errno));
+
+	const SnapshotHeader &header = *static_cast<const SnapshotHeader *>(base);
+	auto reject = [&](const std::string &reason) {
+		munmap(base, length);
+		throw std::runtime_error(path + ": " + reason);
+	};
+	if (std::memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0)
+		reject("not a snapshot");
+	if (header.version != kSnapshotVersion ||
+	    header.byte_order != kByteOrderMark || header.node_size != sizeof(Node))
+		reject("snapshot format version " + std::to_string(header.version) +
+		       " does not match this build");
+	// Every pixel is a leaf, so the node count bounds the dimensions before
+	// the size table is built from them.
+	if (header.rows <= 0 || header.cols <= 0 ||
+	    length != sizeof(SnapshotHeader) + header.node_count * sizeof(Node) ||
+	    (uint64_t)header.rows * (uint64_t)header.cols > header.node_count)
+		reject("truncated or corrupt snapshot");
+	size_t expected = 0;
+	try
+	{
+		expected = tree_size(header.rows, header.cols);
+	}
+	catch (const std::invalid_argument &)
+	{
+		reject("truncated or corrupt snapshot");
+	}
+	if (header.node_count != expected)
+		reject("truncated or corrupt snapshot");
+
+	SegmentTree result;
+	result.rows = header.rows;
+	result.cols = header.cols;
+	Node *first = reinterpret_cast<Node *>(static_cast<char *>(base) +
+	                                       sizeof(SnapshotHeader));
+	result.tree.adopt_mapping(base, length, first, header.node_count);
+	// The mapping now belongs to `result` and is released if this throws.
+	if (verify &&
+	    checksum_bytes(reinterpret_cast<const unsigned char *>(first),
+	                   header.node_count * sizeof(Node)) != header.checksum)
+		throw std::runtime_error(path + ": snapshot checksum mismatch");
+	return result;
+}
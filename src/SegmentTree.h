@@ -1,45 +1,229 @@
 #ifndef SEGMENT_TREE_H
 #define SEGMENT_TREE_H
 
+#include "BufferPool.h"
 #include "Image.h"
 #include "types.h"
+#include <array>
+#include <cstdint>
+#include <string>
 #include <vector>
 
 class SegmentTree
 {
   public:
 	SegmentTree(const Image &image);
+	// Builds from rows pulled in order from `source`, so the full image never
+	// has to exist alongside the tree.
+	SegmentTree(int width, int height, const RowSource &source);
+	// Replaces the contents like the constructor above, reusing the node
+	// array when it is already large enough.
+	void rebuild(int width, int height, const RowSource &source);
+
+	int get_width() const { return cols; }
+	int get_height() const { return rows; }
+
 	void adjust_brightness(int r1, int c1, int r2, int c2, int value);
 	void adjust_contrast(int r1, int c1, int r2, int c2, double multiplier);
 	void fill_region(int r1, int c1, int r2, int c2, const RGB_uc &color);
-	Image get_image();
+	Image get_image(PixelLayout layout = PixelLayout::Interleaved);
+	// Streams the current pixels to `sink` one row at a time.
+	void export_rows(const RowSink &sink);
+	// Pixels of the rectangle (r1, c1)-(r2, c2) as an image of its size.
+	Image get_region(int r1, int c1, int r2, int c2,
+	                 PixelLayout layout = PixelLayout::Interleaved);
+	// Overwrites the rectangle starting at (r1, c1) with `patch`, rebuilding
+	// only the subtrees it covers.
+	void assign_region(int r1, int c1, const Image &patch);
 	RGB_d query_average_color(int r1, int c1, int r2, int c2);
+	// Unsaturated channel sums over the rectangle.
+	RGB_d query_sum(int r1, int c1, int r2, int c2);
+	// Like query_sum/query_average_color, but composes pending tags on the
+	// way down instead of pushing them, so the tree is left untouched and
+	// any number of threads may peek while no one writes.
+	RGB_d peek_sum(int r1, int c1, int r2, int c2) const;
+	RGB_d peek_average_color(int r1, int c1, int r2, int c2) const;
+
+	// One region operation for apply_batch().
+	struct Update
+	{
+		enum Kind : uint8_t
+		{
+			Brightness,
+			Contrast,
+			Fill,
+			Affine // p * value + offset on every channel
+		} kind;
+		int r1, c1, r2, c2;
+		double value = 0; // brightness delta, or contrast/affine multiplier
+		RGB_uc color = {0, 0, 0};
+		double offset = 0;
+	};
+	// Applies `updates` in order with the same result as the matching calls
+	// one by one, in a single traversal: nodes shared by several rectangles
+	// are visited, pushed and re-summed once per batch instead of once per
+	// update.
+	void apply_batch(const std::vector<Update> &updates);
 	Image blur(int r1, int c1, int r2, int c2);
 	SegmentTree delete_row(int row_num);
 	SegmentTree delete_col(int col_num);
 
+	// Writes the node array, pending tags included, to a versioned snapshot
+	// file in one sequential pass.
+	void save_snapshot(const std::string &path) const;
+	// Maps a snapshot copy-on-write: nodes page in on first touch and edits
+	// never reach the file. `verify` checksums every node, which reads the
+	// whole file. Throws std::runtime_error if the file is unusable,
+	// including when it was written by another format version.
+	static SegmentTree load_snapshot(const std::string &path,
+	                                 bool verify = false);
+
+	// Traversal counters for updates and queries. They are only collected
+	// when built with PNGTREE_STATS (make STATS=1); otherwise they stay zero
+	// and the hot paths carry no instrumentation.
+	struct TraversalStats
+	{
+		uint64_t updates = 0, queries = 0;
+		uint64_t nodes_visited = 0;
+		uint64_t full_cover_hits = 0; // nodes answered without descending
+		uint64_t pushes = 0;
+		// Tag applications, by updates and by pushes to children.
+		uint64_t set_tags = 0, affine_tags = 0;
+		int max_depth = 0; // root is depth 0
+		// nodes_per_op[k] counts operations that visited [2^k, 2^(k+1))
+		// nodes.
+		std::array<uint64_t, 32> nodes_per_op{};
+	};
+#ifdef PNGTREE_STATS
+	static constexpr bool stats_enabled = true;
+#else
+	static constexpr bool stats_enabled = false;
+#endif
+	TraversalStats stats() const { return traversal_stats; }
+	void reset_stats() { traversal_stats = TraversalStats(); }
+
+	// Bytes held: the object and its node array (the whole mapping for a
+	// loaded snapshot). The array has one slot per node, about 4/3 per
+	// pixel whatever the image's shape.
+	size_t memory_footprint() const;
+	// The footprint of a tree built for a width x height image.
+	static size_t footprint_for(int width, int height);
+
   private:
 	struct Node
 	{
 		RGB_d sum;
 		RGB_d lazy_add = {0, 0, 0};
 		RGB_d lazy_mul = {1, 1, 1};
-		RGB_uc lazy_set;
+		RGB_uc lazy_set = {0, 0, 0};
 		bool is_lazy_set = false;
+		// Index of the first child; siblings are stored together in
+		// quadrant order. Fills what would otherwise be padding.
+		int32_t first_child = 0;
+	};
+
+	// The node array: owned, or a private mapping of a snapshot file.
+	class NodeStorage
+	{
+	  public:
+		NodeStorage() = default;
+		NodeStorage(const NodeStorage &other);
+		NodeStorage(NodeStorage &&other) noexcept;
+		NodeStorage &operator=(NodeStorage other) noexcept;
+		~NodeStorage();
+
+		// Switches to owned storage of `n` nodes. Their contents are
+		// unspecified until linked and filled; the tree has exactly `n`
+		// nodes, so every slot gets written.
+		void resize(size_t n);
+		// Adopts a mapping of `length` bytes whose nodes start at `first`.
+		void adopt_mapping(void *base, size_t length, Node *first,
+		                   size_t n);
+
+		Node &operator[](size_t i) { return nodes[i]; }
+		const Node &operator[](size_t i) const { return nodes[i]; }
+		const Node *data() const { return nodes; }
+		size_t size() const { return count; }
+		// Bytes of the owned block or of the mapping.
+		size_t bytes_held() const
+		{
+			return mapping ? mapping_length : owned.capacity_bytes();
+		}
+
+	  private:
+		PooledArray<Node> owned;
+		Node *nodes = nullptr;
+		size_t count = 0;
+		void *mapping = nullptr;
+		size_t mapping_length = 0;
+
+		void release();
+		void unmap();
 	};
 
 	int rows, cols;
-	std::vector<Node> tree;
+	NodeStorage tree;
+	TraversalStats traversal_stats;
+	uint64_t op_nodes = 0; // nodes visited by the operation in progress
+
+	SegmentTree() = default;
 
+	// The slot of the first node on each level, numbering the nodes
+	// breadth-first, followed by the node count. Breadth-first keeps the
+	// levels every operation passes through together at the front.
+	static std::vector<int> level_starts(int rows, int cols);
+	static size_t tree_size(int rows, int cols);
+	// Gives every node of the subtree its first_child. `next` holds the
+	// first free slot on each level below the node's; a node takes the
+	// next block of its level as the levels fill in order. Sums and tags
+	// are left for build() or clear_node() to write.
+	void link(int node_idx, int start_r, int start_c, int end_r, int end_c,
+	          int *next);
+	// Resets a node's sum and tags, keeping its link.
+	void clear_node(int node_idx);
+	// Indices of the quadrants (top-left, top-right, bottom-left,
+	// bottom-right) of a node's rectangle; -1 for the empty bottom or right
+	// half of a single row or column, which has no node.
+	void children(int node_idx, int start_r, int start_c, int end_r,
+	              int end_c, int child[4]) const;
+	// Sets a node's sum to the sum of its children's.
+	void pull(int node_idx, const int child[4]);
+	int leaf_index(int r, int c) const;
+	void sum_children(int node_idx, int start_r, int start_c, int end_r,
+	                  int end_c);
+	void push_all(int node_idx, int start_r, int start_c, int end_r,
+	              int end_c);
+	// Fills the subtree from `image`. Given `next`, it also links the
+	// subtree as link() does; otherwise the existing links are kept.
 	void build(int node_idx, int start_r, int start_c, int end_r, int end_c,
-	           const Image &image);
-	void push(int node_idx, int start_r, int start_c, int end_r, int end_c);
+	           const Image &image, int origin_r = 0, int origin_c = 0,
+	           int *next = nullptr);
+	// Passes a node's tags to its children (from children(); null for a
+	// leaf, which only clears them).
+	void push(int node_idx, int start_r, int start_c, int end_r, int end_c,
+	          const int child[4]);
 	void update(int node_idx, int start_r, int start_c, int end_r, int end_c,
 	            int r1, int c1, int r2, int c2, const RGB_d &mul_val,
 	            const RGB_d &add_val, const RGB_uc *set_val);
-	void reconstruct_image_iterative(Image &image);
+	void assign(int node_idx, int start_r, int start_c, int end_r, int end_c,
+	            int r1, int c1, int r2, int c2, const Image &patch);
+	void reconstruct_image_iterative(Image &image, int r1, int c1, int r2,
+	                                 int c2);
 	RGB_d query_tree(int node_idx, int start_r, int start_c, int end_r,
 	                 int end_c, int r1, int c1, int r2, int c2);
+	void apply_tag(Node &node, long long num_pixels, const RGB_d &mul_val,
+	               const RGB_d &add_val, const RGB_uc *set_val);
+	struct BatchOp;
+	void update_batch(int node_idx, int start_r, int start_c, int end_r,
+	                  int end_c, const BatchOp *ops, const int *idx, int n,
+	                  int *scratch);
+	struct PendingTransform;
+	RGB_d peek_tree(int node_idx, int start_r, int start_c, int end_r,
+	                int end_c, int r1, int c1, int r2, int c2,
+	                const PendingTransform &pending) const;
+	void record_visit(int start_r, int start_c, int end_r, int end_c);
+	void record_push(const Node &node, int children);
+	void record_op(bool is_query);
 };
 
 #endif // SEGMENT_TREE_H
@@ -0,0 +1,266 @@
+#include "SyntheticImage.h"
+#include "Philox.h"
+#include "PixelKernels.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace
+{
+// Philox streams, so the kinds never reuse each other's bits. Rows of
+// noise are streams 0 .. height - 1.
+const uint64_t kParamStream = 1ULL << 48;   // + content
+const uint64_t kLatticeStream = 2ULL << 48; // + octave << 32 + lattice row
+const uint64_t kGrainStream = 3ULL << 48;   // + row
+
+// Successive 32-bit draws from one stream, for per-image parameters.
+class Draws
+{
+  public:
+	Draws(unsigned seed, uint64_t stream) : key(seed), stream(stream) {}
+
+	uint32_t next()
+	{
+		if (used == 4)
+		{
+			bits = philox::block(philox::counter(stream, index++), key);
+			used = 0;
+		}
+		return bits[used++];
+	}
+	double unit() { return philox::unit(next()); }
+	int below(int n) { return std::min(n - 1, (int)(unit() * n)); }
+	RGB_uc color()
+	{
+		uint32_t v = next();
+		return {(unsigned char)v, (unsigned char)(v >> 8),
+		        (unsigned char)(v >> 16)};
+	}
+
+  private:
+	uint64_t key, stream;
+	uint32_t index = 0;
+	philox::Counter bits;
+	int used = 4;
+};
+
+unsigned char to_byte(double v)
+{
+	return (unsigned char)(std::min(255.0, std::max(0.0, v)) + 0.5);
+}
+
+RGB_d lerp(const RGB_d &a, const RGB_d &b, double t)
+{
+	return {a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t,
+	        a.b + (b.b - a.b) * t};
+}
+
+RGB_d to_d(const RGB_uc &c) { return {(double)c.r, (double)c.g, (double)c.b}; }
+
+double smooth(double t) { return t * t * (3.0 - 2.0 * t); }
+
+// Calls make_row(r, pixels) for every row, in parallel, and stores each
+// row in the image's layout.
+template <typename MakeRow> void fill_rows(Image &image, MakeRow make_row)
+{
+	int width = image.get_width();
+	bool planar = image.get_layout() == PixelLayout::Planar;
+	auto run = [&](int begin, int end) {
+		std::vector<RGB_uc> scratch(planar ? width : 0);
+		for (int r = begin; r < end; ++r)
+		{
+			RGB_uc *pixels = planar ? scratch.data() : image.row(r);
+			make_row(r, pixels);
+			if (planar)
+				deinterleave_rgb(pixels, image.plane_row(0, r),
+				                 image.plane_row(1, r), image.plane_row(2, r),
+				                 width);
+		}
+	};
+	int rows_per_chunk = std::max(1, (1 << 14) / std::max(width, 1));
+	ThreadPool::instance().parallel_for(0, image.get_height(), run,
+	                                    rows_per_chunk);
+}
+
+void generate_gradient(Image &image, unsigned seed)
+{
+	Draws draws(seed, kParamStream + (int)ImageContent::Gradient);
+	RGB_d corner[4]; // top left, top right, bottom left, bottom right
+	for (RGB_d &c : corner)
+		c = to_d(draws.color());
+	int w = image.get_width(), h = image.get_height();
+	fill_rows(image, [&](int r, RGB_uc *pixels) {
+		double v = h > 1 ? (double)r / (h - 1) : 0.0;
+		RGB_d left = lerp(corner[0], corner[2], v);
+		RGB_d right = lerp(corner[1], corner[3], v);
+		for (int c = 0; c < w; ++c)
+		{
+			RGB_d p = lerp(left, right, w > 1 ? (double)c / (w - 1) : 0.0);
+			pixels[c] = {to_byte(p.r), to_byte(p.g), to_byte(p.b)};
+		}
+	});
+}
+
+void generate_flat(Image &image, unsigned seed)
+{
+	struct Rect
+	{
+		int r0, c0, rows, cols;
+		RGB_uc color;
+	};
+	Draws draws(seed, kParamStream + (int)ImageContent::Flat);
+	int w = image.get_width(), h = image.get_height();
+	RGB_uc palette[8];
+	for (RGB_uc &c : palette)
+		c = draws.color();
+	// Sides from 1/2 down to 1/32 of the image, painted in order.
+	long long area = (long long)w * h;
+	int count = (int)std::min(256LL, std::max(8LL, area / 16384));
+	std::vector<Rect> rects(count);
+	for (Rect &rect : rects)
+	{
+		rect.cols = std::max(1, (int)(w * std::exp2(-1 - 4 * draws.unit())));
+		rect.rows = std::max(1, (int)(h * std::exp2(-1 - 4 * draws.unit())));
+		rect.r0 = draws.below(h - rect.rows + 1);
+		rect.c0 = draws.below(w - rect.cols + 1);
+		rect.color = palette[1 + draws.below(7)];
+	}
+	fill_rows(image, [&](int r, RGB_uc *pixels) {
+		fill_rgb(pixels, w, palette[0]);
+		for (const Rect &rect : rects)
+			if (rect.r0 <= r && r < rect.r0 + rect.rows)
+				fill_rgb(pixels + rect.c0, rect.cols, rect.color);
+	});
+}
+
+void generate_photo(Image &image, unsigned seed)
+{
+	Draws draws(seed, kParamStream + (int)ImageContent::Photo);
+	RGB_d palette[3];
+	for (RGB_d &c : palette)
+		c = to_d(draws.color());
+	int w = image.get_width(), h = image.get_height();
+	// Octave o has lattice cells of base >> o pixels and weight 0.55^o.
+	// The first two octaves also drive a slow tone field that picks the
+	// palette colour; the rest only shade it. Lattice values come from
+	// Philox stream kLatticeStream + (o << 32) + lattice row.
+	const int base = std::max(8, std::max(w, h) / 3);
+	int octaves = 0;
+	while (octaves < 8 && (base >> octaves) >= 2)
+		++octaves;
+	const int tone_octaves = std::min(2, octaves);
+
+	fill_rows(image, [&](int r, RGB_uc *pixels) {
+		std::vector<double> shade(w, 0.0), tone(w, 0.0);
+		// Per lattice column, the field already blended between the
+		// lattice rows above and below r; and the horizontal weights.
+		std::vector<double> shade_col, tone_col, across;
+		double shade_total = 0, tone_total = 0, weight = 1;
+		for (int o = 0; o < octaves; ++o, weight *= 0.55)
+		{
+			int cell = base >> o;
+			double ty = smooth((double)(r % cell) / cell);
+			int nx = w / cell + 2;
+			bool toned = o < tone_octaves;
+			shade_col.resize(nx);
+			tone_col.resize(nx);
+			uint64_t stream = kLatticeStream + ((uint64_t)o << 32) + r / cell;
+			for (int ix = 0; ix < nx; ++ix)
+			{
+				// Word 0 is the shade, word 1 the tone.
+				philox::Counter above =
+				    philox::block(philox::counter(stream, ix), seed);
+				philox::Counter below =
+				    philox::block(philox::counter(stream + 1, ix), seed);
+				double a = philox::unit(above[0]), b = philox::unit(below[0]);
+				shade_col[ix] = a + (b - a) * ty;
+				a = philox::unit(above[1]);
+				b = philox::unit(below[1]);
+				tone_col[ix] = a + (b - a) * ty;
+			}
+			across.resize(cell);
+			for (int k = 0; k < cell; ++k)
+				across[k] = smooth((double)k / cell);
+			for (int ix = 0, c = 0; c < w; ++ix)
+			{
+				double s0 = shade_col[ix], ds = shade_col[ix + 1] - s0;
+				double t0 = tone_col[ix], dt = tone_col[ix + 1] - t0;
+				for (int k = 0; k < cell && c < w; ++k, ++c)
+				{
+					shade[c] += weight * (s0 + ds * across[k]);
+					if (toned)
+						tone[c] += weight * (t0 + dt * across[k]);
+				}
+			}
+			shade_total += weight;
+			if (toned)
+				tone_total += weight;
+		}
+
+		std::vector<unsigned char> grain((size_t)w * 3);
+		random_bytes(grain.data(), grain.size(), seed, kGrainStream + r);
+		for (int c = 0; c < w; ++c)
+		{
+			// Summed octaves bunch up around 0.5; stretch them back out.
+			double s = (shade[c] / shade_total - 0.5) * 2.2 + 0.5;
+			s = std::min(1.0, std::max(0.0, s));
+			double t = tone[c] / tone_total;
+			RGB_d color = t < 0.5 ? lerp(palette[0], palette[1], 2 * t)
+			                      : lerp(palette[1], palette[2], 2 * t - 1);
+			double light = 0.3 + s;
+			const unsigned char *g = &grain[(size_t)c * 3];
+			pixels[c] = {to_byte(color.r * light + g[0] % 17 - 8),
+			             to_byte(color.g * light + g[1] % 17 - 8),
+			             to_byte(color.b * light + g[2] % 17 - 8)};
+		}
+	});
+}
+} // namespace
+
+const char *content_name(ImageContent content)
+{
+	switch (content)
+	{
+	case ImageContent::Noise:
+		return "noise";
+	case ImageContent::Gradient:
+		return "gradient";
+	case ImageContent::Flat:
+		return "flat";
+	case ImageContent::Photo:
+		return "photo";
+	}
+	return "?";
+}
+
+std::vector<std::string> content_names()
+{
+	return {"noise", "gradient", "flat", "photo"};
+}
+
+ImageContent parse_content(const std::string &name)
+{
+	for (ImageContent content :
+	     {ImageContent::Noise, ImageContent::Gradient, ImageContent::Flat,
+	      ImageContent::Photo})
+		if (name == content_name(content))
+			return content;
+	throw std::invalid_argument("unknown image content '" + name +
+	                            "' (noise, gradient, flat or photo)");
+}
+
+void generate_content(Image &image, ImageContent content, unsigned seed)
+{
+	switch (content)
+	{
+	case ImageContent::Noise:
+		return image.generate_random(seed);
+	case ImageContent::Gradient:
+		return generate_gradient(image, seed);
+	case ImageContent::Flat:
+		return generate_flat(image, seed);
+	case ImageContent::Photo:
+		return generate_photo(image, seed);
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef SYNTHETIC_IMAGE_H
+#define SYNTHETIC_IMAGE_H
+
+#include "Image.h"
+#include <string>
+#include <vector>
+
+// Seeded test content. Uniform noise is the worst case for a segment tree:
+// no two neighbouring pixels agree. The other kinds are closer to what
+// real images look like:
+//
+//   Noise     Image::generate_random(seed)
+//   Gradient  bilinear blend of four corner colours
+//   Flat      solid rectangles over a background, like a screenshot or
+//             a cartoon: long runs of equal pixels
+//   Photo     fractal value noise through a colour palette, plus grain
+//
+// All kinds are built from Philox streams (Philox.h) one row at a time on
+// ThreadPool::instance(); the same seed, size and kind always give the
+// same pixels, in either layout.
+enum class ImageContent
+{
+	Noise,
+	Gradient,
+	Flat,
+	Photo
+};
+
+const char *content_name(ImageContent content);
+std::vector<std::string> content_names();
+// Throws std::invalid_argument for a name content_names() does not list.
+ImageContent parse_content(const std::string &name);
+
+// Overwrites every pixel of `image`.
+void generate_content(Image &image, ImageContent content, unsigned seed);
+
+#endif // SYNTHETIC_IMAGE_H
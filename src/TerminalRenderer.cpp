@@ -0,0 +1,283 @@
+#include "TerminalRenderer.h"
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace
+{
+// Screen rows left below a pinned frame for the menu and prompts.
+const int kTextRows = 14;
+
+bool same_color(const RGB_uc &a, const RGB_uc &b)
+{
+	return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+RGB_uc to_cell(const RGB_d &avg)
+{
+	return {saturate_cast_uchar(avg.r), saturate_cast_uchar(avg.g),
+	        saturate_cast_uchar(avg.b)};
+}
+} // namespace
+
+TerminalRenderer::TerminalRenderer(int fd) : fd(fd) {}
+
+TerminalRenderer::~TerminalRenderer()
+{
+	try
+	{
+		unpin();
+	}
+	catch (const std::exception &)
+	{
+		// The terminal went away; nothing left to restore.
+	}
+}
+
+void TerminalRenderer::set_max_cells(int cols, int rows)
+{
+	max_cols = cols;
+	max_rows = rows;
+}
+
+void TerminalRenderer::pin()
+{
+	if (pinned)
+		return;
+	pinned = true;
+	have_previous = false;
+	pinned_rows = 0;
+}
+
+void TerminalRenderer::unpin()
+{
+	if (!pinned)
+		return;
+	pinned = false;
+	have_previous = false;
+	pinned_rows = 0;
+	out.clear();
+	// Drop the scroll region, then continue below everything on screen.
+	emit("\033[0m\033[r");
+	emit_move(screen_rows, 1);
+	emit("\n");
+	flush();
+}
+
+void TerminalRenderer::draw(const Image &image)
+{
+	draw(image.get_width(), image.get_height(),
+	     [&image](int r1, int c1, int r2, int c2) {
+		     if (r1 == r2 && c1 == c2)
+			     return image.get_pixel(r1, c1);
+		     RGB_d sum = {0, 0, 0};
+		     for (int r = r1; r <= r2; ++r)
+			     for (int c = c1; c <= c2; ++c)
+			     {
+				     RGB_uc p = image.get_pixel(r, c);
+				     sum += {(double)p.r, (double)p.g, (double)p.b};
+			     }
+		     return to_cell(sum * (1.0 / ((r2 - r1 + 1) * (c2 - c1 + 1))));
+	     });
+}
+
+void TerminalRenderer::draw(const SegmentTree &tree)
+{
+	draw(tree.get_width(), tree.get_height(),
+	     [&tree](int r1, int c1, int r2, int c2) {
+		     return to_cell(tree.peek_average_color(r1, c1, r2, c2));
+	     });
+}
+
+void TerminalRenderer::draw(int width, int height, const CellSource &source)
+{
+	out.clear();
+	painted_cells = 0;
+	if (width <= 0 || height <= 0)
+	{
+		emit("[Image is empty]\n");
+		flush();
+		return;
+	}
+
+	int screen_cols = 80;
+	screen_rows = 24;
+	winsize size;
+	if (::ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 &&
+	    size.ws_row > 0)
+	{
+		screen_cols = size.ws_col;
+		screen_rows = size.ws_row;
+	}
+	if (pinned && screen_rows < kTextRows + 4)
+		unpin(); // no room to keep a frame on screen
+
+	int cols_budget = max_cols > 0 ? max_cols : std::max(1, screen_cols / 2);
+	int rows_budget = max_rows > 0 ? max_rows
+	                  : pinned     ? screen_rows - kTextRows
+	                               : std::max(1, screen_rows - 2);
+	// One factor for both axes keeps the aspect ratio.
+	int scale = std::max({1, (width + cols_budget - 1) / cols_budget,
+	                      (height + rows_budget - 1) / rows_budget});
+	int cols = (width + scale - 1) / scale, rows = (height + scale - 1) / scale;
+
+	if (pinned && have_previous && (cols != cell_cols || rows != cell_rows))
+		have_previous = false;
+	cell_cols = cols;
+	cell_rows = rows;
+	cells.resize((size_t)cols * rows);
+	for (int r = 0; r < rows; ++r)
+	{
+		int r1 = r * scale, r2 = std::min(height, r1 + scale) - 1;
+		for (int c = 0; c < cols; ++c)
+		{
+			int c1 = c * scale, c2 = std::min(width, c1 + scale) - 1;
+			cells[(size_t)r * cols + c] = source(r1, c1, r2, c2);
+		}
+	}
+
+	if (pinned)
+		build_pinned();
+	else
+		build_inline();
+	flush();
+}
+
+void TerminalRenderer::build_inline()
+{
+	for (int r = 0; r < cell_rows; ++r)
+	{
+		bool have_color = false;
+		RGB_uc current = {0, 0, 0};
+		for (int c = 0; c < cell_cols; ++c)
+		{
+			emit_color(cells[(size_t)r * cell_cols + c], have_color, current);
+			emit("  ");
+		}
+		// Reset before the newline so the background does not run on.
+		emit("\033[0m\n");
+	}
+	painted_cells = cell_cols * cell_rows;
+}
+
+void TerminalRenderer::build_pinned()
+{
+	bool full = !have_previous;
+	if (full)
+	{
+		int rows_needed = cell_rows + 1; // one blank line under the frame
+		if (pinned_rows == 0)
+			emit("\033[2J");
+		else
+			for (int r = 1; r <= std::max(pinned_rows, rows_needed); ++r)
+			{
+				emit_move(r, 1);
+				emit("\033[2K");
+			}
+		if (rows_needed != pinned_rows)
+		{
+			// The scroll region starts below the frame.
+			emit("\033[");
+			emit_number(rows_needed + 1);
+			emit(";");
+			emit_number(screen_rows);
+			emit("r");
+			pinned_rows = rows_needed;
+		}
+	}
+	else
+		emit("\0337"); // save the cursor in the text area
+
+	bool have_color = false;
+	RGB_uc current = {0, 0, 0};
+	int cursor_r = -1, cursor_c = -1;
+	for (int r = 0; r < cell_rows; ++r)
+		for (int c = 0; c < cell_cols; ++c)
+		{
+			size_t i = (size_t)r * cell_cols + c;
+			if (!full && same_color(cells[i], previous[i]))
+				continue;
+			// Consecutive changed cells need no cursor movement.
+			if (r != cursor_r || c != cursor_c)
+				emit_move(r + 1, 2 * c + 1);
+			emit_color(cells[i], have_color, current);
+			emit("  ");
+			cursor_r = r;
+			cursor_c = c + 1;
+			++painted_cells;
+		}
+	emit("\033[0m");
+
+	if (full)
+		emit_move(screen_rows, 1); // text continues at the bottom
+	else
+		emit("\0338");
+	previous.swap(cells);
+	have_previous = true;
+}
+
+void TerminalRenderer::emit(const char *s)
+{
+	while (*s)
+		out.push_back(*s++);
+}
+
+void TerminalRenderer::emit_number(int value)
+{
+	char digits[12];
+	int n = 0;
+	do
+	{
+		digits[n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+	while (n > 0)
+		out.push_back(digits[--n]);
+}
+
+void TerminalRenderer::emit_color(const RGB_uc &color, bool &have_color,
+                                  RGB_uc &current)
+{
+	if (have_color && same_color(color, current))
+		return;
+	emit("\033[48;2;");
+	emit_number(color.r);
+	out.push_back(';');
+	emit_number(color.g);
+	out.push_back(';');
+	emit_number(color.b);
+	out.push_back('m');
+	have_color = true;
+	current = color;
+}
+
+void TerminalRenderer::emit_move(int row, int col)
+{
+	emit("\033[");
+	emit_number(row);
+	out.push_back(';');
+	emit_number(col);
+	out.push_back('H');
+}
+
+void TerminalRenderer::flush()
+{
+	// Text already queued in std::cout must reach the terminal first.
+	std::cout.flush();
+	const char *p = out.data();
+	size_t n = out.size();
+	written_bytes = n;
+	while (n > 0)
+	{
+		ssize_t written = ::write(fd, p, n);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			throw std::runtime_error("error writing to the terminal");
+		p += written;
+		n -= (size_t)written;
+	}
+}
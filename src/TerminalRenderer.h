@@ -0,0 +1,76 @@
+#ifndef TERMINAL_RENDERER_H
+#define TERMINAL_RENDERER_H
+
+#include "Image.h"
+#include "SegmentTree.h"
+#include "types.h"
+#include <functional>
+#include <vector>
+
+// Draws images in a 24-bit colour terminal, one cell (two spaces with a
+// background colour) per pixel. Images larger than the terminal are shrunk
+// by an integer factor, each cell showing the average of its block; a
+// SegmentTree answers those averages directly, without exporting the image.
+//
+// A frame is built in a reused byte buffer and written with one write(2).
+// Colour codes are emitted only where the colour changes along a row.
+//
+// Inline mode (the default) prints each frame at the cursor, like text.
+// Pinned mode keeps the frame at the top of the screen and scrolls all
+// other output in a region below it. There, a frame of the same size as
+// the previous one repaints only the cells whose colour changed.
+class TerminalRenderer
+{
+  public:
+	explicit TerminalRenderer(int fd = 1);
+	~TerminalRenderer();
+
+	TerminalRenderer(const TerminalRenderer &) = delete;
+	TerminalRenderer &operator=(const TerminalRenderer &) = delete;
+
+	void draw(const Image &image);
+	void draw(const SegmentTree &tree);
+
+	// Clears the screen and switches to pinned mode; the next frame is drawn
+	// in full. unpin() restores normal scrolling below the last frame.
+	void pin();
+	void unpin();
+	bool is_pinned() const { return pinned; }
+
+	// Cell budget for frames; 0 means the terminal size (80x24 when the
+	// output is not a terminal).
+	void set_max_cells(int cols, int rows);
+
+	// Cells repainted and bytes written by the last draw().
+	int get_painted_cells() const { return painted_cells; }
+	size_t get_written_bytes() const { return written_bytes; }
+
+  private:
+	using CellSource = std::function<RGB_uc(int r1, int c1, int r2, int c2)>;
+
+	int fd;
+	bool pinned = false;
+	int max_cols = 0, max_rows = 0;
+	int screen_rows = 24;
+
+	// The frame currently on screen (pinned mode) and its size in cells.
+	std::vector<RGB_uc> cells, previous;
+	int cell_cols = 0, cell_rows = 0;
+	bool have_previous = false;
+	int pinned_rows = 0; // screen rows reserved above the scroll region
+
+	std::vector<char> out;
+	int painted_cells = 0;
+	size_t written_bytes = 0;
+
+	void draw(int width, int height, const CellSource &source);
+	void build_inline();
+	void build_pinned();
+	void emit(const char *s);
+	void emit_number(int value);
+	void emit_color(const RGB_uc &color, bool &have_color, RGB_uc &current);
+	void emit_move(int row, int col);
+	void flush();
+};
+
+#endif // TERMINAL_RENDERER_H
@@ -0,0 +1,117 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace
+{
+// Set on workers, and on a caller while it runs chunks of its own job, so
+// a nested parallel_for runs inline instead of waiting on submit_mutex.
+thread_local bool in_pool_job = false;
+}
+
+ThreadPool::ThreadPool(int threads) { start(threads); }
+
+ThreadPool::~ThreadPool() { stop(); }
+
+ThreadPool &ThreadPool::instance()
+{
+	static ThreadPool pool(
+	    (int)std::max(1u, std::thread::hardware_concurrency()));
+	return pool;
+}
+
+void ThreadPool::resize(int threads)
+{
+	std::lock_guard<std::mutex> submit(submit_mutex);
+	stop();
+	start(threads);
+}
+
+void ThreadPool::start(int threads)
+{
+	stopping = false;
+	for (int i = 1; i < std::max(1, threads); ++i)
+		workers.emplace_back(&ThreadPool::worker_loop, this, generation);
+}
+
+void ThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto &t : workers)
+		t.join();
+	workers.clear();
+}
+
+void ThreadPool::parallel_for(int begin, int end,
+                              const std::function<void(int, int)> &fn,
+                              int min_chunk)
+{
+	if (begin >= end)
+		return;
+	int n = end - begin;
+	// A few chunks per thread balances uneven rows without much overhead.
+	int target_chunks = size() * 4;
+	int chunk = std::max(std::max(1, min_chunk),
+	                     (n + target_chunks - 1) / target_chunks);
+	if (in_pool_job || workers.empty() || chunk >= n)
+	{
+		fn(begin, end);
+		return;
+	}
+
+	std::lock_guard<std::mutex> submit(submit_mutex);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job.fn = &fn;
+		job.begin = begin;
+		job.end = end;
+		job.chunk = chunk;
+		job.next = begin;
+		job.active = (int)workers.size();
+		++generation;
+	}
+	wake.notify_all();
+
+	in_pool_job = true;
+	run_chunks();
+	in_pool_job = false;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&]() { return job.active == 0; });
+	job.fn = nullptr;
+}
+
+void ThreadPool::run_chunks()
+{
+	for (;;)
+	{
+		int first = job.next.fetch_add(job.chunk);
+		if (first >= job.end)
+			return;
+		(*job.fn)(first, std::min(job.end, first + job.chunk));
+	}
+}
+
+void ThreadPool::worker_loop(unsigned long long seen)
+{
+	in_pool_job = true;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&]() { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+		run_chunks();
+		if (job.active.fetch_sub(1) == 1)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done.notify_all();
+		}
+	}
+}
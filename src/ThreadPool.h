@@ -0,0 +1,62 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent workers for data-parallel loops. Threads are created once and
+// parked between jobs, so a parallel_for costs a wake-up rather than a
+// thread spawn.
+class ThreadPool
+{
+  public:
+	// `threads` counts the calling thread, so ThreadPool(1) spawns nothing.
+	explicit ThreadPool(int threads);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	// Process-wide pool sized to the hardware concurrency.
+	static ThreadPool &instance();
+
+	int size() const { return (int)workers.size() + 1; }
+	// Restarts the workers with a new thread count (>= 1).
+	void resize(int threads);
+
+	// Calls fn(chunk_begin, chunk_end) over [begin, end) split into chunks of
+	// at least `min_chunk` items; the caller works too and the call returns
+	// when every chunk is done. Nested calls from inside a chunk run inline,
+	// whether on a worker or on the caller.
+	void parallel_for(int begin, int end,
+	                  const std::function<void(int, int)> &fn,
+	                  int min_chunk = 1);
+
+  private:
+	struct Job
+	{
+		const std::function<void(int, int)> *fn = nullptr;
+		int begin = 0, end = 0, chunk = 1;
+		std::atomic<int> next{0};
+		std::atomic<int> active{0};
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::mutex submit_mutex; // one job in flight at a time
+	Job job;
+	unsigned long long generation = 0;
+	bool stopping = false;
+
+	void start(int threads);
+	void stop();
+	void worker_loop(unsigned long long seen);
+	void run_chunks();
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,245 @@
+#include "TiledImage.h"
+#include <algorithm>
+#include <future>
+
+TiledImage::TiledImage(const Image &image, int tile_size, int worker_count)
+    : width(image.get_width()), height(image.get_height()),
+      tile_size(std::max(1, tile_size))
+{
+	tile_rows = (height + this->tile_size - 1) / this->tile_size;
+	tile_cols = (width + this->tile_size - 1) / this->tile_size;
+	tiles.reserve((size_t)tile_rows * tile_cols);
+	for (int tr = 0; tr < tile_rows; ++tr)
+		for (int tc = 0; tc < tile_cols; ++tc)
+		{
+			int r0 = tr * this->tile_size, c0 = tc * this->tile_size;
+			tiles.push_back({r0, c0, std::min(this->tile_size, height - r0),
+			                 std::min(this->tile_size, width - c0), nullptr});
+		}
+
+	if (worker_count <= 0)
+		worker_count = (int)std::max(1u, std::thread::hardware_concurrency());
+	worker_count = std::max(1, std::min(worker_count, (int)tiles.size()));
+	for (int i = 0; i < worker_count; ++i)
+		workers.push_back(std::make_unique<Worker>());
+	for (auto &w : workers)
+		w->thread = std::thread(&TiledImage::worker_loop, this, std::ref(*w));
+
+	// Each worker builds its own trees so their memory is first touched by
+	// the core that will use it.
+	run_on_all([&](int worker) {
+		for (size_t i = 0; i < tiles.size(); ++i)
+		{
+			if (owner((int)i) != worker)
+				continue;
+			Tile &t = tiles[i];
+			Image piece(t.cols, t.rows, image.get_layout());
+			for (int r = 0; r < t.rows; ++r)
+				for (int c = 0; c < t.cols; ++c)
+					piece.set_pixel(r, c, image.get_pixel(t.r0 + r, t.c0 + c));
+			t.tree = std::make_unique<SegmentTree>(piece);
+		}
+	});
+}
+
+TiledImage::~TiledImage()
+{
+	for (auto &w : workers)
+	{
+		{
+			std::lock_guard<std::mutex> lock(w->mutex);
+			w->stopping = true;
+		}
+		w->ready.notify_one();
+	}
+	for (auto &w : workers)
+		w->thread.join();
+}
+
+void TiledImage::enqueue(int worker, std::function<void()> task)
+{
+	Worker &w = *workers[worker];
+	{
+		std::lock_guard<std::mutex> lock(w.mutex);
+		w.queue.push_back(std::move(task));
+	}
+	w.ready.notify_one();
+}
+
+void TiledImage::worker_loop(Worker &worker)
+{
+	for (;;)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(worker.mutex);
+			worker.ready.wait(lock, [&]() {
+				return worker.stopping || !worker.queue.empty();
+			});
+			if (worker.queue.empty())
+				return; // stopping and drained
+			task = std::move(worker.queue.front());
+			worker.queue.pop_front();
+		}
+		task();
+	}
+}
+
+void TiledImage::for_each_tile(
+    int r1, int c1, int r2, int c2,
+    const std::function<void(Tile &, int, int, int, int)> &fn)
+{
+	int tr1 = std::max(0, r1) / tile_size;
+	int tr2 = std::min(height - 1, r2) / tile_size;
+	int tc1 = std::max(0, c1) / tile_size;
+	int tc2 = std::min(width - 1, c2) / tile_size;
+
+	std::lock_guard<std::mutex> order(dispatch_mutex);
+	for (int tr = tr1; tr <= tr2; ++tr)
+		for (int tc = tc1; tc <= tc2; ++tc)
+		{
+			int index = tr * tile_cols + tc;
+			Tile &t = tiles[index];
+			int lr1 = std::max(r1, t.r0) - t.r0;
+			int lc1 = std::max(c1, t.c0) - t.c0;
+			int lr2 = std::min(r2, t.r0 + t.rows - 1) - t.r0;
+			int lc2 = std::min(c2, t.c0 + t.cols - 1) - t.c0;
+			enqueue(owner(index), [&t, fn, lr1, lc1, lr2, lc2]() {
+				fn(t, lr1, lc1, lr2, lc2);
+			});
+		}
+}
+
+void TiledImage::run_on_all(const std::function<void(int)> &fn)
+{
+	std::vector<std::future<void>> pending;
+	{
+		std::lock_guard<std::mutex> order(dispatch_mutex);
+		for (int i = 0; i < (int)workers.size(); ++i)
+		{
+			auto task = std::make_shared<std::packaged_task<void()>>(
+			    [&fn, i]() { fn(i); });
+			pending.push_back(task->get_future());
+			enqueue(i, [task]() { (*task)(); });
+		}
+	}
+	for (auto &f : pending)
+		f.get();
+}
+
+void TiledImage::adjust_brightness(int r1, int c1, int r2, int c2, int value)
+{
+	for_each_tile(r1, c1, r2, c2,
+	              [value](Tile &t, int lr1, int lc1, int lr2, int lc2) {
+		              t.tree->adjust_brightness(lr1, lc1, lr2, lc2, value);
+	              });
+}
+
+void TiledImage::adjust_contrast(int r1, int c1, int r2, int c2,
+                                 double multiplier)
+{
+	for_each_tile(r1, c1, r2, c2,
+	              [multiplier](Tile &t, int lr1, int lc1, int lr2, int lc2) {
+		              t.tree->adjust_contrast(lr1, lc1, lr2, lc2, multiplier);
+	              });
+}
+
+void TiledImage::fill_region(int r1, int c1, int r2, int c2,
+                             const RGB_uc &color)
+{
+	for_each_tile(r1, c1, r2, c2,
+	              [color](Tile &t, int lr1, int lc1, int lr2, int lc2) {
+		              t.tree->fill_region(lr1, lc1, lr2, lc2, color);
+	              });
+}
+
+RGB_d TiledImage::query_average_color(int r1, int c1, int r2, int c2)
+{
+	long long num_pixels = (long long)(r2 - r1 + 1) * (c2 - c1 + 1);
+	if (num_pixels <= 0)
+		return {0, 0, 0};
+
+	// Tiles are clamped to the image as in for_each_tile(); pixels outside
+	// it add nothing to the sum.
+	int tr1 = std::max(0, r1) / tile_size;
+	int tr2 = std::min(height - 1, r2) / tile_size;
+	int tc1 = std::max(0, c1) / tile_size;
+	int tc2 = std::min(width - 1, c2) / tile_size;
+
+	// One partial sum per worker, each over that worker's tiles.
+	std::vector<RGB_d> partial(workers.size(), RGB_d{0, 0, 0});
+	run_on_all([&](int worker) {
+		for (int tr = tr1; tr <= tr2; ++tr)
+			for (int tc = tc1; tc <= tc2; ++tc)
+			{
+				int index = tr * tile_cols + tc;
+				if (owner(index) != worker)
+					continue;
+				Tile &t = tiles[index];
+				partial[worker] += t.tree->query_sum(
+				    std::max(r1, t.r0) - t.r0, std::max(c1, t.c0) - t.c0,
+				    std::min(r2, t.r0 + t.rows - 1) - t.r0,
+				    std::min(c2, t.c0 + t.cols - 1) - t.c0);
+			}
+	});
+
+	RGB_d total = {0, 0, 0};
+	for (const auto &p : partial)
+		total += p;
+	return {total.r / num_pixels, total.g / num_pixels, total.b / num_pixels};
+}
+
+Image TiledImage::get_image(PixelLayout layout)
+{
+	Image image = Image::uninitialized(width, height, layout);
+	run_on_all([&](int worker) {
+		for (size_t i = 0; i < tiles.size(); ++i)
+		{
+			if (owner((int)i) != worker)
+				continue;
+			Tile &t = tiles[i];
+			Image piece = t.tree->get_image();
+			// Tiles are disjoint, so workers never write the same pixel.
+			for (int r = 0; r < t.rows; ++r)
+				for (int c = 0; c < t.cols; ++c)
+					image.set_pixel(t.r0 + r, t.c0 + c, piece.get_pixel(r, c));
+		}
+	});
+	return image;
+}
+
+void TiledImage::flush()
+{
+	run_on_all([](int) {});
+}
+
+size_t TiledImage::memory_footprint() const
+{
+	// Trees are only replaced by the constructor, so their sizes can be
+	// read while workers edit them.
+	size_t bytes = sizeof(TiledImage) + tiles.capacity() * sizeof(Tile) +
+	               workers.size() * sizeof(Worker);
+	for (const Tile &t : tiles)
+		bytes += t.tree->memory_footprint();
+	return bytes;
+}
+
+size_t TiledImage::footprint_for(int width, int height, int tile_size,
+                                 int workers)
+{
+	tile_size = std::max(1, tile_size);
+	size_t tiles = 0, trees = 0;
+	for (int r0 = 0; r0 < height; r0 += tile_size)
+		for (int c0 = 0; c0 < width; c0 += tile_size)
+		{
+			++tiles;
+			trees += SegmentTree::footprint_for(
+			    std::min(tile_size, width - c0),
+			    std::min(tile_size, height - r0));
+		}
+	if (workers <= 0)
+		workers = (int)std::max(1u, std::thread::hardware_concurrency());
+	workers = (int)std::max<size_t>(1, std::min((size_t)workers, tiles));
+	return sizeof(TiledImage) + tiles * sizeof(Tile) +
+	       workers * sizeof(Worker) + trees;
+}
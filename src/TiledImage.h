@@ -0,0 +1,96 @@
+#ifndef TILED_IMAGE_H
+#define TILED_IMAGE_H
+
+#include "Image.h"
+#include "SegmentTree.h"
+#include "types.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// An image sharded into fixed-size tiles, each with its own SegmentTree
+// owned by one worker thread. Updates are split at tile boundaries and
+// queued to the owning workers, so edits to disjoint tiles run in parallel
+// and each tree stays small enough to live in one core's cache. Queries and
+// exports fan out to the workers and merge their partial results.
+//
+// Updates return once queued; queries and exports observe every update
+// issued before them. Safe to call from several client threads.
+class TiledImage
+{
+  public:
+	// workers = 0 uses one worker per hardware core.
+	explicit TiledImage(const Image &image, int tile_size = 512,
+	                    int workers = 0);
+	~TiledImage();
+
+	TiledImage(const TiledImage &) = delete;
+	TiledImage &operator=(const TiledImage &) = delete;
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+	int get_tile_size() const { return tile_size; }
+	int get_worker_count() const { return (int)workers.size(); }
+
+	void adjust_brightness(int r1, int c1, int r2, int c2, int value);
+	void adjust_contrast(int r1, int c1, int r2, int c2, double multiplier);
+	void fill_region(int r1, int c1, int r2, int c2, const RGB_uc &color);
+
+	RGB_d query_average_color(int r1, int c1, int r2, int c2);
+	Image get_image(PixelLayout layout = PixelLayout::Interleaved);
+
+	// Blocks until every queued update has been applied.
+	void flush();
+
+	// Bytes held by the tiles' trees and the tile and worker tables; not
+	// counting updates still queued.
+	size_t memory_footprint() const;
+	// The footprint of a TiledImage built for a width x height image.
+	static size_t footprint_for(int width, int height, int tile_size = 512,
+	                            int workers = 0);
+
+  private:
+	struct Tile
+	{
+		int r0, c0, rows, cols;
+		std::unique_ptr<SegmentTree> tree;
+	};
+
+	struct Worker
+	{
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable ready;
+		std::deque<std::function<void()>> queue;
+		bool stopping = false;
+	};
+
+	int width, height, tile_size;
+	int tile_rows, tile_cols;
+	std::vector<Tile> tiles;
+	std::vector<std::unique_ptr<Worker>> workers;
+	// Held while an operation's pieces are queued, so every worker sees
+	// operations in the same global order.
+	std::mutex dispatch_mutex;
+
+	int owner(int tile_index) const
+	{
+		return tile_index % (int)workers.size();
+	}
+	void enqueue(int worker, std::function<void()> task);
+	void worker_loop(Worker &worker);
+
+	// Calls fn(tile, lr1, lc1, lr2, lc2) on each tile's worker with the
+	// rectangle clipped to the tile, in tile-local coordinates.
+	void for_each_tile(
+	    int r1, int c1, int r2, int c2,
+	    const std::function<void(Tile &, int, int, int, int)> &fn);
+	// Runs fn(worker_index) on every worker and waits for all of them.
+	void run_on_all(const std::function<void(int)> &fn);
+};
+
+#endif // TILED_IMAGE_H
@@ -0,0 +1,260 @@
+#include "Trace.h"
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+namespace
+{
+const char kTraceMagic[8] = {'P', 'N', 'G', 'T', 'R', 'A', 'C', 'E'};
+// Version 2: the image seed refers to the Philox Image::generate_random.
+// Version 1 seeds were for an earlier generator and are dropped on read.
+const uint32_t kTraceVersion = 2;
+const size_t kHeaderSize = 32;
+const size_t kRecordSize = 36;
+
+void put_u32(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = (unsigned char)(v >> (8 * i));
+}
+
+void put_u64(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i)
+		p[i] = (unsigned char)(v >> (8 * i));
+}
+
+uint32_t get_u32(const unsigned char *p)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < 4; ++i)
+		v |= (uint32_t)p[i] << (8 * i);
+	return v;
+}
+
+uint64_t get_u64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; ++i)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+void encode_header(unsigned char *p, int width, int height, uint64_t seed)
+{
+	std::memcpy(p, kTraceMagic, 8);
+	put_u32(p + 8, kTraceVersion);
+	put_u32(p + 12, (uint32_t)kRecordSize);
+	put_u32(p + 16, (uint32_t)width);
+	put_u32(p + 20, (uint32_t)height);
+	put_u64(p + 24, seed);
+}
+
+void encode_record(unsigned char *p, const TraceRecord &r)
+{
+	p[0] = (unsigned char)r.op;
+	p[1] = r.color.r;
+	p[2] = r.color.g;
+	p[3] = r.color.b;
+	put_u32(p + 4, (uint32_t)r.r1);
+	put_u32(p + 8, (uint32_t)r.c1);
+	put_u32(p + 12, (uint32_t)r.r2);
+	put_u32(p + 16, (uint32_t)r.c2);
+	uint64_t bits;
+	std::memcpy(&bits, &r.value, sizeof(bits));
+	put_u64(p + 20, bits);
+	put_u64(p + 28, r.time_ns);
+}
+
+TraceRecord decode_record(const unsigned char *p)
+{
+	TraceRecord r;
+	r.op = (TraceOp)p[0];
+	r.color = {p[1], p[2], p[3]};
+	r.r1 = (int)get_u32(p + 4);
+	r.c1 = (int)get_u32(p + 8);
+	r.r2 = (int)get_u32(p + 12);
+	r.c2 = (int)get_u32(p + 16);
+	uint64_t bits = get_u64(p + 20);
+	std::memcpy(&r.value, &bits, sizeof(bits));
+	r.time_ns = get_u64(p + 28);
+	return r;
+}
+} // namespace
+
+TraceWriter::TraceWriter(const std::string &path, int width, int height,
+                         uint64_t seed)
+    : out(path, std::ios::binary | std::ios::trunc), path(path),
+      start(std::chrono::steady_clock::now())
+{
+	if (!out)
+		throw std::runtime_error("cannot create " + path);
+	unsigned char header[kHeaderSize];
+	encode_header(header, width, height, seed);
+	out.write(reinterpret_cast<const char *>(header), kHeaderSize);
+}
+
+void TraceWriter::append(TraceRecord record)
+{
+	record.time_ns = (uint64_t)std::chrono::duration_cast<
+	                     std::chrono::nanoseconds>(
+	                     std::chrono::steady_clock::now() - start)
+	                     .count();
+	unsigned char buf[kRecordSize];
+	encode_record(buf, record);
+	out.write(reinterpret_cast<const char *>(buf), kRecordSize);
+	++count;
+}
+
+void TraceWriter::flush()
+{
+	out.flush();
+	if (!out)
+		throw std::runtime_error("error writing " + path);
+}
+
+Trace read_trace(const std::string &path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error("cannot open " + path);
+	unsigned char header[kHeaderSize];
+	if (!in.read(reinterpret_cast<char *>(header), kHeaderSize) ||
+	    std::memcmp(header, kTraceMagic, 8) != 0)
+		throw std::runtime_error(path + " is not a trace file");
+	uint32_t version = get_u32(header + 8);
+	if ((version != kTraceVersion && version != 1) ||
+	    get_u32(header + 12) != kRecordSize)
+		throw std::runtime_error(path + ": unsupported trace version");
+
+	Trace trace;
+	trace.width = (int)get_u32(header + 16);
+	trace.height = (int)get_u32(header + 20);
+	trace.seed = version == 1 ? Trace::kNoSeed : get_u64(header + 24);
+	if (trace.width <= 0 || trace.height <= 0)
+		throw std::runtime_error(path + ": bad image size");
+
+	unsigned char buf[kRecordSize];
+	while (in.read(reinterpret_cast<char *>(buf), kRecordSize))
+	{
+		TraceRecord r = decode_record(buf);
+		if ((int)r.op > (int)TraceOp::Query || r.r1 < 0 || r.c1 < 0 ||
+		    r.r1 > r.r2 || r.c1 > r.c2 || r.r2 >= trace.height ||
+		    r.c2 >= trace.width)
+			throw std::runtime_error(path + ": bad record " +
+			                         std::to_string(trace.records.size()));
+		trace.records.push_back(r);
+	}
+	return trace;
+}
+
+void write_trace(const std::string &path, const Trace &trace)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::runtime_error("cannot create " + path);
+	unsigned char header[kHeaderSize];
+	encode_header(header, trace.width, trace.height, trace.seed);
+	out.write(reinterpret_cast<const char *>(header), kHeaderSize);
+	unsigned char buf[kRecordSize];
+	for (const TraceRecord &r : trace.records)
+	{
+		encode_record(buf, r);
+		out.write(reinterpret_cast<const char *>(buf), kRecordSize);
+	}
+	out.flush();
+	if (!out)
+		throw std::runtime_error("error writing " + path);
+}
+
+Trace random_trace(int width, int height, int count, unsigned seed)
+{
+	Trace trace;
+	trace.width = width;
+	trace.height = height;
+	std::mt19937 gen(seed);
+	std::uniform_int_distribution<> op_dist(0, 2);
+	std::uniform_int_distribution<> val_dist(-255, 255);
+	std::uniform_int_distribution<> color_dist(0, 255);
+	std::uniform_real_distribution<> mul_dist(0.5, 1.5);
+	std::uniform_int_distribution<> r_dist(0, height - 1);
+	std::uniform_int_distribution<> c_dist(0, width - 1);
+
+	for (int i = 0; i < count; ++i)
+	{
+		TraceRecord r;
+		int op = op_dist(gen);
+		r.r1 = r_dist(gen);
+		r.r2 = r_dist(gen);
+		r.c1 = c_dist(gen);
+		r.c2 = c_dist(gen);
+		if (r.r1 > r.r2)
+			std::swap(r.r1, r.r2);
+		if (r.c1 > r.c2)
+			std::swap(r.c1, r.c2);
+		if (op == 0)
+		{
+			r.op = TraceOp::Brightness;
+			r.value = val_dist(gen);
+		}
+		else if (op == 1)
+		{
+			r.op = TraceOp::Fill;
+			unsigned char gray = (unsigned char)color_dist(gen);
+			r.color = {gray, gray, gray};
+		}
+		else
+		{
+			r.op = TraceOp::Contrast;
+			r.value = mul_dist(gen);
+		}
+		trace.records.push_back(r);
+	}
+	return trace;
+}
+
+RGB_d apply_record(ImageEngine &engine, const TraceRecord &r)
+{
+	switch (r.op)
+	{
+	case TraceOp::Brightness:
+		engine.adjust_brightness(r.r1, r.c1, r.r2, r.c2, (int)r.value);
+		break;
+	case TraceOp::Contrast:
+		engine.adjust_contrast(r.r1, r.c1, r.r2, r.c2, r.value);
+		break;
+	case TraceOp::Fill:
+		engine.fill_region(r.r1, r.c1, r.r2, r.c2, r.color);
+		break;
+	case TraceOp::Query:
+		return engine.query_average_color(r.r1, r.c1, r.r2, r.c2);
+	}
+	return {0, 0, 0};
+}
+
+void RecordingEngine::adjust_brightness(int r1, int c1, int r2, int c2,
+                                        int value)
+{
+	writer.append({TraceOp::Brightness, r1, c1, r2, c2, (double)value});
+	inner.adjust_brightness(r1, c1, r2, c2, value);
+}
+
+void RecordingEngine::adjust_contrast(int r1, int c1, int r2, int c2,
+                                      double multiplier)
+{
+	writer.append({TraceOp::Contrast, r1, c1, r2, c2, multiplier});
+	inner.adjust_contrast(r1, c1, r2, c2, multiplier);
+}
+
+void RecordingEngine::fill_region(int r1, int c1, int r2, int c2,
+                                  const RGB_uc &color)
+{
+	writer.append({TraceOp::Fill, r1, c1, r2, c2, 0, color});
+	inner.fill_region(r1, c1, r2, c2, color);
+}
+
+RGB_d RecordingEngine::query_average_color(int r1, int c1, int r2, int c2)
+{
+	writer.append({TraceOp::Query, r1, c1, r2, c2});
+	return inner.query_average_color(r1, c1, r2, c2);
+}
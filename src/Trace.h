@@ -0,0 +1,112 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "Engine.h"
+#include "types.h"
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary operation traces, so that a workload recorded from the CLI (or
+// generated) can be replayed against any engine.
+//
+// File layout, all little-endian: a 32-byte header ("PNGTRACE", version,
+// record size, width, height, image seed), then fixed-size 36-byte records
+// (op, fill color, r1, c1, r2, c2, value, time). The record count follows
+// from the file size, so a trace cut short by a crash loses only its last
+// partial record.
+
+enum class TraceOp : uint8_t
+{
+	Brightness, // value = brightness delta
+	Contrast,   // value = multiplier
+	Fill,       // color
+	Query       // average color
+};
+
+struct TraceRecord
+{
+	TraceOp op;
+	int r1, c1, r2, c2;
+	double value = 0;
+	RGB_uc color = {0, 0, 0};
+	uint64_t time_ns = 0; // since the recording started
+};
+
+struct Trace
+{
+	// The initial image is Image::generate_random(seed) at this size when
+	// the seed is known.
+	static constexpr uint64_t kNoSeed = ~0ULL;
+
+	int width = 0, height = 0;
+	uint64_t seed = kNoSeed;
+	std::vector<TraceRecord> records;
+};
+
+// Appends records to a trace file as they happen. Throws std::runtime_error
+// if the file cannot be written.
+class TraceWriter
+{
+  public:
+	TraceWriter(const std::string &path, int width, int height,
+	            uint64_t seed = Trace::kNoSeed);
+
+	// Stamps `record` with the time since construction and appends it.
+	void append(TraceRecord record);
+	void flush();
+	uint64_t get_count() const { return count; }
+
+  private:
+	std::ofstream out;
+	std::string path;
+	std::chrono::steady_clock::time_point start;
+	uint64_t count = 0;
+};
+
+Trace read_trace(const std::string &path);
+void write_trace(const std::string &path, const Trace &trace);
+
+// `count` random brightness, fill and contrast updates over random
+// rectangles: the workload of the CLI's many-update benchmark.
+Trace random_trace(int width, int height, int count, unsigned seed);
+
+// Applies one record to `engine`; returns the query result for queries and
+// zero otherwise.
+RGB_d apply_record(ImageEngine &engine, const TraceRecord &record);
+
+// Forwards every operation to `inner` and appends it to `writer`.
+class RecordingEngine : public ImageEngine
+{
+  public:
+	RecordingEngine(ImageEngine &inner, TraceWriter &writer)
+	    : inner(inner), writer(writer)
+	{
+	}
+
+	const char *name() const override { return inner.name(); }
+	int get_width() const override { return inner.get_width(); }
+	int get_height() const override { return inner.get_height(); }
+
+	void adjust_brightness(int r1, int c1, int r2, int c2,
+	                       int value) override;
+	void adjust_contrast(int r1, int c1, int r2, int c2,
+	                     double multiplier) override;
+	void fill_region(int r1, int c1, int r2, int c2,
+	                 const RGB_uc &color) override;
+	RGB_d query_average_color(int r1, int c1, int r2, int c2) override;
+	Image get_image() override { return inner.get_image(); }
+	void flush() override { inner.flush(); }
+	size_t memory_footprint() const override
+	{
+		return inner.memory_footprint();
+	}
+
+  private:
+	ImageEngine &inner;
+	TraceWriter &writer;
+};
+
+#endif // TRACE_H
@@ -1,61 +1,184 @@
 #include "VectorImage.h"
+#include "PixelKernels.h"
+#include "ThreadPool.h"
 #include "types.h"
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 
-VectorImage::VectorImage(int width, int height) : width(width), height(height) {
-    image_data.resize(width * height);
-    generate_random();
+namespace {
+// 256x256: below this, waking the pool costs more than the pass itself.
+std::atomic<long long> parallel_threshold{1 << 16};
 }
 
-void VectorImage::generate_random() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, 255);
-
-    for (auto& pixel : image_data) {
-        pixel.r = dis(gen);
-        pixel.g = dis(gen);
-        pixel.b = dis(gen);
-    }
+VectorImage::VectorImage(int width, int height, PixelLayout layout)
+    : image(Image::uninitialized(width, height, layout)), width(width),
+      height(height) {
+    generate_random();
 }
 
-Image VectorImage::get_image() const {
-    Image image(width, height);
+VectorImage::VectorImage(const Image& source)
+    : image(source), width(source.get_width()), height(source.get_height()) {}
+
+VectorImage::VectorImage(int width, int height, const RowSource& source,
+                         PixelLayout layout)
+    : image(Image::uninitialized(width, height, layout)), width(width),
+      height(height) {
+    std::vector<RGB_uc> pixels(layout == PixelLayout::Planar ? width : 0);
     for (int r = 0; r < height; ++r) {
+        if (layout == PixelLayout::Interleaved) {
+            source(r, image.row(r));
+            continue;
+        }
+        source(r, pixels.data());
         for (int c = 0; c < width; ++c) {
-            image.set_pixel(r, c, image_data[r * width + c]);
+            image.plane_row(0, r)[c] = pixels[c].r;
+            image.plane_row(1, r)[c] = pixels[c].g;
+            image.plane_row(2, r)[c] = pixels[c].b;
         }
     }
+}
+
+void VectorImage::generate_random() {
+    image.generate_random();
+}
+
+void VectorImage::generate_random(unsigned seed) {
+    image.generate_random(seed);
+}
+
+Image VectorImage::get_image() const {
     return image;
 }
 
-void VectorImage::adjust_brightness(int r1, int c1, int r2, int c2, int value) {
+Image VectorImage::get_region(int r1, int c1, int r2, int c2) const {
+    Image region(c2 - c1 + 1, r2 - r1 + 1, image.get_layout());
     for (int r = r1; r <= r2; ++r) {
-        for (int c = c1; c <= c2; ++c) {
-            RGB_uc& pixel = image_data[r * width + c];
-            pixel.r = saturate_cast_uchar(pixel.r + value);
-            pixel.g = saturate_cast_uchar(pixel.g + value);
-            pixel.b = saturate_cast_uchar(pixel.b + value);
+        if (image.get_layout() == PixelLayout::Interleaved) {
+            std::copy(image.row(r) + c1, image.row(r) + c2 + 1,
+                      region.row(r - r1));
+            continue;
+        }
+        for (int ch = 0; ch < 3; ++ch) {
+            std::copy(image.plane_row(ch, r) + c1, image.plane_row(ch, r) + c2 + 1,
+                      region.plane_row(ch, r - r1));
         }
     }
+    return region;
 }
 
-void VectorImage::adjust_contrast(int r1, int c1, int r2, int c2, double multiplier) {
-    for (int r = r1; r <= r2; ++r) {
-        for (int c = c1; c <= c2; ++c) {
-            RGB_uc& pixel = image_data[r * width + c];
-            pixel.r = saturate_cast_uchar(pixel.r * multiplier);
-            pixel.g = saturate_cast_uchar(pixel.g * multiplier);
-            pixel.b = saturate_cast_uchar(pixel.b * multiplier);
+void VectorImage::export_rows(const RowSink& sink) const {
+    std::vector<RGB_uc> pixels(get_layout() == PixelLayout::Planar ? width : 0);
+    for (int r = 0; r < height; ++r) {
+        if (get_layout() == PixelLayout::Interleaved) {
+            sink(r, image.row(r));
+            continue;
+        }
+        for (int c = 0; c < width; ++c)
+            pixels[c] = {image.plane_row(0, r)[c], image.plane_row(1, r)[c],
+                         image.plane_row(2, r)[c]};
+        sink(r, pixels.data());
+    }
+}
+
+void VectorImage::assign_region(int r1, int c1, const Image& patch) {
+    Image source = patch.to_layout(image.get_layout());
+    int w = source.get_width();
+    for (int r = 0; r < source.get_height(); ++r) {
+        if (image.get_layout() == PixelLayout::Interleaved) {
+            std::copy(source.row(r), source.row(r) + w, image.row(r1 + r) + c1);
+            continue;
+        }
+        for (int ch = 0; ch < 3; ++ch) {
+            std::copy(source.plane_row(ch, r), source.plane_row(ch, r) + w,
+                      image.plane_row(ch, r1 + r) + c1);
         }
     }
 }
 
+void VectorImage::adjust_brightness(int r1, int c1, int r2, int c2, int value) {
+    for_each_span_parallel(r1, c1, r2, c2, [&](unsigned char* span, size_t pixels, int channel) {
+        add_saturate_bytes(span, channel < 0 ? pixels * 3 : pixels, value);
+    });
+}
+
+void VectorImage::adjust_contrast(int r1, int c1, int r2, int c2, double multiplier) {
+    for_each_span_parallel(r1, c1, r2, c2, [&](unsigned char* span, size_t pixels, int channel) {
+        scale_saturate_bytes(span, channel < 0 ? pixels * 3 : pixels, multiplier);
+    });
+}
+
 void VectorImage::fill_region(int r1, int c1, int r2, int c2, const RGB_uc& color) {
-    for (int r = r1; r <= r2; ++r) {
-        for (int c = c1; c <= c2; ++c) {
-            image_data[r * width + c] = color;
+    const unsigned char channel_values[3] = {color.r, color.g, color.b};
+    for_each_span_parallel(r1, c1, r2, c2, [&](unsigned char* span, size_t pixels, int channel) {
+        if (channel < 0)
+            fill_rgb(reinterpret_cast<RGB_uc*>(span), pixels, color);
+        else
+            std::memset(span, channel_values[channel], pixels);
+    });
+}
+
+RGB_d VectorImage::query_average_color(int r1, int c1, int r2, int c2) {
+    long long num_pixels = (long long)(r2 - r1 + 1) * (c2 - c1 + 1);
+    if (num_pixels <= 0)
+        return {0, 0, 0};
+    unsigned long long sum[3] = {0, 0, 0};
+    for_each_span(r1, c1, r2, c2, [&](unsigned char* span, size_t pixels, int channel) {
+        if (channel >= 0) {
+            for (size_t i = 0; i < pixels; ++i)
+                sum[channel] += span[i];
+            return;
+        }
+        for (size_t i = 0; i < pixels; ++i) {
+            sum[0] += span[3 * i];
+            sum[1] += span[3 * i + 1];
+            sum[2] += span[3 * i + 2];
+        }
+    });
+    return {(double)sum[0] / num_pixels, (double)sum[1] / num_pixels,
+            (double)sum[2] / num_pixels};
+}
+
+void VectorImage::set_parallel_threshold(long long pixels) {
+    parallel_threshold = pixels;
+}
+
+long long VectorImage::get_parallel_threshold() {
+    return parallel_threshold;
+}
+
+unsigned char* VectorImage::span_start(int channel, int r, int c) {
+    if (channel < 0)
+        return &image.row(r)[c].r;
+    return image.plane_row(channel, r) + c;
+}
+
+template <typename SpanOp>
+void VectorImage::for_each_span(int r1, int c1, int r2, int c2, SpanOp op) {
+    if (r1 > r2 || c1 > c2)
+        return;
+    bool planar = image.get_layout() == PixelLayout::Planar;
+    for (int ch = planar ? 0 : -1; ch < (planar ? 3 : 0); ++ch) {
+        // Full-width rectangles are one contiguous span.
+        if (c1 == 0 && c2 == width - 1) {
+            op(span_start(ch, r1, 0), (size_t)(r2 - r1 + 1) * width, ch);
+            continue;
+        }
+        for (int r = r1; r <= r2; ++r) {
+            op(span_start(ch, r, c1), (size_t)(c2 - c1 + 1), ch);
         }
     }
-}
\ No newline at end of file
+}
+
+template <typename SpanOp>
+void VectorImage::for_each_span_parallel(int r1, int c1, int r2, int c2, SpanOp op) {
+    long long area = (long long)(r2 - r1 + 1) * (c2 - c1 + 1);
+    if (r1 > r2 || c1 > c2 || area < parallel_threshold) {
+        for_each_span(r1, c1, r2, c2, op);
+        return;
+    }
+    ThreadPool::instance().parallel_for(r1, r2 + 1, [&](int begin, int end) {
+        for_each_span(begin, c1, end - 1, c2, op);
+    });
+}
@@ -3,22 +3,69 @@
 
 #include "Image.h"
 #include "types.h"
+#include <cstddef>
 #include <vector>
 
 class VectorImage {
 public:
-    VectorImage(int width, int height);
+    VectorImage(int width, int height,
+                PixelLayout layout = PixelLayout::Interleaved);
+    // Adopts the pixels and layout of an existing image.
+    explicit VectorImage(const Image& source);
+    // Fills the pixels from rows pulled in order from `source`.
+    VectorImage(int width, int height, const RowSource& source,
+                PixelLayout layout = PixelLayout::Interleaved);
+
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    PixelLayout get_layout() const { return image.get_layout(); }
 
     void generate_random();
+    // Same pixels as Image::generate_random(seed).
+    void generate_random(unsigned seed);
+    // Exports in the image's own layout.
     Image get_image() const;
+    Image get_region(int r1, int c1, int r2, int c2) const;
+    // Streams the pixels to `sink` one row at a time.
+    void export_rows(const RowSink& sink) const;
+    void assign_region(int r1, int c1, const Image& patch);
 
     void adjust_brightness(int r1, int c1, int r2, int c2, int value);
     void adjust_contrast(int r1, int c1, int r2, int c2, double multiplier);
     void fill_region(int r1, int c1, int r2, int c2, const RGB_uc& color);
+    // Scans the rectangle; O(area), unlike SegmentTree's O(log) query.
+    RGB_d query_average_color(int r1, int c1, int r2, int c2);
+
+    // Regions of at least this many pixels split their rows across the
+    // shared ThreadPool; smaller ones stay on the calling thread.
+    static void set_parallel_threshold(long long pixels);
+    static long long get_parallel_threshold();
+
+    // Bytes held: the pixels and little else.
+    size_t memory_footprint() const {
+        return sizeof(VectorImage) - sizeof(Image) + image.memory_footprint();
+    }
+    static size_t footprint_for(int width, int height) {
+        return sizeof(VectorImage) - sizeof(Image) +
+               Image::footprint_for(width, height);
+    }
 
 private:
-    std::vector<RGB_uc> image_data;
+    Image image;
     int width, height;
+
+    // First byte of the run starting at (r, c): the pixel for interleaved
+    // images, or the given channel's byte for planar ones.
+    unsigned char* span_start(int channel, int r, int c);
+
+    // Calls op(first_byte, pixel_count, channel) for each contiguous run of
+    // the rectangle. Interleaved runs cover all channels (channel == -1);
+    // planar runs are visited once per channel plane.
+    template <typename SpanOp>
+    void for_each_span(int r1, int c1, int r2, int c2, SpanOp op);
+    // for_each_span over row bands of the rectangle on the thread pool.
+    template <typename SpanOp>
+    void for_each_span_parallel(int r1, int c1, int r2, int c2, SpanOp op);
 };
 
-#endif // VECTOR_IMAGE_H
\ No newline at end of file
+#endif // VECTOR_IMAGE_H
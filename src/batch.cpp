@@ -0,0 +1,179 @@
+#include "ImageIO.h"
+#include "Pipeline.h"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Usage: batch --edits FILE --out DIR [--workers D,B,O,X,E] [--depth N]
+//              [--format png|ppm] [--verify] IMAGE...
+//
+// Applies the edit list in FILE (brightness/contrast/fill lines, as in
+// image_app --script) to every IMAGE and writes DIR/<name>.<format>;
+// inputs that would share an output name are refused before anything runs.
+// --workers sets the thread count of the decode, build, ops, export and
+// encode stages; --depth the queue length between stages. Prints the
+// per-stage utilization table; exits with 1 if any image failed.
+// --verify then reads every output of a run without failures back and
+// compares it with reference_edits() on the input, allowing one level of
+// difference for floating-point rounding; any other difference also exits
+// with 1.
+
+struct Options
+{
+	std::string edits_path, out_dir, format = "png";
+	bool verify = false;
+	PipelineConfig config;
+	std::vector<std::string> inputs;
+};
+
+bool parse_workers(const std::string &value, PipelineConfig &config)
+{
+	int *counts[] = {&config.decoders, &config.builders, &config.editors,
+	                 &config.exporters, &config.encoders};
+	size_t start = 0;
+	for (int i = 0; i < 5; ++i)
+	{
+		size_t comma = value.find(',', start);
+		if ((comma == std::string::npos) != (i == 4))
+			return false;
+		*counts[i] = std::atoi(value.substr(start, comma - start).c_str());
+		start = comma + 1;
+	}
+	return true;
+}
+
+bool parse_args(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--") != 0)
+		{
+			opt.inputs.push_back(arg);
+			continue;
+		}
+		if (arg == "--verify")
+		{
+			opt.verify = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			return false;
+		std::string value = argv[++i];
+		if (arg == "--edits")
+			opt.edits_path = value;
+		else if (arg == "--out")
+			opt.out_dir = value;
+		else if (arg == "--format")
+			opt.format = value;
+		else if (arg == "--depth")
+			opt.config.queue_depth = std::atoi(value.c_str());
+		else if (arg == "--workers")
+		{
+			if (!parse_workers(value, opt.config))
+				return false;
+		}
+		else
+			return false;
+	}
+	return !opt.edits_path.empty() && !opt.out_dir.empty() &&
+	       !opt.inputs.empty() && (opt.format == "png" || opt.format == "ppm");
+}
+
+// DIR/<input file name without extension>.<format>
+std::string output_path(const Options &opt, const std::string &input)
+{
+	size_t slash = input.find_last_of('/');
+	std::string name =
+	    slash == std::string::npos ? input : input.substr(slash + 1);
+	size_t dot = name.find_last_of('.');
+	if (dot != std::string::npos && dot > 0)
+		name.resize(dot);
+	return opt.out_dir + "/" + name + "." + opt.format;
+}
+
+// Pixels of `output` more than one level away from the reference for
+// `input` in any channel.
+long long count_mismatches(const std::string &input, const std::string &output,
+                           const std::vector<SegmentTree::Update> &edits)
+{
+	Image expected = reference_edits(load_image(input), edits);
+	Image actual = load_image(output);
+	if (actual.get_width() != expected.get_width() ||
+	    actual.get_height() != expected.get_height())
+		throw std::runtime_error("output size differs from the input");
+	long long mismatches = 0;
+	for (int r = 0; r < expected.get_height(); ++r)
+		for (int c = 0; c < expected.get_width(); ++c)
+		{
+			RGB_uc a = actual.get_pixel(r, c), e = expected.get_pixel(r, c);
+			if (std::abs(a.r - e.r) > 1 || std::abs(a.g - e.g) > 1 ||
+			    std::abs(a.b - e.b) > 1)
+				++mismatches;
+		}
+	return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parse_args(argc, argv, opt))
+	{
+		std::cerr << "usage: batch --edits FILE --out DIR "
+		             "[--workers D,B,O,X,E] [--depth N]\n"
+		             "             [--format png|ppm] [--verify] IMAGE...\n";
+		return 2;
+	}
+
+	try
+	{
+		std::ifstream edits_file(opt.edits_path);
+		if (!edits_file)
+			throw std::runtime_error("cannot open " + opt.edits_path);
+		std::vector<SegmentTree::Update> edits = read_edit_list(edits_file);
+
+		// Inputs named alike in different directories, or differing only
+		// in extension, would overwrite each other's output.
+		std::vector<PipelineTask> tasks;
+		std::map<std::string, std::string> written_by;
+		for (const std::string &input : opt.inputs)
+		{
+			std::string output = output_path(opt, input);
+			auto claimed = written_by.emplace(output, input);
+			if (!claimed.second)
+				throw std::runtime_error(claimed.first->second + " and " +
+				                         input + " would both be written to " +
+				                         output);
+			tasks.push_back({input, output});
+		}
+
+		PipelineReport report = run_pipeline(tasks, edits, opt.config);
+		for (const std::string &error : report.errors)
+			std::cerr << error << "\n";
+		report.print(std::cout);
+		bool ok = report.errors.empty();
+		// Only a complete run is checked; failures were reported above.
+		if (opt.verify && ok)
+			for (const PipelineTask &task : tasks)
+			{
+				long long mismatches =
+				    count_mismatches(task.input, task.output, edits);
+				if (mismatches > 0)
+				{
+					std::cerr << task.output << ": " << mismatches
+					          << " pixel(s) differ from the reference\n";
+					ok = false;
+				}
+			}
+		return ok ? 0 : 1;
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "batch: " << e.what() << "\n";
+		return 1;
+	}
+}
@@ -1,119 +1,400 @@
+#include "BenchHarness.h"
+#include "BufferPool.h"
+#include "CpuFeatures.h"
 #include "Image.h"
+#include "MemoryBudget.h"
 #include "SegmentTree.h"
+#include "SyntheticImage.h"
+#include "ThreadPool.h"
+#include "TiledImage.h"
 #include "VectorImage.h"
+#include <algorithm>
 #include <chrono>
-#include <functional>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-// Helper to run and time a function
-double time_operation(const std::function<void()> &f)
+// Usage: benchmark [--size N] [--reps N] [--warmups N] [--seed N]
+//                  [--format csv|json] [--out FILE]
+//                  [--compare BASELINE.csv] [--threshold FRACTION]
+//                  [--hugepages off|thp|explicit]
+//                  [--content noise|gradient|flat|photo]
+//
+// Every engine starts from the same seeded image (uniform noise unless
+// --content picks other synthetic content) and replays the same seeded
+// region lists. Build, update, query and export are timed
+// separately, with perf counters per operation and per pixel where the
+// kernel exposes them, and every row carries its engine's memory
+// footprint in bytes per pixel. A compare run exits with status 1 on
+// regressions.
+
+struct Options
 {
-	auto start = std::chrono::high_resolution_clock::now();
-	f();
-	auto end = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<double, std::milli> ms = end - start;
-	return ms.count();
-}
+	int size = 4096;
+	unsigned seed = 1337;
+	BenchConfig config;
+	std::string format = "csv";
+	std::string out_path;
+	std::string baseline_path;
+	double threshold = 0.10;
+	HugePages huge_pages = HugePages::Transparent;
+	ImageContent content = ImageContent::Noise;
+};
 
-// Main benchmark runner
-void run_benchmark(const std::string &op_name, int width, int height,
-                   int region_size, int iters)
+struct Rect
 {
-	Image initial_image(width, height);
-	initial_image.generate_random();
+	int r1, c1, r2, c2;
+};
 
-	std::mt19937 gen(1337); // Fixed seed for reproducibility
-	std::uniform_int_distribution<> r_dist(0, height - region_size);
-	std::uniform_int_distribution<> c_dist(0, width - region_size);
+enum class Op { Fill, Brightness, Contrast };
+
+struct Scenario
+{
+	std::string name;
+	Op op;
+	int region;
+	std::vector<Rect> rects;
+};
 
-	std::vector<std::pair<int, int>> regions;
-	for (int i = 0; i < iters; ++i)
+// Region sizes from the README's matrix, clipped to the image. Each
+// scenario does enough operations to cover the image about four times,
+// bounded to [4, 1000].
+std::vector<Scenario> make_scenarios(const Options &opt)
+{
+	std::vector<int> regions;
+	for (int region : {4096, 1080, 64})
 	{
-		regions.emplace_back(r_dist(gen), c_dist(gen));
+		region = std::min(region, opt.size);
+		if (std::find(regions.begin(), regions.end(), region) == regions.end())
+			regions.push_back(region);
 	}
 
-	VectorImage vi(width, height);
-	SegmentTree st(initial_image);
+	std::vector<Scenario> scenarios;
+	const std::pair<const char *, Op> ops[] = {{"fill", Op::Fill},
+	                                           {"brightness", Op::Brightness},
+	                                           {"contrast", Op::Contrast}};
+	for (const auto &op : ops)
+		for (int region : regions)
+		{
+			long long area = (long long)region * region;
+			long long count = std::max(
+			    4LL, std::min(1000LL, 4LL * opt.size * opt.size / area));
+			std::mt19937 gen(opt.seed + region);
+			std::uniform_int_distribution<> pos(0, opt.size - region);
+			Scenario s{std::string(op.first) + " " + std::to_string(region) +
+			               "x" + std::to_string(region),
+			           op.second, region, {}};
+			for (long long i = 0; i < count; ++i)
+			{
+				int r = pos(gen), c = pos(gen);
+				s.rects.push_back({r, c, r + region - 1, c + region - 1});
+			}
+			scenarios.push_back(s);
+		}
+	return scenarios;
+}
+
+// Updates on TiledImage are queued; a timed section must include applying
+// them.
+template <typename Engine> void settle(Engine &) {}
+void settle(TiledImage &engine) { engine.flush(); }
+
+// With make STATS=1, prints SegmentTree traversal counters per scenario.
+template <typename Engine> void reset_traversal(Engine &) {}
+void reset_traversal(SegmentTree &engine) { engine.reset_stats(); }
+template <typename Engine>
+void print_traversal(Engine &, const std::string &)
+{
+}
+void print_traversal(SegmentTree &engine, const std::string &label)
+{
+	if (!SegmentTree::stats_enabled)
+		return;
+	SegmentTree::TraversalStats s = engine.stats();
+	double ops = (double)std::max<uint64_t>(1, s.updates + s.queries);
+	std::cerr << "  " << label << ": " << s.nodes_visited / ops
+	          << " nodes/op, " << s.full_cover_hits / ops
+	          << " full-cover/op, " << s.pushes / ops << " pushes/op, "
+	          << s.set_tags / ops << " set + " << s.affine_tags / ops
+	          << " affine tags/op, max depth " << s.max_depth
+	          << "; nodes/op histogram:";
+	for (size_t k = 0; k < s.nodes_per_op.size(); ++k)
+		if (s.nodes_per_op[k])
+			std::cerr << " [" << (1ULL << k) << "," << (2ULL << k)
+			          << "): " << s.nodes_per_op[k];
+	std::cerr << std::endl;
+}
+
+template <typename Engine>
+void apply(Engine &engine, Op op, const Rect &r, int i)
+{
+	if (op == Op::Fill)
+		engine.fill_region(r.r1, r.c1, r.r2, r.c2,
+		                   {(unsigned char)i, 255, (unsigned char)(i * 7)});
+	else if (op == Op::Brightness)
+		engine.adjust_brightness(r.r1, r.c1, r.r2, r.c2, i % 2 ? -20 : 20);
+	else
+		engine.adjust_contrast(r.r1, r.c1, r.r2, r.c2, i % 2 ? 0.8 : 1.25);
+}
 
-	double time_vi = 0.0;
-	double time_st = 0.0;
+template <typename Engine, typename Build>
+void bench_engine(const std::string &name, Build build, const Image &input,
+                  const std::vector<Scenario> &scenarios, const Options &opt,
+                  BenchReport &report)
+{
+	std::cerr << "Benchmarking " << name << "..." << std::endl;
+	// Blocks cached by the previous engine would otherwise serve this
+	// one's first build and count towards its peak RSS.
+	BufferPool::instance().trim();
+	reset_peak_rss();
+	size_t first = report.get_results().size();
+	const long long pixels = (long long)input.get_width() * input.get_height();
 
-	if (op_name == "Fill Region")
+	std::unique_ptr<Engine> engine;
+	PerfReading counters;
+	auto samples = measure(
+	    opt.config, [&]() { engine.reset(); },
+	    [&]() { engine = build(input); }, &counters);
+	report.add(
+	    {name, "build", "full", 1, pixels, summarize(samples), -1, counters});
+	size_t footprint = engine->memory_footprint();
+	std::cerr << "  footprint: " << format_bytes(footprint) << ", "
+	          << (double)footprint / pixels << " bytes/pixel" << std::endl;
+
+	for (const Scenario &s : scenarios)
 	{
-		auto op_vi = [&](int r, int c) {
-			vi.fill_region(r, c, r + region_size - 1, c + region_size - 1,
-			               {0, 255, 0});
-		};
-		auto op_st = [&](int r, int c) {
-			st.fill_region(r, c, r + region_size - 1, c + region_size - 1,
-			               {0, 255, 0});
-		};
-		time_vi = time_operation([&]() {
-			for (const auto &reg : regions)
-				op_vi(reg.first, reg.second);
-		});
-		time_st = time_operation([&]() {
-			for (const auto &reg : regions)
-				op_st(reg.first, reg.second);
-		});
+		reset_traversal(*engine);
+		samples = measure(opt.config, nullptr, [&]() {
+			for (size_t i = 0; i < s.rects.size(); ++i)
+				apply(*engine, s.op, s.rects[i], (int)i);
+			settle(*engine);
+		}, &counters);
+		print_traversal(*engine, "update " + s.name);
+		report.add({name, "update", s.name, (long long)s.rects.size(),
+		            (long long)s.rects.size() * s.region * s.region,
+		            summarize(samples), -1, counters});
 	}
-	else if (op_name == "Adjust Brightness")
+
+	// Queries reuse the fill scenarios' rectangles.
+	for (const Scenario &s : scenarios)
 	{
-		auto op_vi = [&](int r, int c) {
-			vi.adjust_brightness(r, c, r + region_size - 1, c + region_size - 1,
-			                     20);
-		};
-		auto op_st = [&](int r, int c) {
-			st.adjust_brightness(r, c, r + region_size - 1, c + region_size - 1,
-			                     20);
-		};
-		time_vi = time_operation([&]() {
-			for (const auto &reg : regions)
-				op_vi(reg.first, reg.second);
-		});
-		time_st = time_operation([&]() {
-			for (const auto &reg : regions)
-				op_st(reg.first, reg.second);
-		});
+		if (s.op != Op::Fill)
+			continue;
+		double sink = 0;
+		reset_traversal(*engine);
+		samples = measure(opt.config, nullptr, [&]() {
+			for (const Rect &r : s.rects)
+				sink += engine->query_average_color(r.r1, r.c1, r.r2, r.c2).r;
+		}, &counters);
+		if (sink < 0) // keeps the queries observable
+			std::cerr << sink;
+		std::string region = s.name.substr(s.name.find(' ') + 1);
+		print_traversal(*engine, "query average " + region);
+		report.add({name, "query", "average " + region,
+		            (long long)s.rects.size(),
+		            (long long)s.rects.size() * s.region * s.region,
+		            summarize(samples), -1, counters});
 	}
 
-	// Print as CSV for easy parsing
-	std::cout << op_name << ","
-	          << std::to_string(region_size) + "x" + std::to_string(region_size)
-	          << "," << iters << "," << time_vi << "," << time_st << std::endl;
+	samples = measure(opt.config, nullptr, [&]() {
+		Image out = engine->get_image();
+		if (out.get_width() != input.get_width())
+			std::cerr << "export size mismatch\n";
+	}, &counters);
+	report.add({name, "export", "get_image", 1, pixels, summarize(samples), -1,
+	            counters});
+
+	engine.reset();
+	long peak = peak_rss_kb();
+	for (size_t i = first; i < report.get_results().size(); ++i)
+	{
+		report.get_results()[i].peak_rss_kb = peak;
+		report.get_results()[i].bytes_per_px = (double)footprint / pixels;
+	}
 }
 
-int main()
+// Full-frame VectorImage kernel throughput: scalar path vs the dispatched
+// SIMD path. `pixels` counts every pixel read and written per repetition.
+void bench_kernels(const Image &input, const Options &opt, BenchReport &report)
 {
-	const int IMAGE_SIZE = 4096;
-	const std::vector<std::string> OPERATIONS = {"Fill Region",
-	                                             "Adjust Brightness"};
-	const std::vector<int> REGION_SIZES = {4096, 1080, 64};
-	const std::vector<int> ITERATIONS = {1, 1000, 100000};
+	std::cerr << "Benchmarking VectorImage kernels..." << std::endl;
+	reset_peak_rss();
+	size_t first = report.get_results().size();
+	VectorImage vi(input);
+	const int w = input.get_width(), h = input.get_height();
+	const long long pixels = (long long)w * h;
+	for (SimdLevel level : {SimdLevel::Scalar, detected_simd_level()})
+	{
+		set_simd_level(level);
+		std::string engine =
+		    std::string("VectorImage/") + simd_level_name(level);
+		int i = 0;
+		PerfReading counters;
+		auto fill = measure(opt.config, nullptr, [&]() {
+			vi.fill_region(0, 0, h - 1, w - 1, {0, 255, (unsigned char)++i});
+		}, &counters);
+		report.add({engine, "kernel", "fill full", 1, pixels, summarize(fill),
+		            -1, counters});
+		auto bright = measure(opt.config, nullptr, [&]() {
+			vi.adjust_brightness(0, 0, h - 1, w - 1, ++i % 2 ? -20 : 20);
+		}, &counters);
+		report.add({engine, "kernel", "brightness full", 1, 2 * pixels,
+		            summarize(bright), -1, counters});
+		auto contrast = measure(opt.config, nullptr, [&]() {
+			vi.adjust_contrast(0, 0, h - 1, w - 1, ++i % 2 ? 0.8 : 1.25);
+		}, &counters);
+		report.add({engine, "kernel", "contrast full", 1, 2 * pixels,
+		            summarize(contrast), -1, counters});
+	}
+	set_simd_level(detected_simd_level());
 
-	// CSV Header
-	std::cout << "Operation,RegionSize,Iterations,VectorTime,TreeTime"
-	          << std::endl;
+	long peak = peak_rss_kb();
+	for (size_t i = first; i < report.get_results().size(); ++i)
+	{
+		report.get_results()[i].peak_rss_kb = peak;
+		report.get_results()[i].bytes_per_px =
+		    (double)vi.memory_footprint() / pixels;
+	}
+}
 
-	for (const auto &op : OPERATIONS)
+bool parse_args(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i < argc; ++i)
 	{
-		for (int region : REGION_SIZES)
+		std::string arg = argv[i];
+		if (i + 1 >= argc)
+			return false;
+		std::string value = argv[++i];
+		if (arg == "--size")
+			opt.size = std::atoi(value.c_str());
+		else if (arg == "--reps")
+			opt.config.repetitions = std::atoi(value.c_str());
+		else if (arg == "--warmups")
+			opt.config.warmups = std::atoi(value.c_str());
+		else if (arg == "--seed")
+			opt.seed = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+		else if (arg == "--format")
+			opt.format = value;
+		else if (arg == "--out")
+			opt.out_path = value;
+		else if (arg == "--compare")
+			opt.baseline_path = value;
+		else if (arg == "--threshold")
+			opt.threshold = std::atof(value.c_str());
+		else if (arg == "--hugepages" && value == "off")
+			opt.huge_pages = HugePages::Off;
+		else if (arg == "--hugepages" && value == "thp")
+			opt.huge_pages = HugePages::Transparent;
+		else if (arg == "--hugepages" && value == "explicit")
+			opt.huge_pages = HugePages::Explicit;
+		else if (arg == "--content")
 		{
-			for (int iter : ITERATIONS)
+			try
 			{
-				// Don't run huge iterations on huge regions
-				if (region > 1000 && iter > 1000)
-					continue;
-				if (region > 64 && iter > 10000)
-					continue;
-
-				run_benchmark(op, IMAGE_SIZE, IMAGE_SIZE, region, iter);
+				opt.content = parse_content(value);
+			}
+			catch (const std::invalid_argument &)
+			{
+				return false;
 			}
 		}
+		else
+			return false;
+	}
+	return opt.size > 0 && opt.config.repetitions > 0 &&
+	       opt.config.warmups >= 0 &&
+	       (opt.format == "csv" || opt.format == "json");
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parse_args(argc, argv, opt))
+	{
+		std::cerr << "usage: benchmark [--size N] [--reps N] [--warmups N] "
+		             "[--seed N] [--format csv|json] [--out FILE] "
+		             "[--compare BASELINE.csv] [--threshold FRACTION] "
+		             "[--hugepages off|thp|explicit] "
+		             "[--content noise|gradient|flat|photo]\n";
+		return 2;
 	}
 
+	// Counters must open before the pool spawns its workers so that the
+	// workers inherit them.
+	const PerfCounters &perf = PerfCounters::instance();
+	if (!perf.any_available())
+		std::cerr << "Hardware counters unavailable ("
+		          << perf.unavailable_reason() << "); reporting time only"
+		          << std::endl;
+	else if (!perf.unavailable_reason().empty())
+		std::cerr << "Some counters unavailable: " << perf.unavailable_reason()
+		          << std::endl;
+
+	BufferPool::instance().set_huge_pages(opt.huge_pages);
+	auto generate_start = std::chrono::steady_clock::now();
+	Image input = Image::uninitialized(opt.size, opt.size);
+	generate_content(input, opt.content, opt.seed);
+	std::chrono::duration<double, std::milli> generate_ms =
+	    std::chrono::steady_clock::now() - generate_start;
+	std::vector<Scenario> scenarios = make_scenarios(opt);
+	std::cerr << "Image " << opt.size << "x" << opt.size << " of "
+	          << content_name(opt.content) << " (generated in "
+	          << generate_ms.count() << " ms), "
+	          << opt.config.warmups << " warmup(s) + "
+	          << opt.config.repetitions << " repetition(s), "
+	          << ThreadPool::instance().size() << " thread(s)" << std::endl;
+
+	BenchReport report;
+	bench_engine<VectorImage>(
+	    "VectorImage",
+	    [](const Image &img) { return std::make_unique<VectorImage>(img); },
+	    input, scenarios, opt, report);
+	bench_engine<SegmentTree>(
+	    "SegmentTree",
+	    [](const Image &img) { return std::make_unique<SegmentTree>(img); },
+	    input, scenarios, opt, report);
+	bench_engine<TiledImage>(
+	    "TiledImage",
+	    [](const Image &img) { return std::make_unique<TiledImage>(img); },
+	    input, scenarios, opt, report);
+	bench_kernels(input, opt, report);
+	BufferPool::Stats pool = BufferPool::instance().stats();
+	std::cerr << "Buffer pool: " << pool.mapped << " mapped ("
+	          << pool.explicit_huge << " MAP_HUGETLB), " << pool.reused
+	          << " reused, " << pool.unmapped << " unmapped" << std::endl;
+
+	std::ofstream file;
+	if (!opt.out_path.empty())
+	{
+		file.open(opt.out_path);
+		if (!file)
+		{
+			std::cerr << "cannot write " << opt.out_path << "\n";
+			return 2;
+		}
+	}
+	std::ostream &out = opt.out_path.empty() ? std::cout : file;
+	if (opt.format == "json")
+		report.write_json(out);
+	else
+		report.write_csv(out);
+
+	if (!opt.baseline_path.empty())
+	{
+		std::ifstream baseline(opt.baseline_path);
+		if (!baseline)
+		{
+			std::cerr << "cannot read " << opt.baseline_path << "\n";
+			return 2;
+		}
+		int regressions = report.compare(BenchReport::read_csv(baseline),
+		                                 opt.threshold, std::cerr);
+		return regressions > 0 ? 1 : 0;
+	}
 	return 0;
 }
@@ -0,0 +1,179 @@
+#include "BenchHarness.h"
+#include "ImageClient.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Usage: loadgen [--socket PATH] [--clients N] [--ops N] [--size WxH]
+//                [--region N] [--reads F] [--image NAME] [--seed N]
+//
+// Drives a running image_server with N concurrent connections, each issuing
+// --ops random requests on one shared image (created first with --size).
+// A fraction --reads of the requests are queries; the rest are fills and
+// brightness/contrast adjustments of rectangles up to --region pixels on a
+// side. Reports throughput, per-request latency for writes and reads, and
+// the server's average write batch size.
+
+struct Options
+{
+	std::string socket_path = "/tmp/image_server.sock";
+	std::string image = "loadgen";
+	int clients = 4, ops = 10000;
+	int width = 1024, height = 1024, region = 256;
+	double reads = 0.5;
+	unsigned seed = 1337;
+};
+
+struct ClientResult
+{
+	std::vector<double> write_us, read_us;
+	std::string error;
+};
+
+void run_client(const Options &opt, int id, ClientResult &result)
+{
+	try
+	{
+		ImageClient client(opt.socket_path);
+		std::mt19937 rng(opt.seed + (unsigned)id);
+		std::uniform_real_distribution<double> unit(0.0, 1.0);
+		auto pick = [&](int lo, int hi) {
+			return std::uniform_int_distribution<int>(lo, hi)(rng);
+		};
+		result.write_us.reserve(opt.ops);
+		result.read_us.reserve(opt.ops);
+		for (int i = 0; i < opt.ops; ++i)
+		{
+			int h = pick(1, std::min(opt.region, opt.height));
+			int w = pick(1, std::min(opt.region, opt.width));
+			int r1 = pick(0, opt.height - h), c1 = pick(0, opt.width - w);
+			int r2 = r1 + h - 1, c2 = c1 + w - 1;
+			bool read = unit(rng) < opt.reads;
+			int kind = pick(0, 2);
+			auto t0 = std::chrono::steady_clock::now();
+			if (read)
+				client.query_average_color(opt.image, r1, c1, r2, c2);
+			else if (kind == 0)
+				client.fill_region(opt.image, r1, c1, r2, c2,
+				                   {(unsigned char)pick(0, 255),
+				                    (unsigned char)pick(0, 255),
+				                    (unsigned char)pick(0, 255)});
+			else if (kind == 1)
+				client.adjust_brightness(opt.image, r1, c1, r2, c2,
+				                         pick(-50, 50));
+			else
+				client.adjust_contrast(opt.image, r1, c1, r2, c2,
+				                       0.5 + unit(rng));
+			auto t1 = std::chrono::steady_clock::now();
+			double us =
+			    std::chrono::duration<double, std::micro>(t1 - t0).count();
+			(read ? result.read_us : result.write_us).push_back(us);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		result.error = e.what();
+	}
+}
+
+bool parse_args(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string arg = argv[i], value = argv[i + 1];
+		if (arg == "--socket")
+			opt.socket_path = value;
+		else if (arg == "--image")
+			opt.image = value;
+		else if (arg == "--clients")
+			opt.clients = std::atoi(value.c_str());
+		else if (arg == "--ops")
+			opt.ops = std::atoi(value.c_str());
+		else if (arg == "--region")
+			opt.region = std::atoi(value.c_str());
+		else if (arg == "--reads")
+			opt.reads = std::atof(value.c_str());
+		else if (arg == "--seed")
+			opt.seed = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+		else if (arg == "--size")
+		{
+			size_t x = value.find('x');
+			if (x == std::string::npos)
+				return false;
+			opt.width = std::atoi(value.substr(0, x).c_str());
+			opt.height = std::atoi(value.substr(x + 1).c_str());
+		}
+		else
+			return false;
+	}
+	return argc % 2 == 1 && opt.clients > 0 && opt.ops > 0 &&
+	       opt.width > 0 && opt.height > 0 && opt.region > 0 &&
+	       opt.reads >= 0 && opt.reads <= 1;
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parse_args(argc, argv, opt))
+	{
+		std::cerr << "usage: loadgen [--socket PATH] [--clients N] [--ops N] "
+		             "[--size WxH]\n"
+		             "               [--region N] [--reads F] [--image NAME] "
+		             "[--seed N]\n";
+		return 2;
+	}
+
+	try
+	{
+		ImageClient setup(opt.socket_path);
+		setup.create(opt.image, opt.width, opt.height, opt.seed);
+
+		std::vector<ClientResult> results(opt.clients);
+		std::vector<std::thread> threads;
+		auto begin = std::chrono::steady_clock::now();
+		for (int id = 0; id < opt.clients; ++id)
+			threads.emplace_back(run_client, std::cref(opt), id,
+			                     std::ref(results[id]));
+		for (std::thread &t : threads)
+			t.join();
+		auto end = std::chrono::steady_clock::now();
+
+		std::vector<double> all_us, write_us, read_us;
+		for (const ClientResult &r : results)
+		{
+			if (!r.error.empty())
+				throw std::runtime_error(r.error);
+			write_us.insert(write_us.end(), r.write_us.begin(),
+			                r.write_us.end());
+			read_us.insert(read_us.end(), r.read_us.begin(), r.read_us.end());
+		}
+		all_us = write_us;
+		all_us.insert(all_us.end(), read_us.begin(), read_us.end());
+
+		double seconds = std::chrono::duration<double>(end - begin).count();
+		std::cout << opt.clients << " clients x " << opt.ops << " ops on "
+		          << opt.width << "x" << opt.height << ": " << seconds
+		          << " s, " << all_us.size() / seconds << " ops/s\n";
+		print_latency(std::cout, "all", all_us);
+		print_latency(std::cout, "writes", write_us);
+		print_latency(std::cout, "reads", read_us);
+
+		ImageClient::Stats stats = setup.stats(opt.image);
+		double per_batch =
+		    stats.batches ? (double)stats.updates / stats.batches : 0.0;
+		std::cout << "Server: " << stats.updates << " updates in "
+		          << stats.batches << " batches (" << per_batch
+		          << " per batch), " << stats.queries << " queries\n";
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "loadgen: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
@@ -1,37 +1,29 @@
+#include "Convolution.h"
+#include "Engine.h"
 #include "Image.h"
+#include "ImageIO.h"
 #include "ImageProcessor.h"
+#include "MemoryBudget.h"
+#include "ScriptRunner.h"
 #include "SegmentTree.h"
+#include "TerminalRenderer.h"
+#include "Trace.h"
 #include "VectorImage.h"
 #include "types.h"
 #include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <fstream>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <random>
+#include <stdexcept>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
-// --- Image Display ---
-void print_image_terminal(const Image &img)
-{
-	if (img.get_width() <= 0 || img.get_height() <= 0)
-	{
-		std::cout << "[Image is empty]" << std::endl;
-		return;
-	}
-
-	for (int r = 0; r < img.get_height(); ++r)
-	{
-		for (int c = 0; c < img.get_width(); ++c)
-		{
-			RGB_uc pixel = img.get_pixel(r, c);
-			std::cout << "\033[48;2;" << (int)pixel.r << ";" << (int)pixel.g
-			          << ";" << (int)pixel.b << "m  ";
-		}
-		std::cout << "\033[0m\n";
-	}
-	std::cout << "\033[0m";
-}
-
 // --- UI and App Logic ---
 void print_menu()
 {
@@ -39,12 +31,13 @@ void print_menu()
 ┌───────────────────────────────────────────────────────┐
 │                       MENU                            │
 ├───────────────────────────────────────────────────────┤
-│  1. Generate New Random Image   7. Blur Image         │
+│  1. Generate New Random Image   7. Filter Region      │
 │  2. Adjust Brightness           8. Reset to Original  │
 │  3. Adjust Contrast             9. Benchmark (Single) │
 │  4. Fill Region with Color     10. Benchmark (Many)   │
 │  5. Query Average Color         0. Exit               │
-│  6. Delete Row/Column                                 │
+│  6. Delete Row/Column          11. Load Image         │
+│                                12. Save Image         │
 └───────────────────────────────────────────────────────┘
 )";
 	std::cout << "Enter your choice: ";
@@ -68,15 +61,185 @@ bool get_rect(int max_rows, int max_cols, int &r1, int &c1, int &r2, int &c2)
 	return true;
 }
 
+// Where Load caches the tree for `image_path` under `cache_dir`. The name
+// carries a hash of the image's absolute path, so images with the same name
+// in different directories get separate snapshots.
+std::string snapshot_path(const std::string &cache_dir,
+                          const std::string &image_path)
+{
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	fs::path image = fs::absolute(image_path, ec);
+	if (ec)
+		image = image_path;
+	char hash[17];
+	std::snprintf(hash, sizeof(hash), "%016llx",
+	              (unsigned long long)std::hash<std::string>{}(image));
+	fs::create_directories(cache_dir, ec); // a failed save is only a miss
+	return (fs::path(cache_dir) / image.filename()).string() + "." + hash +
+	       ".snapshot";
+}
+
+// Headless mode: runs a command script (see ScriptRunner.h) and prints
+// JSON lines; exits with status 1 if any command failed.
+int run_script_mode(const std::string &path, const std::string &engine)
+{
+	std::ifstream file;
+	if (path != "-")
+	{
+		file.open(path);
+		if (!file)
+		{
+			std::cerr << "cannot open " << path << "\n";
+			return 2;
+		}
+	}
+	std::istream &in = path == "-" ? std::cin : file;
+	try
+	{
+		return run_script(in, std::cout, engine) > 0 ? 1 : 0;
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << "\n";
+		return 2;
+	}
+}
+
 // --- Main Loop ---
-int main()
+// Usage: image_app [--record TRACE] [--inline] [--snapshot-cache DIR]
+//        image_app --script FILE|-
+//                  [--engine vector|tree|tiled|deferred|histogram]
+//                  [--memory-budget SIZE] [--budget-policy reject|fallback]
+// --record writes the session's region operations to a trace for the replay
+// tool, until an operation replaces or resizes the image. --script runs
+// without the menu or any rendering; --memory-budget (e.g. 512M) caps what
+// its engines may hold, and past it make_engine() substitutes a cheaper
+// engine unless the policy is reject. On a terminal the image stays pinned
+// at the top of the screen and is updated in place; --inline prints each
+// frame below the previous output instead. --snapshot-cache keeps a
+// snapshot of each loaded image's tree in DIR so reopening an unchanged
+// file maps it instead of decoding; without it nothing is written.
+int main(int argc, char **argv)
 {
+	std::string record_path, script_path, engine = "tree";
+	std::string budget, policy = "fallback", snapshot_cache;
+	bool inline_frames = false, usage_error = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--record" && i + 1 < argc)
+			record_path = argv[++i];
+		else if (arg == "--script" && i + 1 < argc)
+			script_path = argv[++i];
+		else if (arg == "--engine" && i + 1 < argc)
+			engine = argv[++i];
+		else if (arg == "--inline")
+			inline_frames = true;
+		else if (arg == "--memory-budget" && i + 1 < argc)
+			budget = argv[++i];
+		else if (arg == "--budget-policy" && i + 1 < argc)
+			policy = argv[++i];
+		else if (arg == "--snapshot-cache" && i + 1 < argc)
+			snapshot_cache = argv[++i];
+		else
+			usage_error = true;
+	}
+	try
+	{
+		if (!budget.empty())
+			MemoryBudget::instance().set_limit(parse_byte_size(budget));
+	}
+	catch (const std::invalid_argument &)
+	{
+		usage_error = true;
+	}
+	if (policy == "reject")
+		MemoryBudget::instance().set_policy(MemoryBudget::Policy::Reject);
+	else if (policy != "fallback")
+		usage_error = true;
+	if (usage_error)
+	{
+		std::cerr << "usage: image_app [--record TRACE] [--inline] "
+		             "[--snapshot-cache DIR]\n"
+		             "       image_app --script FILE|- "
+		             "[--engine vector|tree|tiled|deferred|histogram]\n"
+		             "                 [--memory-budget SIZE] "
+		             "[--budget-policy reject|fallback]\n";
+		return 2;
+	}
+	if (!script_path.empty())
+	{
+		std::ios::sync_with_stdio(false);
+		return run_script_mode(script_path, engine);
+	}
+
 	ImageProcessor processor(32, 32);
+	unsigned seed = std::random_device{}();
+	processor.generate_random(seed);
 	Image original_image = processor.get_image();
 	SegmentTree st(original_image);
 
+	// Region operations go through `target`, which records them while a
+	// trace is open.
+	EngineAdapter<SegmentTree &> session("SegmentTree", st);
+	std::unique_ptr<TraceWriter> trace;
+	std::unique_ptr<RecordingEngine> recorder;
+	ImageEngine *target = &session;
+	if (!record_path.empty())
+	{
+		try
+		{
+			trace = std::make_unique<TraceWriter>(
+			    record_path, original_image.get_width(),
+			    original_image.get_height(), seed);
+			recorder = std::make_unique<RecordingEngine>(session, *trace);
+			target = recorder.get();
+		}
+		catch (const std::exception &e)
+		{
+			std::cerr << e.what() << "\n";
+			return 2;
+		}
+	}
+	auto stop_recording = [&](const char *reason) {
+		if (!trace)
+			return;
+		std::cout << "Recorded " << trace->get_count() << " operations to "
+		          << record_path << "; recording stopped (" << reason << ")."
+		          << std::endl;
+		try
+		{
+			trace->flush();
+		}
+		catch (const std::exception &e)
+		{
+			std::cout << "\x1b[31mError: " << e.what() << "\x1b[0m\n";
+		}
+		target = &session;
+		recorder.reset();
+		trace.reset();
+	};
+
+	TerminalRenderer renderer;
+	if (!inline_frames && isatty(STDOUT_FILENO))
+		renderer.pin();
+	// Inline frames show the image before an edit as well as after it; a
+	// pinned frame just changes in place.
+	auto show_before = [&]() {
+		if (renderer.is_pinned())
+			return;
+		std::cout << "\nBefore:\n";
+		renderer.draw(st);
+	};
+	auto show_after = [&]() {
+		if (!renderer.is_pinned())
+			std::cout << "\nAfter:\n";
+		renderer.draw(st);
+	};
+
+	renderer.draw(st);
 	std::cout << "Generated initial 32x32 random image." << std::endl;
-	print_image_terminal(original_image);
 
 	int choice = -1;
 	do
@@ -101,11 +264,12 @@ int main()
 		switch (choice)
 		{
 		case 1: {
+			stop_recording("new image");
 			processor.generate_random();
 			original_image = processor.get_image();
 			st = SegmentTree(original_image);
 			std::cout << "Generated new random image." << std::endl;
-			print_image_terminal(original_image);
+			renderer.draw(st);
 			break;
 		}
 		case 2: { // Brightness
@@ -116,9 +280,8 @@ int main()
 			std::cout << "Enter brightness adjustment (-255 to 255): ";
 			std::cin >> value;
 
-			st.adjust_brightness(r1, c1, r2, c2, value);
-			std::cout << "\nAfter:\n";
-			print_image_terminal(st.get_image());
+			target->adjust_brightness(r1, c1, r2, c2, value);
+			show_after();
 			break;
 		}
 		case 3: { // Contrast
@@ -130,9 +293,8 @@ int main()
 			std::cout << "Enter contrast multiplier (> 0.0): ";
 			std::cin >> multiplier;
 
-			st.adjust_contrast(r1, c1, r2, c2, multiplier);
-			std::cout << "\nAfter:\n";
-			print_image_terminal(st.get_image());
+			target->adjust_contrast(r1, c1, r2, c2, multiplier);
+			show_after();
 			break;
 		}
 		case 4: { // Fill Region
@@ -143,11 +305,10 @@ int main()
 			std::cout << "Enter color (R G B): ";
 			std::cin >> r >> g >> b;
 
-			st.fill_region(
+			target->fill_region(
 			    r1, c1, r2, c2,
 			    {(unsigned char)r, (unsigned char)g, (unsigned char)b});
-			std::cout << "\nAfter:\n";
-			print_image_terminal(st.get_image());
+			show_after();
 			break;
 		}
 
@@ -157,21 +318,20 @@ int main()
 			              original_image.get_width(), r1, c1, r2, c2))
 				break;
 
-			RGB_d avg = st.query_average_color(r1, c1, r2, c2);
+			RGB_d avg = target->query_average_color(r1, c1, r2, c2);
 			std::cout << "Average color in region: (R=" << avg.r
 			          << ", G=" << avg.g << ", B=" << avg.b << ")" << std::endl;
 			break;
 		}
 
 		case 6: { // Delete Row/Column
-			Image before_img = st.get_image();
 			std::cout << "Delete row or col? ";
 			std::string choice;
 			std::cin >> choice;
 
 			int num_to_delete;
-			int old_height = before_img.get_height();
-			int old_width = before_img.get_width();
+			int old_height = st.get_height();
+			int old_width = st.get_width();
 
 			if (choice == "row")
 			{
@@ -183,6 +343,8 @@ int main()
 					std::cout << "\x1b[31mError: Invalid row number.\x1b[0m\n";
 					break;
 				}
+				stop_recording("image resized");
+				show_before();
 				st = st.delete_row(num_to_delete);
 				original_image = st.get_image();
 			}
@@ -197,6 +359,8 @@ int main()
 					    << "\x1b[31mError: Invalid column number.\x1b[0m\n";
 					break;
 				}
+				stop_recording("image resized");
+				show_before();
 				st = st.delete_col(num_to_delete);
 				original_image = st.get_image();
 			}
@@ -206,34 +370,56 @@ int main()
 				break;
 			}
 
-			std::cout << "\nBefore:\n";
-			print_image_terminal(before_img);
-			std::cout << "\nAfter:\n";
-			print_image_terminal(st.get_image());
+			show_after();
 			break;
 		}
 
-		case 7: { // Blur
+		case 7: { // Filter
 			int r1, c1, r2, c2;
 			if (!get_rect(original_image.get_height(),
 			              original_image.get_width(), r1, c1, r2, c2))
 				break;
 
-			Image before_img = st.get_image();
-			Image blurred_img = st.blur(r1, c1, r2, c2);
-			st = SegmentTree(blurred_img);
+			std::cout << "Select filter:\n";
+			std::cout << "1. Box Blur\n";
+			std::cout << "2. Gaussian Blur\n";
+			std::cout << "3. Sharpen\n";
+			std::cout << "4. Edge Detect\n";
+			std::cout << "Enter your choice: ";
+			int filter_choice;
+			std::cin >> filter_choice;
+
+			ConvolutionOptions options;
+			Kernel kernel = Kernel::box(1);
+			if (filter_choice == 1)
+				options.border = BorderMode::Normalize;
+			else if (filter_choice == 2)
+			{
+				kernel = Kernel::gaussian(1.0);
+				options.border = BorderMode::Reflect;
+			}
+			else if (filter_choice == 3)
+				kernel = Kernel::sharpen();
+			else if (filter_choice == 4)
+				kernel = Kernel::edge_detect();
+			else
+			{
+				std::cout << "\x1b[31mError: Invalid filter.\x1b[0m\n";
+				break;
+			}
 
-			std::cout << "\nBefore:\n";
-			print_image_terminal(before_img);
-			std::cout << "\nAfter:\n";
-			print_image_terminal(st.get_image());
+			stop_recording("filter applied");
+			show_before();
+			convolve_region(st, kernel, r1, c1, r2, c2, options);
+			show_after();
 			break;
 		}
 
 		case 8: { // Reset
+			stop_recording("image reset");
 			st = SegmentTree(original_image);
 			std::cout << "Image reset to original." << std::endl;
-			print_image_terminal(original_image);
+			renderer.draw(st);
 			break;
 		}
 
@@ -374,63 +560,22 @@ int main()
 			Image bench_image(width, height);
 			bench_image.generate_random();
 
-			VectorImage vi(width, height);
-			SegmentTree st_bench(bench_image);
+			EngineAdapter<VectorImage> vi("VectorImage", width, height);
+			EngineAdapter<SegmentTree> st_bench("SegmentTree", bench_image);
 
-			std::mt19937 gen(1337); // Fixed seed for reproducibility
-			std::uniform_int_distribution<> op_dist(0, 2);
-			std::uniform_int_distribution<> val_dist(-255, 255);
-			std::uniform_real_distribution<> mul_dist(0.5, 1.5);
-			std::uniform_int_distribution<> r_dist(0, height - 1);
-			std::uniform_int_distribution<> c_dist(0, width - 1);
-
-			std::vector<std::tuple<int, int, int, int, int, int, int, double>>
-			    updates;
-			for (int i = 0; i < num_updates; ++i)
-			{
-				int r1 = r_dist(gen);
-				int r2 = r_dist(gen);
-				int c1 = c_dist(gen);
-				int c2 = c_dist(gen);
-				if (r1 > r2)
-					std::swap(r1, r2);
-				if (c1 > c2)
-					std::swap(c1, c2);
-				updates.emplace_back(op_dist(gen), r1, c1, r2, c2,
-				                     val_dist(gen), val_dist(gen),
-				                     mul_dist(gen));
-			}
+			// Fixed seed for reproducibility; the replay tool regenerates the
+			// same workload with --generate.
+			Trace updates = random_trace(width, height, num_updates, 1337);
 
 			auto start_vi = std::chrono::high_resolution_clock::now();
-			for (const auto &up : updates)
-			{
-				auto [op, r1, c1, r2, c2, val, color, mul] = up;
-				if (op == 0)
-					vi.adjust_brightness(r1, c1, r2, c2, val);
-				else if (op == 1)
-					vi.fill_region(r1, c1, r2, c2,
-					               {(unsigned char)color, (unsigned char)color,
-					                (unsigned char)color});
-				else
-					vi.adjust_contrast(r1, c1, r2, c2, mul);
-			}
+			for (const TraceRecord &up : updates.records)
+				apply_record(vi, up);
 			auto end_vi = std::chrono::high_resolution_clock::now();
 			std::chrono::duration<double> vi_duration = end_vi - start_vi;
 
 			auto start_st = std::chrono::high_resolution_clock::now();
-			for (const auto &up : updates)
-			{
-				auto [op, r1, c1, r2, c2, val, color, mul] = up;
-				if (op == 0)
-					st_bench.adjust_brightness(r1, c1, r2, c2, val);
-				else if (op == 1)
-					st_bench.fill_region(r1, c1, r2, c2,
-					                     {(unsigned char)color,
-					                      (unsigned char)color,
-					                      (unsigned char)color});
-				else
-					st_bench.adjust_contrast(r1, c1, r2, c2, mul);
-			}
+			for (const TraceRecord &up : updates.records)
+				apply_record(st_bench, up);
 			auto end_st = std::chrono::high_resolution_clock::now();
 			std::chrono::duration<double> st_duration = end_st - start_st;
 
@@ -440,10 +585,57 @@ int main()
 			          << vi_duration.count() * 1e3 << " ms" << std::endl;
 			std::cout << "SegmentTree: " << st_duration.count() * 1e3 << " ms"
 			          << std::endl;
+			std::cout << "Replay: build/replay --generate many.trace --size "
+			          << width << "x" << height << " --ops " << num_updates
+			          << " --seed 1337" << std::endl;
+			break;
+		}
+
+		case 11: { // Load
+			std::string path;
+			std::cout << "Enter file to load (.png or .ppm): ";
+			std::cin >> path;
+			try
+			{
+				SegmentTree loaded =
+				    snapshot_cache.empty()
+				        ? load_segment_tree(path)
+				        : open_segment_tree(
+				              path, snapshot_path(snapshot_cache, path));
+				stop_recording("image loaded");
+				st = std::move(loaded);
+				original_image = st.get_image();
+			}
+			catch (const std::exception &e)
+			{
+				std::cout << "\x1b[31mError: " << e.what() << "\x1b[0m\n";
+				break;
+			}
+			std::cout << "Loaded " << original_image.get_width() << "x"
+			          << original_image.get_height() << " image." << std::endl;
+			renderer.draw(st);
+			break;
+		}
+
+		case 12: { // Save
+			std::string path;
+			std::cout << "Enter file to save (.png, otherwise PPM): ";
+			std::cin >> path;
+			try
+			{
+				save_segment_tree(st, path);
+			}
+			catch (const std::exception &e)
+			{
+				std::cout << "\x1b[31mError: " << e.what() << "\x1b[0m\n";
+				break;
+			}
+			std::cout << "Saved to " << path << "." << std::endl;
 			break;
 		}
 
 		case 0:
+			stop_recording("exit");
 			std::cout << "Exiting.\n";
 			break;
 		default:
@@ -0,0 +1,277 @@
+#include "AsyncEngine.h"
+#include "BenchHarness.h"
+#include "DeferredEngine.h"
+#include "Engine.h"
+#include "ImageIO.h"
+#include "Trace.h"
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Usage: replay TRACE [--engine NAME|all] [--image FILE] [--seed N]
+//                     [--reps N] [--async]
+//        replay --generate OUT --size WxH --ops N [--seed N]
+//
+// Replays a trace at full speed, ignoring its timestamps, and reports
+// throughput and the per-operation latency distribution for each engine.
+// TiledImage latencies cover queueing only; its total includes the flush.
+// The start image is --image, else the trace's recorded seed, else --seed.
+// --generate writes the CLI's many-update benchmark workload as a trace.
+// --async drives each engine through an AsyncEngine: latencies then cover
+// submission only, and query results are collected after the last op.
+
+struct Options
+{
+	std::string trace_path;
+	std::string engine = "all";
+	std::string image_path;
+	std::string generate_path;
+	int width = 0, height = 0, ops = 0;
+	unsigned seed = 1337;
+	int reps = 1;
+	bool async = false;
+};
+
+const char *op_name(TraceOp op)
+{
+	switch (op)
+	{
+	case TraceOp::Brightness:
+		return "brightness";
+	case TraceOp::Contrast:
+		return "contrast";
+	case TraceOp::Fill:
+		return "fill";
+	case TraceOp::Query:
+		return "query";
+	}
+	return "?";
+}
+
+void submit_record(AsyncEngine &engine, const TraceRecord &r,
+                   std::vector<std::future<RGB_d>> &answers)
+{
+	switch (r.op)
+	{
+	case TraceOp::Brightness:
+		engine.adjust_brightness(r.r1, r.c1, r.r2, r.c2, (int)r.value);
+		break;
+	case TraceOp::Contrast:
+		engine.adjust_contrast(r.r1, r.c1, r.r2, r.c2, r.value);
+		break;
+	case TraceOp::Fill:
+		engine.fill_region(r.r1, r.c1, r.r2, r.c2, r.color);
+		break;
+	case TraceOp::Query:
+		answers.push_back(engine.query_average_color(r.r1, r.c1, r.r2, r.c2));
+		break;
+	}
+}
+
+// DeferredEngine's compaction counters, or "" for any other engine.
+std::string compaction_summary(ImageEngine &engine)
+{
+	auto *deferred = dynamic_cast<DeferredEngine *>(&engine);
+	if (!deferred)
+		return "";
+	const DeferredEngine::Stats &c = deferred->stats();
+	return "  compaction: " + std::to_string(c.submitted) + " edits, " +
+	       std::to_string(c.fused) + " fused, " + std::to_string(c.dropped) +
+	       " dropped, " + std::to_string(c.applied) + " applied in " +
+	       std::to_string(c.flushes) + " flushes\n";
+}
+
+void replay_engine(const std::string &engine_name, const Trace &trace,
+                   const Image &start, int reps, bool use_async)
+{
+	std::vector<double> latency_us, by_op[4];
+	std::vector<double> totals_ms;
+	std::string display_name;
+	std::string compaction; // DeferredEngine counters of the last run
+	std::string batching;   // AsyncEngine counters of the last run
+	double sink = 0;
+	for (int rep = 0; rep < reps; ++rep)
+	{
+		std::unique_ptr<ImageEngine> engine = make_engine(engine_name, start);
+		display_name = engine->name();
+		std::unique_ptr<AsyncEngine> async;
+		std::vector<std::future<RGB_d>> answers;
+		if (use_async)
+		{
+			display_name += " (async)";
+			async = std::make_unique<AsyncEngine>(std::move(engine));
+		}
+		auto begin = std::chrono::steady_clock::now();
+		for (const TraceRecord &r : trace.records)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+			if (async)
+				submit_record(*async, r, answers);
+			else
+				sink += apply_record(*engine, r).r;
+			auto t1 = std::chrono::steady_clock::now();
+			double us =
+			    std::chrono::duration<double, std::micro>(t1 - t0).count();
+			latency_us.push_back(us);
+			by_op[(int)r.op].push_back(us);
+		}
+		if (async)
+		{
+			async->flush().get();
+			for (std::future<RGB_d> &answer : answers)
+				sink += answer.get().r;
+		}
+		else
+			engine->flush();
+		auto end = std::chrono::steady_clock::now();
+		if (async)
+		{
+			batching = "  worker: " +
+			           std::to_string(async->get_applied_edits()) +
+			           " edits in " +
+			           std::to_string(async->get_applied_batches()) +
+			           " batches\n";
+			// The engine now belongs to the worker; ask it there.
+			compaction = async->submit(compaction_summary).get();
+		}
+		else
+			compaction = compaction_summary(*engine);
+		totals_ms.push_back(
+		    std::chrono::duration<double, std::milli>(end - begin).count());
+	}
+	if (sink < 0) // keeps the queries observable
+		std::cerr << sink;
+
+	SampleStats total = summarize(totals_ms);
+	double ops_per_s = total.median > 0
+	                       ? trace.records.size() / (total.median / 1e3)
+	                       : 0.0;
+	std::cout << display_name << ": " << total.median
+	          << " ms per replay (median of " << reps << "), " << ops_per_s
+	          << " ops/s\n" << compaction << batching;
+	if (latency_us.empty())
+		return;
+	print_latency(std::cout, "all", latency_us);
+	for (int op = 0; op < 4; ++op)
+		if (!by_op[op].empty())
+			print_latency(std::cout, op_name((TraceOp)op), by_op[op]);
+}
+
+bool parse_args(int argc, char **argv, Options &opt)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--") != 0)
+		{
+			if (!opt.trace_path.empty())
+				return false;
+			opt.trace_path = arg;
+			continue;
+		}
+		if (arg == "--async")
+		{
+			opt.async = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			return false;
+		std::string value = argv[++i];
+		if (arg == "--engine")
+			opt.engine = value;
+		else if (arg == "--image")
+			opt.image_path = value;
+		else if (arg == "--seed")
+			opt.seed = (unsigned)std::strtoul(value.c_str(), nullptr, 10);
+		else if (arg == "--reps")
+			opt.reps = std::atoi(value.c_str());
+		else if (arg == "--generate")
+			opt.generate_path = value;
+		else if (arg == "--ops")
+			opt.ops = std::atoi(value.c_str());
+		else if (arg == "--size")
+		{
+			size_t x = value.find('x');
+			if (x == std::string::npos)
+				return false;
+			opt.width = std::atoi(value.substr(0, x).c_str());
+			opt.height = std::atoi(value.substr(x + 1).c_str());
+		}
+		else
+			return false;
+	}
+	if (!opt.generate_path.empty())
+		return opt.trace_path.empty() && opt.width > 0 && opt.height > 0 &&
+		       opt.ops > 0;
+	return !opt.trace_path.empty() && opt.reps > 0;
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	if (!parse_args(argc, argv, opt))
+	{
+		std::cerr << "usage: replay TRACE [--engine NAME|all] [--image FILE] "
+		             "[--seed N] [--reps N] [--async]\n"
+		             "       replay --generate OUT --size WxH --ops N "
+		             "[--seed N]\n";
+		return 2;
+	}
+
+	try
+	{
+		if (!opt.generate_path.empty())
+		{
+			Trace trace =
+			    random_trace(opt.width, opt.height, opt.ops, opt.seed);
+			trace.seed = opt.seed;
+			write_trace(opt.generate_path, trace);
+			std::cout << "Wrote " << trace.records.size() << " ops for a "
+			          << opt.width << "x" << opt.height << " image to "
+			          << opt.generate_path << "\n";
+			return 0;
+		}
+
+		Trace trace = read_trace(opt.trace_path);
+		Image start(trace.width, trace.height);
+		if (!opt.image_path.empty())
+		{
+			start = load_image(opt.image_path);
+			if (start.get_width() != trace.width ||
+			    start.get_height() != trace.height)
+				throw std::runtime_error(opt.image_path +
+				                         " does not match the trace size");
+		}
+		else if (trace.seed != Trace::kNoSeed)
+			start.generate_random((unsigned)trace.seed);
+		else
+		{
+			std::cerr << "Trace has no image seed; using --seed " << opt.seed
+			          << "\n";
+			start.generate_random(opt.seed);
+		}
+
+		double recorded_s =
+		    trace.records.empty() ? 0.0
+		                          : trace.records.back().time_ns / 1e9;
+		std::cout << opt.trace_path << ": " << trace.records.size()
+		          << " ops on " << trace.width << "x" << trace.height
+		          << ", recorded over " << recorded_s << " s\n";
+
+		std::vector<std::string> engines = engine_names();
+		if (opt.engine != "all")
+			engines = {opt.engine};
+		for (const std::string &name : engines)
+			replay_engine(name, trace, start, opt.reps, opt.async);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "replay: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
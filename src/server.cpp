@@ -0,0 +1,86 @@
+#include "ImageServer.h"
+#include "MemoryBudget.h"
+#include <csignal>
+#include <exception>
+#include <iostream>
+#include <pthread.h>
+#include <string>
+#include <thread>
+
+// Usage: image_server [--socket PATH] [--memory-budget SIZE]
+//
+// Holds named images in memory and serves them over a Unix domain socket
+// until SIGINT or SIGTERM. With --memory-budget (e.g. 8G), creating or
+// loading an image whose tree would take the total past SIZE fails. Load
+// and Save requests open files with this process's permissions, so keep
+// the socket private to trusted users.
+
+int main(int argc, char **argv)
+{
+	std::string socket_path = "/tmp/image_server.sock";
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--socket" && i + 1 < argc)
+			socket_path = argv[++i];
+		else if (arg == "--memory-budget" && i + 1 < argc)
+		{
+			try
+			{
+				MemoryBudget::instance().set_limit(
+				    parse_byte_size(argv[++i]));
+			}
+			catch (const std::invalid_argument &e)
+			{
+				std::cerr << "image_server: " << e.what() << "\n";
+				return 2;
+			}
+		}
+		else
+		{
+			std::cerr << "usage: image_server [--socket PATH] "
+			             "[--memory-budget SIZE]\n";
+			return 2;
+		}
+	}
+
+	// Blocked here, the signals are inherited by every connection thread
+	// and only the waiter below receives them.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	try
+	{
+		ImageServer server(socket_path);
+		std::thread waiter([&]() {
+			int signal = 0;
+			sigwait(&signals, &signal);
+			server.stop();
+		});
+		std::cerr << "Listening on " << socket_path << std::endl;
+		std::exception_ptr failed;
+		try
+		{
+			server.run();
+		}
+		catch (const std::exception &)
+		{
+			failed = std::current_exception();
+		}
+		// run() also stops on accept errors; wake the waiter then too.
+		pthread_kill(waiter.native_handle(), SIGTERM);
+		waiter.join();
+		if (failed)
+			std::rethrow_exception(failed);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "image_server: " << e.what() << "\n";
+		return 1;
+	}
+	std::cerr << "Stopped." << std::endl;
+	return 0;
+}
@@ -6,6 +6,13 @@ struct RGB_uc
 	unsigned char r, g, b;
 };
 
+// Pixel storage order: RGBRGB... or three consecutive R, G and B planes.
+enum class PixelLayout
+{
+	Interleaved,
+	Planar
+};
+
 struct RGB_d
 {
 	double r, g, b;